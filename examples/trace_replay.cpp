@@ -0,0 +1,248 @@
+/*
+    trace_replay.cpp
+    ================
+
+    Replays a trace recorded by a TraceRecorder against a PuppetDB
+    server, to load test it with the traffic of an actual service
+
+    Compile with:
+        c++ -std=c++11 trace_replay.cpp -lcurl -pthread -o trace_replay
+
+    Record the trace with:
+        auto trace = std::make_shared<LibPuppetdb::TraceRecorder>();
+        connector.setTraceRecorder(trace);
+        ...
+        std::ofstream file { "trace.json" };
+        trace->writeChromeTrace(file);
+
+    Run with:
+        ./trace_replay trace_file target_url [speed] [ca_crt client_crt client_key]
+    For instance:
+        ./trace_replay trace.json http://localhost:8080
+        ./trace_replay trace.json https://puppetdb:8081 4 ca.pem crt.pem key.pem
+
+    The queries are reissued with the URLs and bodies of the trace, the
+    scheme, host, and port being replaced by those of the target URL, at
+    the pace of the trace multiplied by the speed (1 by default; 0 sends
+    them all at once). The queries that were served by the response
+    cache, or by an identical query in flight, are not replayed.
+*/
+
+
+#include "../include/libpuppetdb/result_parser.h"
+#include <cstdio>
+#include <string>
+
+using namespace LibPuppetdb;
+
+// A query of the trace, and its replay
+struct ReplayedQuery {
+    int64_t offset;  // us since the start of the trace
+    std::string url;
+    std::string body;
+    long recorded_status;
+    std::chrono::microseconds recorded_time;
+
+    CURL* curl;
+    curl_slist* headers;
+    uint64_t received_bytes;
+};
+
+static size_t countBytes(void* contents, size_t size, size_t nmemb,
+                         void* userp) {
+    *static_cast<uint64_t*>(userp) += size * nmemb;
+    return size * nmemb;
+}
+
+// Replaces the scheme, host, and port of the URL with the target ones
+static std::string retarget(const std::string& url, const std::string& target) {
+    size_t host_start { url.find("://") };
+    size_t path_start { host_start == std::string::npos
+                        ? std::string::npos : url.find('/', host_start + 3) };
+    if (path_start == std::string::npos) {
+        throw parsing_error { "invalid URL in the trace: " + url };
+    }
+    std::string base { target };
+    while (!base.empty() && base.back() == '/') {
+        base.pop_back();
+    }
+    return base + url.substr(path_start);
+}
+
+// Reads the queries of a Chrome trace, by start time
+static std::vector<ReplayedQuery> readTrace(const std::string& path,
+                                            const std::string& target) {
+    std::ifstream file { path };
+    if (!file) {
+        throw processing_error { "failed to open " + path };
+    }
+    std::string text { std::istreambuf_iterator<char> { file },
+                       std::istreambuf_iterator<char> {} };
+    JsonValue trace { parseJson(text) };
+
+    std::vector<ReplayedQuery> queries {};
+    const JsonValue& events = trace.get("traceEvents");
+    for (size_t index = 0; index < events.size(); index++) {
+        const JsonValue& event = events[index];
+        const JsonValue* category = event.find("cat");
+        if (category == nullptr || category->asString() != "puppetdb.query") {
+            continue;
+        }
+        const JsonValue& args = event.get("args");
+        if (args.get("from_cache").asBool() || args.get("coalesced").asBool()) {
+            continue;
+        }
+        ReplayedQuery query {};
+        query.offset = event.get("ts").asInt();
+        query.url = retarget(args.get("url").asString(), target);
+        const JsonValue* body = args.find("body");
+        if (body != nullptr) {
+            query.body = body->asString();
+        }
+        query.recorded_status = args.get("status").asInt();
+        query.recorded_time = std::chrono::microseconds {
+            event.get("dur").asInt() };
+        queries.push_back(std::move(query));
+    }
+    std::stable_sort(queries.begin(), queries.end(),
+                     [](const ReplayedQuery& a, const ReplayedQuery& b) {
+                         return a.offset < b.offset;
+                     });
+    if (!queries.empty()) {
+        int64_t start { queries.front().offset };
+        for (auto& query : queries) {
+            query.offset -= start;
+        }
+    }
+    return queries;
+}
+
+static void start(CURLM* multi, ReplayedQuery& query,
+                  const std::vector<std::string>& certificates) {
+    query.curl = curl_easy_init();
+    query.headers = nullptr;
+    query.received_bytes = 0;
+    curl_easy_setopt(query.curl, CURLOPT_URL, query.url.c_str());
+    curl_easy_setopt(query.curl, CURLOPT_WRITEFUNCTION, countBytes);
+    curl_easy_setopt(query.curl, CURLOPT_WRITEDATA, &query.received_bytes);
+    curl_easy_setopt(query.curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(query.curl, CURLOPT_PRIVATE, &query);
+    if (!query.body.empty()) {
+        query.headers = curl_slist_append(query.headers,
+                                          "Content-Type: application/json");
+        query.headers = curl_slist_append(query.headers, "Expect:");
+        curl_easy_setopt(query.curl, CURLOPT_HTTPHEADER, query.headers);
+        curl_easy_setopt(query.curl, CURLOPT_POSTFIELDS, query.body.c_str());
+        curl_easy_setopt(query.curl, CURLOPT_POSTFIELDSIZE,
+                         static_cast<long>(query.body.size()));
+    }
+    if (certificates.size() == 3) {
+        curl_easy_setopt(query.curl, CURLOPT_CAINFO, certificates[0].c_str());
+        curl_easy_setopt(query.curl, CURLOPT_SSLCERT, certificates[1].c_str());
+        curl_easy_setopt(query.curl, CURLOPT_SSLKEY, certificates[2].c_str());
+    }
+    curl_multi_add_handle(multi, query.curl);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3 && argc != 4 && argc != 7) {
+        std::cout << "Usage: " << argv[0] << " trace_file target_url [speed]"
+                  << " [ca_crt client_crt client_key]\n";
+        return 1;
+    }
+    std::string trace_path { argv[1] };
+    std::string target { argv[2] };
+    double speed { argc > 3 ? std::atof(argv[3]) : 1.0 };
+    std::vector<std::string> certificates {};
+    for (int index = 4; index < argc; index++) {
+        certificates.push_back(argv[index]);
+    }
+
+    std::vector<ReplayedQuery> queries {};
+    try {
+        globalInit();
+        queries = readTrace(trace_path, target);
+    } catch (std::exception& e) {
+        std::cout << "Failed to read the trace: " << e.what() << "\n";
+        return 2;
+    }
+    std::cout << "Replaying " << queries.size() << " queries against "
+              << target << "\n";
+
+    CURLM* multi { curl_multi_init() };
+    LatencyHistogram recorded_latency {};
+    LatencyHistogram replayed_latency {};
+    size_t num_started { 0 };
+    size_t num_failed { 0 };
+    size_t num_status_changes { 0 };
+    uint64_t received_bytes { 0 };
+    int num_running { 0 };
+    auto replay_start = std::chrono::steady_clock::now();
+
+    while (num_started < queries.size() || num_running > 0) {
+        // Start the queries that are due
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - replay_start);
+        while (num_started < queries.size()
+               && (speed <= 0
+                   || queries[num_started].offset / speed <= elapsed.count())) {
+            start(multi, queries[num_started++], certificates);
+        }
+
+        curl_multi_perform(multi, &num_running);
+
+        int num_queued { 0 };
+        CURLMsg* msg { nullptr };
+        while ((msg = curl_multi_info_read(multi, &num_queued)) != nullptr) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            ReplayedQuery* query { nullptr };
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &query);
+            QueryStats stats { getQueryStats(msg->easy_handle,
+                                             msg->data.result) };
+            recorded_latency.record(query->recorded_time);
+            replayed_latency.record(stats.total_time);
+            received_bytes += query->received_bytes;
+            if (stats.isError()) {
+                num_failed++;
+            }
+            if (stats.response_code != query->recorded_status) {
+                num_status_changes++;
+            }
+            curl_multi_remove_handle(multi, msg->easy_handle);
+            curl_easy_cleanup(msg->easy_handle);
+            curl_slist_free_all(query->headers);
+        }
+
+        // Wait for activity, or for the next query to be due
+        int timeout_ms { 100 };
+        if (num_started < queries.size() && speed > 0) {
+            double due_us { queries[num_started].offset / speed
+                            - elapsed.count() };
+            timeout_ms = std::max(0, std::min(timeout_ms,
+                                              static_cast<int>(due_us / 1000)));
+        } else if (num_started < queries.size()) {
+            timeout_ms = 0;
+        }
+        curl_multi_poll(multi, nullptr, 0, timeout_ms, nullptr);
+    }
+    curl_multi_cleanup(multi);
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - replay_start);
+    auto recorded = recorded_latency.getSnapshot();
+    auto replayed = replayed_latency.getSnapshot();
+    std::cout << "Replayed in " << duration.count() << " ms: "
+              << num_failed << " failed, " << num_status_changes
+              << " with another status than recorded, "
+              << received_bytes << " bytes received\n";
+    for (double percentile : { 50.0, 95.0, 99.0 }) {
+        std::cout << "p" << percentile << ": "
+                  << replayed.getPercentile(percentile).count() << " us"
+                  << " (recorded: "
+                  << recorded.getPercentile(percentile).count() << " us)\n";
+    }
+    globalCleanup();
+    return num_failed > 0 ? 3 : 0;
+}
@@ -0,0 +1,271 @@
+#ifndef LIBPUPPETDB_INCLUDE_PUPPETDB_BATCH_QUERY_H_
+#define LIBPUPPETDB_INCLUDE_PUPPETDB_BATCH_QUERY_H_
+
+/*
+ *                        libpuppetdb - batch queries
+ *
+ * Optional batching of per-entity lookups. A BatchQuery collects the
+ * keys (e.g. certnames) of many lookups against the same endpoint and
+ * folds them into as few queries as the query size limit allows:
+ *
+ *   ["or",["=","certname","a"],["=","certname","b"],...]
+ *
+ * or, with BatchFolding::InArray (PuppetDB 4.x),
+ *
+ *   ["in","certname",["array",["a","b",...]]]
+ *
+ * optionally combined with a common filter by "and". The records of
+ * the combined results are then demultiplexed by their key field, as
+ * they are received, into one result (json array) per key.
+ *
+ * The queries are capped by the URL length, unless the connector sends
+ * them by POST (see PuppetdbConnector::setQueryMethod), in which case
+ * far fewer and larger queries are performed.
+ *
+ */
+
+#include "libpuppetdb.h"
+#include "result_parser.h"
+
+#include <map>
+#include <set>
+
+namespace LibPuppetdb {
+
+// Default cap on the size of a folded query string, once URL encoded;
+// it keeps the query URLs below the usual 8KiB limit of the servers
+static const size_t BATCH_MAX_QUERY_SIZE_DEFAULT { 6 * 1024 };
+
+// Default cap on the size of a folded query string sent by POST
+static const size_t BATCH_MAX_POST_QUERY_SIZE_DEFAULT { 1024 * 1024 };
+
+enum class BatchFolding { Or, InArray };
+
+class BatchQuery {
+  public:
+    BatchQuery() = delete;
+
+    /// Throws a query_error in case the endpoint or the key field is
+    /// an empty string
+    explicit BatchQuery(std::string endpoint,
+                        std::string key_field = "certname")
+            : endpoint_ { std::move(endpoint) },
+              key_field_ { std::move(key_field) },
+              filter_ {},
+              folding_ { BatchFolding::Or },
+              max_query_size_ { BATCH_MAX_QUERY_SIZE_DEFAULT },
+              max_post_query_size_ { BATCH_MAX_POST_QUERY_SIZE_DEFAULT },
+              keys_ {} {
+        if (endpoint_.empty()) {
+            throw query_error { "no endpoint specified" };
+        }
+        if (key_field_.empty()) {
+            throw query_error { "no key field specified" };
+        }
+    }
+
+    /// Sets a query string (json) that all records must also match,
+    /// e.g. ["=","name","osfamily"]
+    void setFilter(std::string filter) {
+        filter_ = std::move(filter);
+    }
+
+    void setFolding(BatchFolding folding) {
+        folding_ = folding;
+    }
+
+    /// Sets the maximum size of the URL encoded query strings; a key
+    /// that does not fit with the others gets a query of its own
+    void setMaxQuerySize(size_t max_query_size) {
+        max_query_size_ = max_query_size;
+    }
+
+    size_t getMaxQuerySize() const {
+        return max_query_size_;
+    }
+
+    /// Sets the maximum size of the query strings sent by POST
+    void setMaxPostQuerySize(size_t max_query_size) {
+        max_post_query_size_ = max_query_size;
+    }
+
+    size_t getMaxPostQuerySize() const {
+        return max_post_query_size_;
+    }
+
+    /// Adds the lookup of the key; duplicates are performed once
+    void add(std::string key) {
+        keys_.insert(std::move(key));
+    }
+
+    /// Returns the number of distinct keys
+    size_t size() const {
+        return keys_.size();
+    }
+
+    /// Returns the folded queries, each with the keys it looks up,
+    /// capped either for GET or for POST requests
+    std::vector<std::pair<Query, std::set<std::string>>> getQueries(
+            bool posted = false) const {
+        std::vector<std::pair<Query, std::set<std::string>>> queries {};
+        std::string terms {};
+        std::set<std::string> batch_keys {};
+        std::string term {};
+
+        // The size of a query string is that of its terms, separators,
+        // and fixed prefix and suffix, so it is tracked as the terms
+        // are added
+        size_t max_size { posted ? max_post_query_size_ : max_query_size_ };
+        size_t fixed_size { getSentSize(makeQueryString({}), posted) };
+        size_t separator_size { getSentSize(",", posted) };
+        size_t terms_size { 0 };
+
+        for (const auto& key : keys_) {
+            term.clear();
+            appendTerm(term, key);
+            size_t term_size { getSentSize(term, posted) };
+            if (!batch_keys.empty()
+                    && fixed_size + terms_size + separator_size + term_size
+                       > max_size) {
+                queries.emplace_back(Query { endpoint_,
+                                             makeQueryString(terms) },
+                                     std::move(batch_keys));
+                terms.clear();
+                terms_size = 0;
+                batch_keys.clear();
+            }
+            if (!terms.empty()) {
+                terms += ',';
+                terms_size += separator_size;
+            }
+            terms += term;
+            terms_size += term_size;
+            batch_keys.insert(key);
+        }
+
+        if (!batch_keys.empty()) {
+            queries.emplace_back(Query { endpoint_, makeQueryString(terms) },
+                                 std::move(batch_keys));
+        }
+        return queries;
+    }
+
+    /// Performs the folded queries and returns the result (json array
+    /// of records) of each key, in the same format as performQuery;
+    /// keys without records get an empty array
+    /// Throws a processing_error in case of failure (a parsing_error
+    /// in case a record has no string key field)
+    std::map<std::string, std::string> perform(PuppetdbConnector& connector) {
+        std::map<std::string, std::string> results {};
+        for (const auto& key : keys_) {
+            results[key] = "[";
+        }
+
+        for (auto& query : getQueries(isPosting(connector))) {
+            const std::set<std::string>& batch_keys = query.second;
+            RecordSplitter splitter {
+                [&](const char* data, size_t size) {
+                    JsonValue record { parseJson(data, size) };
+                    const JsonValue* key { record.find(key_field_) };
+                    if (key == nullptr || !key->isString()) {
+                        throw parsing_error { "record has no " + key_field_ };
+                    }
+                    // NB: only the keys of this query are expected
+                    if (batch_keys.count(key->asString()) == 0) {
+                        return;
+                    }
+                    std::string& result = results[key->asString()];
+                    if (result.size() > 1) {
+                        result += ',';
+                    }
+                    result.append(data, size);
+                } };
+            connector.performQuery(query.first, splitter.sink());
+            splitter.finish();
+        }
+
+        for (auto& result : results) {
+            result.second += ']';
+        }
+        return results;
+    }
+
+  private:
+    std::string endpoint_;
+    std::string key_field_;
+    std::string filter_;
+    BatchFolding folding_;
+    size_t max_query_size_;
+    size_t max_post_query_size_;
+    // Sorted, so that the folded queries do not depend on the order
+    // of the lookups (and can be cached)
+    std::set<std::string> keys_;
+
+    void appendTerm(std::string& text, const std::string& key) const {
+        if (folding_ == BatchFolding::Or) {
+            text += "[\"=\",";
+            JsonValue::serializeString(key_field_, text);
+            text += ',';
+            JsonValue::serializeString(key, text);
+            text += ']';
+        } else {
+            JsonValue::serializeString(key, text);
+        }
+    }
+
+    std::string makeQueryString(const std::string& terms) const {
+        std::string query_string {};
+        if (!filter_.empty()) {
+            query_string += "[\"and\"," + filter_ + ",";
+        }
+        if (folding_ == BatchFolding::Or) {
+            query_string += "[\"or\"," + terms + "]";
+        } else {
+            query_string += "[\"in\",";
+            JsonValue::serializeString(key_field_, query_string);
+            query_string += ",[\"array\",[" + terms + "]]]";
+        }
+        if (!filter_.empty()) {
+            query_string += "]";
+        }
+        return query_string;
+    }
+
+    // Returns the size of the text as sent: as is in the body of a
+    // POST request, URL encoded otherwise
+    static size_t getSentSize(const std::string& text, bool posted) {
+        return posted ? text.size() : getEncodedSize(text);
+    }
+
+    // Returns true if the connector POSTs all the queries that exceed
+    // the GET cap; with QueryMethod::Auto, the queries below the
+    // threshold must fit in a URL, even if all their characters are
+    // encoded
+    bool isPosting(PuppetdbConnector& connector) const {
+        switch (connector.getQueryMethod()) {
+            case QueryMethod::Post:
+                return true;
+            case QueryMethod::Auto:
+                return 3 * connector.getPostThreshold() <= max_query_size_;
+            default:
+                return false;
+        }
+    }
+
+    static size_t getEncodedSize(const std::string& text) {
+        size_t size { 0 };
+        for (char c : text) {
+            bool is_unreserved { (c >= 'a' && c <= 'z')
+                                 || (c >= 'A' && c <= 'Z')
+                                 || (c >= '0' && c <= '9')
+                                 || c == '-' || c == '.' || c == '_'
+                                 || c == '~' };
+            size += is_unreserved ? 1 : 3;
+        }
+        return size;
+    }
+};
+
+}  // namespace LibPuppetdb
+
+#endif  // LIBPUPPETDB_INCLUDE_PUPPETDB_BATCH_QUERY_H_
@@ -0,0 +1,799 @@
+#ifndef LIBPUPPETDB_INCLUDE_PUPPETDB_COLUMNAR_RESULT_H_
+#define LIBPUPPETDB_INCLUDE_PUPPETDB_COLUMNAR_RESULT_H_
+
+/*
+ *                        libpuppetdb - columnar results
+ *
+ * Optional decoder of query results into columns, for the consumers
+ * that scan many records (e.g. all the facts of a fleet). The fields
+ * of interest are specified by a schema; each one becomes either:
+ *  - a dictionary column: the values are interned in a dictionary of
+ *    the column and the rows hold their ids (certnames, fact names,
+ *    environments, ...);
+ *  - a value column: the rows hold a type tag and an index into the
+ *    contiguous vector of their type (booleans, integers, doubles,
+ *    strings, and the json text of the structured values).
+ *
+ * The decoder consumes the result chunk by chunk, as ResultParser
+ * does, but scans the text of each record straight into the columns,
+ * without building a JsonValue; the other fields are skipped.
+ * Schemas are provided for the facts, fact-contents, and nodes
+ * endpoints (api v4).
+ *
+ */
+
+#include "libpuppetdb.h"
+#include "result_parser.h"
+
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
+
+namespace LibPuppetdb {
+
+//
+// StringDictionary
+//
+
+// Id of a missing or null value of a dictionary column
+static const uint32_t NO_STRING_ID { UINT32_MAX };
+
+// Interned strings, identified by their insertion order; the lookups
+// do not allocate
+class StringDictionary {
+  public:
+    StringDictionary() : strings_ {}, ids_ {} {}
+
+    StringDictionary(const StringDictionary&) = delete;
+    StringDictionary& operator=(const StringDictionary&) = delete;
+
+    /// Returns the id of the string, adding it if required
+    /// Throws a processing_error in case the dictionary is full
+    uint32_t intern(const char* data, size_t size) {
+        auto it = ids_.find(StringView { data, size });
+        if (it != ids_.end()) {
+            return it->second;
+        }
+        if (strings_.size() >= NO_STRING_ID) {
+            throw processing_error { "too many distinct strings" };
+        }
+        // NB: the deque does not move its strings, which are the keys
+        strings_.emplace_back(data, size);
+        uint32_t id { static_cast<uint32_t>(strings_.size() - 1) };
+        ids_.emplace(StringView { strings_.back().data(),
+                                  strings_.back().size() }, id);
+        return id;
+    }
+
+    /// Returns the id of the string, or NO_STRING_ID
+    uint32_t find(const std::string& str) const {
+        auto it = ids_.find(StringView { str.data(), str.size() });
+        return it != ids_.end() ? it->second : NO_STRING_ID;
+    }
+
+    const std::string& get(uint32_t id) const {
+        return strings_[id];
+    }
+
+    size_t size() const {
+        return strings_.size();
+    }
+
+    void clear() {
+        ids_.clear();
+        strings_.clear();
+    }
+
+  private:
+    // FNV-1a
+    struct Hash {
+        size_t operator()(const StringView& view) const {
+            uint64_t hash { 14695981039346656037ull };
+            for (size_t index = 0; index < view.size; index++) {
+                hash ^= static_cast<unsigned char>(view.data[index]);
+                hash *= 1099511628211ull;
+            }
+            return static_cast<size_t>(hash);
+        }
+    };
+
+    struct Equal {
+        bool operator()(const StringView& lhs, const StringView& rhs) const {
+            return lhs.size == rhs.size
+                   && std::memcmp(lhs.data, rhs.data, lhs.size) == 0;
+        }
+    };
+
+    std::deque<std::string> strings_;
+    std::unordered_map<StringView, uint32_t, Hash, Equal> ids_;
+};
+
+//
+// Columns
+//
+
+class DictionaryColumn {
+  public:
+    DictionaryColumn() : ids_ {}, dictionary_ {} {}
+
+    size_t size() const {
+        return ids_.size();
+    }
+
+    /// Returns the id of the value of the row, or NO_STRING_ID
+    uint32_t getId(size_t row) const {
+        return ids_[row];
+    }
+
+    /// Returns the value of the row (an empty string if missing)
+    const std::string& getString(size_t row) const {
+        static const std::string EMPTY {};
+        return ids_[row] != NO_STRING_ID ? dictionary_.get(ids_[row]) : EMPTY;
+    }
+
+    const std::vector<uint32_t>& getIds() const {
+        return ids_;
+    }
+
+    const StringDictionary& getDictionary() const {
+        return dictionary_;
+    }
+
+    void append(const char* data, size_t size) {
+        ids_.push_back(dictionary_.intern(data, size));
+    }
+
+    void appendNull() {
+        ids_.push_back(NO_STRING_ID);
+    }
+
+    void clear() {
+        ids_.clear();
+        dictionary_.clear();
+    }
+
+  private:
+    std::vector<uint32_t> ids_;
+    StringDictionary dictionary_;
+};
+
+// Type of the value of a row; Json is an object or an array, kept as
+// its json text
+enum class ValueType : uint8_t { Null, Bool, Integer, Double, String, Json };
+
+class ValueColumn {
+  public:
+    ValueColumn()
+            : types_ {},
+              indexes_ {},
+              bools_ {},
+              integers_ {},
+              doubles_ {},
+              text_ {},
+              text_offsets_ { 0 } {
+    }
+
+    size_t size() const {
+        return types_.size();
+    }
+
+    ValueType getType(size_t row) const {
+        return types_[row];
+    }
+
+    /// Returns the index of the value of the row in the vector of its
+    /// type (getBools, getIntegers, ...)
+    uint32_t getIndex(size_t row) const {
+        return indexes_[row];
+    }
+
+    /// Throws a processing_error in case the value has another type
+    /// (integers are converted to doubles)
+    bool getBool(size_t row) const {
+        checkType(row, ValueType::Bool, "a boolean");
+        return bools_[indexes_[row]] != 0;
+    }
+
+    int64_t getInteger(size_t row) const {
+        checkType(row, ValueType::Integer, "an integer");
+        return integers_[indexes_[row]];
+    }
+
+    double getDouble(size_t row) const {
+        if (types_[row] == ValueType::Integer) {
+            return static_cast<double>(integers_[indexes_[row]]);
+        }
+        checkType(row, ValueType::Double, "a number");
+        return doubles_[indexes_[row]];
+    }
+
+    StringView getString(size_t row) const {
+        checkType(row, ValueType::String, "a string");
+        return getText(indexes_[row]);
+    }
+
+    StringView getJson(size_t row) const {
+        checkType(row, ValueType::Json, "an object or an array");
+        return getText(indexes_[row]);
+    }
+
+    const std::vector<uint8_t>& getBools() const {
+        return bools_;
+    }
+
+    const std::vector<int64_t>& getIntegers() const {
+        return integers_;
+    }
+
+    const std::vector<double>& getDoubles() const {
+        return doubles_;
+    }
+
+    /// Returns the number of string and json values
+    size_t getNumTexts() const {
+        return text_offsets_.size() - 1;
+    }
+
+    /// Returns the string or json text with the specified index
+    StringView getText(uint32_t index) const {
+        return StringView { text_.data() + text_offsets_[index],
+                            static_cast<size_t>(text_offsets_[index + 1]
+                                                - text_offsets_[index]) };
+    }
+
+    void appendNull() {
+        append(ValueType::Null, 0);
+    }
+
+    void appendBool(bool value) {
+        append(ValueType::Bool, bools_.size());
+        bools_.push_back(value ? 1 : 0);
+    }
+
+    void appendInteger(int64_t value) {
+        append(ValueType::Integer, integers_.size());
+        integers_.push_back(value);
+    }
+
+    void appendDouble(double value) {
+        append(ValueType::Double, doubles_.size());
+        doubles_.push_back(value);
+    }
+
+    void appendString(const char* data, size_t size) {
+        appendText(ValueType::String, data, size);
+    }
+
+    void appendJson(const char* data, size_t size) {
+        appendText(ValueType::Json, data, size);
+    }
+
+    void clear() {
+        types_.clear();
+        indexes_.clear();
+        bools_.clear();
+        integers_.clear();
+        doubles_.clear();
+        text_.clear();
+        text_offsets_.assign(1, 0);
+    }
+
+  private:
+    std::vector<ValueType> types_;
+    std::vector<uint32_t> indexes_;
+    std::vector<uint8_t> bools_;
+    std::vector<int64_t> integers_;
+    std::vector<double> doubles_;
+    // The strings and json texts, back to back
+    std::string text_;
+    std::vector<uint64_t> text_offsets_;
+
+    void append(ValueType type, size_t index) {
+        types_.push_back(type);
+        indexes_.push_back(static_cast<uint32_t>(index));
+    }
+
+    void appendText(ValueType type, const char* data, size_t size) {
+        append(type, text_offsets_.size() - 1);
+        text_.append(data, size);
+        text_offsets_.push_back(text_.size());
+    }
+
+    void checkType(size_t row, ValueType type, const char* type_name) const {
+        if (types_[row] != type) {
+            throw processing_error { std::string { "the value is not " }
+                                     + type_name };
+        }
+    }
+};
+
+//
+// ColumnarResult
+//
+
+enum class ColumnKind { Dictionary, Value };
+
+struct ColumnSpec {
+    std::string field;
+    ColumnKind kind;
+};
+
+/// Columns of the facts endpoint
+inline std::vector<ColumnSpec> getFactsSchema() {
+    return { { "certname", ColumnKind::Dictionary },
+             { "environment", ColumnKind::Dictionary },
+             { "name", ColumnKind::Dictionary },
+             { "value", ColumnKind::Value } };
+}
+
+/// Columns of the fact-contents endpoint; the path is a json array
+inline std::vector<ColumnSpec> getFactContentsSchema() {
+    return { { "certname", ColumnKind::Dictionary },
+             { "environment", ColumnKind::Dictionary },
+             { "name", ColumnKind::Dictionary },
+             { "path", ColumnKind::Value },
+             { "value", ColumnKind::Value } };
+}
+
+/// Columns of the nodes endpoint
+inline std::vector<ColumnSpec> getNodesSchema() {
+    return { { "certname", ColumnKind::Dictionary },
+             { "deactivated", ColumnKind::Value },
+             { "expired", ColumnKind::Value },
+             { "catalog_timestamp", ColumnKind::Value },
+             { "facts_timestamp", ColumnKind::Value },
+             { "report_timestamp", ColumnKind::Value },
+             { "catalog_environment", ColumnKind::Dictionary },
+             { "facts_environment", ColumnKind::Dictionary },
+             { "report_environment", ColumnKind::Dictionary },
+             { "latest_report_status", ColumnKind::Dictionary } };
+}
+
+// The records of a result, decoded into the columns of a schema; the
+// fields missing from a record are null
+class ColumnarResult {
+  public:
+    ColumnarResult() = delete;
+    ColumnarResult(const ColumnarResult&) = delete;
+    ColumnarResult& operator=(const ColumnarResult&) = delete;
+
+    /// Throws a query_error in case a field is specified twice
+    explicit ColumnarResult(std::vector<ColumnSpec> schema)
+            : schema_ { std::move(schema) },
+              column_indexes_ {},
+              dictionary_columns_ {},
+              value_columns_ {},
+              num_rows_ { 0 } {
+        for (size_t index = 0; index < schema_.size(); index++) {
+            for (size_t other = 0; other < index; other++) {
+                if (schema_[other].field == schema_[index].field) {
+                    throw query_error { "duplicate column "
+                                        + schema_[index].field };
+                }
+            }
+            if (schema_[index].kind == ColumnKind::Dictionary) {
+                column_indexes_.push_back(dictionary_columns_.size());
+                dictionary_columns_.emplace_back();
+            } else {
+                column_indexes_.push_back(value_columns_.size());
+                value_columns_.emplace_back();
+            }
+        }
+    }
+
+    const std::vector<ColumnSpec>& getSchema() const {
+        return schema_;
+    }
+
+    /// Returns the number of rows (records)
+    size_t size() const {
+        return num_rows_;
+    }
+
+    /// Throws a query_error in case the field is not a dictionary
+    /// column of the schema
+    const DictionaryColumn& getDictionaryColumn(
+            const std::string& field) const {
+        return dictionary_columns_[getColumnIndex(field,
+                                                  ColumnKind::Dictionary)];
+    }
+
+    /// Throws a query_error in case the field is not a value column
+    /// of the schema
+    const ValueColumn& getValueColumn(const std::string& field) const {
+        return value_columns_[getColumnIndex(field, ColumnKind::Value)];
+    }
+
+    void clear() {
+        for (auto& column : dictionary_columns_) {
+            column.clear();
+        }
+        for (auto& column : value_columns_) {
+            column.clear();
+        }
+        num_rows_ = 0;
+    }
+
+  private:
+    friend class ColumnarDecoder;
+
+    std::vector<ColumnSpec> schema_;
+    // Index of each column of the schema in the vector of its kind
+    std::vector<size_t> column_indexes_;
+    std::deque<DictionaryColumn> dictionary_columns_;
+    std::deque<ValueColumn> value_columns_;
+    size_t num_rows_;
+
+    size_t getColumnIndex(const std::string& field, ColumnKind kind) const {
+        for (size_t index = 0; index < schema_.size(); index++) {
+            if (schema_[index].field == field && schema_[index].kind == kind) {
+                return column_indexes_[index];
+            }
+        }
+        throw query_error { "no such column: " + field };
+    }
+};
+
+//
+// ColumnarDecoder
+//
+
+// Incremental decoder of a query result into a ColumnarResult; the
+// rows are appended to the result
+class ColumnarDecoder {
+  public:
+    explicit ColumnarDecoder(ColumnarResult& result)
+            : result_ ( result ),
+              values_(result.schema_.size()),
+              unescaped_(result.schema_.size()),
+              integers_(result.schema_.size()),
+              doubles_(result.schema_.size()),
+              is_integer_(result.schema_.size()),
+              splitter_ { [this](const char* data, size_t size) {
+                              decode(data, size);
+                          } } {
+    }
+
+    ColumnarDecoder(const ColumnarDecoder&) = delete;
+    ColumnarDecoder& operator=(const ColumnarDecoder&) = delete;
+
+    /// Throws a parsing_error in case the result is malformed
+    void feed(const char* data, size_t size) {
+        splitter_.feed(data, size);
+    }
+
+    /// Throws a parsing_error in case the result is truncated
+    void finish() {
+        splitter_.finish();
+    }
+
+    /// Returns a sink that feeds the decoder, to be passed to
+    /// PuppetdbConnector::performQuery
+    ChunkSink sink() {
+        return [this](const char* data, size_t size) { feed(data, size); };
+    }
+
+  private:
+    // Value of a field of the current record
+    struct Value {
+        enum class Kind { Missing, Null, True, False, Number, String,
+                          EscapedString, Json };
+        Kind kind;
+        const char* data;
+        size_t size;
+    };
+
+    ColumnarResult& result_;
+    std::vector<Value> values_;
+    // Conversions of the values of the current record, per field; only
+    // those of the strings with escape sequences and of the numbers
+    // are set (and read), so that decoding a record does not allocate
+    std::vector<std::string> unescaped_;
+    std::vector<int64_t> integers_;
+    std::vector<double> doubles_;
+    std::vector<uint8_t> is_integer_;
+    RecordSplitter splitter_;
+
+    [[noreturn]] static void fail(const std::string& msg) {
+        throw parsing_error { "invalid record: " + msg };
+    }
+
+    static const char* skipWhitespace(const char* current, const char* end) {
+        while (current != end && (*current == ' ' || *current == '\n'
+                                  || *current == '\r' || *current == '\t')) {
+            current++;
+        }
+        return current;
+    }
+
+    // Scans the string starting at the opening quote; returns the
+    // position after the closing quote
+    static const char* scanString(const char* current, const char* end,
+                                  bool& escaped) {
+        escaped = false;
+        for (current++; current != end; current++) {
+            if (*current == '\\') {
+                escaped = true;
+                if (++current == end) {
+                    break;
+                }
+            } else if (*current == '"') {
+                return current + 1;
+            }
+        }
+        fail("unterminated string");
+    }
+
+    // Scans the object or array starting at the opening bracket;
+    // returns the position after the closing one
+    static const char* scanNested(const char* current, const char* end) {
+        size_t depth { 0 };
+        bool escaped { false };
+        while (current != end) {
+            switch (*current) {
+                case '"':
+                    current = scanString(current, end, escaped);
+                    continue;
+                case '{':
+                case '[':
+                    depth++;
+                    break;
+                case '}':
+                case ']':
+                    if (--depth == 0) {
+                        return current + 1;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            current++;
+        }
+        fail("unterminated object or array");
+    }
+
+    static const char* scanLiteral(const char* current, const char* end,
+                                   const char* literal) {
+        size_t size { std::strlen(literal) };
+        if (static_cast<size_t>(end - current) < size
+                || std::memcmp(current, literal, size) != 0) {
+            fail("invalid literal");
+        }
+        return current + size;
+    }
+
+    static const char* scanValue(const char* current, const char* end,
+                                 Value& value) {
+        if (current == end) {
+            fail("missing value");
+        }
+        const char* start { current };
+        bool escaped { false };
+        switch (*current) {
+            case '"':
+                current = scanString(current, end, escaped);
+                value = { escaped ? Value::Kind::EscapedString
+                                  : Value::Kind::String,
+                          start + 1, static_cast<size_t>(current - start - 2) };
+                return current;
+            case '{':
+            case '[':
+                current = scanNested(current, end);
+                value = { Value::Kind::Json, start,
+                          static_cast<size_t>(current - start) };
+                return current;
+            case 't':
+                value = { Value::Kind::True, nullptr, 0 };
+                return scanLiteral(current, end, "true");
+            case 'f':
+                value = { Value::Kind::False, nullptr, 0 };
+                return scanLiteral(current, end, "false");
+            case 'n':
+                value = { Value::Kind::Null, nullptr, 0 };
+                return scanLiteral(current, end, "null");
+            default:
+                while (current != end
+                        && (std::isdigit(static_cast<unsigned char>(*current))
+                            || *current == '-' || *current == '+'
+                            || *current == '.' || *current == 'e'
+                            || *current == 'E')) {
+                    current++;
+                }
+                if (current == start) {
+                    fail("unexpected character");
+                }
+                value = { Value::Kind::Number, start,
+                          static_cast<size_t>(current - start) };
+                return current;
+        }
+    }
+
+    // Returns the index of the field in the schema, or -1
+    int findField(const char* data, size_t size) const {
+        const auto& schema = result_.schema_;
+        for (size_t index = 0; index < schema.size(); index++) {
+            if (schema[index].field.size() == size
+                    && std::memcmp(schema[index].field.data(), data,
+                                   size) == 0) {
+                return static_cast<int>(index);
+            }
+        }
+        return -1;
+    }
+
+    // Scans the record, then appends its values to the columns, so
+    // that a malformed record leaves the result unchanged
+    void decode(const char* data, size_t size) {
+        for (auto& value : values_) {
+            value = { Value::Kind::Missing, nullptr, 0 };
+        }
+
+        const char* end { data + size };
+        const char* current { skipWhitespace(data, end) };
+        if (current == end || *current != '{') {
+            fail("not an object");
+        }
+        current = skipWhitespace(current + 1, end);
+        if (current != end && *current == '}') {
+            current++;
+        } else {
+            while (true) {
+                if (current == end || *current != '"') {
+                    fail("expected a member name");
+                }
+                bool escaped { false };
+                const char* name { current + 1 };
+                current = scanString(current, end, escaped);
+                int field { escaped
+                            ? -1 : findField(name, static_cast<size_t>(
+                                                 current - name - 1)) };
+
+                current = skipWhitespace(current, end);
+                if (current == end || *current != ':') {
+                    fail("expected ':'");
+                }
+                Value value {};
+                current = scanValue(skipWhitespace(current + 1, end), end,
+                                    value);
+                if (field >= 0) {
+                    values_[field] = value;
+                }
+
+                current = skipWhitespace(current, end);
+                if (current != end && *current == ',') {
+                    current = skipWhitespace(current + 1, end);
+                } else if (current != end && *current == '}') {
+                    current++;
+                    break;
+                } else {
+                    fail("expected ',' or '}'");
+                }
+            }
+        }
+        if (skipWhitespace(current, end) != end) {
+            fail("unexpected trailing characters");
+        }
+
+        // The strings with escape sequences and the numbers are
+        // converted before any column is updated
+        for (size_t index = 0; index < values_.size(); index++) {
+            Value& value = values_[index];
+            if (value.kind == Value::Kind::EscapedString) {
+                // NB: parseJson validates the escape sequences
+                unescaped_[index] = parseJson(value.data - 1, value.size + 2)
+                                        .asString();
+                value = { Value::Kind::String, unescaped_[index].data(),
+                          unescaped_[index].size() };
+            } else if (value.kind == Value::Kind::Number) {
+                is_integer_[index] = parseInteger(value, integers_[index]);
+                if (!is_integer_[index]) {
+                    doubles_[index] = parseDouble(value);
+                }
+            }
+        }
+
+        for (size_t index = 0; index < values_.size(); index++) {
+            const Value& value = values_[index];
+            size_t column_index { result_.column_indexes_[index] };
+            if (result_.schema_[index].kind == ColumnKind::Dictionary) {
+                DictionaryColumn& column =
+                    result_.dictionary_columns_[column_index];
+                switch (value.kind) {
+                    case Value::Kind::Missing:
+                    case Value::Kind::Null:
+                        column.appendNull();
+                        break;
+                    case Value::Kind::True:
+                        column.append("true", 4);
+                        break;
+                    case Value::Kind::False:
+                        column.append("false", 5);
+                        break;
+                    default:
+                        column.append(value.data, value.size);
+                        break;
+                }
+                continue;
+            }
+
+            ValueColumn& column = result_.value_columns_[column_index];
+            switch (value.kind) {
+                case Value::Kind::True:
+                case Value::Kind::False:
+                    column.appendBool(value.kind == Value::Kind::True);
+                    break;
+                case Value::Kind::Number:
+                    if (is_integer_[index]) {
+                        column.appendInteger(integers_[index]);
+                    } else {
+                        column.appendDouble(doubles_[index]);
+                    }
+                    break;
+                case Value::Kind::String:
+                    column.appendString(value.data, value.size);
+                    break;
+                case Value::Kind::Json:
+                    column.appendJson(value.data, value.size);
+                    break;
+                default:
+                    column.appendNull();
+                    break;
+            }
+        }
+        result_.num_rows_++;
+    }
+
+    // Returns false if the number is not an integer in range
+    static bool parseInteger(const Value& value, int64_t& integer) {
+        const char* current { value.data };
+        const char* end { value.data + value.size };
+        bool negative { current != end && *current == '-' };
+        if (negative) {
+            current++;
+        }
+        if (current == end) {
+            fail("invalid number");
+        }
+        uint64_t magnitude { 0 };
+        for (; current != end; current++) {
+            if (!std::isdigit(static_cast<unsigned char>(*current))) {
+                return false;
+            }
+            unsigned digit { static_cast<unsigned>(*current - '0') };
+            if (magnitude > (static_cast<uint64_t>(INT64_MAX) - digit) / 10) {
+                // NB: INT64_MIN is decoded as a double
+                return false;
+            }
+            magnitude = magnitude * 10 + digit;
+        }
+        integer = negative ? -static_cast<int64_t>(magnitude)
+                           : static_cast<int64_t>(magnitude);
+        return true;
+    }
+
+    static double parseDouble(const Value& value) {
+        std::string text { value.data, value.size };
+        char* text_end { nullptr };
+        double number { std::strtod(text.c_str(), &text_end) };
+        if (text_end != text.c_str() + text.size()) {
+            fail("invalid number");
+        }
+        return number;
+    }
+};
+
+/// Performs the query and decodes its result into the columns of the
+/// schema
+/// Throws a processing_error in case of failure (a parsing_error in
+/// case the result is malformed)
+inline void decodeColumns(PuppetdbConnector& connector, Query& query,
+                          ColumnarResult& result) {
+    ColumnarDecoder decoder { result };
+    connector.performQuery(query, decoder.sink());
+    decoder.finish();
+}
+
+}  // namespace LibPuppetdb
+
+#endif  // LIBPUPPETDB_INCLUDE_PUPPETDB_COLUMNAR_RESULT_H_
@@ -0,0 +1,314 @@
+#ifndef LIBPUPPETDB_INCLUDE_PUPPETDB_COROUTINE_H_
+#define LIBPUPPETDB_INCLUDE_PUPPETDB_COROUTINE_H_
+
+/*
+ *                        libpuppetdb - coroutines
+ *
+ * Optional awaitables over the asynchronous queries of a connector,
+ * for C++20 coroutines; requires a compiler supporting them (e.g.
+ * -std=c++20). The rest of the library remains C++11.
+ *
+ *     std::string nodes { co_await asyncQuery(connector, query) };
+ *
+ *     AsyncPager pager { connector, query, 1000 };
+ *     while (auto page = co_await pager.next()) {
+ *         ...
+ *     }
+ *
+ * No thread is blocked while a query runs: the awaiting coroutine is
+ * suspended, and it is resumed once the result is available. By
+ * default, it is resumed on the thread of the asynchronous queries of
+ * the connector, which is then blocked until the coroutine suspends
+ * again; an Executor moves the resumption to another thread or event
+ * loop (e.g. asio::post, or a task queue drained by an epoll loop).
+ *
+ * The coroutine types (tasks) are left to the application or to its
+ * framework; any coroutine can await the results.
+ *
+ */
+
+#if !defined(__cpp_impl_coroutine) || !defined(__has_include)
+#error "libpuppetdb/coroutine.h requires C++20 coroutines"
+#elif !__has_include(<coroutine>)
+#error "libpuppetdb/coroutine.h requires the <coroutine> header"
+#endif
+
+#include "libpuppetdb.h"
+
+#include <atomic>
+#include <coroutine>
+#include <optional>
+
+namespace LibPuppetdb {
+
+// Schedules a task; used to resume the coroutines awaiting query
+// results. An empty executor runs the task right away, on the thread
+// that completes the query.
+using Executor = std::function<void(std::function<void()> task)>;
+
+//
+// AsyncQueryState
+//
+
+// Result of an asynchronous query, shared by the callback of the
+// query and the coroutine awaiting it. Whichever of the two comes
+// second resumes the coroutine: the callback, if the coroutine is
+// suspended, or the coroutine itself, which then does not suspend.
+class AsyncQueryState {
+  public:
+    explicit AsyncQueryState(Executor executor)
+            : executor_ { std::move(executor) },
+              ready_ { false },
+              result_ {},
+              handle_ {} {
+    }
+
+    AsyncQueryState(const AsyncQueryState&) = delete;
+    AsyncQueryState& operator=(const AsyncQueryState&) = delete;
+
+    /// Starts the query; the state is kept alive by the query until
+    /// it completes
+    static std::shared_ptr<AsyncQueryState> start(PuppetdbConnector& connector,
+                                                  Query& query,
+                                                  Executor executor) {
+        std::shared_ptr<AsyncQueryState> state {
+            std::make_shared<AsyncQueryState>(std::move(executor)) };
+        connector.submit(query, [state](std::future<std::string> result) {
+            state->complete(std::move(result));
+        });
+        return state;
+    }
+
+    /// Called by the query callback with the result
+    void complete(std::future<std::string> result) {
+        result_ = std::move(result);
+        if (ready_.exchange(true)) {
+            resume();
+        }
+    }
+
+    /// Called by the awaiting coroutine once suspended; returns false
+    /// if the result is available, i.e. the coroutine must not stay
+    /// suspended
+    /// NB: the state must not be accessed after the call, as the
+    /// coroutine may already be resumed by another thread
+    bool suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        return !ready_.exchange(true);
+    }
+
+    /// Returns the result, once available
+    /// Throws a processing_error in case of failure
+    std::string get() {
+        return result_.get();
+    }
+
+  private:
+    Executor executor_;
+    std::atomic<bool> ready_;
+    std::future<std::string> result_;
+    std::coroutine_handle<> handle_;
+
+    void resume() {
+        std::coroutine_handle<> handle { handle_ };
+        if (executor_) {
+            executor_([handle]() { handle.resume(); });
+        } else {
+            handle.resume();
+        }
+    }
+};
+
+//
+// QueryAwaitable
+//
+
+// Awaitable result (json format) of a query, as returned by
+// asyncQuery; the query starts when it is awaited
+class QueryAwaitable {
+  public:
+    QueryAwaitable(PuppetdbConnector& connector, Query query,
+                   Executor executor)
+            : connector_ ( connector ),
+              query_ { std::move(query) },
+              executor_ { std::move(executor) },
+              state_ {} {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        state_ = AsyncQueryState::start(connector_, query_,
+                                        std::move(executor_));
+        std::shared_ptr<AsyncQueryState> state { state_ };
+        return state->suspend(handle);
+    }
+
+    std::string await_resume() {
+        return state_->get();
+    }
+
+  private:
+    PuppetdbConnector& connector_;
+    Query query_;
+    Executor executor_;
+    std::shared_ptr<AsyncQueryState> state_;
+};
+
+/// Returns an awaitable for the result (json format) of the query; the
+/// awaiting coroutine is resumed by the executor, if any. Awaiting the
+/// result throws a processing_error in case of failure, or the error
+/// raised by the connector if the query cannot be started.
+/// NB: the connector must outlive the query, and must not be used by
+/// another thread while the query is started
+inline QueryAwaitable asyncQuery(PuppetdbConnector& connector, Query query,
+                                 Executor executor = {}) {
+    return QueryAwaitable { connector, std::move(query),
+                            std::move(executor) };
+}
+
+//
+// AsyncPager
+//
+
+// Awaitable iteration over the pages of the results of a query, with
+// the semantics of QueryPager: the next page is fetched while the
+// coroutine processes the current one, if it is full, the iteration
+// ends after the first page with fewer records than the page size, and
+// the limit of the query, if any, caps the total number of records.
+class AsyncPager {
+  public:
+    // Awaitable next page, as returned by next(); an empty optional
+    // ends the iteration
+    class NextPage {
+      public:
+        explicit NextPage(AsyncPager& pager) : pager_ ( pager ) {}
+
+        bool await_ready() const noexcept {
+            return pager_.done_;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            return pager_.suspendNext(handle);
+        }
+
+        std::optional<std::string> await_resume() {
+            return pager_.resumeNext();
+        }
+
+      private:
+        AsyncPager& pager_;
+    };
+
+    AsyncPager() = delete;
+
+    /// Throws a query_error in case the page size is zero
+    AsyncPager(PuppetdbConnector& connector, Query query, size_t page_size,
+               Executor executor = {})
+            : connector_ ( connector ),
+              query_ { std::move(query) },
+              page_size_ { page_size },
+              executor_ { std::move(executor) },
+              next_offset_ { query_.getOffset() },
+              num_left_ { query_.getLimit() > 0 ? query_.getLimit()
+                                                : SIZE_MAX },
+              next_limit_ { 0 },
+              current_limit_ { 0 },
+              num_pages_ { 0 },
+              done_ { false },
+              current_page_ {},
+              next_page_ {} {
+        if (page_size_ == 0) {
+            throw query_error { "the page size must be positive" };
+        }
+    }
+
+    AsyncPager(const AsyncPager&) = delete;
+    AsyncPager& operator=(const AsyncPager&) = delete;
+
+    /// Returns an awaitable for the next page of results (json
+    /// format), or for an empty optional if there are no more results;
+    /// awaiting it throws a processing_error in case of failure
+    NextPage next() {
+        return NextPage { *this };
+    }
+
+    /// Returns the number of pages returned so far
+    size_t getNumPages() const {
+        return num_pages_;
+    }
+
+  private:
+    PuppetdbConnector& connector_;
+    Query query_;
+    size_t page_size_;
+    Executor executor_;
+    size_t next_offset_;
+    // Records left to fetch (SIZE_MAX without limit), and limits of
+    // the pages being fetched
+    size_t num_left_;
+    size_t next_limit_;
+    size_t current_limit_;
+    size_t num_pages_;
+    bool done_;
+    std::shared_ptr<AsyncQueryState> current_page_;
+    std::shared_ptr<AsyncQueryState> next_page_;
+
+    std::shared_ptr<AsyncQueryState> fetchNext() {
+        next_limit_ = std::min(page_size_, num_left_);
+        if (num_left_ != SIZE_MAX) {
+            num_left_ -= next_limit_;
+        }
+        Query page_query { query_ };
+        page_query.setLimit(next_limit_);
+        page_query.setOffset(next_offset_);
+        next_offset_ += next_limit_;
+        return AsyncQueryState::start(connector_, page_query, executor_);
+    }
+
+    bool suspendNext(std::coroutine_handle<> handle) {
+        if (!next_page_) {
+            next_page_ = fetchNext();
+        }
+        current_page_ = std::move(next_page_);
+        current_limit_ = next_limit_;
+
+        std::shared_ptr<AsyncQueryState> state { current_page_ };
+        return state->suspend(handle);
+    }
+
+    std::optional<std::string> resumeNext() {
+        if (done_) {
+            return std::nullopt;
+        }
+        std::string page {};
+        try {
+            page = current_page_->get();
+        } catch (...) {
+            done_ = true;
+            throw;
+        }
+        current_page_.reset();
+
+        // Prefetch the following page only if this one is full and the
+        // limit of the query is not reached
+        if (QueryPager::countRecords(page, current_limit_) < current_limit_
+                || num_left_ == 0) {
+            done_ = true;
+        } else {
+            next_page_ = fetchNext();
+        }
+
+        if (QueryPager::isEmptyResult(page)) {
+            return std::nullopt;
+        }
+        num_pages_++;
+        return page;
+    }
+};
+
+}  // namespace LibPuppetdb
+
+#endif  // LIBPUPPETDB_INCLUDE_PUPPETDB_COROUTINE_H_
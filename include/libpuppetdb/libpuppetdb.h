@@ -14,7 +14,10 @@
  * not change change across the supported versions. Also, the user is
  * responsible for specifying an endpoint compatible with the version.
  *
- * Multiple queries can be executed once a connection is set.
+ * Multiple queries can be executed once a connection is set; the
+ * connector keeps its libcurl handle (and thus the keep-alive
+ * connection and the TLS session) until close() is called or the
+ * connector is destroyed.
  * See example1.cpp and refer to README.
  *
  *
@@ -28,12 +31,15 @@
  *
  * - query format (query string is optional):
  *   {prot}://{hostname}:{port}/{version}/{endpoint}?query=<query_string>
+ *   optionally followed by the paging parameters (limit, offset,
+ *   order_by, and include_total; order-by and include-total before v4)
  * - it is up to the client program to provide an endpoint compatible
  *   with the specified API version
  * - it is up to the client program to provide the query string in
  *   the puppetdb language and to process results, i.e.:
  *      - the interface expects the query string as a string argument
- *      - the interface returns the json result data as a string
+ *      - the interface returns the json result data as a string or a
+ *        ChunkedResult, or passes it chunk by chunk to a ChunkSink
  * - secure connection requires ca_cert, node_cert, and private_key
  *
  */
@@ -44,6 +50,37 @@
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
+#include <exception>
+#include <memory>
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <list>
+#include <unordered_map>
+#include <climits>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <random>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
 
 #include <curl/curl.h>
 
@@ -69,6 +106,18 @@ static std::map<ApiVersion, const std::string> ApiVersionsMap {
 };
 static const ApiVersion API_VERSION_DEFAULT { ApiVersion::v4 };
 
+// Default cap on the number of concurrent asynchronous transfers
+static const size_t MAX_CONCURRENT_TRANSFERS_DEFAULT { 16 };
+
+// How the queries are sent: in the URL of a GET request, in the json
+// body of a POST request (api v4 only), or by POST when the query
+// string exceeds the threshold
+enum class QueryMethod { Get, Post, Auto };
+
+// Default size of the query strings above which QueryMethod::Auto
+// POSTs the query
+static const size_t POST_THRESHOLD_DEFAULT { 2048 };
+
 //
 // Errors
 //
@@ -111,10 +160,263 @@ inline bool fileExists (const std::string& file_path) {
     return exists;
 }
 
+//
+// Global initialization
+//
+
+/// Initializes libcurl; call it once at startup, before starting
+/// other threads, so that the first query does not pay for it.
+/// Otherwise, libcurl is initialized by the first handle, which is
+/// not thread-safe before libcurl 7.84. Each call must be matched by
+/// a call to globalCleanup().
+/// Throws a processing_error in case of failure
+inline void globalInit(long flags = CURL_GLOBAL_DEFAULT) {
+    CURLcode return_code { curl_global_init(flags) };
+    if (return_code != CURLE_OK) {
+        throw processing_error { std::string { "failed to initialize "
+                                               "libcurl: " }
+                                 + curl_easy_strerror(return_code) };
+    }
+}
+
+/// Releases the global resources of libcurl, once all the connectors
+/// are destroyed
+inline void globalCleanup() {
+    curl_global_cleanup();
+}
+
+//
+// Arena
+//
+
+// Default size of the Arena blocks
+static const size_t ARENA_BLOCK_SIZE_DEFAULT { 4096 };
+
+// Monotonic allocator for the temporary objects of a query: memory is
+// carved out of blocks and released all at once by reset(), which
+// keeps the first block for the next query. Only trivially
+// destructible objects, or containers using ArenaAllocator, may be
+// allocated.
+class Arena {
+  public:
+    explicit Arena(size_t block_size = ARENA_BLOCK_SIZE_DEFAULT)
+            : block_size_ { std::max<size_t>(block_size, 64) },
+              blocks_ {},
+              used_ { 0 },
+              num_bytes_ { 0 } {
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    /// Returns uninitialized memory, valid until reset() is called or
+    /// the arena is destroyed
+    void* allocate(size_t size,
+                   size_t alignment = alignof(std::max_align_t)) {
+        size_t offset { align(used_, alignment) };
+        if (blocks_.empty() || offset + size > blocks_.back().size) {
+            // A larger allocation gets a block of its own
+            addBlock(std::max(block_size_, size + alignment));
+            offset = align(used_, alignment);
+        }
+        used_ = offset + size;
+        num_bytes_ += size;
+        return blocks_.back().data.get() + offset;
+    }
+
+    /// Returns a null-terminated copy of the data
+    char* copy(const char* data, size_t size) {
+        char* copied { static_cast<char*>(allocate(size + 1, 1)) };
+        std::copy(data, data + size, copied);
+        copied[size] = '\0';
+        return copied;
+    }
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "the arena does not call destructors");
+        return new (allocate(sizeof(T), alignof(T)))
+            T(std::forward<Args>(args)...);
+    }
+
+    /// Releases all the allocated memory, keeping the first block
+    void reset() {
+        if (blocks_.size() > 1) {
+            blocks_.erase(blocks_.begin() + 1, blocks_.end());
+        }
+        used_ = 0;
+        num_bytes_ = 0;
+    }
+
+    size_t getNumBlocks() const {
+        return blocks_.size();
+    }
+
+    /// Returns the number of bytes allocated since the last reset
+    size_t getNumBytes() const {
+        return num_bytes_;
+    }
+
+  private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    size_t block_size_;
+    std::vector<Block> blocks_;
+    // Offset of the free space in the last block
+    size_t used_;
+    size_t num_bytes_;
+
+    // NB: the blocks are aligned as max_align_t by new[]; larger
+    // alignments are aligned relatively to the block start
+    static size_t align(size_t offset, size_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    void addBlock(size_t size) {
+        blocks_.push_back(Block { std::unique_ptr<char[]> { new char[size] },
+                                  size });
+        used_ = 0;
+    }
+};
+
+// Standard allocator carving memory out of an Arena, e.g. for
+// std::basic_string or std::vector; deallocation is a no-op
+template <typename T>
+class ArenaAllocator {
+  public:
+    using value_type = T;
+
+    explicit ArenaAllocator(Arena& arena) : arena_ { &arena } {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena_ { other.arena_ } {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* pointer, size_t n) {
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return arena_ == other.arena_;
+    }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const {
+        return arena_ != other.arena_;
+    }
+
+  private:
+    template <typename U>
+    friend class ArenaAllocator;
+
+    Arena* arena_;
+};
+
+using ArenaString = std::basic_string<char, std::char_traits<char>,
+                                      ArenaAllocator<char>>;
+
+// libcurl header list allocated in an arena (instead of two
+// allocations per header, as curl_slist_append does); the list is
+// released with the arena and must not be freed with
+// curl_slist_free_all
+class ArenaHeaderList {
+  public:
+    explicit ArenaHeaderList(Arena& arena)
+            : arena_ ( arena ),
+              head_ { nullptr },
+              tail_ { nullptr } {
+    }
+
+    /// Appends the "<name>: <value>" header
+    void append(const std::string& name, const std::string& value) {
+        size_t size { name.size() + 2 + value.size() };
+        char* data { static_cast<char*>(arena_.allocate(size + 1, 1)) };
+        std::copy(name.begin(), name.end(), data);
+        data[name.size()] = ':';
+        data[name.size() + 1] = ' ';
+        std::copy(value.begin(), value.end(), data + name.size() + 2);
+        data[size] = '\0';
+
+        curl_slist* node { arena_.create<curl_slist>() };
+        node->data = data;
+        node->next = nullptr;
+        (tail_ == nullptr ? head_ : tail_->next) = node;
+        tail_ = node;
+    }
+
+    /// Returns the list, or nullptr if it is empty
+    curl_slist* get() const {
+        return head_;
+    }
+
+  private:
+    Arena& arena_;
+    curl_slist* head_;
+    curl_slist* tail_;
+};
+
+/// Appends the URL encoding of the data, as curl_easy_escape does
+/// (all but the unreserved characters are percent-encoded), without
+/// allocating temporary strings
+template <typename String>
+void appendUrlEncoded(String& target, const char* data, size_t size) {
+    static const char HEX_DIGITS[] = "0123456789ABCDEF";
+    for (size_t index = 0; index < size; index++) {
+        unsigned char c { static_cast<unsigned char>(data[index]) };
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                || (c >= '0' && c <= '9')
+                || c == '-' || c == '.' || c == '_' || c == '~') {
+            target += static_cast<char>(c);
+        } else {
+            target += '%';
+            target += HEX_DIGITS[c >> 4];
+            target += HEX_DIGITS[c & 0x0F];
+        }
+    }
+}
+
+/// Appends the data as the content of a json string (quotes, control
+/// characters and backslashes are escaped)
+template <typename String>
+void appendJsonEscaped(String& target, const char* data, size_t size) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    for (size_t index = 0; index < size; index++) {
+        unsigned char c { static_cast<unsigned char>(data[index]) };
+        if (c == '"' || c == '\\') {
+            target += '\\';
+            target += static_cast<char>(c);
+        } else if (c < 0x20) {
+            target += "\\u00";
+            target += HEX_DIGITS[c >> 4];
+            target += HEX_DIGITS[c & 0x0F];
+        } else {
+            target += static_cast<char>(c);
+        }
+    }
+}
+
 //
 // Query
 //
 
+// Sort order of a result field
+struct OrderBy {
+    std::string field;
+    bool ascending;
+
+    OrderBy(std::string field_name, bool is_ascending = true)
+            : field { std::move(field_name) },
+              ascending { is_ascending } {
+    }
+};
+
 class Query {
   public:
     Query() = delete;
@@ -137,206 +439,5102 @@ class Query {
         return query_string_;
     }
 
+    /// Sets the maximum number of results (paging); 0 means no limit
+    void setLimit(size_t limit) {
+        limit_ = limit;
+    }
+
+    size_t getLimit() const {
+        return limit_;
+    }
+
+    /// Sets the number of results to skip (paging)
+    void setOffset(size_t offset) {
+        offset_ = offset;
+    }
+
+    size_t getOffset() const {
+        return offset_;
+    }
+
+    /// Sets the fields used to sort the results; paging requires a
+    /// sort order to return consistent pages
+    void setOrderBy(std::vector<OrderBy> order_by) {
+        order_by_ = std::move(order_by);
+    }
+
+    const std::vector<OrderBy>& getOrderBy() const {
+        return order_by_;
+    }
+
+    /// Makes PuppetDB return the total number of results in the
+    /// X-Records header
+    void setIncludeTotal(bool include_total) {
+        include_total_ = include_total;
+    }
+
+    bool getIncludeTotal() const {
+        return include_total_;
+    }
+
+    /// Returns true if any paging parameter is set
+    bool isPaged() const {
+        return limit_ > 0 || offset_ > 0 || !order_by_.empty()
+               || include_total_;
+    }
+
+    /// Sets the priority of the query (0 by default) over the other
+    /// queued queries of the connector, and over those waiting for the
+    /// permits of a Throttle; higher priorities start first
+    void setPriority(int priority) {
+        priority_ = priority;
+    }
+
+    int getPriority() const {
+        return priority_;
+    }
+
+    /// Sets the fields of the records to return (all fields if empty,
+    /// the default). With the v4 API, the query is wrapped in an
+    /// extract clause so that PuppetDB only returns those fields; the
+    /// query must then be empty or an AST query. The other versions
+    /// return whole records, and the fields are only selected by the
+    /// result parsers.
+    void setProjection(std::vector<std::string> fields) {
+        projection_ = std::move(fields);
+    }
+
+    const std::vector<std::string>& getProjection() const {
+        return projection_;
+    }
+
   private:
     // Endpoint
     std::string endpoint_;
 
     // Query string
     std::string query_string_;
+
+    // Paging parameters
+    size_t limit_ { 0 };
+    size_t offset_ { 0 };
+    std::vector<OrderBy> order_by_ {};
+    bool include_total_ { false };
+
+    // Scheduling priority
+    int priority_ { 0 };
+
+    // Projection
+    std::vector<std::string> projection_ {};
 };
 
 //
 // Query result
 //
 
-struct QueryResult {
-    char* content;
-    size_t size;
+// libcurl write callback, as implemented by QueryResult
+using WriteCallback = size_t (*)(void* contents, size_t size, size_t nmemb,
+                                 void* userp);
+
+// Cap on the result buffer space reserved from the Content-Length
+// header; larger results grow the buffer as they are received
+static const size_t MAX_RESERVED_RESULT_SIZE { 256 * 1024 * 1024 };
+
+// Consumer of a query result; it is called with each chunk of the
+// result (json format) as soon as libcurl receives it
+using ChunkSink = std::function<void(const char* data, size_t size)>;
 
+// libcurl callbacks and transfer state
+struct QueryResult {
     static size_t callback(void* contents, size_t size, size_t nmemb,
                            void *userp) {
         static_cast<std::string*>(userp)->append(static_cast<char*>(contents),
                                                  size * nmemb);
         return size * nmemb;
     }
-};
 
-//
-// PuppetdbConnector
-//
+    // Response headers of a transfer; the result buffer, if any, is
+    // where the space announced by the Content-Length header is
+    // reserved
+    struct ResponseHeaders {
+        std::string* result_buffer;
+        std::string etag;
+        std::string last_modified;
 
-class PuppetdbConnector {
-  public:
-    PuppetdbConnector() = delete;
+        explicit ResponseHeaders(std::string* buffer = nullptr)
+                : result_buffer { buffer },
+                  etag {},
+                  last_modified {} {
+        }
+    };
 
-    /// Constructor for HTTP connector
-    /// Throws a connector_error in case if the hostname is an empty
-    /// string
-    PuppetdbConnector(const std::string& hostname,
-                      const int port = PUPPETDB_HTTP_PORT,
-                      const ApiVersion api_version = API_VERSION_DEFAULT)
-            : hostname_ { hostname },
-              port_ { port },
-              api_version_ { api_version },
-              is_secure_ { false },
-              performed_query_url_ {} {
-        checkHostname();
+    // libcurl header callback; it stores the headers used by the
+    // connector in a ResponseHeaders instance
+    static size_t headerCallback(char* contents, size_t size, size_t nmemb,
+                                 void *userp) {
+        size_t header_size { size * nmemb };
+        auto headers = static_cast<ResponseHeaders*>(userp);
+        std::string header { contents, header_size };
+        size_t colon_idx { header.find(':') };
+
+        if (colon_idx == std::string::npos) {
+            // Status line or end of the headers
+            return header_size;
+        }
+
+        std::string name { header.substr(0, colon_idx) };
+        std::transform(name.begin(), name.end(), name.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+        size_t value_start { header.find_first_not_of(" \t", colon_idx + 1) };
+        size_t value_end { header.find_last_not_of(" \t\r\n") };
+        std::string value {};
+        if (value_start != std::string::npos && value_end >= value_start) {
+            value = header.substr(value_start, value_end - value_start + 1);
+        }
+
+        if (name == "content-length" && headers->result_buffer != nullptr) {
+            unsigned long long content_length {
+                std::strtoull(value.c_str(), nullptr, 10) };
+            headers->result_buffer->reserve(
+                headers->result_buffer->size() + static_cast<size_t>(
+                    std::min<unsigned long long>(content_length,
+                                                 MAX_RESERVED_RESULT_SIZE)));
+        } else if (name == "etag") {
+            headers->etag = value;
+        } else if (name == "last-modified") {
+            headers->last_modified = value;
+        }
+        return header_size;
     }
 
-    /// Constructor for SSL connector
-    /// Throws a connector_error in case if the hostname is an empty
-    /// string, if libcurl is not SSL enabled, or if any of the
-    /// specified certificates is not an existent file
-    PuppetdbConnector(const std::string& hostname,
-                      const std::string& ca_crt_path,
-                      const std::string& client_crt_path,
-                      const std::string& client_key_path,
-                      const int port = PUPPETDB_SECURE_PORT,
-                      const ApiVersion api_version = API_VERSION_DEFAULT)
-            : hostname_ { hostname },
-              port_ { port },
-              api_version_ { api_version },
-              ca_crt_path_ { ca_crt_path },
-              client_crt_path_ { client_crt_path },
-              client_key_path_ { client_key_path },
-              is_secure_ { true },
-              performed_query_url_ {} {
-        checkHostname();
-        checkSSLSupport();
-        checkCertificates();
+    // State of a transfer whose result is passed on to another write
+    // callback; the result size is counted and, if requested, the
+    // result is copied
+    struct ForwardContext {
+        WriteCallback write_callback;
+        void* write_data;
+        bool keep_copy;
+        std::string copy;
+        uint64_t num_bytes;
+
+        ForwardContext(WriteCallback callback, void* data, bool keep)
+                : write_callback { callback },
+                  write_data { data },
+                  keep_copy { keep },
+                  copy {},
+                  num_bytes { 0 } {
+        }
+    };
+
+    static size_t forwardCallback(void* contents, size_t size, size_t nmemb,
+                                  void *userp) {
+        auto context = static_cast<ForwardContext*>(userp);
+        size_t written { context->write_callback(contents, size, nmemb,
+                                                 context->write_data) };
+        if (written == size * nmemb) {
+            context->num_bytes += written;
+            if (context->keep_copy) {
+                context->copy.append(static_cast<char*>(contents), written);
+            }
+        }
+        return written;
     }
 
-    /// Returns true if the Connector instance uses SSL, false
-    /// otherwise
-    bool isSecure() const {
-        return is_secure_;
+    // State of a streamed transfer; the sink error, if any, is
+    // rethrown once libcurl aborts the transfer
+    struct SinkContext {
+        ChunkSink& sink;
+        std::exception_ptr error;
+    };
+
+    static size_t sinkCallback(void* contents, size_t size, size_t nmemb,
+                               void *userp) {
+        auto context = static_cast<SinkContext*>(userp);
+        try {
+            context->sink(static_cast<char*>(contents), size * nmemb);
+        } catch (...) {
+            // NB: exceptions must not cross libcurl
+            context->error = std::current_exception();
+            return 0;
+        }
+        return size * nmemb;
     }
+};
 
-    /// Returns the PuppetDB query result (json format) as a string
-    /// Throws a processing_error in case of failure
-    std::string performQuery(Query& query) {
-        return setupAndPerform(query);
+//
+// ChunkedResult
+//
+
+// Read-only view of a contiguous part of a result
+struct StringView {
+    const char* data;
+    size_t size;
+
+    std::string toString() const {
+        return std::string(data, size);
     }
 
-    /// Returns the URL used to perform the PuppetDB query
-    std::string getPerformedQueryUrl() const {
-        return performed_query_url_;
+#if __cplusplus >= 201703L
+    operator std::string_view() const {
+        return std::string_view { data, size };
     }
+#endif
+};
 
-    // NB: this method is public and virtual for testing purposes
-    virtual std::string getQueryUrl(Query& query, CURL* curl) {
-        std::string protocol { isSecure() ? "https" : "http" };
-        std::string endpoint_and_query = query.getEndpoint();
-        std::string query_str = query.getQueryString();
+// Sizes of the ChunkedResult blocks
+static const size_t MIN_RESULT_BLOCK_SIZE { 16 * 1024 };
+static const size_t MAX_RESULT_BLOCK_SIZE { 1024 * 1024 };
 
-        if (!query_str.empty()) {
-            // URL encode
-            char* encoded_query = curl_easy_escape(curl, query_str.c_str(), 0);
+// A query result held as a chain of reference-counted blocks, filled
+// as the chunks are received, so that it never has to be reallocated
+// or flattened. Copies share the blocks; appending to a copy never
+// alters the others.
+class ChunkedResult {
+  public:
 
-            if (encoded_query == nullptr) {
-                throw processing_error { "failed to encode the query URL" };
-            }
+    ChunkedResult() : chunks_ {}, size_ { 0 }, next_block_size_ { 0 } {}
 
-            endpoint_and_query += "?query=" + std::string { encoded_query };
+    /// libcurl write callback; userp is the ChunkedResult
+    static size_t callback(void* contents, size_t size, size_t nmemb,
+                           void* userp) {
+        static_cast<ChunkedResult*>(userp)->append(
+            static_cast<const char*>(contents), size * nmemb);
+        return size * nmemb;
+    }
 
-            // Free the memory used by curl_easy_escape()
-            curl_free(encoded_query);
+    /// Copies the data at the end of the last block, or of new blocks
+    /// (each up to twice as large as the previous one)
+    void append(const char* data, size_t size) {
+        while (size > 0) {
+            if (!canExtend()) {
+                addBlock(size);
+            }
+            Chunk& chunk = chunks_.back();
+            size_t copy_size { std::min(size,
+                                        chunk.block->capacity
+                                        - chunk.block->used) };
+            std::copy(data, data + copy_size,
+                      chunk.block->data.get() + chunk.block->used);
+            chunk.block->used += copy_size;
+            chunk.size += copy_size;
+            size_ += copy_size;
+            data += copy_size;
+            size -= copy_size;
         }
+    }
 
-        return protocol + "://" + hostname_ + ":" + std::to_string(port_)
-               + "/" + getApiVersion() + "/" + endpoint_and_query;
+    /// Appends the chunks of the other result, without copying them
+    void append(const ChunkedResult& other) {
+        chunks_.insert(chunks_.end(), other.chunks_.begin(),
+                       other.chunks_.end());
+        size_ += other.size_;
     }
 
-  private:
-    // PuppetDB host, port, and api version
-    std::string hostname_;
-    int port_;
-    ApiVersion api_version_;
+    void clear() {
+        chunks_.clear();
+        size_ = 0;
+        next_block_size_ = 0;
+    }
 
-    // File paths used for the SSL connection
-    std::string ca_crt_path_;
-    std::string client_crt_path_;
-    std::string client_key_path_;
+    size_t size() const {
+        return size_;
+    }
 
-    // SSL flag
-    bool is_secure_;
+    bool empty() const {
+        return size_ == 0;
+    }
 
-    // The URL of the performed query
-    std::string performed_query_url_;
+    size_t getNumChunks() const {
+        return chunks_.size();
+    }
 
-    void checkHostname() {
-        if (hostname_.empty()) {
-            throw connector_error { "no hostname specified" };
-        }
+    StringView getChunk(size_t index) const {
+        const Chunk& chunk = chunks_.at(index);
+        return StringView { chunk.block->data.get() + chunk.offset,
+                            chunk.size };
     }
 
-    void checkSSLSupport() {
-        curl_version_info_data* info_data = curl_version_info(CURLVERSION_NOW);
-        if (!(info_data->features & CURL_VERSION_SSL)) {
-            throw connector_error { "libcurl is not SSL enabled" };
+    /// Calls the function with each chunk, in order
+    void forEachChunk(
+            const std::function<void(const char* data, size_t size)>& function)
+            const {
+        for (const auto& chunk : chunks_) {
+            function(chunk.block->data.get() + chunk.offset, chunk.size);
         }
     }
 
-    void checkCertificates() {
-        std::vector<std::string> certificates { ca_crt_path_,
-                                                client_crt_path_,
-                                                client_key_path_ };
-        for (auto cert : certificates) {
-            if (cert.empty()) {
-                throw connector_error { "not all certificates were specified" };
-            }
+    /// Returns a copy of the result as a single string
+    std::string toString() const {
+        std::string result {};
+        result.reserve(size_);
+        for (const auto& chunk : chunks_) {
+            result.append(chunk.block->data.get() + chunk.offset, chunk.size);
         }
+        return result;
+    }
 
-        for (auto cert : certificates) {
-            if (!fileExists(cert)) {
-                throw connector_error { "invalid certificate file: " + cert };
-            }
+#ifndef _WIN32
+    /// Returns the chunks as an iovec array, e.g. for writev or
+    /// sendmsg; it is valid as long as the result is not modified
+    std::vector<iovec> getIovecs() const {
+        std::vector<iovec> iovecs {};
+        iovecs.reserve(chunks_.size());
+        for (const auto& chunk : chunks_) {
+            iovecs.push_back(iovec {
+                chunk.block->data.get() + chunk.offset, chunk.size });
         }
+        return iovecs;
     }
 
-    std::string getApiVersion() {
-        return ApiVersionsMap[api_version_];
+    /// Writes the result to the file descriptor with writev, retrying
+    /// on partial writes and on EINTR
+    /// Throws a processing_error in case of failure
+    void writeTo(int fd) const {
+#ifdef IOV_MAX
+        const size_t max_iovecs { IOV_MAX };
+#else
+        const size_t max_iovecs { 1024 };
+#endif
+        std::vector<iovec> iovecs { getIovecs() };
+        size_t first { 0 };
+        while (first < iovecs.size()) {
+            int count { static_cast<int>(
+                std::min(iovecs.size() - first, max_iovecs)) };
+            ssize_t written { writev(fd, &iovecs[first], count) };
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw processing_error { "failed to write the query result" };
+            }
+            // Skip what was written
+            size_t remaining { static_cast<size_t>(written) };
+            while (first < iovecs.size()
+                    && remaining >= iovecs[first].iov_len) {
+                remaining -= iovecs[first].iov_len;
+                first++;
+            }
+            if (remaining > 0) {
+                iovecs[first].iov_base =
+                    static_cast<char*>(iovecs[first].iov_base) + remaining;
+                iovecs[first].iov_len -= remaining;
+            }
+        }
     }
+#endif
 
-    // NB: this is virtual to enable mocking
-    virtual std::string setupAndPerform(Query& query) {
-        std::string result_buffer {};
+  private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t capacity;
+        size_t used;
+    };
 
-        // libcurl handle
-        CURL* curl { curl_easy_init() };
+    struct Chunk {
+        std::shared_ptr<Block> block;
+        size_t offset;
+        size_t size;
+    };
 
-        if(curl) {
-            performed_query_url_ = getQueryUrl(query, curl);
+    std::vector<Chunk> chunks_;
+    size_t size_;
+    size_t next_block_size_;
 
-            // Configure the libcurl handle
-            curl_easy_setopt(curl, CURLOPT_URL,
-                             performed_query_url_.c_str());
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
-                             QueryResult::callback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &result_buffer);
+    // Whether the last chunk can grow in place: its block must not be
+    // shared, have room left, and end with the chunk
+    bool canExtend() const {
+        if (chunks_.empty()) {
+            return false;
+        }
+        const Chunk& chunk = chunks_.back();
+        return chunk.block.use_count() == 1
+               && chunk.block->used < chunk.block->capacity
+               && chunk.offset + chunk.size == chunk.block->used;
+    }
 
-            if (isSecure()) {
-                setSSLOptions(curl);
-            }
+    void addBlock(size_t size) {
+        next_block_size_ = std::max(next_block_size_, MIN_RESULT_BLOCK_SIZE);
+        size_t capacity { std::max(std::min(size, MAX_RESULT_BLOCK_SIZE),
+                                   next_block_size_) };
+        next_block_size_ = std::min(next_block_size_ * 2,
+                                    MAX_RESULT_BLOCK_SIZE);
+        std::shared_ptr<Block> block { new Block {
+            std::unique_ptr<char[]> { new char[capacity] }, capacity, 0 } };
+        chunks_.push_back(Chunk { std::move(block), 0, 0 });
+    }
+};
 
-            // Perform the query
-            CURLcode return_code { curl_easy_perform(curl) };
+//
+// CompressionCounters
+//
 
-            if (return_code != CURLE_OK) {
-                throw processing_error {
-                    std::string(curl_easy_strerror(return_code)) };
-            }
+// Cumulative sizes of the results received by a connector: as
+// transferred (compressed, if compression is enabled) and as passed to
+// the caller (decompressed)
+class CompressionCounters {
+  public:
+    struct Snapshot {
+        uint64_t compressed_bytes;
+        uint64_t decompressed_bytes;
 
-            // Close all libcurl connections
-            curl_easy_cleanup(curl);
+        /// Returns the decompressed / compressed ratio (1 if nothing
+        /// was received)
+        double getRatio() const {
+            return compressed_bytes > 0
+                   ? static_cast<double>(decompressed_bytes) / compressed_bytes
+                   : 1.0;
         }
-        return result_buffer;
-    }
+    };
 
+    CompressionCounters() : compressed_bytes_ { 0 }, decompressed_bytes_ { 0 } {}
+
+    void add(uint64_t compressed_bytes, uint64_t decompressed_bytes) {
+        compressed_bytes_ += compressed_bytes;
+        decompressed_bytes_ += decompressed_bytes;
+    }
+
+    Snapshot get() const {
+        return Snapshot { compressed_bytes_.load(), decompressed_bytes_.load() };
+    }
+
+    void reset() {
+        compressed_bytes_ = 0;
+        decompressed_bytes_ = 0;
+    }
+
+  private:
+    std::atomic<uint64_t> compressed_bytes_;
+    std::atomic<uint64_t> decompressed_bytes_;
+};
+
+/// Returns the size of the result of the last transfer of the libcurl
+/// handle, as received (i.e. before decompression)
+inline uint64_t getDownloadSize(CURL* curl) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t size { 0 };
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+    return static_cast<uint64_t>(size);
+#else
+    double size { 0 };
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &size);
+    return static_cast<uint64_t>(size);
+#endif
+}
+
+//
+// QueryStats
+//
+
+// Timings, sizes, and outcome of a query; the timings are measured by
+// libcurl from the start of the transfer, as curl_easy_getinfo reports
+// them
+struct QueryStats {
+    std::string url;
+    std::string endpoint;
+
+    // CURLE_OK and 0 unless the transfer happened
+    CURLcode curl_code;
+    long response_code;
+
+    std::chrono::microseconds name_lookup_time;
+    std::chrono::microseconds connect_time;
+    std::chrono::microseconds app_connect_time;
+    std::chrono::microseconds pre_transfer_time;
+    std::chrono::microseconds start_transfer_time;
+    std::chrono::microseconds total_time;
+
+    // Sizes of the request, the response headers, and the result as
+    // received and as passed on (i.e. after decompression)
+    uint64_t request_bytes;
+    uint64_t header_bytes;
+    uint64_t downloaded_bytes;
+    uint64_t result_bytes;
+
+    // Whether an already open connection was used
+    bool connection_reused;
+    // Whether the result was delivered by the response cache, or by
+    // an identical query in flight, without a transfer
+    bool from_cache;
+    bool coalesced;
+    // Whether the cached result was delivered after a 304 response
+    // revalidating it (result_bytes is then the size of the cached
+    // result)
+    bool revalidated;
+
+    // Number of previous attempts of the query, and whether a hedged
+    // request was sent
+    size_t retries;
+    bool hedged;
+
+    QueryStats()
+            : url {},
+              endpoint {},
+              curl_code { CURLE_OK },
+              response_code { 0 },
+              name_lookup_time { 0 },
+              connect_time { 0 },
+              app_connect_time { 0 },
+              pre_transfer_time { 0 },
+              start_transfer_time { 0 },
+              total_time { 0 },
+              request_bytes { 0 },
+              header_bytes { 0 },
+              downloaded_bytes { 0 },
+              result_bytes { 0 },
+              connection_reused { false },
+              from_cache { false },
+              coalesced { false },
+              revalidated { false },
+              retries { 0 },
+              hedged { false } {
+    }
+
+    /// Returns the duration of the TLS handshake (0 for HTTP)
+    std::chrono::microseconds getTlsTime() const {
+        return app_connect_time > connect_time
+               ? app_connect_time - connect_time
+               : std::chrono::microseconds { 0 };
+    }
+
+    /// Returns the time from sending the request to receiving the
+    /// first byte of the response
+    std::chrono::microseconds getServerTime() const {
+        return start_transfer_time > pre_transfer_time
+               ? start_transfer_time - pre_transfer_time
+               : std::chrono::microseconds { 0 };
+    }
+
+    /// Returns the time spent receiving the response
+    std::chrono::microseconds getTransferTime() const {
+        return total_time > start_transfer_time
+               ? total_time - start_transfer_time
+               : std::chrono::microseconds { 0 };
+    }
+
+    /// Returns whether the query failed (either the transfer or the
+    /// HTTP request)
+    bool isError() const {
+        return curl_code != CURLE_OK || response_code >= 400;
+    }
+};
+
+// Returns a libcurl time info of the handle
+inline std::chrono::microseconds getTimeInfo(CURL* curl, CURLINFO info) {
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    curl_off_t time { 0 };
+    curl_easy_getinfo(curl, info, &time);
+    return std::chrono::microseconds { time };
+#else
+    double time { 0 };
+    curl_easy_getinfo(curl, info, &time);
+    return std::chrono::microseconds {
+        static_cast<std::chrono::microseconds::rep>(time * 1e6) };
+#endif
+}
+
+/// Returns the stats of the last transfer of the libcurl handle
+inline QueryStats getQueryStats(CURL* curl, CURLcode curl_code) {
+    QueryStats stats {};
+    stats.curl_code = curl_code;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &stats.response_code);
+
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    stats.name_lookup_time = getTimeInfo(curl, CURLINFO_NAMELOOKUP_TIME_T);
+    stats.connect_time = getTimeInfo(curl, CURLINFO_CONNECT_TIME_T);
+    stats.app_connect_time = getTimeInfo(curl, CURLINFO_APPCONNECT_TIME_T);
+    stats.pre_transfer_time = getTimeInfo(curl, CURLINFO_PRETRANSFER_TIME_T);
+    stats.start_transfer_time = getTimeInfo(curl,
+                                            CURLINFO_STARTTRANSFER_TIME_T);
+    stats.total_time = getTimeInfo(curl, CURLINFO_TOTAL_TIME_T);
+#else
+    stats.name_lookup_time = getTimeInfo(curl, CURLINFO_NAMELOOKUP_TIME);
+    stats.connect_time = getTimeInfo(curl, CURLINFO_CONNECT_TIME);
+    stats.app_connect_time = getTimeInfo(curl, CURLINFO_APPCONNECT_TIME);
+    stats.pre_transfer_time = getTimeInfo(curl, CURLINFO_PRETRANSFER_TIME);
+    stats.start_transfer_time = getTimeInfo(curl, CURLINFO_STARTTRANSFER_TIME);
+    stats.total_time = getTimeInfo(curl, CURLINFO_TOTAL_TIME);
+#endif
+
+    long size { 0 };
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &size);
+    stats.request_bytes = static_cast<uint64_t>(size);
+    curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &size);
+    stats.header_bytes = static_cast<uint64_t>(size);
+    stats.downloaded_bytes = getDownloadSize(curl);
+
+    long num_connects { 0 };
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &num_connects);
+    stats.connection_reused = curl_code == CURLE_OK && num_connects == 0;
+    return stats;
+}
+
+using QueryObserver = std::function<void(const QueryStats& stats)>;
+
+// The global query observer
+struct QueryObserverRegistry {
+    std::mutex mutex;
+    std::shared_ptr<QueryObserver> observer;
+
+    static QueryObserverRegistry& get() {
+        static QueryObserverRegistry registry {};
+        return registry;
+    }
+};
+
+/// Sets the observer that is passed the stats of every query
+/// performed by any connector (including the asynchronous ones, from
+/// the libcurl loop thread); it must be thread safe and must not
+/// throw. Passing an empty function removes the observer.
+inline void setQueryObserver(QueryObserver observer) {
+    auto& registry = QueryObserverRegistry::get();
+    std::shared_ptr<QueryObserver> new_observer {};
+    if (observer) {
+        new_observer = std::make_shared<QueryObserver>(std::move(observer));
+    }
+    std::lock_guard<std::mutex> lock { registry.mutex };
+    registry.observer = std::move(new_observer);
+}
+
+inline void notifyQueryObserver(const QueryStats& stats) {
+    auto& registry = QueryObserverRegistry::get();
+    std::shared_ptr<QueryObserver> observer {};
+    {
+        std::lock_guard<std::mutex> lock { registry.mutex };
+        observer = registry.observer;
+    }
+    if (observer) {
+        try {
+            (*observer)(stats);
+        } catch (...) {
+            // The query outcome must not depend on the observer
+        }
+    }
+}
+
+//
+// LatencyHistogram
+//
+
+// Wait-free histogram of latencies, in microseconds, with log-linear
+// buckets (as HDR histograms): values below 2^SUB_BUCKET_BITS have
+// their own bucket, others share it with the values having the same
+// SUB_BUCKET_BITS most significant bits, so the relative error is
+// below 1 / 2^SUB_BUCKET_BITS (6.25%); values from 2^MAX_BITS us
+// (about 19h) on are recorded in the last bucket
+class LatencyHistogram {
+  public:
+    static const unsigned int SUB_BUCKET_BITS { 4 };
+    static const unsigned int SUB_BUCKET_COUNT { 1u << SUB_BUCKET_BITS };
+    static const unsigned int MAX_BITS { 36 };
+    static const size_t NUM_BUCKETS {
+        SUB_BUCKET_COUNT * (MAX_BITS - SUB_BUCKET_BITS + 1) };
+
+    // Copy of the histogram, which can be merged and queried
+    class Snapshot {
+      public:
+        Snapshot() : counts_(NUM_BUCKETS, 0), count_ { 0 }, sum_ { 0 } {}
+
+        uint64_t getCount() const {
+            return count_;
+        }
+
+        std::chrono::microseconds getMean() const {
+            return std::chrono::microseconds {
+                count_ > 0 ? static_cast<int64_t>(sum_ / count_) : 0 };
+        }
+
+        /// Returns the latency below which the specified percentage
+        /// of the values fall (0 if the histogram is empty), e.g.
+        /// getPercentile(99) for p99
+        std::chrono::microseconds getPercentile(double percentile) const {
+            if (count_ == 0) {
+                return std::chrono::microseconds { 0 };
+            }
+            percentile = std::min(std::max(percentile, 0.0), 100.0);
+            uint64_t rank { static_cast<uint64_t>(
+                percentile / 100.0 * static_cast<double>(count_) + 0.5) };
+            rank = std::min(std::max<uint64_t>(rank, 1), count_);
+            uint64_t seen { 0 };
+            for (size_t index = 0; index < NUM_BUCKETS; index++) {
+                seen += counts_[index];
+                if (seen >= rank) {
+                    return std::chrono::microseconds {
+                        static_cast<int64_t>(getHighestValue(index)) };
+                }
+            }
+            return std::chrono::microseconds {
+                static_cast<int64_t>(getHighestValue(NUM_BUCKETS - 1)) };
+        }
+
+        void merge(const Snapshot& other) {
+            for (size_t index = 0; index < NUM_BUCKETS; index++) {
+                counts_[index] += other.counts_[index];
+            }
+            count_ += other.count_;
+            sum_ += other.sum_;
+        }
+
+      private:
+        friend class LatencyHistogram;
+
+        std::vector<uint64_t> counts_;
+        uint64_t count_;
+        uint64_t sum_;
+    };
+
+    LatencyHistogram() : counts_ {}, count_ { 0 }, sum_ { 0 } {
+        for (auto& count : counts_) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(std::chrono::microseconds latency) {
+        uint64_t value { latency.count() > 0
+                         ? static_cast<uint64_t>(latency.count()) : 0 };
+        counts_[getIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    /// Returns a copy of the histogram; NB: the values recorded while
+    /// copying may or may not be included
+    Snapshot getSnapshot() const {
+        Snapshot snapshot {};
+        for (size_t index = 0; index < NUM_BUCKETS; index++) {
+            snapshot.counts_[index] =
+                counts_[index].load(std::memory_order_relaxed);
+            snapshot.count_ += snapshot.counts_[index];
+        }
+        snapshot.sum_ = sum_.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+
+    static size_t getIndex(uint64_t value) {
+        if (value < SUB_BUCKET_COUNT) {
+            return static_cast<size_t>(value);
+        }
+        unsigned int msb { getMostSignificantBit(value) };
+        if (msb >= MAX_BITS) {
+            return NUM_BUCKETS - 1;
+        }
+        unsigned int shift { msb - SUB_BUCKET_BITS };
+        return static_cast<size_t>(
+            SUB_BUCKET_COUNT * (shift + 1)
+            + ((value >> shift) & (SUB_BUCKET_COUNT - 1)));
+    }
+
+    /// Returns the highest value recorded in the bucket
+    static uint64_t getHighestValue(size_t index) {
+        if (index < SUB_BUCKET_COUNT) {
+            return index;
+        }
+        unsigned int shift {
+            static_cast<unsigned int>(index / SUB_BUCKET_COUNT - 1) };
+        uint64_t sub_bucket { SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT };
+        return ((sub_bucket + 1) << shift) - 1;
+    }
+
+  private:
+    std::atomic<uint64_t> counts_[NUM_BUCKETS];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+
+    static unsigned int getMostSignificantBit(uint64_t value) {
+#if defined(__GNUC__)
+        return 63u - static_cast<unsigned int>(__builtin_clzll(value));
+#else
+        unsigned int msb { 0 };
+        while (value >>= 1) {
+            msb++;
+        }
+        return msb;
+#endif
+    }
+};
+
+//
+// QueryMetrics
+//
+
+// Always-on aggregates of the queries of one or more connectors,
+// per endpoint: request, error, and byte counters, and a latency
+// histogram of the transfers. Recording is wait-free: the endpoints
+// have fixed slots, claimed on first use; once all slots are taken,
+// the other endpoints are aggregated under METRICS_OTHER_ENDPOINT.
+
+static const size_t MAX_METRICS_ENDPOINTS_DEFAULT { 32 };
+static const std::string METRICS_OTHER_ENDPOINT { "(other)" };
+
+class QueryMetrics {
+  public:
+
+    struct EndpointSnapshot {
+        std::string endpoint;
+        uint64_t requests;
+        // Transfers that failed, i.e. that threw a processing_error
+        uint64_t transfer_errors;
+        // Responses per HTTP status class (index 2 for 2xx, etc.);
+        // index 0 for the transfers without HTTP status (file://)
+        uint64_t responses[6];
+        // Results delivered by the response cache, including the
+        // revalidated ones (also counted as 3xx responses)
+        uint64_t cache_hits;
+        uint64_t coalesced;
+        uint64_t downloaded_bytes;
+        uint64_t result_bytes;
+        LatencyHistogram::Snapshot latency;
+
+        EndpointSnapshot() : EndpointSnapshot(std::string {}) {}
+
+        explicit EndpointSnapshot(std::string name)
+                : endpoint { std::move(name) },
+                  requests { 0 },
+                  transfer_errors { 0 },
+                  responses { 0, 0, 0, 0, 0, 0 },
+                  cache_hits { 0 },
+                  coalesced { 0 },
+                  downloaded_bytes { 0 },
+                  result_bytes { 0 },
+                  latency {} {
+        }
+
+        /// Returns the number of failed queries: transfer errors and
+        /// 4xx or 5xx responses
+        uint64_t getErrors() const {
+            return transfer_errors + responses[4] + responses[5];
+        }
+
+        void merge(const EndpointSnapshot& other) {
+            requests += other.requests;
+            transfer_errors += other.transfer_errors;
+            for (size_t index = 0; index < 6; index++) {
+                responses[index] += other.responses[index];
+            }
+            cache_hits += other.cache_hits;
+            coalesced += other.coalesced;
+            downloaded_bytes += other.downloaded_bytes;
+            result_bytes += other.result_bytes;
+            latency.merge(other.latency);
+        }
+    };
+
+    struct Snapshot {
+        // Sorted by endpoint
+        std::vector<EndpointSnapshot> endpoints;
+        EndpointSnapshot total;
+
+        /// Returns the metrics of the endpoint, or nullptr
+        const EndpointSnapshot* find(const std::string& endpoint) const {
+            for (const auto& endpoint_snapshot : endpoints) {
+                if (endpoint_snapshot.endpoint == endpoint) {
+                    return &endpoint_snapshot;
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    explicit QueryMetrics(size_t max_endpoints = MAX_METRICS_ENDPOINTS_DEFAULT)
+            : num_slots_ { max_endpoints },
+              slots_ { new Slot[max_endpoints + 1] } {
+        // The last slot aggregates the endpoints that do not fit
+        slots_[num_slots_].endpoint = METRICS_OTHER_ENDPOINT;
+        slots_[num_slots_].state.store(Slot::READY);
+    }
+
+    QueryMetrics(const QueryMetrics&) = delete;
+    QueryMetrics& operator=(const QueryMetrics&) = delete;
+
+    void record(const QueryStats& stats) {
+        Slot& slot = getSlot(stats.endpoint);
+        slot.requests.fetch_add(1, std::memory_order_relaxed);
+        if (stats.from_cache || stats.revalidated) {
+            slot.cache_hits.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (stats.coalesced) {
+            slot.coalesced.fetch_add(1, std::memory_order_relaxed);
+        } else if (!stats.from_cache) {
+            if (stats.curl_code != CURLE_OK) {
+                slot.transfer_errors.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                long status_class { stats.response_code / 100 };
+                slot.responses[status_class >= 1 && status_class <= 5
+                               ? status_class : 0]
+                    .fetch_add(1, std::memory_order_relaxed);
+            }
+            slot.latency.record(stats.total_time);
+        }
+        slot.downloaded_bytes.fetch_add(stats.downloaded_bytes,
+                                        std::memory_order_relaxed);
+        slot.result_bytes.fetch_add(stats.result_bytes,
+                                    std::memory_order_relaxed);
+    }
+
+    Snapshot getSnapshot() const {
+        Snapshot snapshot {};
+        for (size_t index = 0; index <= num_slots_; index++) {
+            const Slot& slot = slots_[index];
+            if (slot.state.load(std::memory_order_acquire) != Slot::READY) {
+                continue;
+            }
+            EndpointSnapshot endpoint_snapshot { slot.getSnapshot() };
+            if (endpoint_snapshot.requests == 0) {
+                continue;
+            }
+            snapshot.total.merge(endpoint_snapshot);
+            snapshot.endpoints.push_back(std::move(endpoint_snapshot));
+        }
+        std::sort(snapshot.endpoints.begin(), snapshot.endpoints.end(),
+                  [](const EndpointSnapshot& a, const EndpointSnapshot& b) {
+                      return a.endpoint < b.endpoint;
+                  });
+
+        // Merge the slots claimed twice for the same endpoint
+        std::vector<EndpointSnapshot> endpoints {};
+        for (auto& endpoint_snapshot : snapshot.endpoints) {
+            if (!endpoints.empty()
+                    && endpoints.back().endpoint == endpoint_snapshot.endpoint) {
+                endpoints.back().merge(endpoint_snapshot);
+            } else {
+                endpoints.push_back(std::move(endpoint_snapshot));
+            }
+        }
+        snapshot.endpoints = std::move(endpoints);
+        return snapshot;
+    }
+
+  private:
+    struct Slot {
+        enum State { EMPTY, CLAIMING, READY };
+
+        std::atomic<int> state;
+        // Written once, before state becomes READY
+        std::string endpoint;
+        std::atomic<uint64_t> requests;
+        std::atomic<uint64_t> transfer_errors;
+        std::atomic<uint64_t> responses[6];
+        std::atomic<uint64_t> cache_hits;
+        std::atomic<uint64_t> coalesced;
+        std::atomic<uint64_t> downloaded_bytes;
+        std::atomic<uint64_t> result_bytes;
+        LatencyHistogram latency;
+
+        Slot()
+                : state { EMPTY },
+                  endpoint {},
+                  requests { 0 },
+                  transfer_errors { 0 },
+                  cache_hits { 0 },
+                  coalesced { 0 },
+                  downloaded_bytes { 0 },
+                  result_bytes { 0 },
+                  latency {} {
+            for (auto& count : responses) {
+                count.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        EndpointSnapshot getSnapshot() const {
+            EndpointSnapshot snapshot { endpoint };
+            snapshot.requests = requests.load(std::memory_order_relaxed);
+            snapshot.transfer_errors =
+                transfer_errors.load(std::memory_order_relaxed);
+            for (size_t index = 0; index < 6; index++) {
+                snapshot.responses[index] =
+                    responses[index].load(std::memory_order_relaxed);
+            }
+            snapshot.cache_hits = cache_hits.load(std::memory_order_relaxed);
+            snapshot.coalesced = coalesced.load(std::memory_order_relaxed);
+            snapshot.downloaded_bytes =
+                downloaded_bytes.load(std::memory_order_relaxed);
+            snapshot.result_bytes =
+                result_bytes.load(std::memory_order_relaxed);
+            snapshot.latency = latency.getSnapshot();
+            return snapshot;
+        }
+    };
+
+    size_t num_slots_;
+    std::unique_ptr<Slot[]> slots_;
+
+    // Probes at most num_slots_ slots, without waiting for the ones
+    // being claimed by other threads (NB: an endpoint may then get
+    // two slots; they are merged in the snapshot)
+    Slot& getSlot(const std::string& endpoint) {
+        if (num_slots_ > 0) {
+            size_t start { std::hash<std::string> {}(endpoint) % num_slots_ };
+            for (size_t probe = 0; probe < num_slots_; probe++) {
+                Slot& slot = slots_[(start + probe) % num_slots_];
+                int state { slot.state.load(std::memory_order_acquire) };
+                if (state == Slot::EMPTY
+                        && slot.state.compare_exchange_strong(
+                            state, Slot::CLAIMING,
+                            std::memory_order_acquire)) {
+                    slot.endpoint = endpoint;
+                    slot.state.store(Slot::READY, std::memory_order_release);
+                    return slot;
+                }
+                if (state == Slot::READY && slot.endpoint == endpoint) {
+                    return slot;
+                }
+            }
+        }
+        return slots_[num_slots_];
+    }
+};
+
+//
+// TraceRecorder
+//
+
+// Opt-in record of the last queries of one or more connectors: for
+// each query, its URL (and its body, if POSTed), the timing breakdown
+// of its transfer, its response size, and its outcome. The records
+// are kept in a ring of fixed capacity, the oldest being overwritten
+// once it is full; they can be exported as a Chrome trace (as read by
+// chrome://tracing or Perfetto) or as OpenTelemetry spans (OTLP/JSON),
+// and replayed (see examples/trace_replay.cpp).
+
+static const size_t TRACE_CAPACITY_DEFAULT { 4096 };
+
+struct TraceEvent {
+    // Wall-clock start of the query, in microseconds since the epoch
+    int64_t start_time;
+    std::string url;
+    std::string endpoint;
+    // The json body of a POSTed query; empty for a GET one
+    std::string request_body;
+
+    // Offsets from the start of the query, as in QueryStats
+    std::chrono::microseconds name_lookup_time;
+    std::chrono::microseconds connect_time;
+    std::chrono::microseconds app_connect_time;
+    std::chrono::microseconds pre_transfer_time;
+    std::chrono::microseconds start_transfer_time;
+    std::chrono::microseconds total_time;
+
+    uint64_t downloaded_bytes;
+    uint64_t result_bytes;
+
+    CURLcode curl_code;
+    long response_code;
+    bool from_cache;
+    bool coalesced;
+    bool revalidated;
+    bool hedged;
+    size_t retries;
+
+    TraceEvent()
+            : start_time { 0 },
+              url {},
+              endpoint {},
+              request_body {},
+              name_lookup_time { 0 },
+              connect_time { 0 },
+              app_connect_time { 0 },
+              pre_transfer_time { 0 },
+              start_transfer_time { 0 },
+              total_time { 0 },
+              downloaded_bytes { 0 },
+              result_bytes { 0 },
+              curl_code { CURLE_OK },
+              response_code { 0 },
+              from_cache { false },
+              coalesced { false },
+              revalidated { false },
+              hedged { false },
+              retries { 0 } {
+    }
+
+    /// Returns whether the query failed (either the transfer or the
+    /// HTTP request)
+    bool isError() const {
+        return curl_code != CURLE_OK || response_code >= 400;
+    }
+};
+
+class TraceRecorder {
+  public:
+    /// The capacity is the number of queries kept (at least one)
+    explicit TraceRecorder(size_t capacity = TRACE_CAPACITY_DEFAULT)
+            : events_(std::max<size_t>(capacity, 1)),
+              num_recorded_ { 0 } {
+    }
+
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    /// Records a query that just completed; its start is derived from
+    /// its total time. The request body is that of a POSTed query, if
+    /// any.
+    void record(const QueryStats& stats,
+                const std::string* request_body = nullptr) {
+        int64_t end_time {
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count() };
+
+        std::lock_guard<std::mutex> lock { mutex_ };
+        TraceEvent& event = events_[num_recorded_ % events_.size()];
+        num_recorded_++;
+        event.start_time = end_time - stats.total_time.count();
+        event.url = stats.url;
+        event.endpoint = stats.endpoint;
+        if (request_body != nullptr) {
+            event.request_body = *request_body;
+        } else {
+            event.request_body.clear();
+        }
+        event.name_lookup_time = stats.name_lookup_time;
+        event.connect_time = stats.connect_time;
+        event.app_connect_time = stats.app_connect_time;
+        event.pre_transfer_time = stats.pre_transfer_time;
+        event.start_transfer_time = stats.start_transfer_time;
+        event.total_time = stats.total_time;
+        event.downloaded_bytes = stats.downloaded_bytes;
+        event.result_bytes = stats.result_bytes;
+        event.curl_code = stats.curl_code;
+        event.response_code = stats.response_code;
+        event.from_cache = stats.from_cache;
+        event.coalesced = stats.coalesced;
+        event.revalidated = stats.revalidated;
+        event.hedged = stats.hedged;
+        event.retries = stats.retries;
+    }
+
+    /// Returns the recorded queries, by completion order
+    std::vector<TraceEvent> getEvents() const {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        std::vector<TraceEvent> events {};
+        size_t num_events { std::min<size_t>(num_recorded_, events_.size()) };
+        events.reserve(num_events);
+        for (size_t index = num_recorded_ - num_events;
+             index < num_recorded_; index++) {
+            events.push_back(events_[index % events_.size()]);
+        }
+        return events;
+    }
+
+    size_t getCapacity() const {
+        return events_.size();
+    }
+
+    /// Returns the number of queries recorded, overwritten ones
+    /// included
+    uint64_t getNumRecorded() const {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        return num_recorded_;
+    }
+
+    /// Returns the number of queries overwritten by newer ones
+    uint64_t getNumDropped() const {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        return num_recorded_ > events_.size()
+               ? num_recorded_ - events_.size() : 0;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        num_recorded_ = 0;
+    }
+
+    /// Writes the recorded queries as a Chrome trace: one complete
+    /// event per query ("puppetdb.query" category), with its phases
+    /// (DNS, connect, TLS, server, download) as nested events
+    /// ("puppetdb.phase" category). The concurrent queries are put on
+    /// distinct threads (tid) so that their events do not overlap.
+    void writeChromeTrace(std::ostream& out) const {
+        std::vector<TraceEvent> events { getStartOrderedEvents() };
+        std::vector<int64_t> lane_ends {};
+        std::string text { "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" };
+        bool is_first { true };
+        for (const auto& event : events) {
+            int64_t end_time { event.start_time + event.total_time.count() };
+            size_t lane { 0 };
+            while (lane < lane_ends.size()
+                   && lane_ends[lane] > event.start_time) {
+                lane++;
+            }
+            if (lane == lane_ends.size()) {
+                lane_ends.push_back(end_time);
+            } else {
+                lane_ends[lane] = end_time;
+            }
+
+            if (!is_first) {
+                text += ',';
+            }
+            is_first = false;
+            appendChromeEvent(text, "puppetdb.query", event.endpoint,
+                              event.start_time, event.total_time, lane);
+            text += ",\"args\":{";
+            appendMember(text, "url", event.url, true);
+            if (!event.request_body.empty()) {
+                appendMember(text, "body", event.request_body);
+            }
+            appendMember(text, "status", event.response_code);
+            appendMember(text, "curl_code", static_cast<long>(event.curl_code));
+            if (event.curl_code != CURLE_OK) {
+                appendMember(text, "error",
+                             std::string { curl_easy_strerror(event.curl_code) });
+            }
+            appendMember(text, "downloaded_bytes", event.downloaded_bytes);
+            appendMember(text, "result_bytes", event.result_bytes);
+            appendMember(text, "retries", static_cast<uint64_t>(event.retries));
+            appendBoolMember(text, "from_cache", event.from_cache);
+            appendBoolMember(text, "coalesced", event.coalesced);
+            appendBoolMember(text, "revalidated", event.revalidated);
+            appendBoolMember(text, "hedged", event.hedged);
+            text += "}}";
+
+            for (const auto& phase : getPhases(event)) {
+                if (phase.duration.count() <= 0) {
+                    continue;
+                }
+                text += ',';
+                appendChromeEvent(text, "puppetdb.phase", phase.name,
+                                  event.start_time + phase.start.count(),
+                                  phase.duration, lane);
+                text += '}';
+            }
+        }
+        text += "]}";
+        out << text;
+    }
+
+    /// Writes the recorded queries as OpenTelemetry client spans, in
+    /// the OTLP/JSON format (as accepted by the /v1/traces endpoint of
+    /// a collector); each query is the root span of its own trace
+    void writeOtlpSpans(std::ostream& out,
+                        const std::string& service_name = "libpuppetdb") const {
+        std::vector<TraceEvent> events { getStartOrderedEvents() };
+        std::mt19937_64 generator { std::random_device {}() };
+        std::string text { "{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+                           "{\"key\":\"service.name\",\"value\":"
+                           "{\"stringValue\":\"" };
+        appendJsonEscaped(text, service_name.data(), service_name.size());
+        text += "\"}}]},\"scopeSpans\":[{\"scope\":{\"name\":\"libpuppetdb\"},"
+                "\"spans\":[";
+        bool is_first { true };
+        for (const auto& event : events) {
+            if (!is_first) {
+                text += ',';
+            }
+            is_first = false;
+            text += "{\"traceId\":\"";
+            appendHex(text, generator());
+            appendHex(text, generator());
+            text += "\",\"spanId\":\"";
+            appendHex(text, generator());
+            text += "\",\"name\":\"";
+            text += event.request_body.empty() ? "GET " : "POST ";
+            appendJsonEscaped(text, event.endpoint.data(),
+                              event.endpoint.size());
+            text += "\",\"kind\":3,\"startTimeUnixNano\":\"";
+            text += std::to_string(event.start_time * 1000);
+            text += "\",\"endTimeUnixNano\":\"";
+            text += std::to_string(
+                (event.start_time + event.total_time.count()) * 1000);
+            text += "\",\"attributes\":[";
+            appendAttribute(text, "url.full", event.url, true);
+            appendAttribute(text, "http.request.method",
+                            event.request_body.empty() ? "GET" : "POST");
+            if (event.response_code > 0) {
+                appendAttribute(text, "http.response.status_code",
+                                event.response_code);
+            }
+            appendAttribute(text, "http.response.body.size",
+                            static_cast<long>(event.downloaded_bytes));
+            appendAttribute(text, "puppetdb.endpoint", event.endpoint);
+            appendAttribute(text, "puppetdb.result_bytes",
+                            static_cast<long>(event.result_bytes));
+            appendAttribute(text, "puppetdb.retries",
+                            static_cast<long>(event.retries));
+            appendAttribute(text, "puppetdb.from_cache", event.from_cache);
+            appendAttribute(text, "puppetdb.coalesced", event.coalesced);
+            appendAttribute(text, "puppetdb.revalidated", event.revalidated);
+            appendAttribute(text, "puppetdb.hedged", event.hedged);
+            text += "],\"events\":[";
+            bool is_first_phase { true };
+            for (const auto& phase : getPhases(event)) {
+                if (phase.duration.count() <= 0) {
+                    continue;
+                }
+                if (!is_first_phase) {
+                    text += ',';
+                }
+                is_first_phase = false;
+                text += "{\"timeUnixNano\":\"";
+                text += std::to_string(
+                    (event.start_time + phase.start.count()
+                     + phase.duration.count()) * 1000);
+                text += "\",\"name\":\"";
+                text += phase.name;
+                text += " done\"}";
+            }
+            text += "],\"status\":{\"code\":";
+            if (event.isError()) {
+                text += "2,\"message\":\"";
+                std::string message { event.curl_code != CURLE_OK
+                    ? curl_easy_strerror(event.curl_code)
+                    : "HTTP " + std::to_string(event.response_code) };
+                appendJsonEscaped(text, message.data(), message.size());
+                text += "\"}}";
+            } else {
+                text += "0}}";
+            }
+        }
+        text += "]}]}]}";
+        out << text;
+    }
+
+  private:
+    struct Phase {
+        const char* name;
+        std::chrono::microseconds start;
+        std::chrono::microseconds duration;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<TraceEvent> events_;
+    uint64_t num_recorded_;
+
+    std::vector<TraceEvent> getStartOrderedEvents() const {
+        std::vector<TraceEvent> events { getEvents() };
+        std::stable_sort(events.begin(), events.end(),
+                         [](const TraceEvent& a, const TraceEvent& b) {
+                             return a.start_time < b.start_time;
+                         });
+        return events;
+    }
+
+    // The phases of the transfer, as delimited by libcurl; the time
+    // from the end of the TLS handshake to the request being sent
+    // (pre-transfer) is negligible and left out
+    static std::vector<Phase> getPhases(const TraceEvent& event) {
+        using std::chrono::microseconds;
+        microseconds connected { std::max(event.connect_time,
+                                          event.name_lookup_time) };
+        microseconds handshaken { std::max(event.app_connect_time,
+                                           connected) };
+        microseconds responded { std::max(event.start_transfer_time,
+                                          event.pre_transfer_time) };
+        return {
+            Phase { "dns", microseconds { 0 }, event.name_lookup_time },
+            Phase { "connect", event.name_lookup_time,
+                    connected - event.name_lookup_time },
+            Phase { "tls", connected,
+                    event.app_connect_time.count() > 0
+                    ? handshaken - connected : microseconds { 0 } },
+            Phase { "server", event.pre_transfer_time,
+                    responded - event.pre_transfer_time },
+            Phase { "download", responded,
+                    event.total_time > responded
+                    ? event.total_time - responded : microseconds { 0 } } };
+    }
+
+    static void appendChromeEvent(std::string& text, const char* category,
+                                  const std::string& name, int64_t start,
+                                  std::chrono::microseconds duration,
+                                  size_t lane) {
+        text += "{\"name\":\"";
+        appendJsonEscaped(text, name.data(), name.size());
+        text += "\",\"cat\":\"";
+        text += category;
+        text += "\",\"ph\":\"X\",\"ts\":";
+        text += std::to_string(start);
+        text += ",\"dur\":";
+        text += std::to_string(duration.count());
+        text += ",\"pid\":1,\"tid\":";
+        text += std::to_string(lane + 1);
+    }
+
+    static void appendKey(std::string& text, const char* key, bool is_first) {
+        if (!is_first) {
+            text += ',';
+        }
+        text += '"';
+        text += key;
+        text += "\":";
+    }
+
+    static void appendMember(std::string& text, const char* key,
+                             const std::string& value, bool is_first = false) {
+        appendKey(text, key, is_first);
+        text += '"';
+        appendJsonEscaped(text, value.data(), value.size());
+        text += '"';
+    }
+
+    template <typename Integer>
+    static void appendMember(std::string& text, const char* key,
+                             Integer value) {
+        appendKey(text, key, false);
+        text += std::to_string(value);
+    }
+
+    static void appendBoolMember(std::string& text, const char* key,
+                                 bool value) {
+        appendKey(text, key, false);
+        text += value ? "true" : "false";
+    }
+
+    // OTLP attributes: string, integer (as a string), and bool values
+    static void appendAttribute(std::string& text, const char* key,
+                                const std::string& value,
+                                bool is_first = false) {
+        if (!is_first) {
+            text += ',';
+        }
+        text += "{\"key\":\"";
+        text += key;
+        text += "\",\"value\":{\"stringValue\":\"";
+        appendJsonEscaped(text, value.data(), value.size());
+        text += "\"}}";
+    }
+
+    static void appendAttribute(std::string& text, const char* key,
+                                const char* value) {
+        appendAttribute(text, key, std::string { value });
+    }
+
+    static void appendAttribute(std::string& text, const char* key,
+                                long value) {
+        text += ",{\"key\":\"";
+        text += key;
+        text += "\",\"value\":{\"intValue\":\"";
+        text += std::to_string(value);
+        text += "\"}}";
+    }
+
+    static void appendAttribute(std::string& text, const char* key,
+                                bool value) {
+        text += ",{\"key\":\"";
+        text += key;
+        text += "\",\"value\":{\"boolValue\":";
+        text += value ? "true" : "false";
+        text += "}}";
+    }
+
+    static void appendHex(std::string& text, uint64_t value) {
+        static const char HEX_DIGITS[] = "0123456789abcdef";
+        for (int shift = 60; shift >= 0; shift -= 4) {
+            text += HEX_DIGITS[(value >> shift) & 0x0F];
+        }
+    }
+};
+
+//
+// ResponseCache
+//
+
+// Cache of query results, keyed on the query URL, that can be shared
+// by multiple connectors and threads. Results are cached only for the
+// endpoints with a positive time to live (see setTtl), and the cache
+// size (results, URLs, and validators) is bounded by evicting the
+// least recently used results. Stale results that have an ETag or a
+// Last-Modified validator are revalidated with a conditional request.
+class ResponseCache {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        std::string url;
+        std::string body;
+        std::string etag;
+        std::string last_modified;
+        Clock::time_point expiry;
+
+        bool isFresh() const {
+            return Clock::now() < expiry;
+        }
+
+        bool canRevalidate() const {
+            return !etag.empty() || !last_modified.empty();
+        }
+
+        size_t getSize() const {
+            return url.size() + body.size() + etag.size()
+                   + last_modified.size();
+        }
+    };
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t revalidations;
+        uint64_t evictions;
+        size_t entries;
+        size_t bytes;
+    };
+
+    /// The default time to live applies to the endpoints without a
+    /// specific one; zero means that their results are not cached
+    explicit ResponseCache(size_t max_bytes,
+                           std::chrono::milliseconds default_ttl
+                               = std::chrono::milliseconds { 0 })
+            : max_bytes_ { max_bytes },
+              default_ttl_ { default_ttl },
+              bytes_ { 0 },
+              hits_ { 0 },
+              misses_ { 0 },
+              revalidations_ { 0 },
+              evictions_ { 0 } {
+    }
+
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    /// Sets the time to live of the results of the endpoint; zero
+    /// means that they are not cached. An endpoint with path segments
+    /// (e.g. "nodes/<node>/facts") falls back to the time to live of
+    /// its first segment ("nodes").
+    void setTtl(const std::string& endpoint, std::chrono::milliseconds ttl) {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        ttls_[endpoint] = ttl;
+    }
+
+    std::chrono::milliseconds getTtl(const std::string& endpoint) const {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        auto it = ttls_.find(endpoint);
+        if (it == ttls_.end()) {
+            it = ttls_.find(endpoint.substr(0, endpoint.find('/')));
+        }
+        return it != ttls_.end() ? it->second : default_ttl_;
+    }
+
+    bool isCached(const std::string& endpoint) const {
+        return getTtl(endpoint).count() > 0;
+    }
+
+    /// Returns the cached entry of the URL, fresh or stale, or nullptr
+    /// in case there is none; hits and misses are counted
+    std::shared_ptr<const Entry> lookup(const std::string& url) {
+        std::shared_ptr<const Entry> entry {};
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            auto it = entries_.find(url);
+            if (it != entries_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second.second);
+                entry = it->second.first;
+            }
+        }
+        if (entry && entry->isFresh()) {
+            hits_++;
+        } else {
+            misses_++;
+        }
+        return entry;
+    }
+
+    /// Caches the result of the URL; results larger than the cache
+    /// are not cached
+    void store(const std::string& url, const std::string& endpoint,
+               std::string body, std::string etag,
+               std::string last_modified) {
+        std::shared_ptr<Entry> entry { new Entry {} };
+        entry->url = url;
+        entry->body = std::move(body);
+        entry->etag = std::move(etag);
+        entry->last_modified = std::move(last_modified);
+        entry->expiry = Clock::now() + getTtl(endpoint);
+        insert(std::move(entry));
+    }
+
+    /// Renews the stale entry after PuppetDB reported that it is
+    /// still valid (HTTP 304)
+    void refresh(const std::shared_ptr<const Entry>& stale_entry,
+                 const std::string& endpoint) {
+        std::shared_ptr<Entry> entry { new Entry(*stale_entry) };
+        entry->expiry = Clock::now() + getTtl(endpoint);
+        insert(std::move(entry));
+        revalidations_++;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        entries_.clear();
+        lru_.clear();
+        bytes_ = 0;
+    }
+
+    Stats getStats() const {
+        Stats stats {};
+        stats.hits = hits_.load();
+        stats.misses = misses_.load();
+        stats.revalidations = revalidations_.load();
+        stats.evictions = evictions_.load();
+        std::lock_guard<std::mutex> lock { mutex_ };
+        stats.entries = entries_.size();
+        stats.bytes = bytes_;
+        return stats;
+    }
+
+  private:
+    using LruList = std::list<std::string>;
+    using EntryMap = std::unordered_map<
+        std::string, std::pair<std::shared_ptr<const Entry>, LruList::iterator>>;
+
+    size_t max_bytes_;
+    std::chrono::milliseconds default_ttl_;
+
+    // Protects the following members
+    mutable std::mutex mutex_;
+    std::map<std::string, std::chrono::milliseconds> ttls_;
+    EntryMap entries_;
+    LruList lru_;
+    size_t bytes_;
+
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> revalidations_;
+    std::atomic<uint64_t> evictions_;
+
+    void insert(std::shared_ptr<const Entry> entry) {
+        if (entry->getSize() > max_bytes_) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock { mutex_ };
+        auto it = entries_.find(entry->url);
+        if (it != entries_.end()) {
+            bytes_ -= it->second.first->getSize();
+            lru_.erase(it->second.second);
+            entries_.erase(it);
+        }
+
+        bytes_ += entry->getSize();
+        lru_.push_front(entry->url);
+        entries_[lru_.front()] = std::make_pair(std::move(entry), lru_.begin());
+
+        while (bytes_ > max_bytes_) {
+            auto lru_it = entries_.find(lru_.back());
+            bytes_ -= lru_it->second.first->getSize();
+            entries_.erase(lru_it);
+            lru_.pop_back();
+            evictions_++;
+        }
+    }
+};
+
+//
+// SingleFlight
+//
+
+// Coalesces identical queries performed at the same time: the first
+// caller (the leader) performs the query, while the others wait for
+// its result (or its failure). It can be shared by multiple
+// connectors and threads.
+class SingleFlight {
+  public:
+    SingleFlight() : in_flight_ {}, coalesced_ { 0 } {}
+
+    SingleFlight(const SingleFlight&) = delete;
+    SingleFlight& operator=(const SingleFlight&) = delete;
+
+    /// Returns true if the caller is the leader for the key, i.e. if
+    /// it must perform the query and then call complete() or fail();
+    /// otherwise, sets the result of the query in flight
+    bool join(const std::string& key, std::shared_future<std::string>& result) {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        auto it = in_flight_.find(key);
+        if (it != in_flight_.end()) {
+            result = it->second.second;
+            coalesced_++;
+            return false;
+        }
+        std::promise<std::string> promise {};
+        std::shared_future<std::string> shared_result {
+            promise.get_future().share() };
+        in_flight_.emplace(key, std::make_pair(std::move(promise),
+                                               std::move(shared_result)));
+        return true;
+    }
+
+    /// Called by the leader to share the result
+    void complete(const std::string& key, std::string result) {
+        std::promise<std::string> promise { release(key) };
+        promise.set_value(std::move(result));
+    }
+
+    /// Called by the leader to share its failure
+    void fail(const std::string& key, std::exception_ptr error) {
+        std::promise<std::string> promise { release(key) };
+        promise.set_exception(error);
+    }
+
+    /// Returns the number of queries that waited for another one
+    uint64_t getNumCoalesced() const {
+        return coalesced_.load();
+    }
+
+    /// Returns the number of queries in flight
+    size_t getNumInFlight() const {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        return in_flight_.size();
+    }
+
+  private:
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string,
+                       std::pair<std::promise<std::string>,
+                                 std::shared_future<std::string>>> in_flight_;
+    std::atomic<uint64_t> coalesced_;
+
+    // Removes the key, so that the next query starts a new flight
+    std::promise<std::string> release(const std::string& key) {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        auto it = in_flight_.find(key);
+        std::promise<std::string> promise { std::move(it->second.first) };
+        in_flight_.erase(it);
+        return promise;
+    }
+};
+
+//
+// CurlShare
+//
+
+// libcurl share handle, used to share the connection, DNS, and SSL
+// session caches among the handles of different connectors. Each kind
+// of shared data is protected by its own mutex.
+class CurlShare {
+  public:
+    /// Throws a connector_error in case libcurl fails to create the
+    /// share handle
+    CurlShare() : share_ { curl_share_init() } {
+        if (share_ == nullptr) {
+            throw connector_error { "failed to initialize the libcurl share" };
+        }
+        curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, CurlShare::lock);
+        curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, CurlShare::unlock);
+        curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
+
+    CurlShare(const CurlShare&) = delete;
+    CurlShare& operator=(const CurlShare&) = delete;
+
+    /// NB: all the handles using the share must be closed before
+    ~CurlShare() {
+        curl_share_cleanup(share_);
+    }
+
+    CURLSH* get() const {
+        return share_;
+    }
+
+  private:
+    CURLSH* share_;
+    std::mutex mutexes_[CURL_LOCK_DATA_LAST];
+
+    static void lock(CURL* curl, curl_lock_data data,
+                     curl_lock_access access, void* userptr) {
+        static_cast<CurlShare*>(userptr)->mutexes_[data].lock();
+    }
+
+    static void unlock(CURL* curl, curl_lock_data data, void* userptr) {
+        static_cast<CurlShare*>(userptr)->mutexes_[data].unlock();
+    }
+};
+
+//
+// Throttle
+//
+
+// Number of queries over which Throttle tracks the lowest latency
+static const size_t THROTTLE_WINDOW { 100 };
+
+// Settings of a Throttle. The token bucket limits the rate at which
+// the queries start. The concurrency limit adapts to the latency of
+// the queries (AIMD): it grows by one every `limit` queries completed
+// within the latency target, and it is multiplied by the backoff
+// factor, at most once per latency period, when a query is slower than
+// the target, times out, or is rejected by an overloaded server (429
+// or 503 response). Without a latency target, the target is twice the
+// lowest latency, tracked over windows of THROTTLE_WINDOW queries.
+struct ThrottlePolicy {
+    // Queries per second (0 disables the rate limit), and the number
+    // of queries that can start at once after an idle period
+    double rate;
+    size_t burst;
+    // Bounds and initial value of the concurrency limit; a maximum of
+    // 0 disables the concurrency limit
+    size_t max_concurrency;
+    size_t min_concurrency;
+    size_t initial_concurrency;
+    std::chrono::milliseconds latency_target;
+    double backoff;
+
+    ThrottlePolicy()
+            : rate { 0 },
+              burst { 1 },
+              max_concurrency { 0 },
+              min_concurrency { 1 },
+              initial_concurrency { 4 },
+              latency_target { 0 },
+              backoff { 0.9 } {
+    }
+};
+
+// Admission control of the queries of one or more connectors (e.g.
+// those of a pool), so that they do not overload PuppetDB. A query
+// starts once it gets a permit: a token of the bucket must be
+// available, and the number of queries in flight must be under the
+// concurrency limit. The queries waiting for a permit are served by
+// priority (see Query::setPriority), then in order of arrival. The
+// synchronous queries wait on the calling thread; the asynchronous
+// ones wait in the queue of the connector.
+class Throttle {
+  public:
+    // Request for a permit; once it is granted, on_grant is called,
+    // if set, with the lock of the throttle held (it must not block)
+    struct Ticket {
+        int priority;
+        uint64_t sequence;
+        std::function<void()> on_grant;
+        std::atomic<bool> granted;
+
+        Ticket(int ticket_priority, uint64_t ticket_sequence,
+               std::function<void()> callback)
+                : priority { ticket_priority },
+                  sequence { ticket_sequence },
+                  on_grant { std::move(callback) },
+                  granted { false } {
+        }
+    };
+
+    // Permit of a synchronous query, returned once the query completes
+    // or when the permit is destroyed
+    class Permit {
+      public:
+        Permit() : throttle_ { nullptr } {}
+
+        Permit(const Permit&) = delete;
+        Permit& operator=(const Permit&) = delete;
+
+        Permit(Permit&& other) : throttle_ { other.throttle_ } {
+            other.throttle_ = nullptr;
+        }
+
+        Permit& operator=(Permit&& other) {
+            if (this != &other) {
+                returnPermit();
+                throttle_ = other.throttle_;
+                other.throttle_ = nullptr;
+            }
+            return *this;
+        }
+
+        ~Permit() {
+            returnPermit();
+        }
+
+        /// Returns the permit of the query, whose stats adjust the
+        /// concurrency limit
+        void complete(const QueryStats& stats) {
+            if (throttle_ != nullptr) {
+                Throttle* throttle { throttle_ };
+                throttle_ = nullptr;
+                throttle->release(stats);
+            }
+        }
+
+      private:
+        friend class Throttle;
+
+        Throttle* throttle_;
+
+        explicit Permit(Throttle* throttle) : throttle_ { throttle } {}
+
+        void returnPermit() {
+            if (throttle_ != nullptr) {
+                throttle_->release();
+                throttle_ = nullptr;
+            }
+        }
+    };
+
+    explicit Throttle(ThrottlePolicy policy = ThrottlePolicy {})
+            : policy_ { policy },
+              mutex_ {},
+              cv_ {},
+              queue_ {},
+              next_sequence_ { 0 },
+              in_flight_ { 0 },
+              tokens_ { 0 },
+              last_refill_ { std::chrono::steady_clock::now() },
+              limit_ { 0 },
+              last_decrease_ {},
+              window_min_ { 0 },
+              window_count_ { 0 },
+              baseline_ { 0 } {
+        policy_.burst = std::max<size_t>(policy_.burst, 1);
+        policy_.min_concurrency = std::max<size_t>(policy_.min_concurrency, 1);
+        if (policy_.max_concurrency > 0) {
+            policy_.min_concurrency = std::min(policy_.min_concurrency,
+                                               policy_.max_concurrency);
+        }
+        tokens_ = static_cast<double>(policy_.burst);
+        limit_ = static_cast<double>(clampLimit(policy_.initial_concurrency));
+    }
+
+    Throttle(const Throttle&) = delete;
+    Throttle& operator=(const Throttle&) = delete;
+
+    /// Waits for a permit
+    Permit acquire(int priority = 0) {
+        std::unique_lock<std::mutex> lock { mutex_ };
+        std::shared_ptr<Ticket> ticket { enqueue(priority, nullptr) };
+        grant();
+        while (!ticket->granted) {
+            std::chrono::microseconds delay { getTokenDelay() };
+            if (delay.count() > 0) {
+                cv_.wait_for(lock, delay);
+            } else {
+                cv_.wait(lock);
+            }
+            grant();
+        }
+        return Permit { this };
+    }
+
+    /// Queues a request for a permit; its permit must be returned by
+    /// release() once granted, or the ticket cancelled
+    std::shared_ptr<Ticket> request(int priority,
+                                    std::function<void()> on_grant) {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        std::shared_ptr<Ticket> ticket { enqueue(priority,
+                                                 std::move(on_grant)) };
+        grant();
+        return ticket;
+    }
+
+    /// Grants the permits made available by the refill of the bucket;
+    /// returns the time until the next token if a request waits for
+    /// one, 0 otherwise
+    std::chrono::microseconds pump() {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        grant();
+        return queue_.empty() ? std::chrono::microseconds { 0 }
+                              : getTokenDelay();
+    }
+
+    /// Withdraws the request; its permit is returned if it was granted
+    void cancel(const std::shared_ptr<Ticket>& ticket) {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        if (ticket->granted) {
+            in_flight_--;
+        } else {
+            queue_.erase(getKey(*ticket));
+        }
+        grant();
+    }
+
+    /// Returns the permit of a completed query, whose stats adjust the
+    /// concurrency limit
+    void release(const QueryStats& stats) {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        adjust(stats);
+        in_flight_--;
+        grant();
+    }
+
+    /// Returns the permit of a query that did not complete (e.g. the
+    /// connector was closed); the concurrency limit is unchanged
+    void release() {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        in_flight_--;
+        grant();
+    }
+
+    /// Returns the current concurrency limit (0 if disabled)
+    size_t getConcurrencyLimit() const {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        return policy_.max_concurrency > 0 ? getLimit() : 0;
+    }
+
+    size_t getNumInFlight() const {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        return in_flight_;
+    }
+
+    size_t getNumWaiting() const {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        return queue_.size();
+    }
+
+  private:
+    // Requests by decreasing priority, then by arrival
+    using TicketKey = std::pair<int, uint64_t>;
+
+    ThrottlePolicy policy_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<TicketKey, std::shared_ptr<Ticket>> queue_;
+    uint64_t next_sequence_;
+    size_t in_flight_;
+
+    // Token bucket
+    double tokens_;
+    std::chrono::steady_clock::time_point last_refill_;
+
+    // Concurrency limit, and the lowest latencies of the current
+    // window and the previous ones
+    double limit_;
+    std::chrono::steady_clock::time_point last_decrease_;
+    std::chrono::microseconds window_min_;
+    size_t window_count_;
+    std::chrono::microseconds baseline_;
+
+    static TicketKey getKey(const Ticket& ticket) {
+        return TicketKey { -ticket.priority, ticket.sequence };
+    }
+
+    // NB: the mutex must be held by the callers of the following
+    // methods
+
+    std::shared_ptr<Ticket> enqueue(int priority,
+                                    std::function<void()> on_grant) {
+        std::shared_ptr<Ticket> ticket {
+            std::make_shared<Ticket>(priority, next_sequence_++,
+                                     std::move(on_grant)) };
+        queue_[getKey(*ticket)] = ticket;
+        return ticket;
+    }
+
+    // Grants permits to the waiting requests, as long as available
+    void grant() {
+        refill();
+        bool notify { false };
+        while (!queue_.empty() && isAvailable()) {
+            std::shared_ptr<Ticket> ticket { queue_.begin()->second };
+            queue_.erase(queue_.begin());
+            in_flight_++;
+            if (policy_.rate > 0) {
+                tokens_ -= 1;
+            }
+            ticket->granted = true;
+            if (ticket->on_grant) {
+                ticket->on_grant();
+            } else {
+                notify = true;
+            }
+        }
+        if (notify) {
+            cv_.notify_all();
+        }
+    }
+
+    bool isAvailable() const {
+        return (policy_.max_concurrency == 0 || in_flight_ < getLimit())
+               && (policy_.rate <= 0 || tokens_ >= 1);
+    }
+
+    void refill() {
+        auto now = std::chrono::steady_clock::now();
+        if (policy_.rate > 0) {
+            std::chrono::duration<double> elapsed { now - last_refill_ };
+            tokens_ = std::min(static_cast<double>(policy_.burst),
+                               tokens_ + elapsed.count() * policy_.rate);
+        }
+        last_refill_ = now;
+    }
+
+    // Returns the time until the next token, 0 if one is available
+    std::chrono::microseconds getTokenDelay() const {
+        if (policy_.rate <= 0 || tokens_ >= 1) {
+            return std::chrono::microseconds { 0 };
+        }
+        return std::chrono::microseconds {
+            static_cast<int64_t>((1 - tokens_) / policy_.rate * 1e6) + 1 };
+    }
+
+    size_t getLimit() const {
+        return clampLimit(static_cast<size_t>(limit_));
+    }
+
+    size_t clampLimit(size_t limit) const {
+        limit = std::max(limit, policy_.min_concurrency);
+        return policy_.max_concurrency > 0
+               ? std::min(limit, policy_.max_concurrency)
+               : limit;
+    }
+
+    // Adjusts the concurrency limit to the outcome of a query
+    void adjust(const QueryStats& stats) {
+        if (policy_.max_concurrency == 0) {
+            return;
+        }
+        bool completed { stats.curl_code == CURLE_OK };
+        std::chrono::microseconds latency { stats.total_time };
+        if (completed) {
+            window_min_ = window_count_ == 0 ? latency
+                                             : std::min(window_min_, latency);
+            if (++window_count_ == THROTTLE_WINDOW) {
+                // Follow a lasting change of the server latency, slowly
+                // when it increases
+                baseline_ = baseline_.count() == 0 || window_min_ < baseline_
+                            ? window_min_
+                            : baseline_ + (window_min_ - baseline_) / 8;
+                window_count_ = 0;
+            }
+        }
+        std::chrono::microseconds target { policy_.latency_target };
+        if (target.count() == 0) {
+            target = 2 * (baseline_.count() > 0 ? baseline_ : window_min_);
+        }
+
+        bool overloaded { stats.curl_code == CURLE_OPERATION_TIMEDOUT
+                          || stats.response_code == 429
+                          || stats.response_code == 503
+                          || (completed && target.count() > 0
+                              && latency > target) };
+        if (overloaded) {
+            // The queries started before the last decrease do not
+            // reflect it yet
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_decrease_ >= latency) {
+                limit_ = std::max(static_cast<double>(policy_.min_concurrency),
+                                  limit_ * policy_.backoff);
+                last_decrease_ = now;
+            }
+        } else if (completed) {
+            limit_ = std::min(static_cast<double>(policy_.max_concurrency),
+                              limit_ + 1 / limit_);
+        }
+    }
+};
+
+//
+// MultiEngine
+//
+
+// Drives the asynchronous transfers of a PuppetdbConnector on a
+// curl_multi handle, from a background thread. The transfers are
+// configured by the connector; the engine only performs them and
+// fulfils their promises. Connections (HTTP/2 ones included) are
+// cached by the multi handle and shared by all transfers.
+
+/// Called with the result of an asynchronous query once it is
+/// available
+using QueryCallback = std::function<void(std::future<std::string> result)>;
+
+class MultiEngine {
+  public:
+    struct Transfer {
+        CURL* curl;
+        std::string url;
+        // The json body of a POSTed query, sent as is
+        std::string request_body;
+        std::string result_buffer;
+        QueryResult::ResponseHeaders response_headers;
+        // Allocated in the arena, as the other temporaries of the
+        // transfer
+        Arena arena;
+        curl_slist* request_headers;
+        std::promise<std::string> promise;
+
+        // Called with the future of the promise once it is fulfilled,
+        // if set; the future is not available to anyone else
+        QueryCallback callback;
+
+        // Called by the loop thread once the transfer succeeds, before
+        // the promise is fulfilled and the stats are reported; it may
+        // update the result buffer, and set revalidated if it is the
+        // cached result
+        std::function<void(CURL* curl, Transfer& transfer)> on_complete;
+        bool revalidated;
+
+        // Updated once the transfer succeeds, if not nullptr
+        CompressionCounters* compression_counters;
+
+        // Reported to the query observer and to the metrics, if any
+        std::string endpoint;
+        std::shared_ptr<QueryMetrics> metrics;
+        // Passed the stats and the request body of the transfer, if set
+        std::shared_ptr<TraceRecorder> trace;
+
+        // Queued transfers start by decreasing priority; a throttled
+        // transfer waits for a permit of the throttle, if any (admitted
+        // is set once it got one)
+        int priority;
+        bool throttled;
+        bool admitted;
+
+        Transfer()
+                : curl { nullptr },
+                  url {},
+                  request_body {},
+                  result_buffer {},
+                  response_headers { &result_buffer },
+                  arena { 512 },
+                  request_headers { nullptr },
+                  promise {},
+                  callback {},
+                  on_complete {},
+                  revalidated { false },
+                  compression_counters { nullptr },
+                  endpoint {},
+                  metrics {},
+                  trace {},
+                  priority { 0 },
+                  throttled { true },
+                  admitted { false } {
+        }
+
+        Transfer(const Transfer&) = delete;
+        Transfer& operator=(const Transfer&) = delete;
+    };
+
+    /// The transfers wait for a permit of the throttle, if any, before
+    /// they start
+    explicit MultiEngine(size_t max_transfers, bool multiplex,
+                         std::shared_ptr<Throttle> throttle = {})
+            : multi_ { curl_multi_init() },
+              max_transfers_ { max_transfers },
+              throttle_ { std::move(throttle) },
+              ticket_ {},
+              throttle_delay_ { 0 },
+              stopping_ { false } {
+        if (multi_ == nullptr) {
+            throw processing_error { "failed to initialize libcurl multi" };
+        }
+#if LIBCURL_VERSION_NUM >= 0x072b00
+        curl_multi_setopt(multi_, CURLMOPT_PIPELINING,
+                          multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#endif
+        loop_thread_ = std::thread { &MultiEngine::run, this };
+    }
+
+    MultiEngine(const MultiEngine&) = delete;
+    MultiEngine& operator=(const MultiEngine&) = delete;
+
+    ~MultiEngine() {
+        stop();
+        for (auto curl : idle_handles_) {
+            curl_easy_cleanup(curl);
+        }
+        curl_multi_cleanup(multi_);
+    }
+
+    void setMaxTransfers(size_t max_transfers) {
+        max_transfers_ = max_transfers > 0 ? max_transfers : 1;
+        wakeup();
+    }
+
+    /// Returns an easy handle for a new transfer: an idle one, if
+    /// available, or a new one otherwise
+    CURL* acquireHandle() {
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            if (!idle_handles_.empty()) {
+                CURL* curl { idle_handles_.back() };
+                idle_handles_.pop_back();
+                curl_easy_reset(curl);
+                return curl;
+            }
+        }
+        CURL* curl { curl_easy_init() };
+        if (curl == nullptr) {
+            throw processing_error { "failed to initialize libcurl" };
+        }
+        return curl;
+    }
+
+    /// Returns the handle of a transfer that was not submitted
+    void recycleHandle(CURL* curl) {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        releaseHandle(curl);
+    }
+
+    /// Queues a configured transfer; it will start as soon as the
+    /// number of running transfers drops below the cap
+    void submit(std::unique_ptr<Transfer> transfer) {
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            if (!stopping_) {
+                auto position = std::upper_bound(
+                    pending_.begin(), pending_.end(), transfer->priority,
+                    [](int priority, const std::unique_ptr<Transfer>& queued) {
+                        return priority > queued->priority;
+                    });
+                pending_.insert(position, std::move(transfer));
+            } else {
+                releaseHandle(transfer->curl);
+            }
+        }
+        if (transfer) {
+            fail(*transfer, "the connector was closed");
+            return;
+        }
+        wakeup();
+    }
+
+    /// Calls the callback of a transfer whose promise was fulfilled;
+    /// the errors of the callback are ignored, as there is no one to
+    /// report them to
+    static void settle(Transfer& transfer) {
+        if (!transfer.callback) {
+            return;
+        }
+        try {
+            transfer.callback(transfer.promise.get_future());
+        } catch (...) {
+        }
+    }
+
+    /// Stops the event loop; the transfers that did not complete
+    /// fail with a processing_error
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            if (stopping_) {
+                return;
+            }
+            stopping_ = true;
+        }
+        wakeup();
+        loop_thread_.join();
+    }
+
+  private:
+    CURLM* multi_;
+    std::atomic<size_t> max_transfers_;
+    std::thread loop_thread_;
+
+    // Throttle, if any; the loop thread holds at most one request for
+    // a permit, for the first queued transfer, and waits for the
+    // tokens of the bucket at most throttle_delay_
+    std::shared_ptr<Throttle> throttle_;
+    std::shared_ptr<Throttle::Ticket> ticket_;
+    std::chrono::microseconds throttle_delay_;
+
+    // Protects the following members
+    std::mutex mutex_;
+    bool stopping_;
+    std::deque<std::unique_ptr<Transfer>> pending_;
+    std::vector<CURL*> idle_handles_;
+
+    // Owned by the loop thread
+    std::map<CURL*, std::unique_ptr<Transfer>> running_;
+
+    // NB: the mutex must not be held by the caller, as the callback
+    // of the transfer may submit another one
+    static void fail(Transfer& transfer, const std::string& msg) {
+        transfer.promise.set_exception(
+            std::make_exception_ptr(processing_error { msg }));
+        settle(transfer);
+    }
+
+    // NB: the mutex must be held by the caller
+    void releaseHandle(CURL* curl) {
+        if (idle_handles_.size() < max_transfers_) {
+            idle_handles_.push_back(curl);
+        } else {
+            curl_easy_cleanup(curl);
+        }
+    }
+
+    void wakeup() {
+#if LIBCURL_VERSION_NUM >= 0x074400
+        curl_multi_wakeup(multi_);
+#endif
+    }
+
+    void wait() {
+#if LIBCURL_VERSION_NUM >= 0x074400
+        int timeout_ms { 1000 };
+#else
+        int timeout_ms { 10 };
+#endif
+        if (throttle_delay_.count() > 0) {
+            timeout_ms = static_cast<int>(std::min<int64_t>(
+                timeout_ms, throttle_delay_.count() / 1000 + 1));
+        }
+#if LIBCURL_VERSION_NUM >= 0x074400
+        curl_multi_poll(multi_, nullptr, 0, timeout_ms, nullptr);
+#else
+        curl_multi_wait(multi_, nullptr, 0, timeout_ms, nullptr);
+#endif
+    }
+
+    // Returns true if the loop holds a permit of the throttle for the
+    // next transfer; otherwise, requests one (the loop is woken up once
+    // it is granted)
+    bool admit(int priority) {
+        throttle_delay_ = std::chrono::microseconds { 0 };
+        if (!ticket_) {
+            ticket_ = throttle_->request(priority, [this]() { wakeup(); });
+        }
+        if (!ticket_->granted) {
+            throttle_delay_ = throttle_->pump();
+            if (!ticket_->granted) {
+                return false;
+            }
+        }
+        ticket_.reset();
+        return true;
+    }
+
+    // Moves queued transfers to the multi handle, up to the cap;
+    // returns false if the engine is stopping
+    bool startPending() {
+        std::vector<std::unique_ptr<Transfer>> failed {};
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            if (stopping_) {
+                return false;
+            }
+            while (!pending_.empty() && running_.size() < max_transfers_) {
+                const Transfer& next = *pending_.front();
+                if (throttle_ && next.throttled && !admit(next.priority)) {
+                    break;
+                }
+                std::unique_ptr<Transfer> transfer {
+                    std::move(pending_.front()) };
+                pending_.pop_front();
+                transfer->admitted = throttle_ && transfer->throttled;
+                CURL* curl { transfer->curl };
+                if (curl_multi_add_handle(multi_, curl) != CURLM_OK) {
+                    releaseHandle(curl);
+                    if (transfer->admitted) {
+                        throttle_->release();
+                    }
+                    failed.push_back(std::move(transfer));
+                    continue;
+                }
+                running_[curl] = std::move(transfer);
+            }
+        }
+        for (auto& transfer : failed) {
+            fail(*transfer, "failed to start the transfer");
+        }
+        return true;
+    }
+
+    // Fulfils the promises of the completed transfers; returns their
+    // number
+    size_t completeDone() {
+        size_t completed { 0 };
+        int queued_msgs { 0 };
+        CURLMsg* msg { nullptr };
+        while ((msg = curl_multi_info_read(multi_, &queued_msgs)) != nullptr) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            CURL* curl { msg->easy_handle };
+            CURLcode return_code { msg->data.result };
+            curl_multi_remove_handle(multi_, curl);
+
+            auto it = running_.find(curl);
+            if (it == running_.end()) {
+                continue;
+            }
+            std::unique_ptr<Transfer> transfer { std::move(it->second) };
+            running_.erase(it);
+
+            std::exception_ptr error {};
+            if (return_code == CURLE_OK) {
+                try {
+                    if (transfer->compression_counters != nullptr) {
+                        transfer->compression_counters->add(
+                            getDownloadSize(curl),
+                            transfer->result_buffer.size());
+                    }
+                    if (transfer->on_complete) {
+                        transfer->on_complete(curl, *transfer);
+                    }
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+
+            QueryStats stats { getQueryStats(curl, return_code) };
+            stats.url = transfer->url;
+            stats.endpoint = transfer->endpoint;
+            stats.result_bytes = transfer->result_buffer.size();
+            stats.revalidated = transfer->revalidated;
+            notifyQueryObserver(stats);
+            if (transfer->metrics) {
+                transfer->metrics->record(stats);
+            }
+            if (transfer->trace) {
+                transfer->trace->record(stats, transfer->request_body.empty()
+                                               ? nullptr
+                                               : &transfer->request_body);
+            }
+            if (transfer->admitted) {
+                throttle_->release(stats);
+            }
+
+            if (return_code != CURLE_OK) {
+                fail(*transfer, curl_easy_strerror(return_code));
+            } else {
+                if (error) {
+                    transfer->promise.set_exception(error);
+                } else {
+                    transfer->promise.set_value(
+                        std::move(transfer->result_buffer));
+                }
+                settle(*transfer);
+            }
+
+            std::lock_guard<std::mutex> lock { mutex_ };
+            releaseHandle(curl);
+            completed++;
+        }
+        return completed;
+    }
+
+    void run() {
+        int still_running { 0 };
+        while (startPending()) {
+            curl_multi_perform(multi_, &still_running);
+            // Start the queued transfers right away if some completed
+            if (completeDone() == 0) {
+                wait();
+            }
+        }
+
+        // Fail whatever is left
+        if (ticket_) {
+            throttle_->cancel(ticket_);
+            ticket_.reset();
+        }
+        for (auto& entry : running_) {
+            curl_multi_remove_handle(multi_, entry.first);
+            curl_easy_cleanup(entry.first);
+            if (entry.second->admitted) {
+                throttle_->release();
+            }
+            fail(*entry.second, "the connector was closed");
+        }
+        running_.clear();
+
+        std::deque<std::unique_ptr<Transfer>> pending {};
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            pending.swap(pending_);
+        }
+        for (auto& transfer : pending) {
+            curl_easy_cleanup(transfer->curl);
+            fail(*transfer, "the connector was closed");
+        }
+    }
+};
+
+//
+// Retries and hedging
+//
+
+// Retries of the synchronous queries that fail with a transient
+// transfer error (connection failure, timeout, ...) before any part of
+// their result is received; PuppetDB queries are read-only, so they
+// can always be repeated. The delay before the n-th retry is drawn
+// uniformly in [0, min(max_backoff, initial_backoff * 2^(n - 1))]
+// ("full jitter"), so that the retries of many clients do not
+// synchronize.
+struct RetryPolicy {
+    size_t max_retries;
+    std::chrono::milliseconds initial_backoff;
+    std::chrono::milliseconds max_backoff;
+
+    explicit RetryPolicy(size_t retries = 0,
+                         std::chrono::milliseconds initial =
+                             std::chrono::milliseconds { 50 },
+                         std::chrono::milliseconds max =
+                             std::chrono::milliseconds { 2000 })
+            : max_retries { retries },
+              initial_backoff { initial },
+              max_backoff { max } {
+    }
+
+    /// Returns the jittered delay before the retry (1 for the first)
+    std::chrono::milliseconds getBackoff(size_t retry) const {
+        int64_t ceiling { initial_backoff.count() };
+        for (size_t index = 1; index < retry && ceiling < max_backoff.count();
+                index++) {
+            ceiling *= 2;
+        }
+        ceiling = std::min(ceiling, static_cast<int64_t>(max_backoff.count()));
+        if (ceiling <= 0) {
+            return std::chrono::milliseconds { 0 };
+        }
+        static thread_local std::minstd_rand generator {
+            std::random_device {}() };
+        std::uniform_int_distribution<int64_t> distribution { 0, ceiling };
+        return std::chrono::milliseconds { distribution(generator) };
+    }
+
+    /// Returns true if the transfer error may not happen again
+    static bool isRetryable(CURLcode code) {
+        switch (code) {
+            case CURLE_COULDNT_RESOLVE_HOST:
+            case CURLE_COULDNT_CONNECT:
+            case CURLE_OPERATION_TIMEDOUT:
+            case CURLE_SSL_CONNECT_ERROR:
+            case CURLE_SEND_ERROR:
+            case CURLE_RECV_ERROR:
+            case CURLE_GOT_NOTHING:
+            case CURLE_PARTIAL_FILE:
+                return true;
+            default:
+                return false;
+        }
+    }
+};
+
+// Number of latencies recorded before the hedging delay follows their
+// percentile
+static const uint64_t HEDGING_MIN_SAMPLES { 20 };
+
+// Hedged requests: when a synchronous query has not started receiving
+// its result after a delay, the same request is sent to a replica of
+// the PuppetDB server, and the first of the two responses is used (the
+// other request is aborted). The delay is the specified percentile of
+// the latencies of the previous queries (at least min_delay), or
+// initial_delay until enough of them are known.
+struct HedgingPolicy {
+    // The replica; an empty hostname disables hedging
+    std::string hostname;
+    int port;
+    std::chrono::milliseconds initial_delay;
+    std::chrono::milliseconds min_delay;
+    double percentile;
+
+    HedgingPolicy(std::string replica_hostname = "",
+                  int replica_port = PUPPETDB_HTTP_PORT,
+                  std::chrono::milliseconds initial =
+                      std::chrono::milliseconds { 100 },
+                  std::chrono::milliseconds min =
+                      std::chrono::milliseconds { 5 },
+                  double delay_percentile = 95)
+            : hostname { std::move(replica_hostname) },
+              port { replica_port },
+              initial_delay { initial },
+              min_delay { min },
+              percentile { delay_percentile } {
+    }
+
+    bool isEnabled() const {
+        return !hostname.empty();
+    }
+};
+
+//
+// PuppetdbConnector
+//
+
+class PuppetdbConnector {
+  public:
+    PuppetdbConnector() = delete;
+
+    /// Constructor for HTTP connector
+    /// Throws a connector_error in case if the hostname is an empty
+    /// string
+    PuppetdbConnector(const std::string& hostname,
+                      const int port = PUPPETDB_HTTP_PORT,
+                      const ApiVersion api_version = API_VERSION_DEFAULT)
+            : hostname_ { hostname },
+              port_ { port },
+              api_version_ { api_version },
+              certificates_ {},
+              is_secure_ { false },
+              performed_query_url_ {},
+              curl_ { nullptr },
+              max_concurrent_transfers_ { MAX_CONCURRENT_TRANSFERS_DEFAULT },
+              multiplexing_ { true },
+              engine_ {},
+              share_ {},
+              cache_ {},
+              single_flight_ {},
+              compression_ { false },
+              compression_counters_ {},
+              last_query_stats_ {},
+              metrics_ {},
+              trace_ {},
+              throttle_ {},
+              arena_ {},
+              query_method_ { QueryMethod::Get },
+              post_threshold_ { POST_THRESHOLD_DEFAULT },
+              request_body_ {},
+              connect_timeout_ { 0 },
+              timeout_ { 0 },
+              retry_policy_ {},
+              hedging_ {},
+              hedge_multi_ { nullptr },
+              hedge_curl_ { nullptr },
+              hedge_latencies_ {} {
+        checkHostname();
+    }
+
+    /// Constructor for SSL connector; the certificates are read once,
+    /// by the constructor
+    /// Throws a connector_error in case if the hostname is an empty
+    /// string, if libcurl is not SSL enabled, or if any of the
+    /// specified certificates is not a readable file
+    PuppetdbConnector(const std::string& hostname,
+                      const std::string& ca_crt_path,
+                      const std::string& client_crt_path,
+                      const std::string& client_key_path,
+                      const int port = PUPPETDB_SECURE_PORT,
+                      const ApiVersion api_version = API_VERSION_DEFAULT)
+            : hostname_ { hostname },
+              port_ { port },
+              api_version_ { api_version },
+              ca_crt_path_ { ca_crt_path },
+              client_crt_path_ { client_crt_path },
+              client_key_path_ { client_key_path },
+              certificates_ {},
+              is_secure_ { true },
+              performed_query_url_ {},
+              curl_ { nullptr },
+              max_concurrent_transfers_ { MAX_CONCURRENT_TRANSFERS_DEFAULT },
+              multiplexing_ { true },
+              engine_ {},
+              share_ {},
+              cache_ {},
+              single_flight_ {},
+              compression_ { false },
+              compression_counters_ {},
+              last_query_stats_ {},
+              metrics_ {},
+              trace_ {},
+              throttle_ {},
+              arena_ {},
+              query_method_ { QueryMethod::Get },
+              post_threshold_ { POST_THRESHOLD_DEFAULT },
+              request_body_ {},
+              connect_timeout_ { 0 },
+              timeout_ { 0 },
+              retry_policy_ {},
+              hedging_ {},
+              hedge_multi_ { nullptr },
+              hedge_curl_ { nullptr },
+              hedge_latencies_ {} {
+        checkHostname();
+        checkSSLSupport();
+        loadCertificates();
+    }
+
+    /// Copies the connector settings; the copy opens its own libcurl
+    /// handle when it performs its first query
+    PuppetdbConnector(const PuppetdbConnector& other)
+            : hostname_ { other.hostname_ },
+              port_ { other.port_ },
+              api_version_ { other.api_version_ },
+              ca_crt_path_ { other.ca_crt_path_ },
+              client_crt_path_ { other.client_crt_path_ },
+              client_key_path_ { other.client_key_path_ },
+              certificates_ { other.certificates_ },
+              is_secure_ { other.is_secure_ },
+              performed_query_url_ { other.performed_query_url_ },
+              curl_ { nullptr },
+              max_concurrent_transfers_ { other.max_concurrent_transfers_ },
+              multiplexing_ { other.multiplexing_ },
+              engine_ {},
+              share_ { other.share_ },
+              cache_ { other.cache_ },
+              single_flight_ { other.single_flight_ },
+              compression_ { other.compression_ },
+              compression_counters_ {},
+              last_query_stats_ {},
+              metrics_ { other.metrics_ },
+              trace_ { other.trace_ },
+              throttle_ { other.throttle_ },
+              arena_ {},
+              query_method_ { other.query_method_ },
+              post_threshold_ { other.post_threshold_ },
+              request_body_ {},
+              connect_timeout_ { other.connect_timeout_ },
+              timeout_ { other.timeout_ },
+              retry_policy_ { other.retry_policy_ },
+              hedging_ { other.hedging_ },
+              hedge_multi_ { nullptr },
+              hedge_curl_ { nullptr },
+              hedge_latencies_ { other.hedge_latencies_ } {
+    }
+
+    PuppetdbConnector& operator=(const PuppetdbConnector& other) {
+        if (this != &other) {
+            close();
+            hostname_ = other.hostname_;
+            port_ = other.port_;
+            api_version_ = other.api_version_;
+            ca_crt_path_ = other.ca_crt_path_;
+            client_crt_path_ = other.client_crt_path_;
+            client_key_path_ = other.client_key_path_;
+            certificates_ = other.certificates_;
+            is_secure_ = other.is_secure_;
+            performed_query_url_ = other.performed_query_url_;
+            max_concurrent_transfers_ = other.max_concurrent_transfers_;
+            multiplexing_ = other.multiplexing_;
+            share_ = other.share_;
+            cache_ = other.cache_;
+            single_flight_ = other.single_flight_;
+            compression_ = other.compression_;
+            metrics_ = other.metrics_;
+            trace_ = other.trace_;
+            throttle_ = other.throttle_;
+            query_method_ = other.query_method_;
+            post_threshold_ = other.post_threshold_;
+            connect_timeout_ = other.connect_timeout_;
+            timeout_ = other.timeout_;
+            retry_policy_ = other.retry_policy_;
+            hedging_ = other.hedging_;
+            hedge_latencies_ = other.hedge_latencies_;
+        }
+        return *this;
+    }
+
+    virtual ~PuppetdbConnector() {
+        close();
+    }
+
+    /// Returns true if the Connector instance uses SSL, false
+    /// otherwise
+    bool isSecure() const {
+        return is_secure_;
+    }
+
+    const std::string& getHostname() const {
+        return hostname_;
+    }
+
+    int getPort() const {
+        return port_;
+    }
+
+    /// Returns the PuppetDB query result (json format) as a string
+    /// Throws a processing_error in case of failure
+    std::string performQuery(Query& query) {
+        return setupAndPerform(query);
+    }
+
+    /// Stores the PuppetDB query result (json format) in the buffer,
+    /// replacing its content; the buffer capacity is reused, so that
+    /// passing the same buffer to consecutive queries avoids
+    /// reallocations
+    /// Throws a processing_error in case of failure
+    void performQuery(Query& query, std::string& result_buffer) {
+        result_buffer.clear();
+        perform(query, QueryResult::callback, &result_buffer, &result_buffer);
+    }
+
+    /// Performs the query, passing each chunk of the result (json
+    /// format) to the sink as soon as it is received; the result is
+    /// not accumulated. Throws a processing_error in case of failure;
+    /// an exception thrown by the sink aborts the query and is
+    /// rethrown.
+    void performQuery(Query& query, ChunkSink sink) {
+        QueryResult::SinkContext context { sink, nullptr };
+        try {
+            perform(query, QueryResult::sinkCallback, &context);
+        } catch (processing_error&) {
+            if (context.error) {
+                std::rethrow_exception(context.error);
+            }
+            throw;
+        }
+    }
+
+    /// Performs the query, writing the result (json format) to the
+    /// output stream as it is received
+    /// Throws a processing_error in case of failure, including a
+    /// failure to write to the stream
+    void performQuery(Query& query, std::ostream& output) {
+        performQuery(query, [&output](const char* data, size_t size) {
+            if (!output.write(data, size)) {
+                throw processing_error { "failed to write the query result" };
+            }
+        });
+    }
+
+    /// Performs the query, storing the result (json format) in the
+    /// chunked result, which is cleared first; the result is never
+    /// reallocated nor flattened
+    /// Throws a processing_error in case of failure
+    void performQuery(Query& query, ChunkedResult& result) {
+        result.clear();
+        perform(query, ChunkedResult::callback, &result);
+    }
+
+    /// Starts the query asynchronously and returns a future for its
+    /// result (json format); the future throws a processing_error in
+    /// case of failure. At most getMaxConcurrentTransfers() queries
+    /// run at the same time; the others are queued.
+    /// NB: getPerformedQueryUrl() is not updated by asynchronous
+    /// queries
+    std::future<std::string> submit(Query query) {
+        std::unique_ptr<MultiEngine::Transfer> transfer {
+            new MultiEngine::Transfer {} };
+        auto result = transfer->promise.get_future();
+        startTransfer(query, std::move(transfer));
+        return result;
+    }
+
+    /// Starts the query asynchronously and calls the callback with the
+    /// future of its result once it is available: from the thread of
+    /// the asynchronous queries, or from the calling thread if the
+    /// result is cached or the connector is closed. The callback must
+    /// not block, nor destroy the connector; it may submit other
+    /// queries, provided the connector is not used by another thread
+    /// at the same time. The errors raised before the transfer starts
+    /// (an invalid query, ...) are thrown without calling the callback.
+    void submit(Query query, QueryCallback callback) {
+        std::unique_ptr<MultiEngine::Transfer> transfer {
+            new MultiEngine::Transfer {} };
+        transfer->callback = std::move(callback);
+        startTransfer(query, std::move(transfer));
+    }
+
+    /// Opens keep-alive connections to PuppetDB in the background
+    /// (DNS resolution, TCP and TLS handshakes), so that the first
+    /// queries do not pay for them; at most
+    /// getMaxConcurrentTransfers() connections are opened. Returns a
+    /// future for the number of connections opened, which never
+    /// throws. The connections are kept in the share of the connector,
+    /// used by both the synchronous and asynchronous queries; a share
+    /// is created if the connector has none (see setShare).
+    std::future<size_t> warmup(size_t num_connections = 1) {
+        num_connections = std::min(num_connections,
+                                   max_concurrent_transfers_);
+        std::shared_ptr<Warmup> warmup { new Warmup { num_connections } };
+        auto result = warmup->promise.get_future();
+        if (num_connections == 0) {
+            warmup->promise.set_value(0);
+            return result;
+        }
+
+        if (!share_) {
+            share_ = std::make_shared<CurlShare>();
+            if (curl_ != nullptr) {
+                curl_easy_setopt(curl_, CURLOPT_SHARE, share_->get());
+            }
+        }
+        if (!engine_) {
+            engine_.reset(new MultiEngine { max_concurrent_transfers_,
+                                            multiplexing_, throttle_ });
+        }
+
+        std::string url { getServerUrl() };
+        for (size_t idx = 0; idx < num_connections; idx++) {
+            std::unique_ptr<MultiEngine::Transfer> transfer {
+                new MultiEngine::Transfer {} };
+            transfer->curl = engine_->acquireHandle();
+            transfer->url = url;
+            // A HEAD request of the server root, on a new connection
+            // (not one just released by another warmup transfer); any
+            // response leaves the connection open
+            setTransferOptions(transfer->curl, transfer->url,
+                               QueryResult::callback,
+                               &transfer->result_buffer,
+                               &transfer->response_headers);
+            curl_easy_setopt(transfer->curl, CURLOPT_NOBODY, 1L);
+            curl_easy_setopt(transfer->curl, CURLOPT_FRESH_CONNECT, 1L);
+            transfer->throttled = false;
+            curl_easy_setopt(transfer->curl, CURLOPT_SHARE, share_->get());
+#if LIBCURL_VERSION_NUM >= 0x072f00
+            // Negotiate HTTP/2 as the queries would, but without waiting
+            // to multiplex, so that the connections are opened in
+            // parallel
+            if (multiplexing_) {
+                curl_easy_setopt(transfer->curl, CURLOPT_HTTP_VERSION,
+                                 CURL_HTTP_VERSION_2TLS);
+            }
+#endif
+            transfer->on_complete = [warmup](CURL* curl,
+                                             MultiEngine::Transfer&) {
+                long num_connects { 0 };
+                curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &num_connects);
+                warmup->num_opened += static_cast<size_t>(num_connects);
+            };
+            transfer->callback = [warmup](std::future<std::string>) {
+                if (--warmup->num_pending == 0) {
+                    warmup->promise.set_value(warmup->num_opened);
+                }
+            };
+            engine_->submit(std::move(transfer));
+        }
+        return result;
+    }
+
+    /// Starts all queries asynchronously; returns the futures of
+    /// their results, in the same order
+    std::vector<std::future<std::string>> performQueriesAsync(
+            std::vector<Query> queries) {
+        std::vector<std::future<std::string>> results {};
+        results.reserve(queries.size());
+        for (auto& query : queries) {
+            results.push_back(submit(query));
+        }
+        return results;
+    }
+
+    /// Sets the cap on the number of concurrent asynchronous queries
+    void setMaxConcurrentTransfers(size_t max_transfers) {
+        max_concurrent_transfers_ = max_transfers > 0 ? max_transfers : 1;
+        if (engine_) {
+            engine_->setMaxTransfers(max_concurrent_transfers_);
+        }
+    }
+
+    size_t getMaxConcurrentTransfers() const {
+        return max_concurrent_transfers_;
+    }
+
+    /// Enables or disables HTTP/2 multiplexing of asynchronous
+    /// queries (enabled by default; effective on SSL connections to
+    /// servers that negotiate HTTP/2). Only affects the asynchronous
+    /// queries submitted before the first one.
+    void setMultiplexing(bool enabled) {
+        multiplexing_ = enabled;
+    }
+
+    /// Makes the connector share its connection, DNS, and SSL session
+    /// caches with the other connectors using the same share (nullptr
+    /// stops sharing); the current handle is closed
+    void setShare(std::shared_ptr<CurlShare> share) {
+        close();
+        share_ = std::move(share);
+    }
+
+    /// Enables or disables the compression of the results (disabled
+    /// by default): all the encodings supported by libcurl (gzip,
+    /// deflate, br, ...) are accepted and the results are
+    /// decompressed as they are received, before being passed on
+    void setCompression(bool enabled) {
+        compression_ = enabled;
+    }
+
+    bool getCompression() const {
+        return compression_;
+    }
+
+    /// Returns the compressed and decompressed sizes of the results
+    /// received so far
+    CompressionCounters::Snapshot getCompressionCounters() const {
+        return compression_counters_.get();
+    }
+
+    /// Sets how the queries are sent: in the URL (GET, the default),
+    /// in a json body (POST), or by POST when the query string is
+    /// longer than the threshold (Auto). A POSTed query
+    /// is not URL encoded and is not limited by the URL length.
+    /// Throws a connector_error in case POST is requested with api v2
+    /// or v3
+    void setQueryMethod(QueryMethod method,
+                        size_t post_threshold = POST_THRESHOLD_DEFAULT) {
+        if (method != QueryMethod::Get && api_version_ != ApiVersion::v4) {
+            throw connector_error { "POST queries require api v4" };
+        }
+        query_method_ = method;
+        post_threshold_ = post_threshold;
+    }
+
+    QueryMethod getQueryMethod() const {
+        return query_method_;
+    }
+
+    size_t getPostThreshold() const {
+        return post_threshold_;
+    }
+
+    /// Returns true if the query would be sent by POST
+    bool isPosted(Query& query) {
+        switch (query_method_) {
+            case QueryMethod::Post:
+                return true;
+            case QueryMethod::Auto:
+                return getProjectedQueryString(query).size()
+                       > post_threshold_;
+            default:
+                return false;
+        }
+    }
+
+    /// Sets the deadlines of the queries (0 for none, the default):
+    /// the time allowed to connect and the total time of a query,
+    /// retries included. A query that misses its deadline fails with
+    /// a processing_error.
+    void setTimeouts(std::chrono::milliseconds connect_timeout,
+                     std::chrono::milliseconds timeout) {
+        connect_timeout_ = connect_timeout;
+        timeout_ = timeout;
+    }
+
+    std::chrono::milliseconds getConnectTimeout() const {
+        return connect_timeout_;
+    }
+
+    std::chrono::milliseconds getTimeout() const {
+        return timeout_;
+    }
+
+    /// Sets the retries of the synchronous queries (none by default)
+    void setRetryPolicy(const RetryPolicy& retry_policy) {
+        retry_policy_ = retry_policy;
+    }
+
+    const RetryPolicy& getRetryPolicy() const {
+        return retry_policy_;
+    }
+
+    /// Enables the hedging of the synchronous queries to the replica
+    /// of the policy (a policy without hostname disables it); the
+    /// replica uses the same api version and certificates
+    void setHedgingPolicy(const HedgingPolicy& hedging) {
+        hedging_ = hedging;
+        hedge_latencies_.reset(hedging_.isEnabled() ? new LatencyHistogram {}
+                                                    : nullptr);
+    }
+
+    const HedgingPolicy& getHedgingPolicy() const {
+        return hedging_;
+    }
+
+    /// Makes the connector cache the query results in the cache,
+    /// which may be shared with other connectors (nullptr disables
+    /// caching)
+    void setResponseCache(std::shared_ptr<ResponseCache> cache) {
+        cache_ = std::move(cache);
+    }
+
+    std::shared_ptr<ResponseCache> getResponseCache() const {
+        return cache_;
+    }
+
+    /// Makes the connector coalesce its synchronous queries with the
+    /// identical ones performed at the same time by the connectors
+    /// sharing the SingleFlight instance (nullptr disables coalescing)
+    void setSingleFlight(std::shared_ptr<SingleFlight> single_flight) {
+        single_flight_ = std::move(single_flight);
+    }
+
+    /// Makes the connector record its queries in the metrics, which
+    /// may be shared with other connectors (nullptr disables them)
+    void setQueryMetrics(std::shared_ptr<QueryMetrics> metrics) {
+        metrics_ = std::move(metrics);
+    }
+
+    std::shared_ptr<QueryMetrics> getQueryMetrics() const {
+        return metrics_;
+    }
+
+    /// Makes the connector record its queries in the trace recorder,
+    /// which may be shared with other connectors (nullptr, the
+    /// default, disables tracing)
+    void setTraceRecorder(std::shared_ptr<TraceRecorder> trace) {
+        trace_ = std::move(trace);
+    }
+
+    std::shared_ptr<TraceRecorder> getTraceRecorder() const {
+        return trace_;
+    }
+
+    /// Makes the queries of the connector wait for the permits of the
+    /// throttle, which may be shared with other connectors (nullptr
+    /// disables throttling). Each attempt of a synchronous query takes
+    /// a permit; as with setMultiplexing, the asynchronous queries use
+    /// the throttle set before the first of them (or before close()).
+    void setThrottle(std::shared_ptr<Throttle> throttle) {
+        throttle_ = std::move(throttle);
+    }
+
+    std::shared_ptr<Throttle> getThrottle() const {
+        return throttle_;
+    }
+
+    /// Returns the URL used to perform the PuppetDB query (without
+    /// the query, for a POSTed one)
+    std::string getPerformedQueryUrl() const {
+        return performed_query_url_;
+    }
+
+    /// Returns the stats of the last synchronous query; the stats of
+    /// the asynchronous ones are only passed to the query observer
+    const QueryStats& getLastQueryStats() const {
+        return last_query_stats_;
+    }
+
+    /// Returns true if the connector holds a libcurl handle, i.e. if
+    /// a query was performed since construction or the last close()
+    bool isOpen() const {
+        return curl_ != nullptr;
+    }
+
+    /// Releases the libcurl handles, closing the keep-alive
+    /// connections to PuppetDB and dropping the DNS and SSL session
+    /// caches; the next query will open a new handle.
+    /// NB: the pending asynchronous queries fail
+    void close() {
+        engine_.reset();
+        if (curl_ != nullptr) {
+            curl_easy_cleanup(curl_);
+            curl_ = nullptr;
+        }
+        releaseHedgeHandle();
+        if (hedge_multi_ != nullptr) {
+            curl_multi_cleanup(hedge_multi_);
+            hedge_multi_ = nullptr;
+        }
+    }
+
+    /// Resets the options of the libcurl handle to their defaults;
+    /// the open connection and the DNS and SSL session caches are
+    /// kept, so that the next query can still reuse them
+    void reset() {
+        if (curl_ != nullptr) {
+            curl_easy_reset(curl_);
+        }
+    }
+
+    // NB: this method is public and virtual for testing purposes
+    virtual std::string getQueryUrl(Query& query, CURL* curl) {
+        const std::string query_str { getProjectedQueryString(query) };
+
+        // The URL is assembled in place, with room for the encoded
+        // query string
+        std::string url { getEndpointUrl(query, 3 * query_str.size()) };
+
+        size_t parameters_start { url.size() };
+        if (!query_str.empty()) {
+            appendParameter(url, parameters_start, "query", query_str.data(),
+                            query_str.size());
+        }
+
+        if (query.isPaged()) {
+            appendPagingParameters(url, parameters_start, query);
+        }
+
+        return url;
+    }
+
+  private:
+    // PuppetDB host, port, and api version
+    std::string hostname_;
+    int port_;
+    ApiVersion api_version_;
+
+    // File paths used for the SSL connection
+    std::string ca_crt_path_;
+    std::string client_crt_path_;
+    std::string client_key_path_;
+
+    // Contents of the certificate files, read once by the constructor
+    // and shared with the copies of the connector; passed to libcurl
+    // without being copied
+    struct Certificates {
+        std::string ca_crt;
+        std::string client_crt;
+        std::string client_key;
+    };
+    std::shared_ptr<const Certificates> certificates_;
+
+    // SSL flag
+    bool is_secure_;
+
+    // The URL of the performed query
+    std::string performed_query_url_;
+
+    // libcurl handle, reused across queries to keep the connection
+    // alive and to resume the TLS session
+    CURL* curl_;
+
+    // Asynchronous queries settings and engine (created on the first
+    // asynchronous query)
+    size_t max_concurrent_transfers_;
+    bool multiplexing_;
+    std::unique_ptr<MultiEngine> engine_;
+
+    // Caches shared with other connectors, if any
+    std::shared_ptr<CurlShare> share_;
+
+    // Results cache, if any
+    std::shared_ptr<ResponseCache> cache_;
+
+    // Coalescing of identical queries, if enabled
+    std::shared_ptr<SingleFlight> single_flight_;
+
+    // Compression of the results
+    bool compression_;
+    CompressionCounters compression_counters_;
+
+    // Stats of the last synchronous query
+    QueryStats last_query_stats_;
+
+    // Aggregated metrics, if enabled
+    std::shared_ptr<QueryMetrics> metrics_;
+
+    // Record of the last queries, if enabled
+    std::shared_ptr<TraceRecorder> trace_;
+
+    // Admission control, shared with other connectors, if any
+    std::shared_ptr<Throttle> throttle_;
+
+    // Temporaries of the current query (URL assembly and request
+    // headers), released when the next one starts
+    Arena arena_;
+
+    // Query submission method (GET or POST) and the json body of the
+    // current POSTed query, whose capacity is reused
+    QueryMethod query_method_;
+    size_t post_threshold_;
+    std::string request_body_;
+
+    // Deadlines (0 for none), retries, and hedging; the multi handle
+    // running the hedged transfers keeps the connections to both
+    // servers alive, and the latencies (shared with the copies of the
+    // connector) set the hedging delay
+    std::chrono::milliseconds connect_timeout_;
+    std::chrono::milliseconds timeout_;
+    RetryPolicy retry_policy_;
+    HedgingPolicy hedging_;
+    CURLM* hedge_multi_;
+    CURL* hedge_curl_;
+    std::shared_ptr<LatencyHistogram> hedge_latencies_;
+
+    // Progress of a warmup, shared by the callbacks of its transfers
+    struct Warmup {
+        std::atomic<size_t> num_pending;
+        std::atomic<size_t> num_opened;
+        std::promise<size_t> promise;
+
+        explicit Warmup(size_t num_connections)
+                : num_pending { num_connections },
+                  num_opened { 0 },
+                  promise {} {
+        }
+    };
+
+    void checkHostname() {
+        if (hostname_.empty()) {
+            throw connector_error { "no hostname specified" };
+        }
+    }
+
+    void checkSSLSupport() {
+        curl_version_info_data* info_data = curl_version_info(CURLVERSION_NOW);
+        if (!(info_data->features & CURL_VERSION_SSL)) {
+            throw connector_error { "libcurl is not SSL enabled" };
+        }
+    }
+
+    void loadCertificates() {
+        std::vector<std::string> certificates { ca_crt_path_,
+                                                client_crt_path_,
+                                                client_key_path_ };
+        for (auto cert : certificates) {
+            if (cert.empty()) {
+                throw connector_error { "not all certificates were specified" };
+            }
+        }
+
+        std::shared_ptr<Certificates> contents { new Certificates {} };
+        readCertificate(ca_crt_path_, contents->ca_crt);
+        readCertificate(client_crt_path_, contents->client_crt);
+        readCertificate(client_key_path_, contents->client_key);
+        certificates_ = contents;
+    }
+
+    static void readCertificate(const std::string& path,
+                                std::string& content) {
+        std::ifstream file { path, std::ios::binary };
+        if (!file.good()) {
+            throw connector_error { "invalid certificate file: " + path };
+        }
+        content.assign(std::istreambuf_iterator<char> { file },
+                       std::istreambuf_iterator<char> {});
+        if (file.bad()) {
+            throw connector_error { "invalid certificate file: " + path };
+        }
+    }
+
+    std::string getApiVersion() {
+        return ApiVersionsMap[api_version_];
+    }
+
+    // Returns the URL of the root of the server
+    std::string getServerUrl() const {
+        return (isSecure() ? "https://" : "http://") + hostname_ + ':'
+               + std::to_string(port_) + '/';
+    }
+
+    // Returns the URL of the endpoint of the query, reserving room for
+    // the parameters
+    std::string getEndpointUrl(Query& query, size_t parameters_size = 0) {
+        const std::string& endpoint = query.getEndpoint();
+        const std::string& api_version = ApiVersionsMap[api_version_];
+
+        std::string url {};
+        url.reserve(hostname_.size() + endpoint.size() + parameters_size
+                    + 64);
+        url += isSecure() ? "https://" : "http://";
+        url += hostname_;
+        url += ':';
+        url += std::to_string(port_);
+        url += '/';
+        url += api_version;
+        url += '/';
+        url += endpoint;
+        return url;
+    }
+
+    // Returns the query string to send: with the v4 API, the query
+    // wrapped in an extract clause of the fields of its projection,
+    // if any; otherwise, the query string itself
+    // Throws a query_error in case the query cannot be projected
+    std::string getProjectedQueryString(Query& query) {
+        std::string query_str { query.getQueryString() };
+        const std::vector<std::string>& fields = query.getProjection();
+        if (fields.empty() || api_version_ != ApiVersion::v4) {
+            return query_str;
+        }
+
+        size_t first { query_str.find_first_not_of(" \t\r\n") };
+        if (first != std::string::npos) {
+            if (query_str[first] != '[') {
+                throw query_error { "a projection requires a json query; "
+                                    "PQL queries select their fields "
+                                    "themselves" };
+            }
+            size_t operator_start { query_str.find_first_not_of(
+                " \t\r\n", first + 1) };
+            if (operator_start != std::string::npos
+                    && query_str.compare(operator_start, 9,
+                                         "\"extract\"") == 0) {
+                throw query_error { "a projection cannot be applied to "
+                                    "an extract query" };
+            }
+        }
+
+        std::string extract { "[\"extract\",[" };
+        for (size_t index = 0; index < fields.size(); index++) {
+            if (index > 0) {
+                extract += ',';
+            }
+            extract += '"';
+            appendJsonEscaped(extract, fields[index].data(),
+                              fields[index].size());
+            extract += '"';
+        }
+        extract += ']';
+        if (first != std::string::npos) {
+            extract += ',';
+            extract += query_str;
+        }
+        extract += ']';
+        return extract;
+    }
+
+    // Appends the json body of the POSTed query: the query itself
+    // (a json query is sent as is, without being re-encoded) and the
+    // paging parameters
+    void appendQueryBody(std::string& body, Query& query) {
+        const std::string query_str { getProjectedQueryString(query) };
+        body += '{';
+        if (!query_str.empty()) {
+            body += "\"query\":";
+            size_t first { query_str.find_first_not_of(" \t\r\n") };
+            if (first != std::string::npos && query_str[first] == '[') {
+                body += query_str;
+            } else {
+                // PQL
+                body += '"';
+                appendJsonEscaped(body, query_str.data(), query_str.size());
+                body += '"';
+            }
+        }
+        if (query.getLimit() > 0) {
+            appendBodyMember(body, "limit", std::to_string(query.getLimit()));
+        }
+        if (query.getOffset() > 0) {
+            appendBodyMember(body, "offset",
+                             std::to_string(query.getOffset()));
+        }
+        if (!query.getOrderBy().empty()) {
+            std::string order_by {};
+            appendOrderBy(order_by, query);
+            appendBodyMember(body, "order_by", order_by);
+        }
+        if (query.getIncludeTotal()) {
+            appendBodyMember(body, "include_total", "true");
+        }
+        body += '}';
+    }
+
+    static void appendBodyMember(std::string& body, const char* name,
+                                 const std::string& value) {
+        if (body.size() > 1) {
+            body += ',';
+        }
+        body += '"';
+        body += name;
+        body += "\":";
+        body += value;
+    }
+
+    // Appends the json array of the sort order of the query
+    template <typename String>
+    static void appendOrderBy(String& text, Query& query) {
+        text += '[';
+        bool is_first { true };
+        for (const auto& field_order : query.getOrderBy()) {
+            if (!is_first) {
+                text += ',';
+            }
+            is_first = false;
+            text += "{\"field\":\"";
+            text.append(field_order.field.data(), field_order.field.size());
+            text += "\",\"order\":\"";
+            text += field_order.ascending ? "asc" : "desc";
+            text += "\"}";
+        }
+        text += ']';
+    }
+
+    // Returns the key identifying a POSTed query in the response cache
+    // and among the coalesced queries
+    static std::string getPostKey(const std::string& url,
+                                  const std::string& body) {
+        return url + "\nPOST " + body;
+    }
+
+    // Appends the URL-encoded parameter to the URL parameters
+    // Appends the URL encoded parameter to the URL, whose parameters
+    // start at the specified position
+    static void appendParameter(std::string& url, size_t parameters_start,
+                                const char* name, const char* value,
+                                size_t value_size) {
+        url += url.size() == parameters_start ? '?' : '&';
+        url += name;
+        url += '=';
+        appendUrlEncoded(url, value, value_size);
+    }
+
+    static void appendParameter(std::string& url, size_t parameters_start,
+                                const char* name, size_t value) {
+        std::string value_str { std::to_string(value) };
+        appendParameter(url, parameters_start, name, value_str.data(),
+                        value_str.size());
+    }
+
+    // NB: v4 uses snake case parameter names, v2 and v3 kebab case
+    void appendPagingParameters(std::string& url, size_t parameters_start,
+                                Query& query) {
+        bool is_v4 { api_version_ == ApiVersion::v4 };
+
+        if (query.getLimit() > 0) {
+            appendParameter(url, parameters_start, "limit", query.getLimit());
+        }
+
+        if (query.getOffset() > 0) {
+            appendParameter(url, parameters_start, "offset",
+                            query.getOffset());
+        }
+
+        if (!query.getOrderBy().empty()) {
+            // The json text is a temporary of the query arena
+            ArenaString order_by { ArenaAllocator<char> { arena_ } };
+            appendOrderBy(order_by, query);
+            appendParameter(url, parameters_start,
+                            is_v4 ? "order_by" : "order-by",
+                            order_by.data(), order_by.size());
+        }
+
+        if (query.getIncludeTotal()) {
+            appendParameter(url, parameters_start,
+                            is_v4 ? "include_total" : "include-total",
+                            "true", 4);
+        }
+    }
+
+    // Returns the libcurl handle, creating it on first use; the
+    // options set by the previous query are cleared
+    CURL* getHandle() {
+        if (curl_ == nullptr) {
+            curl_ = curl_easy_init();
+            if (curl_ == nullptr) {
+                throw processing_error { "failed to initialize libcurl" };
+            }
+            // NB: the share is kept by curl_easy_reset
+            if (share_) {
+                curl_easy_setopt(curl_, CURLOPT_SHARE, share_->get());
+            }
+        } else {
+            curl_easy_reset(curl_);
+        }
+        return curl_;
+    }
+
+    // NB: this is virtual to enable mocking
+    virtual std::string setupAndPerform(Query& query) {
+        std::string result_buffer {};
+        perform(query, QueryResult::callback, &result_buffer, &result_buffer);
+        return result_buffer;
+    }
+
+    // Performs the query, passing the result chunks to the libcurl
+    // write callback; the space announced by the Content-Length
+    // header is reserved in the result buffer, if any
+    void perform(Query& query, WriteCallback write_callback,
+                 void* write_data, std::string* result_buffer = nullptr) {
+        // The temporaries of the previous query are released at once
+        arena_.reset();
+
+        // libcurl handle
+        CURL* curl { getHandle() };
+
+        // A POSTed query is identified by its URL and its body
+        bool post { isPosted(query) };
+        std::string post_key {};
+        if (post) {
+            performed_query_url_ = getEndpointUrl(query);
+            request_body_.clear();
+            appendQueryBody(request_body_, query);
+            post_key = getPostKey(performed_query_url_, request_body_);
+        } else {
+            performed_query_url_ = getQueryUrl(query, curl);
+        }
+        const std::string& key = post ? post_key : performed_query_url_;
+        const std::string* request_body { post ? &request_body_ : nullptr };
+
+        std::shared_ptr<const ResponseCache::Entry> cached {};
+        if (cache_ && cache_->isCached(query.getEndpoint())) {
+            cached = cache_->lookup(key);
+            if (cached && cached->isFresh()) {
+                setDeliveredStats(query, cached->body, true, request_body);
+                deliver(cached->body, write_callback, write_data);
+                return;
+            }
+        }
+
+        if (!single_flight_) {
+            transfer(query, curl, key, request_body, cached, write_callback,
+                     write_data, result_buffer, false);
+            return;
+        }
+
+        std::shared_future<std::string> in_flight {};
+        if (!single_flight_->join(key, in_flight)) {
+            // Wait for the identical query that is in flight; its
+            // failure is rethrown
+            const std::string& result = in_flight.get();
+            setDeliveredStats(query, result, false, request_body);
+            deliver(result, write_callback, write_data);
+            return;
+        }
+
+        try {
+            single_flight_->complete(
+                key,
+                transfer(query, curl, key, request_body, cached,
+                         write_callback, write_data, result_buffer, true));
+        } catch (...) {
+            single_flight_->fail(key, std::current_exception());
+            throw;
+        }
+    }
+
+    // Transfers the result of the query (POSTing the request body, if
+    // any), revalidating the cached entry if any, and caches it under
+    // the key if required; returns a copy of the result if requested
+    std::string transfer(Query& query, CURL* curl, const std::string& key,
+                         const std::string* request_body,
+                         const std::shared_ptr<const ResponseCache::Entry>& cached,
+                         WriteCallback write_callback, void* write_data,
+                         std::string* result_buffer, bool copy_result) {
+        bool is_cached { cache_ && cache_->isCached(query.getEndpoint()) };
+
+        // Count the result bytes and keep a copy of a streamed result,
+        // to cache or share it
+        QueryResult::ForwardContext forward {
+            write_callback, write_data,
+            (is_cached || copy_result) && result_buffer == nullptr };
+
+        QueryResult::ResponseHeaders response_headers { result_buffer };
+        setTransferOptions(curl, performed_query_url_,
+                           QueryResult::forwardCallback, &forward,
+                           &response_headers);
+
+        if (request_body != nullptr) {
+            setPostOptions(curl, *request_body);
+        }
+
+        curl_slist* request_headers {
+            getRequestHeaders(cached, request_body != nullptr, arena_) };
+        if (request_headers != nullptr) {
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request_headers);
+        }
+
+        // Perform the query, retrying it if required; the connection
+        // is left open for the next one
+        auto start = std::chrono::steady_clock::now();
+        CURL* done_curl { curl };
+        CURLcode return_code { CURLE_OK };
+        for (size_t retry = 0;; retry++) {
+            Throttle::Permit permit {};
+            if (throttle_) {
+                permit = throttle_->acquire(query.getPriority());
+            }
+            if (timeout_.count() > 0) {
+                setAttemptTimeout(curl, start);
+            }
+            bool hedged { false };
+            done_curl = curl;
+            return_code = hedging_.isEnabled()
+                          ? performHedged(curl, forward, response_headers,
+                                          start, done_curl, hedged)
+                          : curl_easy_perform(curl);
+
+            last_query_stats_ = getQueryStats(done_curl, return_code);
+            last_query_stats_.url = done_curl == curl
+                                    ? performed_query_url_
+                                    : getHedgeUrl(performed_query_url_);
+            last_query_stats_.endpoint = query.getEndpoint();
+            last_query_stats_.result_bytes = forward.num_bytes;
+            if (return_code == CURLE_OK
+                    && last_query_stats_.response_code == 304 && cached) {
+                // The cached result is delivered
+                last_query_stats_.result_bytes = cached->body.size();
+                last_query_stats_.revalidated = true;
+            }
+            last_query_stats_.retries = retry;
+            last_query_stats_.hedged = hedged;
+            report(last_query_stats_, request_body);
+            permit.complete(last_query_stats_);
+
+            std::chrono::milliseconds backoff { 0 };
+            if (!shouldRetry(return_code, forward.num_bytes, retry, start,
+                             backoff)) {
+                break;
+            }
+            response_headers = QueryResult::ResponseHeaders { result_buffer };
+            std::this_thread::sleep_for(backoff);
+        }
+
+        if (hedge_latencies_ && return_code == CURLE_OK) {
+            hedge_latencies_->record(std::chrono::duration_cast<
+                std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start));
+        }
+
+        if (return_code != CURLE_OK) {
+            throw processing_error {
+                std::string(curl_easy_strerror(return_code)) };
+        }
+
+        compression_counters_.add(last_query_stats_.downloaded_bytes,
+                                  forward.num_bytes);
+
+        std::string& result { result_buffer != nullptr ? *result_buffer
+                                                       : forward.copy };
+        long response_code { 0 };
+        curl_easy_getinfo(done_curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+        if (response_code == 304 && cached) {
+            if (is_cached) {
+                cache_->refresh(cached, query.getEndpoint());
+            }
+            deliver(cached->body, write_callback, write_data);
+            return copy_result ? cached->body : std::string {};
+        }
+
+        if (is_cached && response_code == 200) {
+            cache_->store(key, query.getEndpoint(), result,
+                          response_headers.etag,
+                          response_headers.last_modified);
+        }
+        return copy_result ? result : std::string {};
+    }
+
+    // Limits the next attempt of the query to the time left before
+    // its deadline
+    void setAttemptTimeout(CURL* curl,
+                           std::chrono::steady_clock::time_point start) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start);
+        // NB: a timeout of 0 would disable it
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, static_cast<long>(
+            std::max<int64_t>((timeout_ - elapsed).count(), 1)));
+    }
+
+    // Returns true if the failed attempt should be retried, after the
+    // backoff delay; the result must not have been passed on yet, and
+    // the retry must start before the deadline
+    bool shouldRetry(CURLcode return_code, uint64_t num_result_bytes,
+                     size_t retry, std::chrono::steady_clock::time_point start,
+                     std::chrono::milliseconds& backoff) const {
+        if (return_code == CURLE_OK || num_result_bytes > 0
+                || retry >= retry_policy_.max_retries
+                || !RetryPolicy::isRetryable(return_code)) {
+            return false;
+        }
+        backoff = retry_policy_.getBackoff(retry + 1);
+        return timeout_.count() == 0
+               || std::chrono::steady_clock::now() + backoff
+                  < start + timeout_;
+    }
+
+    void releaseHedgeHandle() {
+        if (hedge_curl_ != nullptr) {
+            curl_easy_cleanup(hedge_curl_);
+            hedge_curl_ = nullptr;
+        }
+    }
+
+    // Returns the URL of the query on the hedging replica, or an empty
+    // string
+    std::string getHedgeUrl(const std::string& url) const {
+        std::string prefix { (isSecure() ? "https://" : "http://") + hostname_
+                             + ':' + std::to_string(port_) + '/' };
+        if (url.compare(0, prefix.size(), prefix) != 0) {
+            return "";
+        }
+        return (isSecure() ? "https://" : "http://") + hedging_.hostname
+               + ':' + std::to_string(hedging_.port) + '/'
+               + url.substr(prefix.size());
+    }
+
+    std::chrono::milliseconds getHedgeDelay() const {
+        auto latencies = hedge_latencies_->getSnapshot();
+        if (latencies.getCount() < HEDGING_MIN_SAMPLES) {
+            return hedging_.initial_delay;
+        }
+        return std::max(hedging_.min_delay,
+                        std::chrono::duration_cast<std::chrono::milliseconds>(
+                            latencies.getPercentile(hedging_.percentile)));
+    }
+
+    // State of a hedged query: the first of its two requests that
+    // receives a part of the result wins; the other one is aborted
+    struct HedgeState {
+        QueryResult::ForwardContext* forward;
+        int winner;
+    };
+
+    struct HedgeRequest {
+        HedgeState* state;
+        int index;
+    };
+
+    static size_t hedgeCallback(void* contents, size_t size, size_t nmemb,
+                                void *userp) {
+        auto request = static_cast<HedgeRequest*>(userp);
+        int& winner = request->state->winner;
+        if (winner < 0) {
+            winner = request->index;
+        }
+        if (winner != request->index) {
+            return 0;
+        }
+        return QueryResult::forwardCallback(contents, size, nmemb,
+                                            request->state->forward);
+    }
+
+    // Performs the configured transfer, sending the same request to
+    // the replica if there is no response after the hedging delay;
+    // returns the outcome of the request whose result was used, and
+    // its handle (the replica one is released before returning)
+    CURLcode performHedged(CURL* curl, QueryResult::ForwardContext& forward,
+                           QueryResult::ResponseHeaders& response_headers,
+                           std::chrono::steady_clock::time_point start,
+                           CURL*& done_curl, bool& hedged) {
+        releaseHedgeHandle();
+        std::string hedge_url { getHedgeUrl(performed_query_url_) };
+        if (hedge_url.empty()) {
+            return curl_easy_perform(curl);
+        }
+        if (hedge_multi_ == nullptr) {
+            hedge_multi_ = curl_multi_init();
+            if (hedge_multi_ == nullptr) {
+                return curl_easy_perform(curl);
+            }
+        }
+
+        HedgeState state { &forward, -1 };
+        HedgeRequest requests[2] { { &state, 0 }, { &state, 1 } };
+        QueryResult::ResponseHeaders hedge_headers {
+            response_headers.result_buffer };
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, hedgeCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &requests[0]);
+
+        CURL* handles[2] { curl, nullptr };
+        bool done[2] { false, false };
+        CURLcode codes[2] { CURLE_OK, CURLE_OK };
+        auto hedge_time = std::chrono::steady_clock::now() + getHedgeDelay();
+        int result { -1 };
+        curl_multi_add_handle(hedge_multi_, curl);
+
+        while (result < 0) {
+            int num_running { 0 };
+            curl_multi_perform(hedge_multi_, &num_running);
+            CURLMsg* message { nullptr };
+            int num_messages { 0 };
+            while ((message = curl_multi_info_read(hedge_multi_,
+                                                   &num_messages))) {
+                if (message->msg == CURLMSG_DONE) {
+                    int index { message->easy_handle == curl ? 0 : 1 };
+                    done[index] = true;
+                    codes[index] = message->data.result;
+                }
+            }
+
+            // The request that passed on the result, or the first one
+            // that succeeded without a body, or the last one to fail
+            bool can_hedge { handles[1] == nullptr && state.winner < 0 };
+            if (done[0] && (state.winner == 0
+                            || (state.winner < 0
+                                && (codes[0] == CURLE_OK || can_hedge
+                                    || (done[1] && codes[1] != CURLE_OK))))) {
+                result = 0;
+            } else if (done[1] && (state.winner == 1
+                                   || (state.winner < 0
+                                       && (codes[1] == CURLE_OK
+                                           || done[0])))) {
+                result = 1;
+            } else if (can_hedge
+                           && std::chrono::steady_clock::now() >= hedge_time) {
+                handles[1] = curl_easy_duphandle(curl);
+                if (handles[1] != nullptr) {
+                    curl_easy_setopt(handles[1], CURLOPT_URL,
+                                     hedge_url.c_str());
+                    curl_easy_setopt(handles[1], CURLOPT_WRITEDATA,
+                                     &requests[1]);
+                    curl_easy_setopt(handles[1], CURLOPT_HEADERDATA,
+                                     &hedge_headers);
+                    if (timeout_.count() > 0) {
+                        setAttemptTimeout(handles[1], start);
+                    }
+                    curl_multi_add_handle(hedge_multi_, handles[1]);
+                    hedged = true;
+                    continue;
+                }
+                // NB: no hedging without a second handle
+                hedge_time = std::chrono::steady_clock::time_point::max();
+            } else {
+                auto wait = std::chrono::milliseconds { 1000 };
+                if (handles[1] == nullptr) {
+                    wait = std::min(wait, std::max(
+                        std::chrono::milliseconds { 0 },
+                        std::chrono::duration_cast<std::chrono::milliseconds>(
+                            hedge_time - std::chrono::steady_clock::now())));
+                }
+#if LIBCURL_VERSION_NUM >= 0x074200
+                curl_multi_poll(hedge_multi_, nullptr, 0,
+                                static_cast<int>(wait.count()), nullptr);
+#else
+                curl_multi_wait(hedge_multi_, nullptr, 0,
+                                static_cast<int>(wait.count()), nullptr);
+#endif
+            }
+        }
+
+        curl_multi_remove_handle(hedge_multi_, curl);
+        if (handles[1] != nullptr) {
+            curl_multi_remove_handle(hedge_multi_, handles[1]);
+            // NB: kept until the next query, as the source of its
+            // stats and response code
+            hedge_curl_ = handles[1];
+        }
+        if (result == 1) {
+            response_headers = hedge_headers;
+            done_curl = handles[1];
+        }
+        return codes[result];
+    }
+
+    // Configures the transfer of an asynchronous query and passes it to
+    // the engine
+    void startTransfer(Query& query,
+                       std::unique_ptr<MultiEngine::Transfer> transfer) {
+        arena_.reset();
+        if (!engine_) {
+            engine_.reset(new MultiEngine { max_concurrent_transfers_,
+                                            multiplexing_, throttle_ });
+        }
+
+        transfer->curl = engine_->acquireHandle();
+
+        bool post { isPosted(query) };
+        std::string key {};
+        try {
+            if (post) {
+                transfer->url = getEndpointUrl(query);
+                appendQueryBody(transfer->request_body, query);
+                key = getPostKey(transfer->url, transfer->request_body);
+            } else {
+                transfer->url = getQueryUrl(query, transfer->curl);
+                key = transfer->url;
+            }
+        } catch (...) {
+            curl_easy_cleanup(transfer->curl);
+            throw;
+        }
+
+        std::shared_ptr<const ResponseCache::Entry> cached {};
+        if (cache_ && cache_->isCached(query.getEndpoint())) {
+            cached = cache_->lookup(key);
+            if (cached && cached->isFresh()) {
+                engine_->recycleHandle(transfer->curl);
+                report(getDeliveredStats(transfer->url, query, cached->body,
+                                         true),
+                       post ? &transfer->request_body : nullptr);
+                transfer->promise.set_value(cached->body);
+                MultiEngine::settle(*transfer);
+                return;
+            }
+            std::shared_ptr<ResponseCache> cache { cache_ };
+            std::string endpoint { query.getEndpoint() };
+            transfer->on_complete =
+                [cache, cached, endpoint, key](CURL* curl,
+                                               MultiEngine::Transfer& done) {
+                    long response_code { 0 };
+                    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE,
+                                      &response_code);
+                    if (response_code == 304 && cached) {
+                        done.result_buffer = cached->body;
+                        done.revalidated = true;
+                        cache->refresh(cached, endpoint);
+                    } else if (response_code == 200) {
+                        cache->store(key, endpoint, done.result_buffer,
+                                     done.response_headers.etag,
+                                     done.response_headers.last_modified);
+                    }
+                };
+        }
+
+        setTransferOptions(transfer->curl, transfer->url,
+                           QueryResult::callback, &transfer->result_buffer,
+                           &transfer->response_headers);
+        transfer->compression_counters = &compression_counters_;
+        transfer->endpoint = query.getEndpoint();
+        transfer->metrics = metrics_;
+        transfer->trace = trace_;
+        transfer->priority = query.getPriority();
+        if (share_) {
+            curl_easy_setopt(transfer->curl, CURLOPT_SHARE, share_->get());
+        }
+        if (post) {
+            setPostOptions(transfer->curl, transfer->request_body);
+        }
+        transfer->request_headers = getRequestHeaders(cached, post,
+                                                      transfer->arena);
+        if (transfer->request_headers != nullptr) {
+            curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER,
+                             transfer->request_headers);
+        }
+        if (multiplexing_) {
+            setMultiplexingOptions(transfer->curl);
+        }
+
+        engine_->submit(std::move(transfer));
+    }
+
+    // Returns the stats of a query whose result was delivered without
+    // a transfer
+    static QueryStats getDeliveredStats(const std::string& url, Query& query,
+                                        const std::string& result,
+                                        bool from_cache) {
+        QueryStats stats {};
+        stats.url = url;
+        stats.endpoint = query.getEndpoint();
+        stats.result_bytes = result.size();
+        stats.from_cache = from_cache;
+        stats.coalesced = !from_cache;
+        return stats;
+    }
+
+    void setDeliveredStats(Query& query, const std::string& result,
+                           bool from_cache,
+                           const std::string* request_body) {
+        last_query_stats_ = getDeliveredStats(performed_query_url_, query,
+                                              result, from_cache);
+        report(last_query_stats_, request_body);
+    }
+
+    // Passes the stats to the query observer, the metrics, and the
+    // trace recorder (with the body of a POSTed query)
+    void report(const QueryStats& stats,
+                const std::string* request_body = nullptr) {
+        notifyQueryObserver(stats);
+        if (metrics_) {
+            metrics_->record(stats);
+        }
+        if (trace_) {
+            trace_->record(stats, request_body);
+        }
+    }
+
+    // Passes a cached result to the write callback
+    static void deliver(const std::string& body, WriteCallback write_callback,
+                        void* write_data) {
+        if (body.empty()) {
+            return;
+        }
+        if (write_callback(const_cast<char*>(body.data()), 1, body.size(),
+                           write_data) != body.size()) {
+            throw processing_error { "failed to write the query result" };
+        }
+    }
+
+    // Returns the headers of the request (a POST one, or a conditional
+    // one revalidating the cached entry), or nullptr
+    static curl_slist* getRequestHeaders(
+            const std::shared_ptr<const ResponseCache::Entry>& cached,
+            bool post, Arena& arena) {
+        ArenaHeaderList headers { arena };
+        if (post) {
+            headers.append("Content-Type", "application/json");
+            // NB: an empty value removes the header; the body is sent
+            // without waiting for a 100-continue response
+            headers.append("Expect", "");
+        }
+        if (cached && !cached->etag.empty()) {
+            headers.append("If-None-Match", cached->etag);
+        }
+        if (cached && !cached->last_modified.empty()) {
+            headers.append("If-Modified-Since", cached->last_modified);
+        }
+        return headers.get();
+    }
+
+    // Configures the libcurl handle to fetch the URL through the write
+    // callback; the URL and the write data must outlive the transfer
+    void setTransferOptions(CURL* curl, const std::string& url,
+                            WriteCallback write_callback,
+                            void* write_data,
+                            QueryResult::ResponseHeaders* response_headers) {
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, write_data);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION,
+                         QueryResult::headerCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, response_headers);
+        setConnectionOptions(curl);
+
+        if (isSecure()) {
+            setSSLOptions(curl);
+        }
+    }
+
+    // Makes the transfer POST the body, straight from the buffer (not
+    // copied by libcurl); the body must outlive the transfer
+    static void setPostOptions(CURL* curl, const std::string& body) {
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                         static_cast<curl_off_t>(body.size()));
+    }
+
+    void setConnectionOptions(CURL* curl) {
+#if LIBCURL_VERSION_NUM >= 0x071900
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+        if (connect_timeout_.count() > 0) {
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                             static_cast<long>(connect_timeout_.count()));
+        }
+        if (timeout_.count() > 0) {
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS,
+                             static_cast<long>(timeout_.count()));
+        }
+        if (compression_) {
+            // An empty string accepts all the supported encodings
+#if LIBCURL_VERSION_NUM >= 0x071506
+            curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+#else
+            curl_easy_setopt(curl, CURLOPT_ENCODING, "");
+#endif
+        }
+    }
+
+    void setMultiplexingOptions(CURL* curl) {
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+        // Wait for a connection that can be multiplexed rather than
+        // opening a new one
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+    }
+
+    // The certificates are passed from memory if the SSL backend
+    // supports it, rather than read from their files by each TLS
+    // handshake
     void setSSLOptions(CURL* curl) {
+#if LIBCURL_VERSION_NUM >= 0x074700
+        setCertificateOption(curl, CURLOPT_SSLCERT_BLOB, CURLOPT_SSLCERT,
+                             certificates_->client_crt, client_crt_path_);
+        setCertificateOption(curl, CURLOPT_SSLKEY_BLOB, CURLOPT_SSLKEY,
+                             certificates_->client_key, client_key_path_);
+#else
         curl_easy_setopt(curl, CURLOPT_SSLCERT, client_crt_path_.c_str());
         curl_easy_setopt(curl, CURLOPT_SSLKEY, client_key_path_.c_str());
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074d00
+        // NB: the blob replaces the default CA bundle, as the file did
+        if (setCertificateOption(curl, CURLOPT_CAINFO_BLOB, CURLOPT_CAINFO,
+                                 certificates_->ca_crt, ca_crt_path_)) {
+            curl_easy_setopt(curl, CURLOPT_CAINFO, nullptr);
+        }
+#else
         curl_easy_setopt(curl, CURLOPT_CAINFO, ca_crt_path_.c_str());
+#endif
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x074700
+    // Sets the blob option, or the file one if the blob is not
+    // supported; returns true if the blob was set. The content is not
+    // copied, and must outlive the handle options.
+    static bool setCertificateOption(CURL* curl, CURLoption blob_option,
+                                     CURLoption file_option,
+                                     const std::string& content,
+                                     const std::string& path) {
+        curl_blob blob {};
+        blob.data = const_cast<char*>(content.data());
+        blob.len = content.size();
+        blob.flags = CURL_BLOB_NOCOPY;
+        if (curl_easy_setopt(curl, blob_option, &blob) == CURLE_OK) {
+            return true;
+        }
+        curl_easy_setopt(curl, file_option, path.c_str());
+        return false;
+    }
+#endif
+};
+
+//
+// QueryPager
+//
+
+// Iterates over the pages of the results of a query. While the caller
+// processes a full page, the next one is fetched in the background by
+// an asynchronous query of the connector. The iteration ends after the
+// first page with fewer records than the page size. The offset of the
+// query is the offset of the first page, and its limit, if any, the
+// total number of records (the last page is shrunk to fit); the query
+// should specify a sort order (see Query::setOrderBy).
+class QueryPager {
+  public:
+    QueryPager() = delete;
+
+    /// Throws a query_error in case the page size is zero
+    QueryPager(PuppetdbConnector& connector, Query query, size_t page_size)
+            : connector_ ( connector ),
+              query_ { std::move(query) },
+              page_size_ { page_size },
+              next_offset_ { query_.getOffset() },
+              num_left_ { query_.getLimit() > 0 ? query_.getLimit()
+                                                : SIZE_MAX },
+              next_limit_ { 0 },
+              num_pages_ { 0 },
+              done_ { false },
+              next_page_ {} {
+        if (page_size_ == 0) {
+            throw query_error { "the page size must be positive" };
+        }
+    }
+
+    /// Gets the next page of results (json format); returns false
+    /// if there are no more results
+    /// Throws a processing_error in case of failure
+    bool next(std::string& page) {
+        if (done_) {
+            return false;
+        }
+        if (!next_page_.valid()) {
+            next_page_ = fetchNext();
+        }
+
+        std::future<std::string> current_page { std::move(next_page_) };
+        size_t page_limit { next_limit_ };
+        try {
+            page = current_page.get();
+        } catch (...) {
+            done_ = true;
+            throw;
+        }
+
+        // Prefetch the following page only if this one is full and the
+        // limit of the query is not reached
+        if (countRecords(page, page_limit) < page_limit || num_left_ == 0) {
+            done_ = true;
+        } else {
+            next_page_ = fetchNext();
+        }
+
+        if (isEmptyResult(page)) {
+            return false;
+        }
+        num_pages_++;
+        return true;
+    }
+
+    /// Returns the number of pages returned so far
+    size_t getNumPages() const {
+        return num_pages_;
+    }
+
+    /// Returns true if the result (json format) is an empty array
+    static bool isEmptyResult(const std::string& result) {
+        for (char c : result) {
+            if (c != '[' && c != ']' && c != ' ' && c != '\n' && c != '\r'
+                    && c != '\t') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Returns the number of records of the result (json array),
+    /// counting up to max_records at most
+    static size_t countRecords(const std::string& result,
+                               size_t max_records = SIZE_MAX) {
+        size_t num_records { 0 };
+        size_t depth { 0 };
+        bool in_string { false };
+        bool escaped { false };
+        bool before_record { false };
+        for (char c : result) {
+            if (in_string) {
+                if (escaped) {
+                    escaped = false;
+                } else if (c == '\\') {
+                    escaped = true;
+                } else if (c == '"') {
+                    in_string = false;
+                }
+                continue;
+            }
+            if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+                continue;
+            }
+            if (depth == 1) {
+                if (c == ',') {
+                    before_record = true;
+                    continue;
+                }
+                if (before_record && c != ']') {
+                    before_record = false;
+                    if (++num_records >= max_records) {
+                        return num_records;
+                    }
+                }
+            }
+            switch (c) {
+                case '"':
+                    in_string = true;
+                    break;
+                case '[':
+                case '{':
+                    before_record = ++depth == 1;
+                    break;
+                case ']':
+                case '}':
+                    if (depth > 0) {
+                        depth--;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        return num_records;
+    }
+
+  private:
+    PuppetdbConnector& connector_;
+    Query query_;
+    size_t page_size_;
+    size_t next_offset_;
+    // Records left to fetch (SIZE_MAX without limit), and limit of the
+    // page being fetched
+    size_t num_left_;
+    size_t next_limit_;
+    size_t num_pages_;
+    bool done_;
+    std::future<std::string> next_page_;
+
+    std::future<std::string> fetchNext() {
+        next_limit_ = std::min(page_size_, num_left_);
+        if (num_left_ != SIZE_MAX) {
+            num_left_ -= next_limit_;
+        }
+        Query page_query { query_ };
+        page_query.setLimit(next_limit_);
+        page_query.setOffset(next_offset_);
+        next_offset_ += next_limit_;
+        return connector_.submit(page_query);
+    }
+};
+
+//
+// PuppetdbConnectorPool
+//
+
+// Bounded pool of connectors for multi-threaded callers. Each thread
+// leases a connector for the duration of its queries, so that the
+// connector state (e.g. the performed query URL) is not shared; the
+// connection, DNS, and SSL session caches are shared by all the
+// connectors of the pool. Leasing a connector does not take a lock
+// unless all the connectors are in use.
+class PuppetdbConnectorPool {
+  public:
+    using ConnectorFactory = std::function<std::unique_ptr<PuppetdbConnector>()>;
+
+    // Connector leased from a pool; it is returned to the pool when
+    // the Lease is destroyed
+    class Lease {
+      public:
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        Lease(Lease&& other)
+                : pool_ { other.pool_ },
+                  slot_ { other.slot_ } {
+            other.pool_ = nullptr;
+        }
+
+        ~Lease() {
+            if (pool_ != nullptr) {
+                pool_->release(slot_);
+            }
+        }
+
+        PuppetdbConnector& operator*() const {
+            return *pool_->connectors_[slot_];
+        }
+
+        PuppetdbConnector* operator->() const {
+            return pool_->connectors_[slot_].get();
+        }
+
+      private:
+        friend class PuppetdbConnectorPool;
+
+        PuppetdbConnectorPool* pool_;
+        size_t slot_;
+
+        Lease(PuppetdbConnectorPool* pool, size_t slot)
+                : pool_ { pool },
+                  slot_ { slot } {
+        }
+    };
+
+    PuppetdbConnectorPool() = delete;
+    PuppetdbConnectorPool(const PuppetdbConnectorPool&) = delete;
+    PuppetdbConnectorPool& operator=(const PuppetdbConnectorPool&) = delete;
+
+    /// Creates a pool of copies of the specified connector
+    /// Throws a connector_error in case the size is zero or libcurl
+    /// fails to create the shared caches
+    PuppetdbConnectorPool(const PuppetdbConnector& prototype, size_t size)
+            : PuppetdbConnectorPool(
+                [prototype]() {
+                    return std::unique_ptr<PuppetdbConnector> {
+                        new PuppetdbConnector { prototype } };
+                }, size) {
+    }
+
+    /// Creates a pool of connectors obtained by the factory
+    /// Throws a connector_error in case the size is zero, the factory
+    /// returns nullptr, or libcurl fails to create the shared caches
+    PuppetdbConnectorPool(ConnectorFactory factory, size_t size)
+            : share_ { std::make_shared<CurlShare>() },
+              connectors_ {},
+              in_use_ { new std::atomic<bool>[size] },
+              waiters_ { 0 } {
+        if (size == 0) {
+            throw connector_error { "the pool size must be positive" };
+        }
+        for (size_t idx = 0; idx < size; idx++) {
+            auto connector = factory();
+            if (!connector) {
+                throw connector_error { "failed to create a pool connector" };
+            }
+            connector->setShare(share_);
+            connectors_.push_back(std::move(connector));
+            in_use_[idx] = false;
+        }
+    }
+
+    /// NB: all the leases must be returned before
+    ~PuppetdbConnectorPool() {
+        // Close the handles before the share is released
+        connectors_.clear();
+    }
+
+    size_t size() const {
+        return connectors_.size();
+    }
+
+    /// Leases a connector, waiting for one to be returned in case
+    /// all are in use
+    Lease acquire() {
+        size_t slot {};
+        if (tryClaim(slot)) {
+            return Lease { this, slot };
+        }
+
+        std::unique_lock<std::mutex> lock { mutex_ };
+        waiters_++;
+        available_.wait(lock, [this, &slot]() { return tryClaim(slot); });
+        waiters_--;
+        return Lease { this, slot };
+    }
+
+    /// Performs the query on a leased connector
+    /// Throws a processing_error in case of failure
+    std::string performQuery(Query& query) {
+        Lease lease { acquire() };
+        return lease->performQuery(query);
+    }
+
+    /// Sets the results cache of all the connectors
+    /// NB: all the connectors must be returned to the pool
+    void setResponseCache(std::shared_ptr<ResponseCache> cache) {
+        for (auto& connector : connectors_) {
+            connector->setResponseCache(cache);
+        }
+    }
+
+    /// Makes the connectors coalesce identical queries performed at
+    /// the same time (nullptr disables coalescing)
+    /// NB: all the connectors must be returned to the pool
+    void setSingleFlight(std::shared_ptr<SingleFlight> single_flight) {
+        for (auto& connector : connectors_) {
+            connector->setSingleFlight(single_flight);
+        }
+    }
+
+    /// Makes the connectors record their queries in the metrics
+    /// (nullptr disables them)
+    /// NB: all the connectors must be returned to the pool
+    void setQueryMetrics(std::shared_ptr<QueryMetrics> metrics) {
+        for (auto& connector : connectors_) {
+            connector->setQueryMetrics(metrics);
+        }
+    }
+
+    /// Makes the connectors record their queries in the trace recorder
+    /// (nullptr disables tracing)
+    /// NB: all the connectors must be returned to the pool
+    void setTraceRecorder(std::shared_ptr<TraceRecorder> trace) {
+        for (auto& connector : connectors_) {
+            connector->setTraceRecorder(trace);
+        }
+    }
+
+    /// Makes the queries of all the connectors wait for the permits
+    /// of the throttle (nullptr disables throttling)
+    /// NB: all the connectors must be returned to the pool
+    void setThrottle(std::shared_ptr<Throttle> throttle) {
+        for (auto& connector : connectors_) {
+            connector->setThrottle(throttle);
+        }
+    }
+
+  private:
+    std::shared_ptr<CurlShare> share_;
+    std::vector<std::unique_ptr<PuppetdbConnector>> connectors_;
+    std::unique_ptr<std::atomic<bool>[]> in_use_;
+
+    // Used only when all the connectors are in use
+    std::mutex mutex_;
+    std::condition_variable available_;
+    std::atomic<size_t> waiters_;
+
+    // Claims a free slot, starting the scan from a per-thread hint so
+    // that threads tend to spread over (and keep) different slots
+    bool tryClaim(size_t& slot) {
+        size_t size { connectors_.size() };
+        size_t start { std::hash<std::thread::id> {}(std::this_thread::get_id())
+                       % size };
+        for (size_t idx = 0; idx < size; idx++) {
+            size_t candidate { (start + idx) % size };
+            bool expected { false };
+            if (!in_use_[candidate].load()
+                    && in_use_[candidate].compare_exchange_strong(expected,
+                                                                  true)) {
+                slot = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void release(size_t slot) {
+        in_use_[slot].store(false);
+        if (waiters_.load() > 0) {
+            // Lock to avoid waking up a waiter before it waits
+            std::lock_guard<std::mutex> lock { mutex_ };
+            available_.notify_one();
+        }
+    }
+};
+
+//
+// PuppetdbCluster
+//
+
+// How a PuppetdbCluster picks the replica of a query: the one with the
+// fewest queries in progress, or the better of two random replicas by
+// latency (EWMA) times queries in progress ("power of two choices")
+enum class BalancingStrategy { LeastOutstanding, EwmaLatency };
+
+// Number of latencies of a replica before it can be ejected as slow
+static const uint64_t CLUSTER_SLOW_MIN_SAMPLES { 10 };
+
+struct ClusterPolicy {
+    BalancingStrategy strategy;
+    // Connectors of each replica, i.e. its concurrent queries
+    size_t connectors_per_replica;
+    // Replicas tried by a query in case of transfer failure or 5xx
+    // response
+    size_t max_attempts;
+    // Consecutive failures (queries or probes) ejecting a replica
+    size_t max_failures;
+    // A replica whose latency exceeds slow_factor times the lowest
+    // latency of the others is ejected (0 disables it)
+    double slow_factor;
+    // Time before an ejected replica is probed again
+    std::chrono::milliseconds ejection_time;
+    // Interval of the health probes (0 disables them), and their
+    // deadline
+    std::chrono::milliseconds probe_interval;
+    std::chrono::milliseconds probe_timeout;
+
+    ClusterPolicy()
+            : strategy { BalancingStrategy::EwmaLatency },
+              connectors_per_replica { 4 },
+              max_attempts { 2 },
+              max_failures { 3 },
+              slow_factor { 5 },
+              ejection_time { 10000 },
+              probe_interval { 1000 },
+              probe_timeout { 1000 } {
+    }
+};
+
+// Spreads the queries over several PuppetDB replicas, each served by a
+// PuppetdbConnectorPool, so that it can be used by multiple threads.
+// Replicas that keep failing, or that are much slower than the others,
+// are ejected: they get no queries until a health probe, run in the
+// background by the cluster, succeeds after the ejection time. The
+// last healthy replica is never ejected.
+class PuppetdbCluster {
+  public:
+    struct ReplicaStatus {
+        std::string hostname;
+        int port;
+        bool healthy;
+        size_t outstanding;
+        // EWMA of the latencies of the transfers
+        std::chrono::microseconds latency;
+        uint64_t requests;
+        uint64_t failures;
+    };
+
+    PuppetdbCluster() = delete;
+    PuppetdbCluster(const PuppetdbCluster&) = delete;
+    PuppetdbCluster& operator=(const PuppetdbCluster&) = delete;
+
+    /// Creates a cluster of the replicas, each one specified by a
+    /// connector whose copies will perform its queries
+    /// Throws a connector_error in case there are no replicas or the
+    /// pools cannot be created
+    PuppetdbCluster(const std::vector<PuppetdbConnector>& replicas,
+                    ClusterPolicy policy = ClusterPolicy {})
+            : policy_ { policy },
+              replicas_ {},
+              next_replica_ { 0 },
+              health_mutex_ {},
+              probe_query_ { "version" },
+              stopping_ { false } {
+        if (replicas.empty()) {
+            throw connector_error { "no replicas specified" };
+        }
+        for (const auto& replica : replicas) {
+            replicas_.emplace_back(new Replica {
+                replica, policy_.connectors_per_replica,
+                policy_.probe_timeout });
+        }
+        if (policy_.probe_interval.count() > 0) {
+            probe_thread_ = std::thread { &PuppetdbCluster::probeLoop, this };
+        }
+    }
+
+    ~PuppetdbCluster() {
+        {
+            std::lock_guard<std::mutex> lock { probe_mutex_ };
+            stopping_ = true;
+        }
+        probe_wakeup_.notify_all();
+        if (probe_thread_.joinable()) {
+            probe_thread_.join();
+        }
+    }
+
+    size_t size() const {
+        return replicas_.size();
+    }
+
+    /// Performs the query on a replica, and on another one in case of
+    /// transfer failure or 5xx response (up to max_attempts); returns
+    /// the result of the last attempt
+    /// Throws a processing_error in case all the attempts fail
+    std::string performQuery(Query& query) {
+        std::string result {};
+        performQuery(query, result);
+        return result;
+    }
+
+    /// Stores the result in the buffer, as
+    /// PuppetdbConnector::performQuery does
+    void performQuery(Query& query, std::string& result_buffer) {
+        std::vector<bool> tried(replicas_.size(), false);
+        std::exception_ptr error {};
+        size_t num_attempts { std::min(std::max<size_t>(policy_.max_attempts,
+                                                        1),
+                                       replicas_.size()) };
+
+        for (size_t attempt = 0; attempt < num_attempts; attempt++) {
+            size_t index { select(tried) };
+            tried[index] = true;
+            Replica& replica = *replicas_[index];
+            replica.requests++;
+
+            QueryStats stats {};
+            bool failed { false };
+            {
+                OutstandingGuard guard { replica.outstanding };
+                try {
+                    PuppetdbConnectorPool::Lease lease {
+                        replica.pool.acquire() };
+                    lease->performQuery(query, result_buffer);
+                    stats = lease->getLastQueryStats();
+                } catch (const processing_error&) {
+                    error = std::current_exception();
+                    failed = true;
+                }
+            }
+
+            if (!failed && stats.response_code < 500) {
+                onSuccess(index, stats);
+                return;
+            }
+            if (!failed) {
+                error = nullptr;
+            }
+            onFailure(index);
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    /// Sets the query of the health probes ("version" by default);
+    /// a replica is healthy if the query succeeds without a 5xx
+    /// response
+    void setHealthProbe(Query query) {
+        std::lock_guard<std::mutex> lock { probe_mutex_ };
+        probe_query_ = std::move(query);
+    }
+
+    std::vector<ReplicaStatus> getStatus() const {
+        std::vector<ReplicaStatus> status {};
+        for (const auto& replica : replicas_) {
+            status.push_back(ReplicaStatus {
+                replica->hostname, replica->port, !replica->ejected,
+                replica->outstanding,
+                std::chrono::microseconds { replica->latency.load() },
+                replica->requests, replica->failures });
+        }
+        return status;
+    }
+
+    /// Sets the results cache of all the replicas
+    /// NB: no query must be in progress
+    void setResponseCache(std::shared_ptr<ResponseCache> cache) {
+        for (auto& replica : replicas_) {
+            replica->pool.setResponseCache(cache);
+        }
+    }
+
+    /// Makes the replicas record their queries in the metrics
+    /// NB: no query must be in progress
+    void setQueryMetrics(std::shared_ptr<QueryMetrics> metrics) {
+        for (auto& replica : replicas_) {
+            replica->pool.setQueryMetrics(metrics);
+        }
+    }
+
+    /// Makes the replicas record their queries in the trace recorder
+    /// NB: no query must be in progress
+    void setTraceRecorder(std::shared_ptr<TraceRecorder> trace) {
+        for (auto& replica : replicas_) {
+            replica->pool.setTraceRecorder(trace);
+        }
+    }
+
+  private:
+    struct Replica {
+        std::string hostname;
+        int port;
+        PuppetdbConnectorPool pool;
+        // Used by the probe thread only
+        PuppetdbConnector probe_connector;
+
+        std::atomic<size_t> outstanding;
+        std::atomic<int64_t> latency;
+        std::atomic<uint64_t> num_samples;
+        std::atomic<uint64_t> requests;
+        std::atomic<uint64_t> failures;
+        std::atomic<size_t> consecutive_failures;
+        std::atomic<bool> ejected;
+        // Updated under the health mutex
+        std::chrono::steady_clock::time_point ejected_until;
+
+        Replica(const PuppetdbConnector& prototype, size_t num_connectors,
+                std::chrono::milliseconds probe_timeout)
+                : hostname { prototype.getHostname() },
+                  port { prototype.getPort() },
+                  pool { prototype, num_connectors },
+                  probe_connector { prototype },
+                  outstanding { 0 },
+                  latency { 0 },
+                  num_samples { 0 },
+                  requests { 0 },
+                  failures { 0 },
+                  consecutive_failures { 0 },
+                  ejected { false },
+                  ejected_until {} {
+            // The probes are neither retried, cached, nor throttled
+            // (their timeouts would reduce the concurrency limit), and
+            // are not part of the metrics or of the traces
+            probe_connector.setTimeouts(probe_timeout, probe_timeout);
+            probe_connector.setRetryPolicy(RetryPolicy {});
+            probe_connector.setHedgingPolicy(HedgingPolicy {});
+            probe_connector.setResponseCache(nullptr);
+            probe_connector.setSingleFlight(nullptr);
+            probe_connector.setQueryMetrics(nullptr);
+            probe_connector.setThrottle(nullptr);
+            probe_connector.setTraceRecorder(nullptr);
+        }
+    };
+
+    struct OutstandingGuard {
+        std::atomic<size_t>& outstanding;
+
+        explicit OutstandingGuard(std::atomic<size_t>& count)
+                : outstanding ( count ) {
+            outstanding++;
+        }
+
+        ~OutstandingGuard() {
+            outstanding--;
+        }
+    };
+
+    ClusterPolicy policy_;
+    std::vector<std::unique_ptr<Replica>> replicas_;
+    std::atomic<size_t> next_replica_;
+    std::mutex health_mutex_;
+
+    // Health probes
+    std::mutex probe_mutex_;
+    std::condition_variable probe_wakeup_;
+    Query probe_query_;
+    bool stopping_;
+    std::thread probe_thread_;
+
+    // Returns the replica of the next attempt: a healthy one that was
+    // not tried yet, if any, or else any one not tried yet
+    size_t select(const std::vector<bool>& tried) {
+        std::vector<size_t> candidates {};
+        for (size_t index = 0; index < replicas_.size(); index++) {
+            if (!tried[index] && !replicas_[index]->ejected) {
+                candidates.push_back(index);
+            }
+        }
+        if (candidates.empty()) {
+            for (size_t index = 0; index < replicas_.size(); index++) {
+                if (!tried[index]) {
+                    candidates.push_back(index);
+                }
+            }
+        }
+        if (candidates.size() == 1) {
+            return candidates[0];
+        }
+
+        if (policy_.strategy == BalancingStrategy::LeastOutstanding) {
+            // Ties are broken in turn
+            size_t start { next_replica_++ % candidates.size() };
+            size_t best { candidates[start] };
+            for (size_t idx = 1; idx < candidates.size(); idx++) {
+                size_t index { candidates[(start + idx) % candidates.size()] };
+                if (replicas_[index]->outstanding
+                        < replicas_[best]->outstanding) {
+                    best = index;
+                }
+            }
+            return best;
+        }
+
+        static thread_local std::minstd_rand generator {
+            std::random_device {}() };
+        std::uniform_int_distribution<size_t> distribution {
+            0, candidates.size() - 1 };
+        size_t first { candidates[distribution(generator)] };
+        size_t second { first };
+        while (second == first) {
+            second = candidates[distribution(generator)];
+        }
+        return getScore(second) < getScore(first) ? second : first;
+    }
+
+    double getScore(size_t index) const {
+        const Replica& replica = *replicas_[index];
+        return static_cast<double>(replica.latency.load() + 1)
+               * static_cast<double>(replica.outstanding.load() + 1);
+    }
+
+    void onSuccess(size_t index, const QueryStats& stats) {
+        Replica& replica = *replicas_[index];
+        replica.consecutive_failures = 0;
+        if (stats.from_cache || stats.coalesced) {
+            return;
+        }
+
+        // EWMA with a weight of 1/5 for the new latency
+        int64_t sample { stats.total_time.count() };
+        int64_t latency { replica.latency.load() };
+        while (!replica.latency.compare_exchange_weak(
+                latency, latency == 0 ? sample
+                                      : latency + (sample - latency) / 5)) {
+        }
+        replica.num_samples++;
+
+        if (policy_.slow_factor > 0 && isSlow(index)) {
+            eject(index);
+        }
+    }
+
+    bool isSlow(size_t index) const {
+        const Replica& replica = *replicas_[index];
+        if (replica.num_samples < CLUSTER_SLOW_MIN_SAMPLES) {
+            return false;
+        }
+        int64_t lowest { 0 };
+        for (size_t other = 0; other < replicas_.size(); other++) {
+            const Replica& candidate = *replicas_[other];
+            if (other == index || candidate.ejected
+                    || candidate.num_samples < CLUSTER_SLOW_MIN_SAMPLES) {
+                continue;
+            }
+            int64_t latency { candidate.latency.load() };
+            if (lowest == 0 || latency < lowest) {
+                lowest = latency;
+            }
+        }
+        return lowest > 0 && static_cast<double>(replica.latency.load())
+                             > policy_.slow_factor
+                               * static_cast<double>(lowest);
+    }
+
+    void onFailure(size_t index) {
+        Replica& replica = *replicas_[index];
+        replica.failures++;
+        if (++replica.consecutive_failures >= policy_.max_failures) {
+            eject(index);
+        }
+    }
+
+    void eject(size_t index) {
+        std::lock_guard<std::mutex> lock { health_mutex_ };
+        Replica& replica = *replicas_[index];
+        if (replica.ejected) {
+            return;
+        }
+        size_t num_healthy { 0 };
+        for (const auto& other : replicas_) {
+            if (!other->ejected) {
+                num_healthy++;
+            }
+        }
+        if (num_healthy <= 1) {
+            return;
+        }
+        replica.ejected_until = std::chrono::steady_clock::now()
+                                + policy_.ejection_time;
+        replica.ejected = true;
+    }
+
+    // Probes the replicas (the ejected ones once their ejection time
+    // is over), until the cluster is destroyed
+    void probeLoop() {
+        std::unique_lock<std::mutex> lock { probe_mutex_ };
+        while (!probe_wakeup_.wait_for(lock, policy_.probe_interval,
+                                       [this]() { return stopping_; })) {
+            Query query { probe_query_ };
+            lock.unlock();
+            for (size_t index = 0; index < replicas_.size(); index++) {
+                probe(index, query);
+            }
+            lock.lock();
+        }
+    }
+
+    void probe(size_t index, Query& query) {
+        Replica& replica = *replicas_[index];
+        bool ejected { replica.ejected };
+        if (ejected) {
+            std::lock_guard<std::mutex> lock { health_mutex_ };
+            if (std::chrono::steady_clock::now() < replica.ejected_until) {
+                return;
+            }
+        }
+
+        bool healthy { true };
+        try {
+            replica.probe_connector.performQuery(query);
+            healthy = replica.probe_connector.getLastQueryStats()
+                          .response_code < 500;
+        } catch (const processing_error&) {
+            healthy = false;
+        }
+
+        if (!ejected) {
+            if (healthy) {
+                replica.consecutive_failures = 0;
+            } else {
+                onFailure(index);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock { health_mutex_ };
+        if (healthy) {
+            // Its latency is measured again
+            replica.consecutive_failures = 0;
+            replica.num_samples = 0;
+            replica.latency = 0;
+            replica.ejected = false;
+        } else {
+            replica.ejected_until = std::chrono::steady_clock::now()
+                                    + policy_.ejection_time;
+        }
     }
 };
 
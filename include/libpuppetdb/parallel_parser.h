@@ -0,0 +1,443 @@
+#ifndef LIBPUPPETDB_INCLUDE_PUPPETDB_PARALLEL_PARSER_H_
+#define LIBPUPPETDB_INCLUDE_PUPPETDB_PARALLEL_PARSER_H_
+
+/*
+ *                        libpuppetdb - parallel parser
+ *
+ * Optional pipelined parser, for results too large to be parsed by
+ * the thread that receives them (e.g. a full export of the resources
+ * of a fleet). The pipeline has three stages:
+ *  - the sink, called by libcurl on the thread performing the query,
+ *    only copies each chunk into a lock-free ring;
+ *  - a splitter thread splits the chunks into records (RecordSplitter)
+ *    and groups them by batches;
+ *  - worker threads parse the batches (parseJson) in parallel and
+ *    call the record callback.
+ * Both queues are bounded; when the workers fall behind, the sink
+ * waits for room in the ring, which stops the reads from the socket
+ * until the workers catch up.
+ *
+ * The callback is called concurrently by the workers, and the records
+ * are not passed in the order of the result.
+ *
+ */
+
+#include "libpuppetdb.h"
+#include "result_parser.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace LibPuppetdb {
+
+// Consumer of a parsed record, called concurrently by the workers of
+// a ParallelResultParser; worker is the index of the calling worker,
+// e.g. to accumulate per-worker results without locking. The record
+// is valid only for the duration of the call.
+using ParallelRecordCallback =
+    std::function<void(const JsonValue& record, size_t worker)>;
+
+// Default number of result chunks buffered between the query thread
+// and the splitter (libcurl passes chunks of up to 16KiB)
+static const size_t PARALLEL_RING_SIZE_DEFAULT { 256 };
+
+// Default number of records per batch passed to a worker
+static const size_t PARALLEL_BATCH_SIZE_DEFAULT { 256 };
+
+//
+// ChunkRing
+//
+
+// Bounded single-producer, single-consumer ring of chunks. The
+// producer and the consumer only synchronize through the head and
+// tail indexes, except to sleep when the ring is full or empty. The
+// slots keep their capacity, so that the chunks are not allocated.
+class ChunkRing {
+  public:
+    explicit ChunkRing(size_t capacity)
+            : slots_(std::max<size_t>(capacity, 1)),
+              head_ { 0 },
+              tail_ { 0 },
+              closed_ { false },
+              num_waiters_ { 0 },
+              mutex_ {},
+              wakeup_ {} {
+    }
+
+    ChunkRing(const ChunkRing&) = delete;
+    ChunkRing& operator=(const ChunkRing&) = delete;
+
+    /// Copies the chunk in the ring, waiting for a free slot (producer)
+    /// Returns false if the ring was closed while waiting
+    bool push(const char* data, size_t size) {
+        size_t tail { tail_.load(std::memory_order_relaxed) };
+        if (!waitFor([&]() { return tail - head_.load() < slots_.size(); })) {
+            return false;
+        }
+        slots_[tail % slots_.size()].assign(data, size);
+        tail_.store(tail + 1);
+        wake();
+        return true;
+    }
+
+    /// Returns the oldest chunk, to be released with pop(), waiting
+    /// for one if required (consumer)
+    /// Returns nullptr once the ring is closed and empty
+    const std::string* front() {
+        size_t head { head_.load(std::memory_order_relaxed) };
+        if (!waitFor([&]() { return tail_.load() != head; })) {
+            return nullptr;
+        }
+        return &slots_[head % slots_.size()];
+    }
+
+    void pop() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1);
+        wake();
+    }
+
+    /// Ends the stream of chunks; the waiting threads are woken up
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            closed_ = true;
+        }
+        wakeup_.notify_all();
+    }
+
+  private:
+    // Number of checks before sleeping
+    static const int SPIN_COUNT { 64 };
+
+    std::vector<std::string> slots_;
+    std::atomic<size_t> head_;
+    std::atomic<size_t> tail_;
+    bool closed_;
+    // NB: the index updates and the waiter count are sequentially
+    // consistent, so that either the waiter sees the update or the
+    // updater sees the waiter
+    std::atomic<size_t> num_waiters_;
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+
+    template <typename Predicate>
+    bool waitFor(Predicate ready) {
+        for (int count = 0; count < SPIN_COUNT; count++) {
+            if (ready()) {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock { mutex_ };
+        num_waiters_.fetch_add(1);
+        while (!ready() && !closed_) {
+            wakeup_.wait(lock);
+        }
+        num_waiters_.fetch_sub(1);
+        return ready();
+    }
+
+    void wake() {
+        if (num_waiters_.load() > 0) {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            wakeup_.notify_all();
+        }
+    }
+};
+
+//
+// ParallelResultParser
+//
+
+class ParallelResultParser {
+  public:
+    ParallelResultParser() = delete;
+    ParallelResultParser(const ParallelResultParser&) = delete;
+    ParallelResultParser& operator=(const ParallelResultParser&) = delete;
+
+    /// Starts the splitter and the workers; by default, there is one
+    /// worker per core
+    explicit ParallelResultParser(
+            ParallelRecordCallback callback,
+            size_t num_workers = 0,
+            size_t ring_size = PARALLEL_RING_SIZE_DEFAULT,
+            size_t batch_size = PARALLEL_BATCH_SIZE_DEFAULT)
+            : callback_ { std::move(callback) },
+              batch_size_ { std::max<size_t>(batch_size, 1) },
+              ring_ { ring_size },
+              batches_ { 2 * getNumWorkers(num_workers) },
+              failed_ { false },
+              error_mutex_ {},
+              error_ {},
+              num_records_ { 0 },
+              splitter_thread_ {},
+              workers_ {} {
+        try {
+            splitter_thread_ = std::thread { [this]() { split(); } };
+            for (size_t index = 0; index < getNumWorkers(num_workers);
+                    index++) {
+                workers_.emplace_back([this, index]() { work(index); });
+            }
+        } catch (...) {
+            abort();
+            throw;
+        }
+    }
+
+    ~ParallelResultParser() {
+        abort();
+    }
+
+    /// Hands the chunk over to the splitter, waiting while the ring is
+    /// full
+    /// Rethrows the error of the pipeline, if any (a parsing_error in
+    /// case the result is malformed, or the error of the callback)
+    void feed(const char* data, size_t size) {
+        if (failed_ || !ring_.push(data, size) || failed_) {
+            rethrowError();
+        }
+    }
+
+    /// Returns a sink that feeds the parser, to be passed to
+    /// PuppetdbConnector::performQuery
+    ChunkSink sink() {
+        return [this](const char* data, size_t size) { feed(data, size); };
+    }
+
+    /// Waits for all the records to be parsed and returns their number
+    /// Rethrows the error of the pipeline, if any (a parsing_error in
+    /// case the result is malformed or truncated)
+    size_t finish() {
+        ring_.close();
+        join();
+        if (failed_) {
+            rethrowError();
+        }
+        return num_records_;
+    }
+
+    /// Stops the pipeline, dropping the pending chunks and batches
+    void abort() {
+        failed_ = true;
+        ring_.close();
+        batches_.close();
+        join();
+    }
+
+    size_t getNumWorkers() const {
+        return workers_.size();
+    }
+
+  private:
+    // Record texts stored back to back
+    struct RecordBatch {
+        std::string text;
+        std::vector<size_t> ends;
+
+        RecordBatch() : text {}, ends {} {}
+    };
+
+    // Bounded queue of batches; the consumed batches are recycled
+    class BatchQueue {
+      public:
+        explicit BatchQueue(size_t capacity)
+                : capacity_ { capacity },
+                  batches_ {},
+                  free_batches_ {},
+                  closed_ { false },
+                  mutex_ {},
+                  not_empty_ {},
+                  not_full_ {} {
+        }
+
+        /// Moves the batch in the queue, waiting while it is full, and
+        /// replaces it by an empty one
+        /// Returns false if the queue was closed
+        bool push(RecordBatch& batch) {
+            std::unique_lock<std::mutex> lock { mutex_ };
+            while (batches_.size() >= capacity_ && !closed_) {
+                not_full_.wait(lock);
+            }
+            if (closed_) {
+                return false;
+            }
+            batches_.push_back(std::move(batch));
+            if (free_batches_.empty()) {
+                batch = RecordBatch {};
+            } else {
+                batch = std::move(free_batches_.back());
+                free_batches_.pop_back();
+            }
+            batch.text.clear();
+            batch.ends.clear();
+            lock.unlock();
+            not_empty_.notify_one();
+            return true;
+        }
+
+        /// Recycles the batch and replaces it by the next one, waiting
+        /// while the queue is empty
+        /// Returns false once the queue is closed and empty
+        bool pop(RecordBatch& batch) {
+            std::unique_lock<std::mutex> lock { mutex_ };
+            if (batch.text.capacity() > 0 && free_batches_.size() < capacity_) {
+                free_batches_.push_back(std::move(batch));
+            }
+            while (batches_.empty() && !closed_) {
+                not_empty_.wait(lock);
+            }
+            if (batches_.empty()) {
+                return false;
+            }
+            batch = std::move(batches_.front());
+            batches_.pop_front();
+            lock.unlock();
+            not_full_.notify_one();
+            return true;
+        }
+
+        void close() {
+            {
+                std::lock_guard<std::mutex> lock { mutex_ };
+                closed_ = true;
+            }
+            not_empty_.notify_all();
+            not_full_.notify_all();
+        }
+
+      private:
+        size_t capacity_;
+        std::deque<RecordBatch> batches_;
+        std::vector<RecordBatch> free_batches_;
+        bool closed_;
+        std::mutex mutex_;
+        std::condition_variable not_empty_;
+        std::condition_variable not_full_;
+    };
+
+    ParallelRecordCallback callback_;
+    size_t batch_size_;
+    ChunkRing ring_;
+    BatchQueue batches_;
+    std::atomic<bool> failed_;
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+    size_t num_records_;
+    std::thread splitter_thread_;
+    std::vector<std::thread> workers_;
+
+    static size_t getNumWorkers(size_t num_workers) {
+        if (num_workers == 0) {
+            num_workers = std::thread::hardware_concurrency();
+        }
+        return std::max<size_t>(num_workers, 1);
+    }
+
+    // Splitter thread
+    void split() {
+        RecordBatch batch {};
+        try {
+            RecordSplitter splitter {
+                [&](const char* data, size_t size) {
+                    batch.text.append(data, size);
+                    batch.ends.push_back(batch.text.size());
+                    if (batch.ends.size() >= batch_size_) {
+                        batches_.push(batch);
+                    }
+                } };
+            while (const std::string* chunk = ring_.front()) {
+                if (failed_) {
+                    break;
+                }
+                splitter.feed(chunk->data(), chunk->size());
+                ring_.pop();
+            }
+            if (!failed_) {
+                splitter.finish();
+                if (!batch.ends.empty()) {
+                    batches_.push(batch);
+                }
+                num_records_ = splitter.getNumRecords();
+            }
+        } catch (...) {
+            setError(std::current_exception());
+        }
+        // NB: the workers process the remaining batches, then stop
+        batches_.close();
+    }
+
+    // Worker thread
+    void work(size_t worker) {
+        RecordBatch batch {};
+        while (batches_.pop(batch)) {
+            try {
+                size_t start { 0 };
+                for (size_t end : batch.ends) {
+                    if (failed_) {
+                        break;
+                    }
+                    JsonValue record { parseJson(batch.text.data() + start,
+                                                 end - start) };
+                    callback_(record, worker);
+                    start = end;
+                }
+            } catch (...) {
+                setError(std::current_exception());
+            }
+        }
+    }
+
+    void setError(std::exception_ptr error) {
+        {
+            std::lock_guard<std::mutex> lock { error_mutex_ };
+            if (!error_) {
+                error_ = error;
+            }
+        }
+        failed_ = true;
+        // NB: wakes up the sink, the splitter, and the workers
+        ring_.close();
+        batches_.close();
+    }
+
+    void rethrowError() {
+        std::lock_guard<std::mutex> lock { error_mutex_ };
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        throw processing_error { "the parallel parsing was aborted" };
+    }
+
+    void join() {
+        if (splitter_thread_.joinable()) {
+            splitter_thread_.join();
+        }
+        for (auto& worker : workers_) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+};
+
+/// Performs the query and parses its result with a pipeline of
+/// num_workers workers (one per core by default); returns the number
+/// of records
+/// Throws a processing_error in case of failure (a parsing_error in
+/// case the result is malformed); an exception thrown by the callback
+/// aborts the query and is rethrown
+inline size_t forEachRecordParallel(PuppetdbConnector& connector,
+                                    Query& query,
+                                    ParallelRecordCallback callback,
+                                    size_t num_workers = 0) {
+    ParallelResultParser parser { std::move(callback), num_workers };
+    connector.performQuery(query, parser.sink());
+    return parser.finish();
+}
+
+}  // namespace LibPuppetdb
+
+#endif  // LIBPUPPETDB_INCLUDE_PUPPETDB_PARALLEL_PARSER_H_
@@ -0,0 +1,688 @@
+#ifndef LIBPUPPETDB_INCLUDE_PUPPETDB_QUERY_BUILDER_H_
+#define LIBPUPPETDB_INCLUDE_PUPPETDB_QUERY_BUILDER_H_
+
+/*
+ *                        libpuppetdb - query builder
+ *
+ * Optional typed builder of PuppetDB (AST) query strings. A query is
+ * an expression tree whose shape is part of its type, e.g.
+ *
+ *   using namespace LibPuppetdb::Pql;
+ *   auto expr = and_(eq(Fields::NAME, "operatingsystem"),
+ *                    match(Fields::VALUE, "^Debian"));
+ *   Query query { makeQuery(Endpoints::FACTS, expr) };
+ *
+ * which gives ["and",["=","name","operatingsystem"],["~","value","^Debian"]].
+ *
+ * The syntax of each node (brackets, operator, separators) is known at
+ * compile time, as are the field, entity, and endpoint names declared
+ * as constexpr Names; only the values are measured at run time. The
+ * query string is then written in a single buffer of the exact size,
+ * without intermediate strings.
+ *
+ * The string values passed as literals (or char arrays) are referenced,
+ * up to their first NUL; the other ones, including the char pointers,
+ * are copied in the expression.
+ *
+ */
+
+#include "libpuppetdb.h"
+
+#include <array>
+#include <cstring>
+#include <tuple>
+#include <utility>
+
+namespace LibPuppetdb {
+namespace Pql {
+
+//
+// Names
+//
+
+// A name known at compile time (field, entity, endpoint)
+struct Name {
+    const char* data;
+    size_t size;
+
+    template <size_t N>
+    constexpr Name(const char (&text)[N]) : data { text }, size { N - 1 } {}
+
+    std::string toString() const {
+        return std::string(data, size);
+    }
+};
+
+namespace Endpoints {
+    constexpr Name NODES { "nodes" };
+    constexpr Name FACTS { "facts" };
+    constexpr Name FACT_CONTENTS { "fact-contents" };
+    constexpr Name RESOURCES { "resources" };
+    constexpr Name REPORTS { "reports" };
+    constexpr Name EVENTS { "events" };
+    constexpr Name CATALOGS { "catalogs" };
+}  // namespace Endpoints
+
+// Subquery entities
+namespace Entities {
+    constexpr Name SELECT_NODES { "select_nodes" };
+    constexpr Name SELECT_FACTS { "select_facts" };
+    constexpr Name SELECT_FACT_CONTENTS { "select_fact_contents" };
+    constexpr Name SELECT_RESOURCES { "select_resources" };
+    constexpr Name SELECT_REPORTS { "select_reports" };
+    constexpr Name SELECT_EVENTS { "select_events" };
+}  // namespace Entities
+
+namespace Fields {
+    constexpr Name CERTNAME { "certname" };
+    constexpr Name ENVIRONMENT { "environment" };
+    constexpr Name NAME { "name" };
+    constexpr Name VALUE { "value" };
+    constexpr Name PATH { "path" };
+    constexpr Name TYPE { "type" };
+    constexpr Name TITLE { "title" };
+    constexpr Name TAG { "tag" };
+    constexpr Name DEACTIVATED { "deactivated" };
+    constexpr Name EXPIRED { "expired" };
+    constexpr Name FACTS_TIMESTAMP { "facts_timestamp" };
+    constexpr Name REPORT_TIMESTAMP { "report_timestamp" };
+    constexpr Name PRODUCER_TIMESTAMP { "producer_timestamp" };
+    constexpr Name STATUS { "status" };
+}  // namespace Fields
+
+//
+// Writing
+//
+
+namespace Detail {
+
+    inline char* writeRaw(char* out, const char* data, size_t size) {
+        std::memcpy(out, data, size);
+        return out + size;
+    }
+
+    inline bool needsEscape(unsigned char c) {
+        return c < 0x20 || c == '"' || c == '\\';
+    }
+
+    /// Returns the size of the json string, quotes included
+    inline size_t getStringSize(const char* data, size_t size) {
+        size_t string_size { size + 2 };
+        for (size_t index = 0; index < size; index++) {
+            unsigned char c { static_cast<unsigned char>(data[index]) };
+            if (needsEscape(c)) {
+                // \n, \", ... or \u00XX
+                string_size += (c == '"' || c == '\\' || c == '\n'
+                                || c == '\r' || c == '\t') ? 1 : 5;
+            }
+        }
+        return string_size;
+    }
+
+    inline char* writeString(char* out, const char* data, size_t size) {
+        static const char HEX_DIGITS[] = "0123456789abcdef";
+        *out++ = '"';
+        for (size_t index = 0; index < size; index++) {
+            unsigned char c { static_cast<unsigned char>(data[index]) };
+            if (!needsEscape(c)) {
+                *out++ = static_cast<char>(c);
+                continue;
+            }
+            *out++ = '\\';
+            switch (c) {
+                case '"':  *out++ = '"'; break;
+                case '\\': *out++ = '\\'; break;
+                case '\n': *out++ = 'n'; break;
+                case '\r': *out++ = 'r'; break;
+                case '\t': *out++ = 't'; break;
+                default:
+                    *out++ = 'u';
+                    *out++ = '0';
+                    *out++ = '0';
+                    *out++ = HEX_DIGITS[c >> 4];
+                    *out++ = HEX_DIGITS[c & 0x0F];
+            }
+        }
+        *out++ = '"';
+        return out;
+    }
+
+    inline unsigned long long getMagnitude(long long value) {
+        return value < 0 ? 0ull - static_cast<unsigned long long>(value)
+                         : static_cast<unsigned long long>(value);
+    }
+
+    inline size_t getNumDigits(unsigned long long value) {
+        size_t num_digits { 1 };
+        while (value >= 10) {
+            value /= 10;
+            num_digits++;
+        }
+        return num_digits;
+    }
+
+    inline size_t getIntegerSize(long long value) {
+        return getNumDigits(getMagnitude(value)) + (value < 0 ? 1 : 0);
+    }
+
+    inline char* writeInteger(char* out, long long value) {
+        unsigned long long magnitude { getMagnitude(value) };
+        if (value < 0) {
+            *out++ = '-';
+        }
+        char* end { out + getNumDigits(magnitude) };
+        char* digit { end };
+        do {
+            *--digit = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude > 0);
+        return end;
+    }
+
+    // Sizes and writes the elements of a tuple of expressions,
+    // each preceded by a comma
+    template <size_t I, typename Tuple>
+    struct TupleWriter {
+        static size_t getSize(const Tuple& elements) {
+            return TupleWriter<I - 1, Tuple>::getSize(elements) + 1
+                   + std::get<I - 1>(elements).getSize();
+        }
+
+        static char* write(char* out, const Tuple& elements) {
+            out = TupleWriter<I - 1, Tuple>::write(out, elements);
+            *out++ = ',';
+            return std::get<I - 1>(elements).write(out);
+        }
+    };
+
+    template <typename Tuple>
+    struct TupleWriter<0, Tuple> {
+        static size_t getSize(const Tuple& elements) {
+            return 0;
+        }
+
+        static char* write(char* out, const Tuple& elements) {
+            return out;
+        }
+    };
+
+}  // namespace Detail
+
+//
+// Values
+//
+
+// A string literal or char array, referenced
+struct LiteralValue {
+    const char* data;
+    size_t size;
+
+    size_t getSize() const {
+        return Detail::getStringSize(data, size);
+    }
+
+    char* write(char* out) const {
+        return Detail::writeString(out, data, size);
+    }
+};
+
+// A string, copied
+struct StringValue {
+    std::string text;
+
+    size_t getSize() const {
+        return Detail::getStringSize(text.data(), text.size());
+    }
+
+    char* write(char* out) const {
+        return Detail::writeString(out, text.data(), text.size());
+    }
+};
+
+struct IntegerValue {
+    long long value;
+
+    size_t getSize() const {
+        return Detail::getIntegerSize(value);
+    }
+
+    char* write(char* out) const {
+        return Detail::writeInteger(out, value);
+    }
+};
+
+struct BoolValue {
+    bool value;
+
+    size_t getSize() const {
+        return value ? 4 : 5;
+    }
+
+    char* write(char* out) const {
+        return value ? Detail::writeRaw(out, "true", 4)
+                     : Detail::writeRaw(out, "false", 5);
+    }
+};
+
+// NB: a char array is not necessarily filled up to its end
+template <size_t N>
+LiteralValue makeValue(const char (&text)[N]) {
+    return LiteralValue { text, strnlen(text, N - 1) };
+}
+
+// A template, so that the arrays select the overload above instead of
+// decaying, and the pointers do not convert to bool
+template <typename T,
+          typename std::enable_if<
+              std::is_same<T, const char*>::value
+              || std::is_same<T, char*>::value, int>::type = 0>
+StringValue makeValue(T text) {
+    return StringValue { std::string { text } };
+}
+
+inline StringValue makeValue(std::string text) {
+    return StringValue { std::move(text) };
+}
+
+inline IntegerValue makeValue(int value) {
+    return IntegerValue { value };
+}
+
+inline IntegerValue makeValue(long value) {
+    return IntegerValue { value };
+}
+
+inline IntegerValue makeValue(long long value) {
+    return IntegerValue { value };
+}
+
+inline IntegerValue makeValue(unsigned int value) {
+    return IntegerValue { static_cast<long long>(value) };
+}
+
+inline IntegerValue makeValue(unsigned long value) {
+    return IntegerValue { static_cast<long long>(value) };
+}
+
+inline IntegerValue makeValue(unsigned long long value) {
+    return IntegerValue { static_cast<long long>(value) };
+}
+
+inline BoolValue makeValue(bool value) {
+    return BoolValue { value };
+}
+
+//
+// Operators
+//
+
+#define LIBPUPPETDB_PQL_OPERATOR(TYPE, TEXT)                            \
+    struct TYPE {                                                       \
+        static constexpr const char* getText() { return TEXT; }         \
+        static constexpr size_t getSize() { return sizeof(TEXT) - 1; }  \
+    };
+
+LIBPUPPETDB_PQL_OPERATOR(Equal, "=")
+LIBPUPPETDB_PQL_OPERATOR(Greater, ">")
+LIBPUPPETDB_PQL_OPERATOR(GreaterOrEqual, ">=")
+LIBPUPPETDB_PQL_OPERATOR(Less, "<")
+LIBPUPPETDB_PQL_OPERATOR(LessOrEqual, "<=")
+LIBPUPPETDB_PQL_OPERATOR(Match, "~")
+LIBPUPPETDB_PQL_OPERATOR(IsNull, "null?")
+LIBPUPPETDB_PQL_OPERATOR(And, "and")
+LIBPUPPETDB_PQL_OPERATOR(Or, "or")
+
+#undef LIBPUPPETDB_PQL_OPERATOR
+
+//
+// Expressions
+//
+
+// Every expression provides getStaticSize() (the size of its syntax,
+// known at compile time), getSize() (its exact serialized size), and
+// write(out) (which writes getSize() characters and returns the end)
+
+// ["<op>","<field>",<value>]
+template <typename Op, typename Value>
+struct Comparison {
+    Name field;
+    Value value;
+
+    static constexpr size_t getStaticSize() {
+        return 8 + Op::getSize();
+    }
+
+    size_t getSize() const {
+        return getStaticSize() + field.size + value.getSize();
+    }
+
+    char* write(char* out) const {
+        out = Detail::writeRaw(out, "[\"", 2);
+        out = Detail::writeRaw(out, Op::getText(), Op::getSize());
+        out = Detail::writeRaw(out, "\",\"", 3);
+        out = Detail::writeRaw(out, field.data, field.size);
+        out = Detail::writeRaw(out, "\",", 2);
+        out = value.write(out);
+        *out++ = ']';
+        return out;
+    }
+};
+
+// ["<op>",<expression>,...]
+template <typename Op, typename... Expressions>
+struct Conjunction {
+    std::tuple<Expressions...> expressions;
+
+    static constexpr size_t getStaticSize() {
+        return 4 + Op::getSize() + sizeof...(Expressions);
+    }
+
+    size_t getSize() const {
+        return 4 + Op::getSize()
+               + Detail::TupleWriter<sizeof...(Expressions),
+                                     std::tuple<Expressions...>>::getSize(
+                   expressions);
+    }
+
+    char* write(char* out) const {
+        out = Detail::writeRaw(out, "[\"", 2);
+        out = Detail::writeRaw(out, Op::getText(), Op::getSize());
+        *out++ = '"';
+        out = Detail::TupleWriter<sizeof...(Expressions),
+                                  std::tuple<Expressions...>>::write(
+            out, expressions);
+        *out++ = ']';
+        return out;
+    }
+};
+
+// ["not",<expression>]
+template <typename Expression>
+struct Negation {
+    Expression expression;
+
+    static constexpr size_t getStaticSize() {
+        return 8;
+    }
+
+    size_t getSize() const {
+        return getStaticSize() + expression.getSize();
+    }
+
+    char* write(char* out) const {
+        out = Detail::writeRaw(out, "[\"not\",", 7);
+        out = expression.write(out);
+        *out++ = ']';
+        return out;
+    }
+};
+
+// ["<entity>",<expression>]
+template <typename Expression>
+struct Subquery {
+    Name entity;
+    Expression expression;
+
+    static constexpr size_t getStaticSize() {
+        return 5;
+    }
+
+    size_t getSize() const {
+        return getStaticSize() + entity.size + expression.getSize();
+    }
+
+    char* write(char* out) const {
+        out = Detail::writeRaw(out, "[\"", 2);
+        out = Detail::writeRaw(out, entity.data, entity.size);
+        out = Detail::writeRaw(out, "\",", 2);
+        out = expression.write(out);
+        *out++ = ']';
+        return out;
+    }
+};
+
+// The fields of extract and in: "<field>" or ["<field>",...]
+template <size_t N>
+struct FieldList {
+    std::array<Name, N> names;
+
+    size_t getSize() const {
+        size_t size { N == 1 ? 0u : N + 1 };
+        for (const auto& name : names) {
+            size += name.size + 2;
+        }
+        return size;
+    }
+
+    char* write(char* out) const {
+        if (N != 1) {
+            *out++ = '[';
+        }
+        for (size_t index = 0; index < N; index++) {
+            if (index > 0) {
+                *out++ = ',';
+            }
+            *out++ = '"';
+            out = Detail::writeRaw(out, names[index].data, names[index].size);
+            *out++ = '"';
+        }
+        if (N != 1) {
+            *out++ = ']';
+        }
+        return out;
+    }
+};
+
+// ["extract",<fields>,<expression>]
+template <size_t N, typename Expression>
+struct Extract {
+    FieldList<N> fields;
+    Expression expression;
+
+    static constexpr size_t getStaticSize() {
+        return 13;
+    }
+
+    size_t getSize() const {
+        return getStaticSize() + fields.getSize() + expression.getSize();
+    }
+
+    char* write(char* out) const {
+        out = Detail::writeRaw(out, "[\"extract\",", 11);
+        out = fields.write(out);
+        *out++ = ',';
+        out = expression.write(out);
+        *out++ = ']';
+        return out;
+    }
+};
+
+// ["in",<fields>,<subquery>]
+template <size_t N, typename Source>
+struct In {
+    FieldList<N> fields;
+    Source source;
+
+    static constexpr size_t getStaticSize() {
+        return 8;
+    }
+
+    size_t getSize() const {
+        return getStaticSize() + fields.getSize() + source.getSize();
+    }
+
+    char* write(char* out) const {
+        out = Detail::writeRaw(out, "[\"in\",", 6);
+        out = fields.write(out);
+        *out++ = ',';
+        out = source.write(out);
+        *out++ = ']';
+        return out;
+    }
+};
+
+// ["array",[<value>,...]], the source of an "in" matching a list of
+// values
+struct ValueArray {
+    std::vector<std::string> values;
+
+    static constexpr size_t getStaticSize() {
+        return 12;
+    }
+
+    size_t getSize() const {
+        size_t size { getStaticSize() };
+        for (const auto& value : values) {
+            size += Detail::getStringSize(value.data(), value.size()) + 1;
+        }
+        return values.empty() ? size : size - 1;
+    }
+
+    char* write(char* out) const {
+        out = Detail::writeRaw(out, "[\"array\",[", 10);
+        for (size_t index = 0; index < values.size(); index++) {
+            if (index > 0) {
+                *out++ = ',';
+            }
+            out = Detail::writeString(out, values[index].data(),
+                                      values[index].size());
+        }
+        return Detail::writeRaw(out, "]]", 2);
+    }
+};
+
+//
+// Builder functions
+//
+
+template <typename T>
+auto eq(Name field, T&& value)
+        -> Comparison<Equal, decltype(makeValue(std::forward<T>(value)))> {
+    return { field, makeValue(std::forward<T>(value)) };
+}
+
+template <typename T>
+auto gt(Name field, T&& value)
+        -> Comparison<Greater, decltype(makeValue(std::forward<T>(value)))> {
+    return { field, makeValue(std::forward<T>(value)) };
+}
+
+template <typename T>
+auto ge(Name field, T&& value)
+        -> Comparison<GreaterOrEqual,
+                      decltype(makeValue(std::forward<T>(value)))> {
+    return { field, makeValue(std::forward<T>(value)) };
+}
+
+template <typename T>
+auto lt(Name field, T&& value)
+        -> Comparison<Less, decltype(makeValue(std::forward<T>(value)))> {
+    return { field, makeValue(std::forward<T>(value)) };
+}
+
+template <typename T>
+auto le(Name field, T&& value)
+        -> Comparison<LessOrEqual,
+                      decltype(makeValue(std::forward<T>(value)))> {
+    return { field, makeValue(std::forward<T>(value)) };
+}
+
+/// Regular expression match
+template <typename T>
+auto match(Name field, T&& regexp)
+        -> Comparison<Match, decltype(makeValue(std::forward<T>(regexp)))> {
+    return { field, makeValue(std::forward<T>(regexp)) };
+}
+
+inline Comparison<IsNull, BoolValue> isNull(Name field, bool is_null = true) {
+    return { field, BoolValue { is_null } };
+}
+
+template <typename... Expressions>
+Conjunction<And, typename std::decay<Expressions>::type...> and_(
+        Expressions&&... expressions) {
+    return { std::make_tuple(std::forward<Expressions>(expressions)...) };
+}
+
+template <typename... Expressions>
+Conjunction<Or, typename std::decay<Expressions>::type...> or_(
+        Expressions&&... expressions) {
+    return { std::make_tuple(std::forward<Expressions>(expressions)...) };
+}
+
+template <typename Expression>
+Negation<typename std::decay<Expression>::type> not_(Expression&& expression) {
+    return { std::forward<Expression>(expression) };
+}
+
+/// Subquery of the entity, e.g. Entities::SELECT_FACTS
+template <typename Expression>
+Subquery<typename std::decay<Expression>::type> select(
+        Name entity, Expression&& expression) {
+    return { entity, std::forward<Expression>(expression) };
+}
+
+template <typename... Names>
+FieldList<sizeof...(Names)> fields(Names... names) {
+    return { { { names... } } };
+}
+
+template <typename Expression>
+Extract<1, typename std::decay<Expression>::type> extract(
+        Name field, Expression&& expression) {
+    return { fields(field), std::forward<Expression>(expression) };
+}
+
+template <size_t N, typename Expression>
+Extract<N, typename std::decay<Expression>::type> extract(
+        FieldList<N> field_list, Expression&& expression) {
+    return { field_list, std::forward<Expression>(expression) };
+}
+
+template <typename Source>
+In<1, typename std::decay<Source>::type> in(Name field, Source&& source) {
+    return { fields(field), std::forward<Source>(source) };
+}
+
+template <size_t N, typename Source>
+In<N, typename std::decay<Source>::type> in(FieldList<N> field_list,
+                                            Source&& source) {
+    return { field_list, std::forward<Source>(source) };
+}
+
+/// ["in","<field>",["array",[<value>,...]]]
+inline In<1, ValueArray> in(Name field, std::vector<std::string> values) {
+    return { fields(field), ValueArray { std::move(values) } };
+}
+
+//
+// Serialization
+//
+
+/// Writes the expression in the buffer, replacing its content; the
+/// buffer is resized once, to the exact size of the query string
+template <typename Expression>
+void serialize(const Expression& expression, std::string& buffer) {
+    buffer.resize(expression.getSize());
+    if (!buffer.empty()) {
+        expression.write(&buffer[0]);
+    }
+}
+
+template <typename Expression>
+std::string serialize(const Expression& expression) {
+    std::string buffer {};
+    serialize(expression, buffer);
+    return buffer;
+}
+
+/// Returns the query of the endpoint
+template <typename Expression>
+Query makeQuery(Name endpoint, const Expression& expression) {
+    return Query { endpoint.toString(), serialize(expression) };
+}
+
+}  // namespace Pql
+}  // namespace LibPuppetdb
+
+#endif  // LIBPUPPETDB_INCLUDE_PUPPETDB_QUERY_BUILDER_H_
@@ -0,0 +1,1184 @@
+#ifndef LIBPUPPETDB_INCLUDE_PUPPETDB_RESULT_PARSER_H_
+#define LIBPUPPETDB_INCLUDE_PUPPETDB_RESULT_PARSER_H_
+
+/*
+ *                        libpuppetdb - result parser
+ *
+ * Optional incremental parser for PuppetDB query results. PuppetDB
+ * returns a json array of records (nodes, facts, resources, events,
+ * ...); the parser consumes the result chunk by chunk, as passed to a
+ * ChunkSink, and calls the record callback with each record as soon
+ * as its last byte is received. Only the record being received is
+ * buffered.
+ *
+ * The parsing is done in two stages:
+ *  - RecordSplitter finds the boundaries of the records in the
+ *    stream of chunks and passes the json text of each record on;
+ *  - parseJson parses the text of a single record into a JsonValue.
+ * ResultParser chains the two stages.
+ *
+ * A result that is not a json array (e.g. the single object returned
+ * by the nodes/<node> endpoint) is treated as a single record.
+ *
+ */
+
+#include "libpuppetdb.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <utility>
+
+// The vectorized scan kernels are built unless LIBPUPPETDB_NO_SIMD is
+// defined; the AVX2 one is only used if the CPU supports it
+#if !defined(LIBPUPPETDB_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define LIBPUPPETDB_SCAN_X86 1
+#include <immintrin.h>
+#elif !defined(LIBPUPPETDB_NO_SIMD) && defined(__aarch64__)
+#define LIBPUPPETDB_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace LibPuppetdb {
+
+//
+// Errors
+//
+
+// Error due to a malformed query result
+class parsing_error : public processing_error {
+  public:
+    explicit parsing_error(std::string const& msg) : processing_error(msg) {}
+};
+
+//
+// JsonValue
+//
+
+enum class JsonType { Null, Bool, Number, String, Array, Object };
+
+class JsonValue {
+  public:
+    using Member = std::pair<std::string, JsonValue>;
+
+    JsonValue() : type_ { JsonType::Null }, bool_ { false } {}
+
+    explicit JsonValue(JsonType type) : type_ { type }, bool_ { false } {}
+
+    static JsonValue makeBool(bool value) {
+        JsonValue json_value { JsonType::Bool };
+        json_value.bool_ = value;
+        return json_value;
+    }
+
+    /// The number is stored as its json text, to preserve precision
+    static JsonValue makeNumber(std::string text) {
+        JsonValue json_value { JsonType::Number };
+        json_value.text_ = std::move(text);
+        return json_value;
+    }
+
+    static JsonValue makeString(std::string text) {
+        JsonValue json_value { JsonType::String };
+        json_value.text_ = std::move(text);
+        return json_value;
+    }
+
+    JsonType getType() const { return type_; }
+    bool isNull() const { return type_ == JsonType::Null; }
+    bool isBool() const { return type_ == JsonType::Bool; }
+    bool isNumber() const { return type_ == JsonType::Number; }
+    bool isString() const { return type_ == JsonType::String; }
+    bool isArray() const { return type_ == JsonType::Array; }
+    bool isObject() const { return type_ == JsonType::Object; }
+
+    /// Throws a parsing_error in case the value is not a boolean
+    bool asBool() const {
+        checkType(JsonType::Bool, "a boolean");
+        return bool_;
+    }
+
+    /// Throws a parsing_error in case the value is not a number
+    double asDouble() const {
+        checkType(JsonType::Number, "a number");
+        return std::strtod(text_.c_str(), nullptr);
+    }
+
+    /// Throws a parsing_error in case the value is not a number
+    long long asInt() const {
+        checkType(JsonType::Number, "a number");
+        return std::strtoll(text_.c_str(), nullptr, 10);
+    }
+
+    /// Throws a parsing_error in case the value is not a string
+    const std::string& asString() const {
+        checkType(JsonType::String, "a string");
+        return text_;
+    }
+
+    /// Returns the number of elements (array) or members (object)
+    size_t size() const {
+        return type_ == JsonType::Array ? elements_.size() : members_.size();
+    }
+
+    /// Throws a parsing_error in case the value is not an array or
+    /// the index is out of range
+    const JsonValue& operator[](size_t idx) const {
+        checkType(JsonType::Array, "an array");
+        if (idx >= elements_.size()) {
+            throw parsing_error { "json array index out of range" };
+        }
+        return elements_[idx];
+    }
+
+    const std::vector<JsonValue>& getElements() const {
+        return elements_;
+    }
+
+    const std::vector<Member>& getMembers() const {
+        return members_;
+    }
+
+    /// Returns the value of the object member with the specified key,
+    /// or nullptr in case there is no such member
+    const JsonValue* find(const std::string& key) const {
+        for (const auto& member : members_) {
+            if (member.first == key) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+
+    /// Throws a parsing_error in case there is no such member
+    const JsonValue& get(const std::string& key) const {
+        const JsonValue* json_value { find(key) };
+        if (json_value == nullptr) {
+            throw parsing_error { "json object has no member " + key };
+        }
+        return *json_value;
+    }
+
+    void append(JsonValue element) {
+        elements_.push_back(std::move(element));
+    }
+
+    void set(std::string key, JsonValue json_value) {
+        members_.emplace_back(std::move(key), std::move(json_value));
+    }
+
+    /// Returns the compact json text of the value
+    std::string serialize() const {
+        std::string text {};
+        serialize(text);
+        return text;
+    }
+
+    void serialize(std::string& text) const {
+        switch (type_) {
+            case JsonType::Null:
+                text += "null";
+                break;
+            case JsonType::Bool:
+                text += bool_ ? "true" : "false";
+                break;
+            case JsonType::Number:
+                text += text_;
+                break;
+            case JsonType::String:
+                serializeString(text_, text);
+                break;
+            case JsonType::Array:
+                text += '[';
+                for (size_t idx = 0; idx < elements_.size(); idx++) {
+                    if (idx > 0) {
+                        text += ',';
+                    }
+                    elements_[idx].serialize(text);
+                }
+                text += ']';
+                break;
+            case JsonType::Object:
+                text += '{';
+                for (size_t idx = 0; idx < members_.size(); idx++) {
+                    if (idx > 0) {
+                        text += ',';
+                    }
+                    serializeString(members_[idx].first, text);
+                    text += ':';
+                    members_[idx].second.serialize(text);
+                }
+                text += '}';
+                break;
+        }
+    }
+
+    /// Appends the json (quoted and escaped) form of the string
+    static void serializeString(const std::string& str, std::string& text) {
+        static const char* HEX_DIGITS { "0123456789abcdef" };
+        text += '"';
+        for (char c : str) {
+            switch (c) {
+                case '"':  text += "\\\""; break;
+                case '\\': text += "\\\\"; break;
+                case '\b': text += "\\b"; break;
+                case '\f': text += "\\f"; break;
+                case '\n': text += "\\n"; break;
+                case '\r': text += "\\r"; break;
+                case '\t': text += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        text += "\\u00";
+                        text += HEX_DIGITS[(c >> 4) & 0x0f];
+                        text += HEX_DIGITS[c & 0x0f];
+                    } else {
+                        text += c;
+                    }
+            }
+        }
+        text += '"';
+    }
+
+  private:
+    JsonType type_;
+    bool bool_;
+    std::string text_;
+    std::vector<JsonValue> elements_;
+    std::vector<Member> members_;
+
+    void checkType(JsonType type, const std::string& description) const {
+        if (type_ != type) {
+            throw parsing_error { "json value is not " + description };
+        }
+    }
+};
+
+//
+// JsonReader
+//
+
+// Recursive descent parser of a complete json text; if a projection
+// is given, the members of a top-level object that are not part of it
+// are validated and skipped, without being decoded or stored
+class JsonReader {
+  public:
+    JsonReader(const char* data, size_t size,
+               const std::vector<std::string>* projection = nullptr)
+            : begin_ { data },
+              current_ { data },
+              end_ { data + size },
+              projection_ { projection != nullptr && !projection->empty()
+                            ? projection : nullptr } {
+    }
+
+    /// Throws a parsing_error in case the text is not a single valid
+    /// json value
+    JsonValue parse() {
+        JsonValue json_value { projection_ != nullptr && peek() == '{'
+                               ? parseObject(projection_)
+                               : parseValue() };
+        skipWhitespace();
+        if (current_ != end_) {
+            fail("unexpected trailing characters");
+        }
+        return json_value;
+    }
+
+  private:
+    const char* begin_;
+    const char* current_;
+    const char* end_;
+    const std::vector<std::string>* projection_;
+
+    void fail(const std::string& msg) const {
+        throw parsing_error { "invalid json at offset "
+                              + std::to_string(current_ - begin_)
+                              + ": " + msg };
+    }
+
+    void skipWhitespace() {
+        while (current_ != end_ && (*current_ == ' ' || *current_ == '\n'
+                                    || *current_ == '\r' || *current_ == '\t')) {
+            current_++;
+        }
+    }
+
+    char peek() {
+        skipWhitespace();
+        if (current_ == end_) {
+            fail("unexpected end of text");
+        }
+        return *current_;
+    }
+
+    void expect(char c) {
+        if (peek() != c) {
+            fail(std::string { "expected '" } + c + "'");
+        }
+        current_++;
+    }
+
+    void expectLiteral(const char* literal) {
+        for (const char* c = literal; *c != '\0'; c++) {
+            if (current_ == end_ || *current_ != *c) {
+                fail("invalid literal");
+            }
+            current_++;
+        }
+    }
+
+    JsonValue parseValue() {
+        switch (peek()) {
+            case '{':
+                return parseObject();
+            case '[':
+                return parseArray();
+            case '"':
+                return JsonValue::makeString(parseString());
+            case 't':
+                expectLiteral("true");
+                return JsonValue::makeBool(true);
+            case 'f':
+                expectLiteral("false");
+                return JsonValue::makeBool(false);
+            case 'n':
+                expectLiteral("null");
+                return JsonValue {};
+            default:
+                return parseNumber();
+        }
+    }
+
+    JsonValue parseObject(const std::vector<std::string>* fields = nullptr) {
+        JsonValue object { JsonType::Object };
+        expect('{');
+        if (peek() == '}') {
+            current_++;
+            return object;
+        }
+        while (true) {
+            if (peek() != '"') {
+                fail("expected an object key");
+            }
+            std::string key { parseString() };
+            expect(':');
+            if (fields == nullptr
+                    || std::find(fields->begin(), fields->end(), key)
+                       != fields->end()) {
+                object.set(std::move(key), parseValue());
+            } else {
+                skipValue();
+            }
+            char c { peek() };
+            current_++;
+            if (c == '}') {
+                return object;
+            }
+            if (c != ',') {
+                fail("expected ',' or '}'");
+            }
+        }
+    }
+
+    JsonValue parseArray() {
+        JsonValue array { JsonType::Array };
+        expect('[');
+        if (peek() == ']') {
+            current_++;
+            return array;
+        }
+        while (true) {
+            array.append(parseValue());
+            char c { peek() };
+            current_++;
+            if (c == ']') {
+                return array;
+            }
+            if (c != ',') {
+                fail("expected ',' or ']'");
+            }
+        }
+    }
+
+    JsonValue parseNumber() {
+        const char* start { current_ };
+        skipNumber();
+        return JsonValue::makeNumber(std::string { start, current_ });
+    }
+
+    void skipNumber() {
+        const char* start { current_ };
+        if (current_ != end_ && *current_ == '-') {
+            current_++;
+        }
+        bool has_digits { false };
+        while (current_ != end_
+               && ((*current_ >= '0' && *current_ <= '9') || *current_ == '.'
+                   || *current_ == 'e' || *current_ == 'E'
+                   || *current_ == '+' || *current_ == '-')) {
+            has_digits = has_digits || (*current_ >= '0' && *current_ <= '9');
+            current_++;
+        }
+        if (!has_digits) {
+            current_ = start;
+            fail("unexpected character");
+        }
+    }
+
+    // Validates the next value and moves past it
+    void skipValue() {
+        switch (peek()) {
+            case '{':
+                skipContainer('{', '}');
+                break;
+            case '[':
+                skipContainer('[', ']');
+                break;
+            case '"':
+                skipString();
+                break;
+            case 't':
+                expectLiteral("true");
+                break;
+            case 'f':
+                expectLiteral("false");
+                break;
+            case 'n':
+                expectLiteral("null");
+                break;
+            default:
+                skipNumber();
+        }
+    }
+
+    void skipContainer(char open, char close) {
+        expect(open);
+        if (peek() == close) {
+            current_++;
+            return;
+        }
+        while (true) {
+            if (open == '{') {
+                if (peek() != '"') {
+                    fail("expected an object key");
+                }
+                skipString();
+                expect(':');
+            }
+            skipValue();
+            char c { peek() };
+            current_++;
+            if (c == close) {
+                return;
+            }
+            if (c != ',') {
+                fail(std::string { "expected ',' or '" } + close + "'");
+            }
+        }
+    }
+
+    void skipString() {
+        current_++;  // opening quote
+        while (true) {
+            while (current_ != end_ && *current_ != '"' && *current_ != '\\') {
+                current_++;
+            }
+            if (current_ == end_) {
+                fail("unterminated string");
+            }
+            if (*current_++ == '"') {
+                return;
+            }
+            if (current_ == end_) {
+                fail("unterminated string");
+            }
+            switch (*current_++) {
+                case '"': case '\\': case '/': case 'b':
+                case 'f': case 'n': case 'r': case 't':
+                    break;
+                case 'u':
+                    parseHex4();
+                    break;
+                default:
+                    fail("invalid escape sequence");
+            }
+        }
+    }
+
+    unsigned parseHex4() {
+        if (end_ - current_ < 4) {
+            fail("truncated unicode escape");
+        }
+        unsigned code_point { 0 };
+        for (int idx = 0; idx < 4; idx++) {
+            char c { *current_++ };
+            code_point <<= 4;
+            if (c >= '0' && c <= '9') {
+                code_point |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                code_point |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                code_point |= c - 'A' + 10;
+            } else {
+                fail("invalid unicode escape");
+            }
+        }
+        return code_point;
+    }
+
+    static void appendUtf8(unsigned code_point, std::string& str) {
+        if (code_point < 0x80) {
+            str += static_cast<char>(code_point);
+        } else if (code_point < 0x800) {
+            str += static_cast<char>(0xc0 | (code_point >> 6));
+            str += static_cast<char>(0x80 | (code_point & 0x3f));
+        } else if (code_point < 0x10000) {
+            str += static_cast<char>(0xe0 | (code_point >> 12));
+            str += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+            str += static_cast<char>(0x80 | (code_point & 0x3f));
+        } else {
+            str += static_cast<char>(0xf0 | (code_point >> 18));
+            str += static_cast<char>(0x80 | ((code_point >> 12) & 0x3f));
+            str += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+            str += static_cast<char>(0x80 | (code_point & 0x3f));
+        }
+    }
+
+    std::string parseString() {
+        std::string str {};
+        current_++;  // opening quote
+        while (true) {
+            // Copy the unescaped run at once
+            const char* run_start { current_ };
+            while (current_ != end_ && *current_ != '"' && *current_ != '\\') {
+                current_++;
+            }
+            str.append(run_start, current_);
+
+            if (current_ == end_) {
+                fail("unterminated string");
+            }
+            if (*current_++ == '"') {
+                return str;
+            }
+            if (current_ == end_) {
+                fail("unterminated string");
+            }
+            char c { *current_++ };
+            switch (c) {
+                case '"':  str += '"'; break;
+                case '\\': str += '\\'; break;
+                case '/':  str += '/'; break;
+                case 'b':  str += '\b'; break;
+                case 'f':  str += '\f'; break;
+                case 'n':  str += '\n'; break;
+                case 'r':  str += '\r'; break;
+                case 't':  str += '\t'; break;
+                case 'u': {
+                    unsigned code_point { parseHex4() };
+                    if (code_point >= 0xd800 && code_point < 0xdc00) {
+                        // Surrogate pair
+                        if (end_ - current_ < 2 || current_[0] != '\\'
+                                || current_[1] != 'u') {
+                            fail("invalid surrogate pair");
+                        }
+                        current_ += 2;
+                        unsigned low { parseHex4() };
+                        if (low < 0xdc00 || low > 0xdfff) {
+                            fail("invalid surrogate pair");
+                        }
+                        code_point = 0x10000 + ((code_point - 0xd800) << 10)
+                                     + (low - 0xdc00);
+                    }
+                    appendUtf8(code_point, str);
+                    break;
+                }
+                default:
+                    fail("invalid escape sequence");
+            }
+        }
+    }
+};
+
+/// Parses a complete json text
+/// Throws a parsing_error in case the text is not valid json
+inline JsonValue parseJson(const char* data, size_t size) {
+    return JsonReader { data, size }.parse();
+}
+
+inline JsonValue parseJson(const std::string& text) {
+    return parseJson(text.data(), text.size());
+}
+
+/// Parses a complete json text; if the text is an object, only its
+/// members named in the projection are kept (all of them if the
+/// projection is empty)
+/// Throws a parsing_error in case the text is not valid json
+inline JsonValue parseJson(const char* data, size_t size,
+                           const std::vector<std::string>& projection) {
+    return JsonReader { data, size, &projection }.parse();
+}
+
+//
+// Structural scanning
+//
+
+// Implementations of the scan of the structural characters of the
+// records (quotes, backslashes, brackets); RecordSplitter uses the
+// fastest one supported by the CPU, picked at run time
+enum class ScanKernel { Scalar, Sse2, Avx2, Neon };
+
+// Number of bytes scanned at once (one bit each in a mask)
+static const size_t SCAN_BLOCK_SIZE { 64 };
+
+// Returns the mask of the structural characters of a block of
+// SCAN_BLOCK_SIZE bytes; bit i is set if byte i is structural
+using ScanMaskFunction = uint64_t (*)(const char* block);
+
+namespace ScanKernels {
+
+// NB: '[' and ']' only differ from '{' and '}' by the 0x20 bit
+inline uint64_t getScalarMask(const char* block) {
+    uint64_t mask { 0 };
+    for (size_t index = 0; index < SCAN_BLOCK_SIZE; index++) {
+        char c { block[index] };
+        char folded { static_cast<char>(c | 0x20) };
+        if (c == '"' || c == '\\' || folded == '{' || folded == '}') {
+            mask |= uint64_t { 1 } << index;
+        }
+    }
+    return mask;
+}
+
+#ifdef LIBPUPPETDB_SCAN_X86
+
+inline uint64_t getSse2Mask(const char* block) {
+    const __m128i quote { _mm_set1_epi8('"') };
+    const __m128i backslash { _mm_set1_epi8('\\') };
+    const __m128i open { _mm_set1_epi8('{') };
+    const __m128i close { _mm_set1_epi8('}') };
+    const __m128i case_bit { _mm_set1_epi8(0x20) };
+    uint64_t mask { 0 };
+    for (size_t offset = 0; offset < SCAN_BLOCK_SIZE; offset += 16) {
+        __m128i bytes { _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(block + offset)) };
+        __m128i folded { _mm_or_si128(bytes, case_bit) };
+        __m128i matches { _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, quote),
+                         _mm_cmpeq_epi8(bytes, backslash)),
+            _mm_or_si128(_mm_cmpeq_epi8(folded, open),
+                         _mm_cmpeq_epi8(folded, close))) };
+        mask |= static_cast<uint64_t>(static_cast<uint32_t>(
+                    _mm_movemask_epi8(matches))) << offset;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+inline uint64_t getAvx2Mask(const char* block) {
+    const __m256i quote { _mm256_set1_epi8('"') };
+    const __m256i backslash { _mm256_set1_epi8('\\') };
+    const __m256i open { _mm256_set1_epi8('{') };
+    const __m256i close { _mm256_set1_epi8('}') };
+    const __m256i case_bit { _mm256_set1_epi8(0x20) };
+    uint64_t mask { 0 };
+    for (size_t offset = 0; offset < SCAN_BLOCK_SIZE; offset += 32) {
+        __m256i bytes { _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(block + offset)) };
+        __m256i folded { _mm256_or_si256(bytes, case_bit) };
+        __m256i matches { _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, quote),
+                            _mm256_cmpeq_epi8(bytes, backslash)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(folded, open),
+                            _mm256_cmpeq_epi8(folded, close))) };
+        mask |= static_cast<uint64_t>(static_cast<uint32_t>(
+                    _mm256_movemask_epi8(matches))) << offset;
+    }
+    return mask;
+}
+
+#endif  // LIBPUPPETDB_SCAN_X86
+
+#ifdef LIBPUPPETDB_SCAN_NEON
+
+inline uint64_t getNeonMask(const char* block) {
+    const uint8x16_t bits { 1, 2, 4, 8, 16, 32, 64, 128,
+                            1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t case_bit { vdupq_n_u8(0x20) };
+    uint8x16_t matches[4];
+    for (size_t index = 0; index < 4; index++) {
+        uint8x16_t bytes { vld1q_u8(
+            reinterpret_cast<const uint8_t*>(block) + 16 * index) };
+        uint8x16_t folded { vorrq_u8(bytes, case_bit) };
+        uint8x16_t match { vorrq_u8(
+            vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('"')),
+                     vceqq_u8(bytes, vdupq_n_u8('\\'))),
+            vorrq_u8(vceqq_u8(folded, vdupq_n_u8('{')),
+                     vceqq_u8(folded, vdupq_n_u8('}')))) };
+        matches[index] = vandq_u8(match, bits);
+    }
+    // NB: the pairwise additions pack the 64 bits in byte order
+    uint8x16_t sum { vpaddq_u8(vpaddq_u8(matches[0], matches[1]),
+                               vpaddq_u8(matches[2], matches[3])) };
+    sum = vpaddq_u8(sum, sum);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+}
+
+#endif  // LIBPUPPETDB_SCAN_NEON
+
+}  // namespace ScanKernels
+
+inline bool isScanKernelSupported(ScanKernel kernel) {
+    switch (kernel) {
+#ifdef LIBPUPPETDB_SCAN_X86
+        case ScanKernel::Sse2:
+            return true;
+        case ScanKernel::Avx2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef LIBPUPPETDB_SCAN_NEON
+        case ScanKernel::Neon:
+            return true;
+#endif
+        case ScanKernel::Scalar:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// Returns the fastest kernel supported by the CPU
+inline ScanKernel getBestScanKernel() {
+    static const ScanKernel best_kernel {
+        isScanKernelSupported(ScanKernel::Avx2) ? ScanKernel::Avx2
+        : isScanKernelSupported(ScanKernel::Sse2) ? ScanKernel::Sse2
+        : isScanKernelSupported(ScanKernel::Neon) ? ScanKernel::Neon
+        : ScanKernel::Scalar };
+    return best_kernel;
+}
+
+/// Throws a processing_error in case the kernel is not supported
+inline ScanMaskFunction getScanMaskFunction(ScanKernel kernel) {
+    if (!isScanKernelSupported(kernel)) {
+        throw processing_error { "scan kernel not supported by the CPU" };
+    }
+    switch (kernel) {
+#ifdef LIBPUPPETDB_SCAN_X86
+        case ScanKernel::Sse2:
+            return &ScanKernels::getSse2Mask;
+        case ScanKernel::Avx2:
+            return &ScanKernels::getAvx2Mask;
+#endif
+#ifdef LIBPUPPETDB_SCAN_NEON
+        case ScanKernel::Neon:
+            return &ScanKernels::getNeonMask;
+#endif
+        default:
+            return &ScanKernels::getScalarMask;
+    }
+}
+
+//
+// RecordSplitter
+//
+
+// Consumer of the json text of a single record; the text is valid
+// only for the duration of the call
+using RecordTextCallback = std::function<void(const char* data, size_t size)>;
+
+// Incremental splitter of a json array into its elements. It only
+// tracks nesting and strings, so a record is not validated until it
+// is parsed. Objects and arrays are scanned a block at a time, by
+// visiting only the structural characters of each block.
+class RecordSplitter {
+  public:
+    explicit RecordSplitter(RecordTextCallback callback)
+            : callback_ { std::move(callback) },
+              state_ { State::Start },
+              is_array_ { false },
+              depth_ { 0 },
+              in_string_ { false },
+              escaped_ { false },
+              kernel_ { getBestScanKernel() },
+              get_mask_ { getScanMaskFunction(kernel_) },
+              record_buffer_ {},
+              num_records_ { 0 } {
+    }
+
+    /// Throws a processing_error in case the kernel is not supported
+    /// by the CPU
+    void setScanKernel(ScanKernel kernel) {
+        get_mask_ = getScanMaskFunction(kernel);
+        kernel_ = kernel;
+    }
+
+    ScanKernel getScanKernel() const {
+        return kernel_;
+    }
+
+    /// Processes the next chunk of the result
+    /// Throws a parsing_error in case the result is malformed
+    void feed(const char* data, size_t size) {
+        const char* current { data };
+        const char* end { data + size };
+        const char* record_start { state_ == State::InRecord ? data : nullptr };
+
+        while (current != end) {
+            char c { *current };
+            switch (state_) {
+                case State::Start:
+                    if (isWhitespace(c)) {
+                        break;
+                    }
+                    if (c == '[') {
+                        is_array_ = true;
+                        state_ = State::BeforeRecord;
+                        break;
+                    }
+                    // Not an array: the whole result is one record
+                    startRecord(c);
+                    record_start = current;
+                    continue;
+
+                case State::BeforeRecord:
+                case State::AfterComma:
+                    if (isWhitespace(c)) {
+                        break;
+                    }
+                    if (c == ']' && state_ == State::BeforeRecord) {
+                        state_ = State::End;
+                        break;
+                    }
+                    if (c == ']' || c == ',') {
+                        fail("expected a record");
+                    }
+                    startRecord(c);
+                    record_start = current;
+                    continue;
+
+                case State::AfterRecord:
+                    if (isWhitespace(c)) {
+                        break;
+                    }
+                    if (!is_array_) {
+                        fail("unexpected characters after the result");
+                    }
+                    if (c == ',') {
+                        state_ = State::AfterComma;
+                    } else if (c == ']') {
+                        state_ = State::End;
+                    } else {
+                        fail("expected ',' or ']'");
+                    }
+                    break;
+
+                case State::InRecord:
+                    current = scanRecord(current, end);
+                    if (state_ == State::InRecord) {
+                        // The record continues in the next chunk
+                        continue;
+                    }
+                    emit(record_start, current);
+                    record_start = nullptr;
+                    if (is_scalar_) {
+                        // The delimiter is processed in AfterRecord
+                        continue;
+                    }
+                    break;
+
+                case State::End:
+                    if (!isWhitespace(c)) {
+                        fail("unexpected characters after the result");
+                    }
+                    break;
+            }
+            current++;
+        }
+
+        if (state_ == State::InRecord && record_start != nullptr) {
+            record_buffer_.append(record_start, end);
+        }
+    }
+
+    /// Checks that the result is complete; a scalar record pending at
+    /// the end of a non-array result is emitted
+    /// Throws a parsing_error in case the result is truncated
+    void finish() {
+        if (state_ == State::InRecord && !is_array_ && is_scalar_
+                && !in_string_) {
+            emit(nullptr, nullptr);
+        }
+        if (state_ == State::AfterRecord && !is_array_) {
+            state_ = State::End;
+        }
+        if (state_ != State::End) {
+            fail("truncated result");
+        }
+    }
+
+    /// Returns the number of records found so far
+    size_t getNumRecords() const {
+        return num_records_;
+    }
+
+    /// Returns a sink that feeds the splitter
+    ChunkSink sink() {
+        return [this](const char* data, size_t size) { feed(data, size); };
+    }
+
+  private:
+    enum class State { Start, BeforeRecord, AfterComma, InRecord,
+                       AfterRecord, End };
+
+    RecordTextCallback callback_;
+    State state_;
+    bool is_array_;
+
+    // Record scanning state
+    bool is_scalar_;
+    size_t depth_;
+    bool in_string_;
+    bool escaped_;
+    ScanKernel kernel_;
+    ScanMaskFunction get_mask_;
+
+    // Beginning of a record that spans multiple chunks
+    std::string record_buffer_;
+
+    size_t num_records_;
+
+    static bool isWhitespace(char c) {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    static bool isDelimiter(char c) {
+        return c == ',' || c == ']' || isWhitespace(c);
+    }
+
+    void fail(const std::string& msg) const {
+        throw parsing_error { "invalid query result after record "
+                              + std::to_string(num_records_) + ": " + msg };
+    }
+
+    void startRecord(char c) {
+        state_ = State::InRecord;
+        is_scalar_ = (c != '{' && c != '[');
+        depth_ = 0;
+        in_string_ = false;
+        escaped_ = false;
+    }
+
+    // Scans the record from the current character; returns the
+    // position of its last character (of the delimiter following it,
+    // for numbers and literals) and sets the AfterRecord state, or
+    // returns end in case the record continues in the next chunk
+    const char* scanRecord(const char* current, const char* end) {
+        if (!is_scalar_) {
+            current = scanBlocks(current, end);
+            if (state_ == State::AfterRecord) {
+                return current;
+            }
+        }
+        for (; current != end; current++) {
+            char c { *current };
+            if (in_string_) {
+                if (escaped_) {
+                    escaped_ = false;
+                } else if (c == '\\') {
+                    escaped_ = true;
+                } else if (c == '"') {
+                    in_string_ = false;
+                    if (is_scalar_ && depth_ == 0) {
+                        // String record; include the closing quote
+                        state_ = State::AfterRecord;
+                        is_scalar_ = false;
+                        return current;
+                    }
+                }
+                continue;
+            }
+
+            switch (c) {
+                case '"':
+                    in_string_ = true;
+                    break;
+                case '{':
+                case '[':
+                    depth_++;
+                    break;
+                case '}':
+                case ']':
+                    if (is_scalar_) {
+                        state_ = State::AfterRecord;
+                        return current;
+                    }
+                    if (--depth_ == 0) {
+                        state_ = State::AfterRecord;
+                        return current;
+                    }
+                    break;
+                default:
+                    if (is_scalar_ && isDelimiter(c)) {
+                        state_ = State::AfterRecord;
+                        return current;
+                    }
+            }
+        }
+        return end;
+    }
+
+    // Scans the whole blocks of an object or array, as scanRecord;
+    // returns the position of the first byte not scanned otherwise
+    const char* scanBlocks(const char* current, const char* end) {
+        while (static_cast<size_t>(end - current) >= SCAN_BLOCK_SIZE) {
+            uint64_t mask { get_mask_(current) };
+            if (escaped_) {
+                // The backslash ended the previous block
+                mask &= ~uint64_t { 1 };
+                escaped_ = false;
+            }
+            while (mask != 0) {
+                unsigned int index { getLeastSignificantBit(mask) };
+                mask &= mask - 1;
+                char c { current[index] };
+                if (in_string_) {
+                    if (c == '"') {
+                        in_string_ = false;
+                    } else if (c == '\\') {
+                        if (index + 1 == SCAN_BLOCK_SIZE) {
+                            escaped_ = true;
+                        } else {
+                            mask &= ~(uint64_t { 1 } << (index + 1));
+                        }
+                    }
+                    continue;
+                }
+
+                switch (c) {
+                    case '"':
+                        in_string_ = true;
+                        break;
+                    case '{':
+                    case '[':
+                        depth_++;
+                        break;
+                    case '}':
+                    case ']':
+                        if (--depth_ == 0) {
+                            state_ = State::AfterRecord;
+                            return current + index;
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+            current += SCAN_BLOCK_SIZE;
+        }
+        return current;
+    }
+
+    static unsigned int getLeastSignificantBit(uint64_t value) {
+#if defined(__GNUC__)
+        return static_cast<unsigned int>(__builtin_ctzll(value));
+#else
+        unsigned int lsb { 0 };
+        while ((value & 1) == 0) {
+            value >>= 1;
+            lsb++;
+        }
+        return lsb;
+#endif
+    }
+
+    // Emits the record ending at last (included, unless the record is
+    // a number or literal); the beginning of the record may be
+    // buffered
+    void emit(const char* record_start, const char* last) {
+        const char* record_end { last };
+        if (last != nullptr && !is_scalar_) {
+            record_end++;
+        }
+
+        if (record_buffer_.empty()) {
+            callback_(record_start, record_end - record_start);
+        } else {
+            if (record_start != nullptr) {
+                record_buffer_.append(record_start, record_end);
+            }
+            callback_(record_buffer_.data(), record_buffer_.size());
+            // NB: the capacity is kept for the next record
+            record_buffer_.clear();
+        }
+        num_records_++;
+    }
+};
+
+//
+// ResultParser
+//
+
+// Consumer of a parsed record; the record is valid only for the
+// duration of the call
+using RecordCallback = std::function<void(const JsonValue& record)>;
+
+// Incremental parser of a query result; it calls the record callback
+// with each record of the result as soon as the record is received
+class ResultParser {
+  public:
+    /// Only the fields of the projection, if any, are kept in the
+    /// records; the others are skipped without being decoded
+    explicit ResultParser(RecordCallback callback,
+                          std::vector<std::string> projection = {})
+            : callback_ { std::move(callback) },
+              projection_ { std::move(projection) },
+              splitter_ { [this](const char* data, size_t size) {
+                              callback_(parseJson(data, size, projection_));
+                          } } {
+    }
+
+    ResultParser(const ResultParser&) = delete;
+    ResultParser& operator=(const ResultParser&) = delete;
+
+    /// Throws a parsing_error in case the result is malformed
+    void feed(const char* data, size_t size) {
+        splitter_.feed(data, size);
+    }
+
+    /// Throws a parsing_error in case the result is truncated
+    void finish() {
+        splitter_.finish();
+    }
+
+    size_t getNumRecords() const {
+        return splitter_.getNumRecords();
+    }
+
+    /// Returns a sink that feeds the parser, to be passed to
+    /// PuppetdbConnector::performQuery
+    ChunkSink sink() {
+        return [this](const char* data, size_t size) { feed(data, size); };
+    }
+
+  private:
+    RecordCallback callback_;
+    std::vector<std::string> projection_;
+    RecordSplitter splitter_;
+};
+
+/// Performs the query and calls the callback with each record of the
+/// result, as soon as it is received; returns the number of records.
+/// The records only contain the fields of the projection of the query,
+/// if any.
+/// Throws a processing_error in case of failure (a parsing_error in
+/// case the result is malformed)
+inline size_t forEachRecord(PuppetdbConnector& connector, Query& query,
+                            RecordCallback callback) {
+    ResultParser parser { std::move(callback), query.getProjection() };
+    connector.performQuery(query, parser.sink());
+    parser.finish();
+    return parser.getNumRecords();
+}
+
+}  // namespace LibPuppetdb
+
+#endif  // LIBPUPPETDB_INCLUDE_PUPPETDB_RESULT_PARSER_H_
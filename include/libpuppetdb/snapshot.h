@@ -0,0 +1,705 @@
+#ifndef LIBPUPPETDB_INCLUDE_PUPPETDB_SNAPSHOT_H_
+#define LIBPUPPETDB_INCLUDE_PUPPETDB_SNAPSHOT_H_
+
+/*
+ *                        libpuppetdb - snapshots
+ *
+ * Optional on-disk snapshots of query results, for results larger
+ * than the memory or analysed repeatedly. SnapshotWriter is a sink
+ * that encodes the records in a compact binary format as they are
+ * received; Snapshot maps the file in memory and gives random access
+ * to the records, which are read in place, without parsing.
+ *
+ * File layout (integers in the byte order of the writer, which the
+ * reader checks):
+ *
+ *   header      "PDBSNAP1", version (u32), byte order mark (u32)
+ *   records     encoded values, back to back
+ *   strings     offsets (u64 x (num_strings + 1)), then the bytes
+ *   index       offset of each record (u64 x num_records)
+ *   footer      num_records, strings offset, num_strings,
+ *               index offset (u64 each), "PDBSNAP1"
+ *
+ * Each value is a tag byte followed by its payload:
+ *
+ *   null, false, true   -
+ *   integer             i64
+ *   number              u32 size, json text (not an exact i64)
+ *   string              u32 size, bytes
+ *   string ref          u32 id in the string table
+ *   array               u32 count, u32 size of the elements, elements
+ *   object              u32 count, u32 size of the members, members
+ *                       (a string or string ref key, then the value)
+ *
+ * The short strings (keys, certnames, fact names, ...) are interned in
+ * the string table, up to a maximum number of distinct strings.
+ *
+ * The snapshot is written to "<path>.tmp" and renamed once complete.
+ * The structure of a snapshot is checked when it is opened, the
+ * records are not. POSIX only.
+ *
+ */
+
+#include "libpuppetdb.h"
+#include "result_parser.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace LibPuppetdb {
+
+static const char SNAPSHOT_MAGIC[] { "PDBSNAP1" };
+static const size_t SNAPSHOT_MAGIC_SIZE { 8 };
+static const uint32_t SNAPSHOT_VERSION { 1 };
+static const uint32_t SNAPSHOT_BYTE_ORDER_MARK { 0x01020304 };
+static const size_t SNAPSHOT_HEADER_SIZE { 16 };
+static const size_t SNAPSHOT_FOOTER_SIZE { 40 };
+
+// Only the strings up to this size are interned
+static const size_t SNAPSHOT_MAX_INTERNED_SIZE { 64 };
+
+// Default maximum number of distinct interned strings
+static const size_t SNAPSHOT_MAX_STRINGS_DEFAULT { 1024 * 1024 };
+
+enum class SnapshotTag : uint8_t { Null, False, True, Integer, Number,
+                                   String, StringRef, Array, Object };
+
+//
+// SnapshotWriter
+//
+
+class SnapshotWriter {
+  public:
+    SnapshotWriter() = delete;
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    /// Creates the temporary file and writes the header
+    /// Throws a processing_error in case of failure
+    explicit SnapshotWriter(std::string path,
+                            size_t max_strings = SNAPSHOT_MAX_STRINGS_DEFAULT)
+            : path_ { std::move(path) },
+              tmp_path_ { path_ + ".tmp" },
+              file_ { std::fopen(tmp_path_.c_str(), "wb") },
+              max_strings_ { max_strings },
+              offset_ { 0 },
+              record_ {},
+              string_ids_ {},
+              string_offsets_ { 0 },
+              string_bytes_ {},
+              index_ {},
+              splitter_ { [this](const char* data, size_t size) {
+                              addRecord(parseJson(data, size));
+                          } } {
+        if (file_ == nullptr) {
+            throw processing_error { "failed to create the snapshot "
+                                     + tmp_path_ };
+        }
+        std::string header { SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE };
+        appendScalar(header, SNAPSHOT_VERSION);
+        appendScalar(header, SNAPSHOT_BYTE_ORDER_MARK);
+        write(header);
+    }
+
+    /// Removes the temporary file, unless the snapshot was finished
+    ~SnapshotWriter() {
+        if (file_ != nullptr) {
+            std::fclose(file_);
+            std::remove(tmp_path_.c_str());
+        }
+    }
+
+    /// Throws a parsing_error in case the result is malformed, or a
+    /// processing_error in case of a write failure
+    void feed(const char* data, size_t size) {
+        splitter_.feed(data, size);
+    }
+
+    /// Returns a sink that feeds the writer, to be passed to
+    /// PuppetdbConnector::performQuery
+    ChunkSink sink() {
+        return [this](const char* data, size_t size) { feed(data, size); };
+    }
+
+    /// Appends a record
+    /// Throws a processing_error in case of a write failure
+    void addRecord(const JsonValue& record) {
+        record_.clear();
+        encode(record);
+        index_.push_back(offset_);
+        write(record_);
+    }
+
+    /// Writes the string table, the index, and the footer, then
+    /// renames the snapshot to its final path; returns the number of
+    /// records
+    /// Throws a parsing_error in case the result is truncated, or a
+    /// processing_error in case of a write failure
+    size_t finish() {
+        splitter_.finish();
+
+        std::string buffer {};
+        pad(buffer);
+        uint64_t strings_offset { offset_ + buffer.size() };
+        for (uint64_t string_offset : string_offsets_) {
+            appendScalar(buffer, string_offset);
+        }
+        write(buffer);
+        write(string_bytes_);
+
+        buffer.clear();
+        pad(buffer);
+        uint64_t index_offset { offset_ + buffer.size() };
+        for (uint64_t record_offset : index_) {
+            appendScalar(buffer, record_offset);
+        }
+        appendScalar(buffer, static_cast<uint64_t>(index_.size()));
+        appendScalar(buffer, strings_offset);
+        appendScalar(buffer, static_cast<uint64_t>(string_offsets_.size() - 1));
+        appendScalar(buffer, index_offset);
+        buffer.append(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+        write(buffer);
+
+        int close_result { std::fclose(file_) };
+        file_ = nullptr;
+        if (close_result != 0
+                || std::rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+            std::remove(tmp_path_.c_str());
+            throw processing_error { "failed to write the snapshot " + path_ };
+        }
+        return index_.size();
+    }
+
+    size_t getNumRecords() const {
+        return index_.size();
+    }
+
+  private:
+    std::string path_;
+    std::string tmp_path_;
+    std::FILE* file_;
+    size_t max_strings_;
+    uint64_t offset_;
+    std::string record_;
+    std::unordered_map<std::string, uint32_t> string_ids_;
+    std::vector<uint64_t> string_offsets_;
+    std::string string_bytes_;
+    std::vector<uint64_t> index_;
+    RecordSplitter splitter_;
+
+    template <typename T>
+    static void appendScalar(std::string& buffer, T value) {
+        buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static void patchScalar(std::string& buffer, size_t position, T value) {
+        std::memcpy(&buffer[position], &value, sizeof(T));
+    }
+
+    // Aligns the next section on 8 bytes
+    void pad(std::string& buffer) const {
+        buffer.append(static_cast<size_t>((8 - offset_ % 8) % 8), '\0');
+    }
+
+    void write(const std::string& data) {
+        if (!data.empty()
+                && std::fwrite(data.data(), 1, data.size(), file_)
+                   != data.size()) {
+            throw processing_error { "failed to write the snapshot "
+                                     + tmp_path_ };
+        }
+        offset_ += data.size();
+    }
+
+    static uint32_t checkSize(size_t size) {
+        if (size > UINT32_MAX) {
+            throw processing_error { "snapshot value too large" };
+        }
+        return static_cast<uint32_t>(size);
+    }
+
+    void encodeText(SnapshotTag tag, const std::string& text) {
+        record_ += static_cast<char>(tag);
+        appendScalar(record_, checkSize(text.size()));
+        record_ += text;
+    }
+
+    void encodeString(const std::string& text) {
+        if (text.size() <= SNAPSHOT_MAX_INTERNED_SIZE) {
+            auto it = string_ids_.find(text);
+            if (it == string_ids_.end() && string_ids_.size() < max_strings_) {
+                string_bytes_ += text;
+                string_offsets_.push_back(string_bytes_.size());
+                it = string_ids_.emplace(
+                    text, static_cast<uint32_t>(string_ids_.size())).first;
+            }
+            if (it != string_ids_.end()) {
+                record_ += static_cast<char>(SnapshotTag::StringRef);
+                appendScalar(record_, it->second);
+                return;
+            }
+        }
+        encodeText(SnapshotTag::String, text);
+    }
+
+    void encodeNumber(const JsonValue& value) {
+        std::string text { value.serialize() };
+        char* end { nullptr };
+        errno = 0;
+        long long integer { std::strtoll(text.c_str(), &end, 10) };
+        // NB: the integers are stored as such only if they are printed
+        // back identically
+        if (errno == 0 && *end == '\0' && std::to_string(integer) == text) {
+            record_ += static_cast<char>(SnapshotTag::Integer);
+            appendScalar(record_, static_cast<int64_t>(integer));
+        } else {
+            encodeText(SnapshotTag::Number, text);
+        }
+    }
+
+    void encode(const JsonValue& value) {
+        switch (value.getType()) {
+            case JsonType::Null:
+                record_ += static_cast<char>(SnapshotTag::Null);
+                break;
+            case JsonType::Bool:
+                record_ += static_cast<char>(value.asBool() ? SnapshotTag::True
+                                                            : SnapshotTag::False);
+                break;
+            case JsonType::Number:
+                encodeNumber(value);
+                break;
+            case JsonType::String:
+                encodeString(value.asString());
+                break;
+            case JsonType::Array:
+            case JsonType::Object: {
+                record_ += static_cast<char>(value.isArray()
+                                             ? SnapshotTag::Array
+                                             : SnapshotTag::Object);
+                size_t position { record_.size() };
+                appendScalar(record_, checkSize(value.size()));
+                appendScalar(record_, uint32_t { 0 });
+                if (value.isArray()) {
+                    for (const auto& element : value.getElements()) {
+                        encode(element);
+                    }
+                } else {
+                    for (const auto& member : value.getMembers()) {
+                        encodeString(member.first);
+                        encode(member.second);
+                    }
+                }
+                patchScalar(record_, position + 4,
+                            checkSize(record_.size() - position - 8));
+                break;
+            }
+        }
+    }
+};
+
+/// Performs the query and writes its result to a snapshot; returns
+/// the number of records
+/// Throws a processing_error in case of failure (a parsing_error in
+/// case the result is malformed)
+inline size_t writeSnapshot(PuppetdbConnector& connector, Query& query,
+                            const std::string& path) {
+    SnapshotWriter writer { path };
+    connector.performQuery(query, writer.sink());
+    return writer.finish();
+}
+
+//
+// Snapshot
+//
+
+class Snapshot;
+
+// Read-only view of a value of a snapshot, valid as long as the
+// snapshot is open; a default constructed or missing value is invalid
+class SnapshotValue {
+  public:
+    SnapshotValue() : snapshot_ { nullptr }, data_ { nullptr } {}
+
+    SnapshotValue(const Snapshot* snapshot, const char* data)
+            : snapshot_ { snapshot }, data_ { data } {
+    }
+
+    /// Returns false for a missing value (see find)
+    explicit operator bool() const {
+        return data_ != nullptr;
+    }
+
+    JsonType getType() const {
+        switch (getTag()) {
+            case SnapshotTag::Null:
+                return JsonType::Null;
+            case SnapshotTag::False:
+            case SnapshotTag::True:
+                return JsonType::Bool;
+            case SnapshotTag::Integer:
+            case SnapshotTag::Number:
+                return JsonType::Number;
+            case SnapshotTag::String:
+            case SnapshotTag::StringRef:
+                return JsonType::String;
+            case SnapshotTag::Array:
+                return JsonType::Array;
+            default:
+                return JsonType::Object;
+        }
+    }
+
+    bool isNull() const { return getType() == JsonType::Null; }
+    bool isBool() const { return getType() == JsonType::Bool; }
+    bool isNumber() const { return getType() == JsonType::Number; }
+    bool isString() const { return getType() == JsonType::String; }
+    bool isArray() const { return getType() == JsonType::Array; }
+    bool isObject() const { return getType() == JsonType::Object; }
+
+    /// Throws a parsing_error in case the value is not a boolean
+    bool asBool() const {
+        checkType(JsonType::Bool, "a boolean");
+        return getTag() == SnapshotTag::True;
+    }
+
+    /// Throws a parsing_error in case the value is not a number
+    long long asInt() const {
+        checkType(JsonType::Number, "a number");
+        if (getTag() == SnapshotTag::Integer) {
+            return static_cast<long long>(read<int64_t>(data_ + 1));
+        }
+        return std::strtoll(getText().toString().c_str(), nullptr, 10);
+    }
+
+    /// Throws a parsing_error in case the value is not a number
+    double asDouble() const {
+        checkType(JsonType::Number, "a number");
+        if (getTag() == SnapshotTag::Integer) {
+            return static_cast<double>(read<int64_t>(data_ + 1));
+        }
+        return std::strtod(getText().toString().c_str(), nullptr);
+    }
+
+    /// Throws a parsing_error in case the value is not a string
+    inline StringView asString() const;
+
+    /// Returns the number of elements or members (0 for the other
+    /// values)
+    size_t size() const {
+        return isArray() || isObject() ? read<uint32_t>(data_ + 1) : 0;
+    }
+
+    /// Returns the element; the preceding elements are skipped
+    /// Throws a parsing_error in case the value is not an array or the
+    /// index is out of range
+    SnapshotValue operator[](size_t idx) const {
+        checkType(JsonType::Array, "an array");
+        if (idx >= size()) {
+            throw parsing_error { "array index out of range" };
+        }
+        const char* current { data_ + 9 };
+        for (size_t count = 0; count < idx; count++) {
+            current += getEncodedSize(current);
+        }
+        return SnapshotValue { snapshot_, current };
+    }
+
+    /// Returns the member with the key, or an invalid value
+    /// Throws a parsing_error in case the value is not an object
+    SnapshotValue find(const std::string& key) const {
+        SnapshotValue found {};
+        forEachMember([&](StringView name, SnapshotValue value) {
+            if (!found && name.size == key.size()
+                    && std::memcmp(name.data, key.data(), key.size()) == 0) {
+                found = value;
+            }
+        });
+        return found;
+    }
+
+    /// Calls f(SnapshotValue) with each element
+    /// Throws a parsing_error in case the value is not an array
+    template <typename Function>
+    void forEachElement(Function f) const {
+        checkType(JsonType::Array, "an array");
+        const char* current { data_ + 9 };
+        for (size_t count = size(); count > 0; count--) {
+            f(SnapshotValue { snapshot_, current });
+            current += getEncodedSize(current);
+        }
+    }
+
+    /// Calls f(StringView key, SnapshotValue) with each member
+    /// Throws a parsing_error in case the value is not an object
+    template <typename Function>
+    void forEachMember(Function f) const {
+        checkType(JsonType::Object, "an object");
+        const char* current { data_ + 9 };
+        for (size_t count = size(); count > 0; count--) {
+            SnapshotValue key { snapshot_, current };
+            current += getEncodedSize(current);
+            f(key.asString(), SnapshotValue { snapshot_, current });
+            current += getEncodedSize(current);
+        }
+    }
+
+    /// Copies the value in a JsonValue
+    JsonValue toJsonValue() const {
+        switch (getType()) {
+            case JsonType::Null:
+                return JsonValue {};
+            case JsonType::Bool:
+                return JsonValue::makeBool(asBool());
+            case JsonType::Number:
+                return JsonValue::makeNumber(
+                    getTag() == SnapshotTag::Integer
+                    ? std::to_string(read<int64_t>(data_ + 1))
+                    : getText().toString());
+            case JsonType::String:
+                return JsonValue::makeString(asString().toString());
+            case JsonType::Array: {
+                JsonValue array { JsonType::Array };
+                forEachElement([&](SnapshotValue element) {
+                    array.append(element.toJsonValue());
+                });
+                return array;
+            }
+            default: {
+                JsonValue object { JsonType::Object };
+                forEachMember([&](StringView key, SnapshotValue value) {
+                    object.set(key.toString(), value.toJsonValue());
+                });
+                return object;
+            }
+        }
+    }
+
+    /// Returns the json text of the value
+    std::string serialize() const {
+        return toJsonValue().serialize();
+    }
+
+  private:
+    const Snapshot* snapshot_;
+    const char* data_;
+
+    template <typename T>
+    static T read(const char* data) {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    SnapshotTag getTag() const {
+        if (data_ == nullptr) {
+            throw parsing_error { "missing value" };
+        }
+        return static_cast<SnapshotTag>(*data_);
+    }
+
+    // Text of a number or of an inline string
+    StringView getText() const {
+        return StringView { data_ + 5, read<uint32_t>(data_ + 1) };
+    }
+
+    static size_t getEncodedSize(const char* data) {
+        switch (static_cast<SnapshotTag>(*data)) {
+            case SnapshotTag::Integer:
+                return 9;
+            case SnapshotTag::Number:
+            case SnapshotTag::String:
+                return 5 + read<uint32_t>(data + 1);
+            case SnapshotTag::StringRef:
+                return 5;
+            case SnapshotTag::Array:
+            case SnapshotTag::Object:
+                return 9 + read<uint32_t>(data + 5);
+            default:
+                return 1;
+        }
+    }
+
+    void checkType(JsonType type, const char* type_name) const {
+        if (getType() != type) {
+            throw parsing_error { std::string { "the value is not " }
+                                  + type_name };
+        }
+    }
+};
+
+// A snapshot, mapped in memory
+class Snapshot {
+  public:
+    Snapshot() = delete;
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    /// Maps the snapshot and checks its structure
+    /// Throws a processing_error in case the file cannot be mapped, or
+    /// a parsing_error in case it is not a valid snapshot
+    explicit Snapshot(const std::string& path)
+            : data_ { nullptr },
+              size_ { 0 },
+              num_records_ { 0 },
+              strings_offset_ { 0 },
+              num_strings_ { 0 },
+              index_offset_ { 0 } {
+        int fd { ::open(path.c_str(), O_RDONLY) };
+        if (fd < 0) {
+            throw processing_error { "failed to open the snapshot " + path };
+        }
+        struct stat file_stat;
+        if (::fstat(fd, &file_stat) != 0) {
+            ::close(fd);
+            throw processing_error { "failed to open the snapshot " + path };
+        }
+        size_ = static_cast<size_t>(file_stat.st_size);
+        if (size_ < SNAPSHOT_HEADER_SIZE + SNAPSHOT_FOOTER_SIZE) {
+            ::close(fd);
+            throw parsing_error { "not a snapshot: " + path };
+        }
+        void* data { ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0) };
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw processing_error { "failed to map the snapshot " + path };
+        }
+        data_ = static_cast<const char*>(data);
+        try {
+            checkStructure(path);
+        } catch (...) {
+            ::munmap(const_cast<char*>(data_), size_);
+            throw;
+        }
+    }
+
+    ~Snapshot() {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+
+    /// Returns the number of records
+    size_t size() const {
+        return static_cast<size_t>(num_records_);
+    }
+
+    /// Returns the record
+    /// Throws a parsing_error in case the index is out of range
+    SnapshotValue operator[](size_t idx) const {
+        if (idx >= num_records_) {
+            throw parsing_error { "record index out of range" };
+        }
+        return SnapshotValue { this, data_ + read(index_offset_ + 8 * idx) };
+    }
+
+    /// Calls f(SnapshotValue) with each record, in order
+    template <typename Function>
+    void forEach(Function f) const {
+        for (size_t idx = 0; idx < num_records_; idx++) {
+            f((*this)[idx]);
+        }
+    }
+
+    size_t getNumStrings() const {
+        return static_cast<size_t>(num_strings_);
+    }
+
+    /// Returns the interned string
+    /// Throws a parsing_error in case the id is out of range
+    StringView getString(uint32_t id) const {
+        if (id >= num_strings_) {
+            throw parsing_error { "invalid string id" };
+        }
+        uint64_t start { read(strings_offset_ + 8 * id) };
+        uint64_t end { read(strings_offset_ + 8 * (id + 1)) };
+        return StringView { getStringBytes() + start,
+                            static_cast<size_t>(end - start) };
+    }
+
+  private:
+    const char* data_;
+    size_t size_;
+    uint64_t num_records_;
+    uint64_t strings_offset_;
+    uint64_t num_strings_;
+    uint64_t index_offset_;
+
+    uint64_t read(uint64_t offset) const {
+        uint64_t value;
+        std::memcpy(&value, data_ + offset, sizeof(value));
+        return value;
+    }
+
+    const char* getStringBytes() const {
+        return data_ + strings_offset_ + 8 * (num_strings_ + 1);
+    }
+
+    void checkStructure(const std::string& path) {
+        uint32_t version;
+        uint32_t byte_order_mark;
+        std::memcpy(&version, data_ + SNAPSHOT_MAGIC_SIZE, 4);
+        std::memcpy(&byte_order_mark, data_ + SNAPSHOT_MAGIC_SIZE + 4, 4);
+        const char* footer { data_ + size_ - SNAPSHOT_FOOTER_SIZE };
+        if (std::memcmp(data_, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0
+                || std::memcmp(footer + 32, SNAPSHOT_MAGIC,
+                               SNAPSHOT_MAGIC_SIZE) != 0) {
+            throw parsing_error { "not a snapshot (or truncated): " + path };
+        }
+        if (version != SNAPSHOT_VERSION) {
+            throw parsing_error { "unsupported snapshot version: " + path };
+        }
+        if (byte_order_mark != SNAPSHOT_BYTE_ORDER_MARK) {
+            throw parsing_error { "snapshot written with another byte order: "
+                                  + path };
+        }
+
+        uint64_t footer_offset { size_ - SNAPSHOT_FOOTER_SIZE };
+        num_records_ = read(footer_offset);
+        strings_offset_ = read(footer_offset + 8);
+        num_strings_ = read(footer_offset + 16);
+        index_offset_ = read(footer_offset + 24);
+        // NB: the counts are checked first, so that the sizes below
+        // cannot overflow
+        bool valid { num_records_ <= size_ / 8 && num_strings_ <= size_ / 8
+                     && strings_offset_ >= SNAPSHOT_HEADER_SIZE
+                     && strings_offset_ + 8 * (num_strings_ + 1)
+                        <= index_offset_
+                     && index_offset_ + 8 * num_records_ == footer_offset };
+        if (valid) {
+            uint64_t bytes_offset { strings_offset_ + 8 * (num_strings_ + 1) };
+            valid = read(strings_offset_) == 0
+                    && bytes_offset + read(strings_offset_ + 8 * num_strings_)
+                       <= index_offset_;
+        }
+        for (uint64_t idx = 0; valid && idx < num_strings_; idx++) {
+            valid = read(strings_offset_ + 8 * idx)
+                    <= read(strings_offset_ + 8 * (idx + 1));
+        }
+        for (uint64_t idx = 0; valid && idx < num_records_; idx++) {
+            uint64_t offset { read(index_offset_ + 8 * idx) };
+            valid = offset >= SNAPSHOT_HEADER_SIZE && offset < strings_offset_;
+        }
+        if (!valid) {
+            throw parsing_error { "invalid snapshot: " + path };
+        }
+    }
+};
+
+inline StringView SnapshotValue::asString() const {
+    checkType(JsonType::String, "a string");
+    if (getTag() == SnapshotTag::StringRef) {
+        return snapshot_->getString(read<uint32_t>(data_ + 1));
+    }
+    return getText();
+}
+
+}  // namespace LibPuppetdb
+
+#endif  // LIBPUPPETDB_INCLUDE_PUPPETDB_SNAPSHOT_H_
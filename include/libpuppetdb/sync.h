@@ -0,0 +1,386 @@
+#ifndef LIBPUPPETDB_INCLUDE_PUPPETDB_SYNC_H_
+#define LIBPUPPETDB_INCLUDE_PUPPETDB_SYNC_H_
+
+/*
+ *                        libpuppetdb - incremental sync
+ *
+ * Optional helper to keep a local copy of the records of a query
+ * (e.g. nodes, factsets, reports) up to date without downloading them
+ * all on each run. IncrementalSync tracks the high-water mark of a
+ * timestamp field of the records (producer_timestamp,
+ * report_timestamp, ...) and rewrites the query into
+ *
+ *   ["and", <query>, [">=", <timestamp field>, <watermark>]]
+ *
+ * The records received are merged by their key field into a local
+ * store, which is saved along with the watermark in a state file, if
+ * any. The records with the watermark timestamp are received again on
+ * the next run; a lookback period also re-fetches the records stored
+ * late with an older timestamp. Deleted records are not detected: a
+ * periodic full sync (reset) removes them.
+ *
+ */
+
+#include "libpuppetdb.h"
+#include "result_parser.h"
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+
+namespace LibPuppetdb {
+
+//
+// Timestamps
+//
+
+/// Parses an ISO 8601 timestamp, as returned by PuppetDB (e.g.
+/// 2015-06-19T23:05:37.125Z or 2015-06-19T23:05:37+01:00) into
+/// milliseconds since the epoch
+/// Returns false in case the timestamp is not valid
+inline bool parseTimestamp(const std::string& text, int64_t& milliseconds) {
+    int year, month, day, hour, minute, second;
+    int consumed { 0 };
+    if (std::sscanf(text.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n", &year, &month,
+                    &day, &hour, &minute, &second, &consumed) != 6
+            || consumed != 19 || month < 1 || month > 12 || day < 1
+            || day > 31 || hour > 23 || minute > 59 || second > 60) {
+        return false;
+    }
+    size_t position { 19 };
+    int64_t fraction { 0 };
+    if (position < text.size() && text[position] == '.') {
+        int64_t scale { 100 };
+        for (position++; position < text.size()
+                && std::isdigit(static_cast<unsigned char>(text[position]));
+                position++) {
+            fraction += (text[position] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    int64_t offset_minutes { 0 };
+    if (position < text.size() && (text[position] == '+'
+                                   || text[position] == '-')) {
+        int offset_hour, offset_minute;
+        if (std::sscanf(text.c_str() + position + 1, "%2d:%2d", &offset_hour,
+                        &offset_minute) != 2 || position + 6 != text.size()) {
+            return false;
+        }
+        offset_minutes = (text[position] == '+' ? 1 : -1)
+                         * (offset_hour * 60 + offset_minute);
+    } else if (position + 1 != text.size() || text[position] != 'Z') {
+        return false;
+    }
+
+    // Days since the epoch of the civil date (proleptic Gregorian)
+    int64_t y { month <= 2 ? year - 1 : year };
+    int64_t era { (y >= 0 ? y : y - 399) / 400 };
+    int64_t year_of_era { y - era * 400 };
+    int64_t day_of_year { (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5
+                          + day - 1 };
+    int64_t day_of_era { year_of_era * 365 + year_of_era / 4
+                         - year_of_era / 100 + day_of_year };
+    int64_t days { era * 146097 + day_of_era - 719468 };
+
+    milliseconds = ((days * 24 + hour) * 60 + minute - offset_minutes)
+                   * 60000 + second * 1000 + fraction;
+    return true;
+}
+
+/// Formats milliseconds since the epoch as an ISO 8601 UTC timestamp,
+/// e.g. 2015-06-19T23:05:37.125Z
+inline std::string formatTimestamp(int64_t milliseconds) {
+    int64_t days { milliseconds / 86400000 };
+    int64_t remainder { milliseconds % 86400000 };
+    if (remainder < 0) {
+        days--;
+        remainder += 86400000;
+    }
+
+    // Civil date of the days since the epoch
+    int64_t z { days + 719468 };
+    int64_t era { (z >= 0 ? z : z - 146096) / 146097 };
+    int64_t day_of_era { z - era * 146097 };
+    int64_t year_of_era { (day_of_era - day_of_era / 1460
+                           + day_of_era / 36524 - day_of_era / 146096) / 365 };
+    int64_t day_of_year { day_of_era - (365 * year_of_era + year_of_era / 4
+                                        - year_of_era / 100) };
+    int64_t mp { (5 * day_of_year + 2) / 153 };
+    int64_t day { day_of_year - (153 * mp + 2) / 5 + 1 };
+    int64_t month { mp < 10 ? mp + 3 : mp - 9 };
+    int64_t year { year_of_era + era * 400 + (month <= 2 ? 1 : 0) };
+
+    // NB: sized for any int64_t, not only for 4-digit years
+    char text[96];
+    std::snprintf(text, sizeof(text), "%04lld-%02lld-%02lldT%02lld:%02lld:"
+                  "%02lld.%03lldZ", static_cast<long long>(year),
+                  static_cast<long long>(month), static_cast<long long>(day),
+                  static_cast<long long>(remainder / 3600000),
+                  static_cast<long long>(remainder / 60000 % 60),
+                  static_cast<long long>(remainder / 1000 % 60),
+                  static_cast<long long>(remainder % 1000));
+    return text;
+}
+
+//
+// IncrementalSync
+//
+
+struct SyncStats {
+    // Records received
+    size_t num_records;
+    // Records added to the store, or that differ from the stored ones
+    size_t num_changed;
+    // The query was not a delta query
+    bool full;
+};
+
+class IncrementalSync {
+  public:
+    IncrementalSync() = delete;
+
+    /// The query string must be a json query (or empty)
+    /// Throws a query_error in case the key or timestamp field is an
+    /// empty string
+    explicit IncrementalSync(Query query,
+                             std::string key_field = "certname",
+                             std::string timestamp_field = "producer_timestamp")
+            : query_ { std::move(query) },
+              key_field_ { std::move(key_field) },
+              timestamp_field_ { std::move(timestamp_field) },
+              lookback_ { 0 },
+              state_path_ {},
+              watermark_ {},
+              records_ {},
+              change_callback_ {} {
+        if (key_field_.empty()) {
+            throw query_error { "no key field specified" };
+        }
+        if (timestamp_field_.empty()) {
+            throw query_error { "no timestamp field specified" };
+        }
+    }
+
+    /// Sets the period before the watermark that the delta queries
+    /// also cover
+    void setLookback(std::chrono::milliseconds lookback) {
+        lookback_ = lookback;
+    }
+
+    std::chrono::milliseconds getLookback() const {
+        return lookback_;
+    }
+
+    /// Sets the file where the watermark and the store are saved after
+    /// each sync, and loads them if the file exists
+    /// Throws a parsing_error in case the file is not a valid state
+    void setStatePath(std::string path) {
+        state_path_ = std::move(path);
+        std::ifstream input { state_path_, std::ios::binary };
+        if (input) {
+            std::string text { std::istreambuf_iterator<char> { input },
+                               std::istreambuf_iterator<char> {} };
+            load(text);
+        }
+    }
+
+    /// Sets a callback called with the json text of each record that
+    /// is added or changed, as it is merged
+    void setChangeCallback(RecordTextCallback callback) {
+        change_callback_ = std::move(callback);
+    }
+
+    /// Returns the highest timestamp of the records received, or an
+    /// empty string before the first sync
+    const std::string& getWatermark() const {
+        return watermark_;
+    }
+
+    void setWatermark(std::string watermark) {
+        watermark_ = std::move(watermark);
+    }
+
+    /// Returns the stored records (json texts) by key
+    const std::map<std::string, std::string>& getRecords() const {
+        return records_;
+    }
+
+    /// Clears the watermark and the store, so that the next sync
+    /// downloads all the records again
+    void reset() {
+        watermark_.clear();
+        records_.clear();
+    }
+
+    /// Returns the query of the next sync
+    /// Throws a query_error in case the query string is not a json
+    /// query
+    Query getDeltaQuery() {
+        std::string query_string { query_.getQueryString() };
+        size_t start { query_string.find_first_not_of(" \t\r\n") };
+        if (start != std::string::npos && query_string[start] != '[') {
+            throw query_error { "incremental sync requires a json query" };
+        }
+        if (!watermark_.empty()) {
+            std::string condition { "[\">=\"," };
+            JsonValue::serializeString(timestamp_field_, condition);
+            condition += ',';
+            JsonValue::serializeString(getLowerBound(), condition);
+            condition += ']';
+            query_string = start == std::string::npos
+                           ? condition
+                           : "[\"and\"," + query_string + "," + condition + "]";
+        }
+        Query delta_query { query_.getEndpoint(), query_string };
+        delta_query.setLimit(query_.getLimit());
+        delta_query.setOffset(query_.getOffset());
+        delta_query.setOrderBy(query_.getOrderBy());
+        delta_query.setIncludeTotal(query_.getIncludeTotal());
+        delta_query.setProjection(query_.getProjection());
+        return delta_query;
+    }
+
+    /// Performs the delta query and merges its records; the watermark
+    /// advances, and the state is saved, only once all the records are
+    /// merged, so that a failed sync is repeated by the next one
+    /// Throws a processing_error in case of failure (a parsing_error in
+    /// case a record has no string key field)
+    SyncStats sync(PuppetdbConnector& connector) {
+        Query delta_query { getDeltaQuery() };
+        SyncStats stats { 0, 0, watermark_.empty() };
+        std::string watermark { watermark_ };
+        RecordSplitter splitter {
+            [&](const char* data, size_t size) {
+                merge(parseJson(data, size), watermark, stats);
+            } };
+        connector.performQuery(delta_query, splitter.sink());
+        splitter.finish();
+
+        watermark_ = std::move(watermark);
+        if (!state_path_.empty()) {
+            save();
+        }
+        return stats;
+    }
+
+  private:
+    Query query_;
+    std::string key_field_;
+    std::string timestamp_field_;
+    std::chrono::milliseconds lookback_;
+    std::string state_path_;
+    std::string watermark_;
+    std::map<std::string, std::string> records_;
+    RecordTextCallback change_callback_;
+
+    std::string getLowerBound() const {
+        int64_t milliseconds { 0 };
+        if (lookback_.count() == 0
+                || !parseTimestamp(watermark_, milliseconds)) {
+            return watermark_;
+        }
+        return formatTimestamp(milliseconds - lookback_.count());
+    }
+
+    // Returns true if the timestamp is after the other one; timestamps
+    // that cannot be parsed are compared as strings
+    static bool isAfter(const std::string& timestamp,
+                        const std::string& other) {
+        int64_t milliseconds { 0 };
+        int64_t other_milliseconds { 0 };
+        if (parseTimestamp(timestamp, milliseconds)
+                && parseTimestamp(other, other_milliseconds)) {
+            return milliseconds > other_milliseconds;
+        }
+        return timestamp > other;
+    }
+
+    void merge(const JsonValue& record, std::string& watermark,
+               SyncStats& stats) {
+        const JsonValue* key { record.find(key_field_) };
+        if (key == nullptr || !key->isString()) {
+            throw parsing_error { "record has no " + key_field_ };
+        }
+        stats.num_records++;
+
+        const JsonValue* timestamp { record.find(timestamp_field_) };
+        if (timestamp != nullptr && timestamp->isString()
+                && (watermark.empty()
+                    || isAfter(timestamp->asString(), watermark))) {
+            watermark = timestamp->asString();
+        }
+
+        std::string text { record.serialize() };
+        std::string& stored = records_[key->asString()];
+        if (stored != text) {
+            stored = std::move(text);
+            stats.num_changed++;
+            if (change_callback_) {
+                change_callback_(stored.data(), stored.size());
+            }
+        }
+    }
+
+    // {"watermark": <string>, "records": [<record>, ...]}
+    void load(const std::string& text) {
+        JsonValue state { parseJson(text) };
+        const JsonValue* watermark { state.isObject()
+                                     ? state.find("watermark") : nullptr };
+        const JsonValue* records { state.isObject()
+                                   ? state.find("records") : nullptr };
+        if (watermark == nullptr || !watermark->isString()
+                || records == nullptr || !records->isArray()) {
+            throw parsing_error { "invalid sync state " + state_path_ };
+        }
+        std::map<std::string, std::string> loaded_records {};
+        for (const auto& record : records->getElements()) {
+            const JsonValue* key { record.isObject()
+                                   ? record.find(key_field_) : nullptr };
+            if (key == nullptr || !key->isString()) {
+                throw parsing_error { "invalid sync state " + state_path_ };
+            }
+            loaded_records[key->asString()] = record.serialize();
+        }
+        watermark_ = watermark->asString();
+        records_ = std::move(loaded_records);
+    }
+
+    // The state is replaced atomically
+    void save() const {
+        std::string text { "{\"watermark\":" };
+        JsonValue::serializeString(watermark_, text);
+        text += ",\"records\":[";
+        bool first { true };
+        for (const auto& record : records_) {
+            if (!first) {
+                text += ',';
+            }
+            first = false;
+            text += record.second;
+        }
+        text += "]}";
+
+        std::string tmp_path { state_path_ + ".tmp" };
+        {
+            std::ofstream output { tmp_path, std::ios::binary
+                                             | std::ios::trunc };
+            output.write(text.data(), static_cast<std::streamsize>(
+                                          text.size()));
+            output.close();
+            if (!output) {
+                std::remove(tmp_path.c_str());
+                throw processing_error { "failed to save the sync state "
+                                         + state_path_ };
+            }
+        }
+        if (std::rename(tmp_path.c_str(), state_path_.c_str()) != 0) {
+            std::remove(tmp_path.c_str());
+            throw processing_error { "failed to save the sync state "
+                                     + state_path_ };
+        }
+    }
+};
+
+}  // namespace LibPuppetdb
+
+#endif  // LIBPUPPETDB_INCLUDE_PUPPETDB_SYNC_H_
@@ -0,0 +1,161 @@
+/*
+    batch_query_test.cpp
+    ====================
+
+    libpuppetdb batch query unit tests.
+    Requires: googletest, googlemock.
+
+*/
+
+#include "../include/libpuppetdb/batch_query.h"
+#include "test_utils.h"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <cctype>
+
+namespace LibPuppetdb {
+
+// Testing the batch queries
+
+class BatchQueryTest : public ::testing::Test {};
+
+TEST_F(BatchQueryTest, invalidArguments) {
+    EXPECT_THROW(BatchQuery { "" }, query_error);
+    EXPECT_THROW((BatchQuery { "facts", "" }), query_error);
+}
+
+TEST_F(BatchQueryTest, orFolding) {
+    BatchQuery batch { "facts" };
+    batch.add("b");
+    batch.add("a");
+    batch.add("b");
+
+    auto queries = batch.getQueries();
+
+    EXPECT_EQ(2u, batch.size());
+    ASSERT_EQ(1u, queries.size());
+    EXPECT_EQ("facts", queries[0].first.getEndpoint());
+    EXPECT_EQ("[\"or\",[\"=\",\"certname\",\"a\"],[\"=\",\"certname\",\"b\"]]",
+              queries[0].first.getQueryString());
+    EXPECT_EQ((std::set<std::string> { "a", "b" }), queries[0].second);
+}
+
+TEST_F(BatchQueryTest, inArrayFoldingWithFilter) {
+    BatchQuery batch { "facts" };
+    batch.setFolding(BatchFolding::InArray);
+    batch.setFilter("[\"=\",\"name\",\"osfamily\"]");
+    batch.add("a\"b");
+
+    auto queries = batch.getQueries();
+
+    ASSERT_EQ(1u, queries.size());
+    EXPECT_EQ("[\"and\",[\"=\",\"name\",\"osfamily\"],"
+              "[\"in\",\"certname\",[\"array\",[\"a\\\"b\"]]]]",
+              queries[0].first.getQueryString());
+}
+
+TEST_F(BatchQueryTest, queriesAreSplitBySize) {
+    BatchQuery batch { "facts" };
+    batch.setMaxQuerySize(200);
+    for (int index = 0; index < 20; index++) {
+        batch.add("node" + std::to_string(index) + ".example.com");
+    }
+
+    auto queries = batch.getQueries();
+    size_t num_keys { 0 };
+
+    EXPECT_GT(queries.size(), 1u);
+    for (auto& query : queries) {
+        EXPECT_TRUE(parseJson(query.first.getQueryString()).isArray());
+        num_keys += query.second.size();
+    }
+    EXPECT_EQ(20u, num_keys);
+}
+
+TEST_F(BatchQueryTest, postedQueriesAreLarger) {
+    BatchQuery batch { "facts" };
+    batch.setMaxQuerySize(200);
+    batch.setMaxPostQuerySize(400);
+    for (int index = 0; index < 20; index++) {
+        batch.add("node" + std::to_string(index) + ".example.com");
+    }
+
+    auto queries = batch.getQueries(false);
+    auto posted_queries = batch.getQueries(true);
+
+    EXPECT_LT(posted_queries.size(), queries.size());
+    for (auto& query : posted_queries) {
+        EXPECT_LE(query.first.getQueryString().size(), 400u);
+    }
+}
+
+TEST_F(BatchQueryTest, queriesFillTheCap) {
+    BatchQuery batch { "facts" };
+    batch.setFolding(BatchFolding::InArray);
+    batch.setFilter("[\"=\",\"name\",\"osfamily\"]");
+    batch.add("a");
+    batch.add("b c");
+    batch.add("d");
+    std::string query_string {
+        batch.getQueries(true)[0].first.getQueryString() };
+    // Once URL encoded, each character but the letters takes 3
+    size_t encoded_size { 0 };
+    for (char c : query_string) {
+        encoded_size += std::isalpha(static_cast<unsigned char>(c)) ? 1 : 3;
+    }
+
+    batch.setMaxPostQuerySize(query_string.size());
+    EXPECT_EQ(1u, batch.getQueries(true).size());
+    batch.setMaxPostQuerySize(query_string.size() - 1);
+    EXPECT_EQ(2u, batch.getQueries(true).size());
+    batch.setMaxQuerySize(encoded_size);
+    EXPECT_EQ(1u, batch.getQueries(false).size());
+    batch.setMaxQuerySize(encoded_size - 1);
+    EXPECT_EQ(2u, batch.getQueries(false).size());
+}
+
+TEST_F(BatchQueryTest, resultsAreDemultiplexed) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .Times(2)
+        .WillRepeatedly(testing::Return(getResourceUrl("facts.json")));
+    BatchQuery batch { "facts" };
+    // One key per query
+    batch.setMaxQuerySize(1);
+    batch.add("master.example.com");
+    batch.add("agent1.example.com");
+
+    auto results = batch.perform(mock_connector);
+
+    ASSERT_EQ(2u, results.size());
+    JsonValue master { parseJson(results["master.example.com"]) };
+    JsonValue agent { parseJson(results["agent1.example.com"]) };
+    ASSERT_EQ(2u, master.size());
+    EXPECT_EQ("processorcount", master[1].find("name")->asString());
+    ASSERT_EQ(2u, agent.size());
+    EXPECT_EQ("Debian", agent[0].find("value")->asString());
+}
+
+TEST_F(BatchQueryTest, keysWithoutRecords) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("facts.json")));
+    BatchQuery batch { "facts" };
+    batch.add("agent2.example.com");
+
+    auto results = batch.perform(mock_connector);
+
+    EXPECT_EQ("[]", results["agent2.example.com"]);
+}
+
+TEST_F(BatchQueryTest, missingKeyField) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("facts.json")));
+    BatchQuery batch { "facts", "hash" };
+    batch.add("spam");
+
+    EXPECT_THROW(batch.perform(mock_connector), parsing_error);
+}
+
+}  // namespace LibPuppetdb
@@ -0,0 +1,167 @@
+/*
+    columnar_result_test.cpp
+    ========================
+
+    libpuppetdb columnar result unit tests.
+    Requires: googletest, googlemock.
+
+*/
+
+#include "../include/libpuppetdb/columnar_result.h"
+#include "test_utils.h"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace LibPuppetdb {
+
+// Testing the columnar results
+
+class ColumnarResultTest : public ::testing::Test {};
+
+static void decode(ColumnarResult& result, const std::string& text) {
+    ColumnarDecoder decoder { result };
+    decoder.feed(text.data(), text.size());
+    decoder.finish();
+}
+
+TEST_F(ColumnarResultTest, stringDictionary) {
+    StringDictionary dictionary {};
+
+    EXPECT_EQ(0u, dictionary.intern("spam", 4));
+    EXPECT_EQ(1u, dictionary.intern("eggs", 4));
+    EXPECT_EQ(0u, dictionary.intern("spam and eggs", 4));
+    EXPECT_EQ(2u, dictionary.size());
+    EXPECT_EQ("eggs", dictionary.get(1));
+    EXPECT_EQ(1u, dictionary.find("eggs"));
+    EXPECT_EQ(NO_STRING_ID, dictionary.find("ham"));
+}
+
+TEST_F(ColumnarResultTest, invalidSchema) {
+    EXPECT_THROW((ColumnarResult { { { "name", ColumnKind::Dictionary },
+                                     { "name", ColumnKind::Value } } }),
+                 query_error);
+
+    ColumnarResult result { getFactsSchema() };
+
+    EXPECT_THROW(result.getValueColumn("name"), query_error);
+    EXPECT_THROW(result.getDictionaryColumn("spam"), query_error);
+}
+
+TEST_F(ColumnarResultTest, decodeFacts) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("facts.json")));
+    Query query { "facts" };
+    ColumnarResult result { getFactsSchema() };
+
+    decodeColumns(mock_connector, query, result);
+
+    ASSERT_EQ(4u, result.size());
+    const auto& certnames = result.getDictionaryColumn("certname");
+    const auto& names = result.getDictionaryColumn("name");
+    const auto& environments = result.getDictionaryColumn("environment");
+    const auto& values = result.getValueColumn("value");
+    EXPECT_EQ(2u, certnames.getDictionary().size());
+    EXPECT_EQ((std::vector<uint32_t> { 0, 0, 1, 1 }), certnames.getIds());
+    EXPECT_EQ("agent1.example.com", certnames.getString(3));
+    EXPECT_EQ(names.getId(0), names.getId(2));
+    EXPECT_EQ("testing", environments.getString(3));
+
+    EXPECT_EQ(ValueType::String, values.getType(0));
+    EXPECT_EQ("RedHat", values.getString(0).toString());
+    EXPECT_EQ(4, values.getInteger(1));
+    EXPECT_EQ(4.0, values.getDouble(1));
+    EXPECT_TRUE(values.getBool(3));
+    EXPECT_EQ((std::vector<int64_t> { 4 }), values.getIntegers());
+    EXPECT_EQ(2u, values.getNumTexts());
+    EXPECT_THROW(values.getBool(0), processing_error);
+}
+
+TEST_F(ColumnarResultTest, decodeFactContents) {
+    ColumnarResult result { getFactContentsSchema() };
+
+    decode(result, "[{\"certname\":\"n1\",\"name\":\"os\","
+                   "\"path\":[\"os\",\"release\",\"major\"],\"value\":\"7\","
+                   "\"environment\":\"production\"},"
+                   "{\"certname\":\"n1\",\"name\":\"load\","
+                   "\"path\":[\"load\",{\"x\":\"]\"}],\"value\":-0.5e1}]");
+
+    ASSERT_EQ(2u, result.size());
+    const auto& paths = result.getValueColumn("path");
+    const auto& values = result.getValueColumn("value");
+    EXPECT_EQ("[\"os\",\"release\",\"major\"]", paths.getJson(0).toString());
+    EXPECT_EQ("[\"load\",{\"x\":\"]\"}]", paths.getJson(1).toString());
+    EXPECT_EQ(ValueType::Double, values.getType(1));
+    EXPECT_EQ(-5.0, values.getDouble(1));
+    EXPECT_EQ(NO_STRING_ID, result.getDictionaryColumn("environment").getId(1));
+}
+
+TEST_F(ColumnarResultTest, decodeNodes) {
+    ColumnarResult result { getNodesSchema() };
+
+    decode(result, "[{\"certname\":\"n1\",\"deactivated\":null,"
+                   "\"facts_timestamp\":\"2015-06-19T23:05:37.125Z\","
+                   "\"latest_report_status\":\"unchanged\","
+                   "\"report_environment\":\"production\"}]");
+
+    ASSERT_EQ(1u, result.size());
+    EXPECT_EQ(ValueType::Null,
+              result.getValueColumn("deactivated").getType(0));
+    EXPECT_EQ(ValueType::Null, result.getValueColumn("expired").getType(0));
+    EXPECT_EQ("2015-06-19T23:05:37.125Z",
+              result.getValueColumn("facts_timestamp").getString(0)
+                  .toString());
+    EXPECT_EQ("unchanged",
+              result.getDictionaryColumn("latest_report_status").getString(0));
+}
+
+TEST_F(ColumnarResultTest, escapedStringsAndNestedValues) {
+    ColumnarResult result { getFactsSchema() };
+
+    decode(result, "[{\"certname\":\"a\\\"b\",\"name\":\"os\","
+                   "\"value\":{\"family\":\"RedHat\",\"n\":[1,2]},"
+                   "\"extra\":{\"skipped\":[true]}},"
+                   "{\"certname\":\"a\\u0022b\",\"name\":\"big\","
+                   "\"value\":123456789012345678901234567890}]");
+
+    ASSERT_EQ(2u, result.size());
+    const auto& certnames = result.getDictionaryColumn("certname");
+    const auto& values = result.getValueColumn("value");
+    EXPECT_EQ("a\"b", certnames.getString(0));
+    EXPECT_EQ(certnames.getId(0), certnames.getId(1));
+    EXPECT_EQ("{\"family\":\"RedHat\",\"n\":[1,2]}",
+              values.getJson(0).toString());
+    EXPECT_EQ(ValueType::Double, values.getType(1));
+}
+
+TEST_F(ColumnarResultTest, malformedRecordsLeaveTheResultUnchanged) {
+    ColumnarResult result { getFactsSchema() };
+
+    EXPECT_THROW(decode(result, "[{\"certname\":\"a\",\"value\":tru}]"),
+                 parsing_error);
+    EXPECT_THROW(decode(result, "[{\"certname\":\"a\" \"value\":1}]"),
+                 parsing_error);
+    EXPECT_THROW(decode(result, "[[\"certname\",\"a\"]]"), parsing_error);
+    EXPECT_THROW(decode(result, "[{\"certname\":\"a\\x\"}]"), parsing_error);
+    EXPECT_EQ(0u, result.size());
+    EXPECT_EQ(0u, result.getDictionaryColumn("certname").size());
+}
+
+TEST_F(ColumnarResultTest, resultsAccumulate) {
+    ColumnarResult result { getFactsSchema() };
+
+    decode(result, "[{\"certname\":\"a\",\"value\":1}]");
+    decode(result, "[{\"certname\":\"b\",\"value\":false}]");
+
+    EXPECT_EQ(2u, result.size());
+    EXPECT_EQ(2u, result.getValueColumn("value").size());
+    EXPECT_FALSE(result.getValueColumn("value").getBool(1));
+
+    result.clear();
+
+    EXPECT_EQ(0u, result.size());
+    EXPECT_EQ(0u,
+              result.getDictionaryColumn("certname").getDictionary().size());
+}
+
+}  // namespace LibPuppetdb
@@ -0,0 +1,261 @@
+/*
+    coroutine_test.cpp
+    ==================
+
+    libpuppetdb coroutine unit tests; built only by C++20 compilers.
+    Requires: googletest, googlemock.
+
+*/
+
+#include "../include/libpuppetdb/coroutine.h"
+#include "test_utils.h"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+
+namespace LibPuppetdb {
+
+// Coroutine started right away and destroyed once completed
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+// Executor running the tasks on the thread calling runOne
+class TaskQueue {
+  public:
+    Executor getExecutor() {
+        return [this](std::function<void()> task) {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            tasks_.push_back(std::move(task));
+            cv_.notify_one();
+        };
+    }
+
+    void runOne() {
+        std::unique_lock<std::mutex> lock { mutex_ };
+        cv_.wait(lock, [this]() { return !tasks_.empty(); });
+        std::function<void()> task { std::move(tasks_.front()) };
+        tasks_.pop_front();
+        lock.unlock();
+        task();
+    }
+
+  private:
+    std::mutex mutex_ {};
+    std::condition_variable cv_ {};
+    std::deque<std::function<void()>> tasks_ {};
+};
+
+DetachedTask fetch(PuppetdbConnector& connector, Query query,
+                   std::promise<std::string>& result,
+                   Executor executor = {}) {
+    try {
+        result.set_value(co_await asyncQuery(connector, query,
+                                             std::move(executor)));
+    } catch (...) {
+        result.set_exception(std::current_exception());
+    }
+}
+
+static std::string readResource(const std::string& name) {
+    std::ifstream file { "./resources/" + name };
+    return std::string { std::istreambuf_iterator<char> { file },
+                         std::istreambuf_iterator<char> {} };
+}
+
+// Testing the awaitable queries
+
+class CoroutineTest : public ::testing::Test {};
+
+TEST_F(CoroutineTest, awaitQuery) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("facts.json")));
+    std::promise<std::string> result {};
+
+    fetch(mock_connector, Query { "facts" }, result);
+
+    EXPECT_EQ(readResource("facts.json"), result.get_future().get());
+}
+
+TEST_F(CoroutineTest, awaitQueryFailure) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("non_existent.json")));
+    std::promise<std::string> result {};
+
+    fetch(mock_connector, Query { "facts" }, result);
+
+    EXPECT_THROW(result.get_future().get(), processing_error);
+}
+
+TEST_F(CoroutineTest, queryThatCannotStart) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Throw(query_error { "invalid query" }));
+    std::promise<std::string> result {};
+
+    fetch(mock_connector, Query { "facts" }, result);
+
+    EXPECT_THROW(result.get_future().get(), query_error);
+}
+
+TEST_F(CoroutineTest, executorResumesTheCoroutines) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("facts.json")));
+    TaskQueue queue {};
+    const size_t num_queries { 20 };
+    size_t num_completed { 0 };
+    std::vector<std::thread::id> threads {};
+
+    auto run = [&]() -> DetachedTask {
+        std::string result { co_await asyncQuery(
+            mock_connector, Query { "facts" }, queue.getExecutor()) };
+        EXPECT_FALSE(result.empty());
+        threads.push_back(std::this_thread::get_id());
+        num_completed++;
+    };
+    for (size_t idx = 0; idx < num_queries; idx++) {
+        run();
+    }
+    // The coroutines that were not completed right away are resumed
+    // by the queue, on this thread
+    while (num_completed < num_queries) {
+        queue.runOne();
+    }
+
+    for (auto& thread : threads) {
+        EXPECT_EQ(std::this_thread::get_id(), thread);
+    }
+}
+
+// Testing the asynchronous pager
+
+TEST_F(CoroutineTest, pagerWithZeroPageSize) {
+    PuppetdbConnector connector { "spam" };
+
+    EXPECT_THROW(AsyncPager(connector, Query { "facts" }, 0), query_error);
+}
+
+TEST_F(CoroutineTest, pagerFetchesAllPages) {
+    MockURLConnector mock_connector { "spam" };
+    std::vector<size_t> offsets {};
+    std::mutex offsets_mutex {};
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Invoke([&](Query& query, CURL* curl) {
+            std::lock_guard<std::mutex> lock { offsets_mutex };
+            EXPECT_EQ(4u, query.getLimit());
+            offsets.push_back(query.getOffset());
+            return getResourceUrl(query.getOffset() < 10 ? "facts.json"
+                                                         : "empty.json");
+        }));
+    Query query { "facts" };
+    query.setOffset(2);
+    AsyncPager pager { mock_connector, query, 4 };
+    std::promise<std::vector<std::string>> pages {};
+
+    // NB: the lambda must outlive the coroutine, which refers to its
+    // captures
+    auto iterate = [&]() -> DetachedTask {
+        std::vector<std::string> result {};
+        while (auto page = co_await pager.next()) {
+            result.push_back(std::move(*page));
+        }
+        // The iteration stays ended
+        EXPECT_FALSE(co_await pager.next());
+        pages.set_value(std::move(result));
+    };
+    iterate();
+
+    EXPECT_EQ((std::vector<std::string>(2, readResource("facts.json"))),
+              pages.get_future().get());
+    EXPECT_EQ(2u, pager.getNumPages());
+    std::lock_guard<std::mutex> lock { offsets_mutex };
+    EXPECT_EQ((std::vector<size_t> { 2, 6, 10 }), offsets);
+}
+
+TEST_F(CoroutineTest, pagerStopsAtShortPage) {
+    MockURLConnector mock_connector { "spam" };
+    std::vector<size_t> offsets {};
+    std::mutex offsets_mutex {};
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Invoke([&](Query& query, CURL* curl) {
+            std::lock_guard<std::mutex> lock { offsets_mutex };
+            offsets.push_back(query.getOffset());
+            return getResourceUrl(query.getOffset() < 4 ? "facts.json"
+                                                        : "reports.json");
+        }));
+    AsyncPager pager { mock_connector, Query { "facts" }, 4 };
+    std::promise<std::vector<std::string>> pages {};
+
+    auto iterate = [&]() -> DetachedTask {
+        std::vector<std::string> result {};
+        while (auto page = co_await pager.next()) {
+            result.push_back(std::move(*page));
+        }
+        pages.set_value(std::move(result));
+    };
+    iterate();
+
+    EXPECT_EQ((std::vector<std::string> { readResource("facts.json"),
+                                          readResource("reports.json") }),
+              pages.get_future().get());
+    EXPECT_EQ(2u, pager.getNumPages());
+    // No page is fetched past the short one
+    std::lock_guard<std::mutex> lock { offsets_mutex };
+    EXPECT_EQ((std::vector<size_t> { 0, 4 }), offsets);
+}
+
+TEST_F(CoroutineTest, pagerStopsAtQueryLimit) {
+    MockURLConnector mock_connector { "spam" };
+    std::vector<std::pair<size_t, size_t>> pages {};
+    std::mutex pages_mutex {};
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Invoke([&](Query& query, CURL* curl) {
+            std::lock_guard<std::mutex> lock { pages_mutex };
+            pages.emplace_back(query.getOffset(), query.getLimit());
+            return getResourceUrl("facts.json");
+        }));
+    Query query { "facts" };
+    query.setLimit(6);
+    AsyncPager pager { mock_connector, query, 4 };
+    std::promise<size_t> num_pages {};
+
+    auto iterate = [&]() -> DetachedTask {
+        size_t count { 0 };
+        while (co_await pager.next()) {
+            count++;
+        }
+        num_pages.set_value(count);
+    };
+    iterate();
+
+    // The last page is shrunk to the limit
+    EXPECT_EQ(2u, num_pages.get_future().get());
+    std::lock_guard<std::mutex> lock { pages_mutex };
+    EXPECT_EQ((std::vector<std::pair<size_t, size_t>> { { 0, 4 }, { 4, 2 } }),
+              pages);
+}
+
+}  // namespace LibPuppetdb
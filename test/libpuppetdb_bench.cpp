@@ -0,0 +1,360 @@
+/*
+    libpuppetdb_bench.cpp
+    =====================
+
+    libpuppetdb benchmarks, run against a local mock PuppetDB server.
+    The results are printed in json format, to be compared from one
+    release to the next.
+
+    Usage: libpuppetdb_bench [--queries N] [--threads N] [--size BYTES]
+                             [--latency-ms MS] [--output FILE]
+
+*/
+
+#include "../include/libpuppetdb/libpuppetdb.h"
+#include "../include/libpuppetdb/parallel_parser.h"
+#include "../include/libpuppetdb/result_parser.h"
+#include "mock_server.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace LibPuppetdb {
+
+struct BenchOptions {
+    size_t num_queries;
+    size_t num_threads;
+    size_t result_size;
+    std::chrono::milliseconds latency;
+    std::string output_path;
+
+    BenchOptions()
+            : num_queries { 200 },
+              num_threads { 4 },
+              result_size { 256 * 1024 },
+              latency { 1 },
+              output_path {} {
+    }
+};
+
+class Bench {
+  public:
+    explicit Bench(const BenchOptions& options)
+            : options_(options),
+              server_ {},
+              results_ { JsonType::Array } {
+        server_.setResponse("small", MockPuppetdbServer::makeRecords(1024),
+                            options_.latency);
+        server_.setResponse("large",
+                            MockPuppetdbServer::makeRecords(
+                                options_.result_size),
+                            options_.latency);
+        server_.start();
+    }
+
+    void runAll() {
+        runSequential("sequential_handle_reuse", "small", false);
+        runSequential("sequential_no_handle_reuse", "small", true);
+        runPooled("pooled", "small");
+        runAsync("async", "small");
+        runBuffered<std::string>("buffered_large");
+        runBuffered<ChunkedResult>("chunked_large");
+        runStreaming("streaming_large");
+        runParallel("parallel_large");
+        runCompression("compression_off", false);
+        runCompression("compression_on", true);
+        runCache("cache_fresh_hits", std::chrono::milliseconds { 60000 });
+        runCache("cache_revalidation", std::chrono::milliseconds { 1 });
+        runSplitter("split_scalar", ScanKernel::Scalar);
+        runSplitter("split_sse2", ScanKernel::Sse2);
+        runSplitter("split_avx2", ScanKernel::Avx2);
+        runSplitter("split_neon", ScanKernel::Neon);
+    }
+
+    std::string getReport() const {
+        JsonValue report { JsonType::Object };
+        report.set("library_version", JsonValue::makeString(VERSION_STRING));
+        report.set("curl_version",
+                   JsonValue::makeString(curl_version_info(
+                       CURLVERSION_NOW)->version));
+        JsonValue options { JsonType::Object };
+        options.set("queries", makeNumber(options_.num_queries));
+        options.set("threads", makeNumber(options_.num_threads));
+        options.set("result_size", makeNumber(options_.result_size));
+        options.set("latency_ms", makeNumber(options_.latency.count()));
+        report.set("options", std::move(options));
+        report.set("benchmarks", results_);
+        return report.serialize();
+    }
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    const BenchOptions& options_;
+    MockPuppetdbServer server_;
+    JsonValue results_;
+
+    template <typename T>
+    static JsonValue makeNumber(T value) {
+        return JsonValue::makeNumber(std::to_string(value));
+    }
+
+    PuppetdbConnector makeConnector() {
+        return PuppetdbConnector { "127.0.0.1", server_.getPort() };
+    }
+
+    // Runs the benchmark body and returns its results, from the
+    // metrics recorded by the connectors
+    template <typename Body>
+    JsonValue run(const std::string& name, size_t num_queries, Body body) {
+        std::shared_ptr<QueryMetrics> metrics { new QueryMetrics {} };
+        size_t num_connections { server_.getNumConnections() };
+        size_t num_requests { server_.getNumRequests() };
+
+        auto start = Clock::now();
+        body(metrics);
+        double seconds { std::chrono::duration<double>(
+            Clock::now() - start).count() };
+
+        auto total = metrics->getSnapshot().total;
+        JsonValue result { JsonType::Object };
+        result.set("name", JsonValue::makeString(name));
+        result.set("queries", makeNumber(num_queries));
+        result.set("seconds", makeNumber(seconds));
+        result.set("queries_per_second", makeNumber(num_queries / seconds));
+        result.set("latency_p50_us",
+                   makeNumber(total.latency.getPercentile(50).count()));
+        result.set("latency_p95_us",
+                   makeNumber(total.latency.getPercentile(95).count()));
+        result.set("latency_p99_us",
+                   makeNumber(total.latency.getPercentile(99).count()));
+        result.set("errors", makeNumber(total.getErrors()));
+        result.set("downloaded_bytes", makeNumber(total.downloaded_bytes));
+        result.set("result_bytes", makeNumber(total.result_bytes));
+        result.set("server_requests",
+                   makeNumber(server_.getNumRequests() - num_requests));
+        result.set("server_connections",
+                   makeNumber(server_.getNumConnections() - num_connections));
+        return result;
+    }
+
+    void runSequential(const std::string& name, const std::string& endpoint,
+                       bool close_handle) {
+        results_.append(run(name, options_.num_queries,
+            [&](std::shared_ptr<QueryMetrics> metrics) {
+                PuppetdbConnector connector { makeConnector() };
+                connector.setQueryMetrics(metrics);
+                Query query { endpoint };
+                for (size_t index = 0; index < options_.num_queries; index++) {
+                    if (close_handle) {
+                        connector.close();
+                    }
+                    connector.performQuery(query);
+                }
+            }));
+    }
+
+    void runPooled(const std::string& name, const std::string& endpoint) {
+        size_t per_thread { options_.num_queries / options_.num_threads };
+        results_.append(run(name, per_thread * options_.num_threads,
+            [&](std::shared_ptr<QueryMetrics> metrics) {
+                PuppetdbConnectorPool pool { makeConnector(),
+                                             options_.num_threads };
+                pool.setQueryMetrics(metrics);
+                std::vector<std::thread> threads {};
+                for (size_t index = 0; index < options_.num_threads; index++) {
+                    threads.emplace_back([&]() {
+                        Query query { endpoint };
+                        for (size_t count = 0; count < per_thread; count++) {
+                            pool.performQuery(query);
+                        }
+                    });
+                }
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+            }));
+    }
+
+    void runAsync(const std::string& name, const std::string& endpoint) {
+        results_.append(run(name, options_.num_queries,
+            [&](std::shared_ptr<QueryMetrics> metrics) {
+                PuppetdbConnector connector { makeConnector() };
+                connector.setQueryMetrics(metrics);
+                std::vector<Query> queries(options_.num_queries,
+                                           Query { endpoint });
+                for (auto& result : connector.performQueriesAsync(queries)) {
+                    result.get();
+                }
+            }));
+    }
+
+    // The result is a std::string or a ChunkedResult
+    template <typename Result>
+    void runBuffered(const std::string& name) {
+        results_.append(run(name, options_.num_queries,
+            [&](std::shared_ptr<QueryMetrics> metrics) {
+                PuppetdbConnector connector { makeConnector() };
+                connector.setQueryMetrics(metrics);
+                Query query { "large" };
+                Result result {};
+                for (size_t index = 0; index < options_.num_queries; index++) {
+                    connector.performQuery(query, result);
+                }
+            }));
+    }
+
+    void runStreaming(const std::string& name) {
+        size_t num_records { 0 };
+        JsonValue result = run(name, options_.num_queries,
+            [&](std::shared_ptr<QueryMetrics> metrics) {
+                PuppetdbConnector connector { makeConnector() };
+                connector.setQueryMetrics(metrics);
+                Query query { "large" };
+                for (size_t index = 0; index < options_.num_queries; index++) {
+                    num_records += forEachRecord(
+                        connector, query, [](const JsonValue& record) {});
+                }
+            });
+        result.set("records", makeNumber(num_records));
+        results_.append(std::move(result));
+    }
+
+    void runParallel(const std::string& name) {
+        size_t num_records { 0 };
+        JsonValue result = run(name, options_.num_queries,
+            [&](std::shared_ptr<QueryMetrics> metrics) {
+                PuppetdbConnector connector { makeConnector() };
+                connector.setQueryMetrics(metrics);
+                Query query { "large" };
+                for (size_t index = 0; index < options_.num_queries; index++) {
+                    num_records += forEachRecordParallel(
+                        connector, query,
+                        [](const JsonValue& record, size_t worker) {},
+                        options_.num_threads);
+                }
+            });
+        result.set("records", makeNumber(num_records));
+        results_.append(std::move(result));
+    }
+
+    void runCompression(const std::string& name, bool enabled) {
+        double ratio { 1 };
+        JsonValue result = run(name, options_.num_queries,
+            [&](std::shared_ptr<QueryMetrics> metrics) {
+                PuppetdbConnector connector { makeConnector() };
+                connector.setQueryMetrics(metrics);
+                connector.setCompression(enabled);
+                Query query { "large" };
+                std::string result {};
+                for (size_t index = 0; index < options_.num_queries; index++) {
+                    connector.performQuery(query, result);
+                }
+                ratio = connector.getCompressionCounters().getRatio();
+            });
+        result.set("compression_ratio", makeNumber(ratio));
+        results_.append(std::move(result));
+    }
+
+    // Splits an in-memory result, with no transfer; the kernels not
+    // supported by the CPU are skipped
+    void runSplitter(const std::string& name, ScanKernel kernel) {
+        if (!isScanKernelSupported(kernel)) {
+            return;
+        }
+        static const std::string text {
+            MockPuppetdbServer::makeRecords(64 * 1024 * 1024) };
+        static const size_t CHUNK_SIZE { 16 * 1024 };
+        size_t num_records { 0 };
+        RecordSplitter splitter { [&](const char*, size_t) {
+                                      num_records++;
+                                  } };
+        splitter.setScanKernel(kernel);
+
+        auto start = Clock::now();
+        for (size_t idx = 0; idx < text.size(); idx += CHUNK_SIZE) {
+            splitter.feed(text.data() + idx,
+                          std::min(CHUNK_SIZE, text.size() - idx));
+        }
+        splitter.finish();
+        double seconds { std::chrono::duration<double>(
+            Clock::now() - start).count() };
+
+        JsonValue result { JsonType::Object };
+        result.set("name", JsonValue::makeString(name));
+        result.set("seconds", makeNumber(seconds));
+        result.set("records", makeNumber(num_records));
+        result.set("bytes_per_second", makeNumber(text.size() / seconds));
+        results_.append(std::move(result));
+    }
+
+    // Queries cycle through 10 distinct URLs
+    void runCache(const std::string& name, std::chrono::milliseconds ttl) {
+        std::shared_ptr<ResponseCache> cache {
+            new ResponseCache { 64 * 1024 * 1024, ttl } };
+        JsonValue result = run(name, options_.num_queries,
+            [&](std::shared_ptr<QueryMetrics> metrics) {
+                PuppetdbConnector connector { makeConnector() };
+                connector.setQueryMetrics(metrics);
+                connector.setResponseCache(cache);
+                for (size_t index = 0; index < options_.num_queries; index++) {
+                    Query query { "small",
+                                  "[\"=\", \"certname\", \"node"
+                                  + std::to_string(index % 10) + "\"]" };
+                    connector.performQuery(query);
+                }
+            });
+        auto stats = cache->getStats();
+        result.set("cache_hits", makeNumber(stats.hits));
+        result.set("cache_misses", makeNumber(stats.misses));
+        result.set("cache_revalidations", makeNumber(stats.revalidations));
+        result.set("cache_hit_rate",
+                   makeNumber(static_cast<double>(stats.hits)
+                              / options_.num_queries));
+        results_.append(std::move(result));
+    }
+};
+
+}  // namespace LibPuppetdb
+
+int main(int argc, char* argv[]) {
+    LibPuppetdb::BenchOptions options {};
+    for (int index = 1; index + 1 < argc; index += 2) {
+        std::string option { argv[index] };
+        std::string value { argv[index + 1] };
+        if (option == "--queries") {
+            options.num_queries = std::stoul(value);
+        } else if (option == "--threads") {
+            options.num_threads = std::max<size_t>(std::stoul(value), 1);
+        } else if (option == "--size") {
+            options.result_size = std::stoul(value);
+        } else if (option == "--latency-ms") {
+            options.latency = std::chrono::milliseconds { std::stol(value) };
+        } else if (option == "--output") {
+            options.output_path = value;
+        } else {
+            std::cerr << "unknown option " << option << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    try {
+        LibPuppetdb::Bench bench { options };
+        bench.runAll();
+        if (options.output_path.empty()) {
+            std::cout << bench.getReport() << std::endl;
+        } else {
+            std::ofstream output { options.output_path };
+            output << bench.getReport() << std::endl;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "benchmark failed: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
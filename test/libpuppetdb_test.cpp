@@ -8,9 +8,13 @@
 */
 
 #include "../include/libpuppetdb/libpuppetdb.h"
+#include "test_utils.h"
+#include "mock_server.h"
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <chrono>
+#include <sstream>
+#include <thread>
 
 // To test SSL with puppet agent certificates
 // #define PUPET_AGENT_TEST
@@ -19,13 +23,6 @@ namespace LibPuppetdb {
 
 // Mock classes
 
-class MockURLConnector : public PuppetdbConnector {
-  public:
-    MockURLConnector(std::string host_name)
-        : PuppetdbConnector::PuppetdbConnector(host_name) {}
-    MOCK_METHOD2(getQueryUrl, std::string(Query& query, CURL* curl));
-};
-
 
 class MockSetupConnector : public PuppetdbConnector {
   public:
@@ -34,6 +31,16 @@ class MockSetupConnector : public PuppetdbConnector {
     MOCK_METHOD1(setupAndPerform, std::string(Query& query));
 };
 
+class MockSSLURLConnector : public PuppetdbConnector {
+  public:
+    MockSSLURLConnector(std::string ca_crt_path, std::string client_crt_path,
+                        std::string client_key_path)
+        : PuppetdbConnector::PuppetdbConnector("spam", ca_crt_path,
+                                               client_crt_path,
+                                               client_key_path) {}
+    MOCK_METHOD2(getQueryUrl, std::string(Query& query, CURL* curl));
+};
+
 // Testing the PuppetDB query
 
 class QueryTest : public ::testing::Test {};
@@ -73,6 +80,586 @@ TEST_F(QueryTest, getQueryComponentsWithQueryString) {
     EXPECT_EQ(expected_query, obtained_query);
 }
 
+TEST_F(QueryTest, pagingParameters) {
+    Query query { "nodes" };
+
+    EXPECT_FALSE(query.isPaged());
+    query.setLimit(10);
+    query.setOffset(20);
+    query.setOrderBy({ OrderBy { "certname" }, OrderBy { "facts", false } });
+
+    EXPECT_TRUE(query.isPaged());
+    EXPECT_EQ(10u, query.getLimit());
+    EXPECT_EQ(20u, query.getOffset());
+    ASSERT_EQ(2u, query.getOrderBy().size());
+    EXPECT_TRUE(query.getOrderBy()[0].ascending);
+    EXPECT_FALSE(query.getOrderBy()[1].ascending);
+}
+
+TEST_F(QueryTest, projection) {
+    Query query { "resources" };
+
+    EXPECT_TRUE(query.getProjection().empty());
+    query.setProjection({ "certname", "title" });
+
+    EXPECT_EQ((std::vector<std::string> { "certname", "title" }),
+              query.getProjection());
+    EXPECT_FALSE(query.isPaged());
+}
+
+// Testing the arena
+
+class ArenaTest : public ::testing::Test {};
+
+TEST_F(ArenaTest, allocateAndReset) {
+    Arena arena { 256 };
+
+    char* first { static_cast<char*>(arena.allocate(3, 1)) };
+    void* aligned { arena.allocate(8, 8) };
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(aligned) % 8);
+    EXPECT_LE(first + 3, static_cast<char*>(aligned));
+    EXPECT_EQ(1u, arena.getNumBlocks());
+
+    arena.allocate(1024);
+    arena.allocate(200);
+    EXPECT_EQ(3u, arena.getNumBlocks());
+    EXPECT_EQ(1235u, arena.getNumBytes());
+
+    arena.reset();
+    EXPECT_EQ(1u, arena.getNumBlocks());
+    EXPECT_EQ(0u, arena.getNumBytes());
+}
+
+TEST_F(ArenaTest, arenaString) {
+    Arena arena {};
+    ArenaString text { ArenaAllocator<char> { arena } };
+    for (int index = 0; index < 100; index++) {
+        text += "spam";
+    }
+    EXPECT_EQ(400u, text.size());
+    EXPECT_EQ("spamspam", std::string(text.data(), 8));
+    EXPECT_LE(400u, arena.getNumBytes());
+}
+
+TEST_F(ArenaTest, headerList) {
+    Arena arena {};
+    ArenaHeaderList headers { arena };
+    EXPECT_EQ(nullptr, headers.get());
+
+    headers.append("If-None-Match", "\"abc\"");
+    headers.append("Accept", "application/json");
+
+    curl_slist* list { headers.get() };
+    ASSERT_NE(nullptr, list);
+    EXPECT_STREQ("If-None-Match: \"abc\"", list->data);
+    ASSERT_NE(nullptr, list->next);
+    EXPECT_STREQ("Accept: application/json", list->next->data);
+    EXPECT_EQ(nullptr, list->next->next);
+}
+
+TEST_F(ArenaTest, urlEncodingMatchesLibcurl) {
+    std::string data {};
+    for (int c = 0; c < 256; c++) {
+        data += static_cast<char>(c);
+    }
+    CURL* curl { curl_easy_init() };
+    char* expected { curl_easy_escape(curl, data.data(),
+                                      static_cast<int>(data.size())) };
+    std::string encoded {};
+
+    appendUrlEncoded(encoded, data.data(), data.size());
+
+    EXPECT_EQ(std::string { expected }, encoded);
+    curl_free(expected);
+    curl_easy_cleanup(curl);
+}
+
+// Testing the query result
+
+class QueryResultTest : public ::testing::Test {};
+
+TEST_F(QueryResultTest, reserveFromContentLength) {
+    std::string buffer {};
+    QueryResult::ResponseHeaders response_headers { &buffer };
+    std::string header { "Content-Length: 100000\r\n" };
+
+    size_t processed { QueryResult::headerCallback(&header[0], 1,
+                                                   header.size(),
+                                                   &response_headers) };
+
+    EXPECT_EQ(header.size(), processed);
+    EXPECT_LE(100000u, buffer.capacity());
+    EXPECT_TRUE(buffer.empty());
+}
+
+TEST_F(QueryResultTest, ignoreOtherHeaders) {
+    std::string buffer {};
+    QueryResult::ResponseHeaders response_headers { &buffer };
+    size_t initial_capacity { buffer.capacity() };
+    std::string header { "Content-Type: application/json\r\n" };
+
+    QueryResult::headerCallback(&header[0], 1, header.size(),
+                                &response_headers);
+
+    EXPECT_EQ(initial_capacity, buffer.capacity());
+}
+
+TEST_F(QueryResultTest, storeValidators) {
+    QueryResult::ResponseHeaders response_headers {};
+    std::string etag_header { "ETag: \"abc\"\r\n" };
+    std::string date_header {
+        "last-modified:  Wed, 21 Oct 2015 07:28:00 GMT\r\n" };
+
+    QueryResult::headerCallback(&etag_header[0], 1, etag_header.size(),
+                                &response_headers);
+    QueryResult::headerCallback(&date_header[0], 1, date_header.size(),
+                                &response_headers);
+
+    EXPECT_EQ("\"abc\"", response_headers.etag);
+    EXPECT_EQ("Wed, 21 Oct 2015 07:28:00 GMT", response_headers.last_modified);
+}
+
+// Testing the chunked result
+
+class ChunkedResultTest : public ::testing::Test {};
+
+TEST_F(ChunkedResultTest, appendAcrossBlocks) {
+    ChunkedResult result {};
+    std::string data(MIN_RESULT_BLOCK_SIZE + 100, 'x');
+    data[MIN_RESULT_BLOCK_SIZE] = 'y';
+
+    result.append(data.data(), 10);
+    result.append(data.data() + 10, data.size() - 10);
+
+    EXPECT_EQ(data.size(), result.size());
+    ASSERT_EQ(2u, result.getNumChunks());
+    EXPECT_EQ(MIN_RESULT_BLOCK_SIZE, result.getChunk(0).size);
+    EXPECT_EQ('y', result.getChunk(1).data[0]);
+    EXPECT_EQ(data, result.toString());
+}
+
+TEST_F(ChunkedResultTest, copiesShareBlocks) {
+    ChunkedResult result {};
+    result.append("spam", 4);
+    ChunkedResult copy { result };
+
+    copy.append("eggs", 4);
+    result.append("ham", 3);
+
+    EXPECT_EQ("spamham", result.toString());
+    EXPECT_EQ("spameggs", copy.toString());
+    EXPECT_EQ(copy.getChunk(0).data, result.getChunk(0).data);
+
+    ChunkedResult concatenation {};
+    concatenation.append(result);
+    concatenation.append(copy);
+    EXPECT_EQ("spamhamspameggs", concatenation.toString());
+    EXPECT_EQ(result.getChunk(0).data, concatenation.getChunk(0).data);
+}
+
+TEST_F(ChunkedResultTest, writeToFileDescriptor) {
+    ChunkedResult result {};
+    std::string data {};
+    for (size_t index = 0; index < 5000; index++) {
+        std::string line { std::to_string(index) + "\n" };
+        result.append(line.data(), line.size());
+        data += line;
+    }
+    char path[] = "/tmp/libpuppetdb_test_XXXXXX";
+    int fd { mkstemp(path) };
+    ASSERT_LE(0, fd);
+
+    result.writeTo(fd);
+    close(fd);
+
+    std::ifstream file { path };
+    std::string written { std::istreambuf_iterator<char>(file),
+                          std::istreambuf_iterator<char>() };
+    unlink(path);
+    EXPECT_EQ(data, written);
+    EXPECT_THROW(result.writeTo(-1), processing_error);
+}
+
+TEST_F(ChunkedResultTest, performQuery) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("facts.json")));
+    ChunkedResult result {};
+    result.append("stale", 5);
+
+    mock_connector.performQuery(query, result);
+
+    EXPECT_EQ(mock_connector.performQuery(query), result.toString());
+}
+
+// Testing the response cache
+
+class ResponseCacheTest : public ::testing::Test {};
+
+TEST_F(ResponseCacheTest, ttlPerEndpoint) {
+    ResponseCache cache { 1024 };
+    cache.setTtl("nodes", std::chrono::milliseconds { 1000 });
+
+    EXPECT_TRUE(cache.isCached("nodes"));
+    EXPECT_TRUE(cache.isCached("nodes/spam/facts"));
+    EXPECT_FALSE(cache.isCached("facts"));
+    EXPECT_EQ(1000, cache.getTtl("nodes/spam").count());
+}
+
+TEST_F(ResponseCacheTest, lookupAndStats) {
+    ResponseCache cache { 1024, std::chrono::milliseconds { 60000 } };
+
+    EXPECT_EQ(nullptr, cache.lookup("http://spam/v4/nodes"));
+    cache.store("http://spam/v4/nodes", "nodes", "[]", "\"abc\"", "");
+    auto entry = cache.lookup("http://spam/v4/nodes");
+
+    ASSERT_NE(nullptr, entry);
+    EXPECT_EQ("[]", entry->body);
+    EXPECT_TRUE(entry->isFresh());
+    EXPECT_TRUE(entry->canRevalidate());
+    auto stats = cache.getStats();
+    EXPECT_EQ(1u, stats.hits);
+    EXPECT_EQ(1u, stats.misses);
+    EXPECT_EQ(1u, stats.entries);
+}
+
+TEST_F(ResponseCacheTest, staleEntryIsRefreshed) {
+    ResponseCache cache { 1024 };
+    cache.setTtl("nodes", std::chrono::milliseconds { 1 });
+    cache.store("url", "nodes", "[]", "", "Wed, 21 Oct 2015 07:28:00 GMT");
+    std::this_thread::sleep_for(std::chrono::milliseconds { 5 });
+
+    auto stale_entry = cache.lookup("url");
+    ASSERT_NE(nullptr, stale_entry);
+    EXPECT_FALSE(stale_entry->isFresh());
+    cache.setTtl("nodes", std::chrono::milliseconds { 60000 });
+    cache.refresh(stale_entry, "nodes");
+
+    EXPECT_TRUE(cache.lookup("url")->isFresh());
+    EXPECT_EQ(1u, cache.getStats().revalidations);
+}
+
+TEST_F(ResponseCacheTest, leastRecentlyUsedIsEvicted) {
+    ResponseCache cache { 30, std::chrono::milliseconds { 60000 } };
+    cache.store("a", "nodes", std::string(10, 'a'), "", "");
+    cache.store("b", "nodes", std::string(10, 'b'), "", "");
+    cache.lookup("a");
+    cache.store("c", "nodes", std::string(10, 'c'), "", "");
+
+    EXPECT_NE(nullptr, cache.lookup("a"));
+    EXPECT_EQ(nullptr, cache.lookup("b"));
+    EXPECT_NE(nullptr, cache.lookup("c"));
+    EXPECT_EQ(1u, cache.getStats().evictions);
+    EXPECT_GE(30u, cache.getStats().bytes);
+}
+
+TEST_F(ResponseCacheTest, tooLargeResultIsNotCached) {
+    ResponseCache cache { 10, std::chrono::milliseconds { 60000 } };
+    cache.store("a", "nodes", std::string(20, 'a'), "", "");
+
+    EXPECT_EQ(0u, cache.getStats().entries);
+}
+
+TEST_F(ResponseCacheTest, connectorUsesFreshResult) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "nodes" };
+    std::string url { "http://unreachable.invalid/v4/nodes" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(url));
+    std::shared_ptr<ResponseCache> cache {
+        new ResponseCache { 1024, std::chrono::milliseconds { 60000 } } };
+    cache->store(url, "nodes", "[\"cached\"]", "", "");
+    mock_connector.setResponseCache(cache);
+    std::string streamed_result {};
+
+    EXPECT_EQ("[\"cached\"]", mock_connector.performQuery(query));
+    mock_connector.performQuery(query, [&](const char* data, size_t size) {
+        streamed_result.append(data, size);
+    });
+    EXPECT_EQ("[\"cached\"]", streamed_result);
+    EXPECT_EQ("[\"cached\"]", mock_connector.submit(query).get());
+    EXPECT_EQ(3u, cache->getStats().hits);
+    EXPECT_TRUE(mock_connector.getLastQueryStats().from_cache);
+}
+
+TEST_F(ResponseCacheTest, connectorIgnoresUncachedEndpoint) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "facts" };
+    std::string url { getResourceUrl("facts.json") };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(url));
+    std::shared_ptr<ResponseCache> cache { new ResponseCache { 1024 } };
+    cache->store(url, "facts", "[\"cached\"]", "", "");
+    mock_connector.setResponseCache(cache);
+
+    EXPECT_NE("[\"cached\"]", mock_connector.performQuery(query));
+}
+
+// Testing the metrics
+
+class MetricsTest : public ::testing::Test {
+  protected:
+    static QueryStats makeStats(std::string endpoint, long response_code,
+                                int64_t total_time) {
+        QueryStats stats {};
+        stats.endpoint = std::move(endpoint);
+        stats.response_code = response_code;
+        stats.total_time = std::chrono::microseconds { total_time };
+        stats.downloaded_bytes = 10;
+        stats.result_bytes = 20;
+        return stats;
+    }
+};
+
+TEST_F(MetricsTest, histogramBuckets) {
+    for (uint64_t value : { 0ull, 1ull, 15ull, 16ull, 17ull, 100ull, 1000ull,
+                            123456ull }) {
+        size_t index { LatencyHistogram::getIndex(value) };
+        EXPECT_LE(value, LatencyHistogram::getHighestValue(index));
+        EXPECT_LE(LatencyHistogram::getHighestValue(index), value * 17 / 16);
+        if (index > 0) {
+            EXPECT_GT(value, LatencyHistogram::getHighestValue(index - 1));
+        }
+    }
+    EXPECT_EQ(LatencyHistogram::getIndex(1ull << 40),
+              LatencyHistogram::getIndex(1ull << 50));
+
+    size_t num_buckets { LatencyHistogram::NUM_BUCKETS };
+    EXPECT_EQ(num_buckets - 1, LatencyHistogram::getIndex((1ull << 36) - 1));
+    EXPECT_LT(LatencyHistogram::getIndex(1ull << 36), num_buckets);
+    EXPECT_LT(LatencyHistogram::getIndex((1ull << 37) - 1), num_buckets);
+}
+
+TEST_F(MetricsTest, histogramPercentiles) {
+    LatencyHistogram histogram {};
+    EXPECT_EQ(0, histogram.getSnapshot().getPercentile(50).count());
+
+    for (int64_t value = 1; value <= 1000; value++) {
+        histogram.record(std::chrono::microseconds { value });
+    }
+    auto snapshot = histogram.getSnapshot();
+
+    EXPECT_EQ(1000u, snapshot.getCount());
+    EXPECT_EQ(500, snapshot.getMean().count());
+    EXPECT_NEAR(500, snapshot.getPercentile(50).count(), 500 / 16);
+    EXPECT_NEAR(950, snapshot.getPercentile(95).count(), 950 / 16);
+    EXPECT_NEAR(990, snapshot.getPercentile(99).count(), 990 / 16);
+    EXPECT_LE(1000, snapshot.getPercentile(100).count());
+}
+
+TEST_F(MetricsTest, countersPerEndpoint) {
+    QueryMetrics metrics {};
+    metrics.record(makeStats("nodes", 200, 100));
+    metrics.record(makeStats("nodes", 503, 200));
+    metrics.record(makeStats("facts", 404, 300));
+    QueryStats failed { makeStats("facts", 0, 400) };
+    failed.curl_code = CURLE_COULDNT_CONNECT;
+    metrics.record(failed);
+    QueryStats cached { makeStats("facts", 0, 0) };
+    cached.from_cache = true;
+    metrics.record(cached);
+    QueryStats revalidated { makeStats("nodes", 304, 50) };
+    revalidated.revalidated = true;
+    metrics.record(revalidated);
+
+    auto snapshot = metrics.getSnapshot();
+
+    ASSERT_EQ(2u, snapshot.endpoints.size());
+    EXPECT_EQ("facts", snapshot.endpoints[0].endpoint);
+    const auto* nodes = snapshot.find("nodes");
+    ASSERT_NE(nullptr, nodes);
+    EXPECT_EQ(3u, nodes->requests);
+    EXPECT_EQ(1u, nodes->responses[2]);
+    EXPECT_EQ(1u, nodes->responses[3]);
+    EXPECT_EQ(1u, nodes->responses[5]);
+    EXPECT_EQ(1u, nodes->cache_hits);
+    EXPECT_EQ(1u, nodes->getErrors());
+    EXPECT_EQ(3u, nodes->latency.getCount());
+    const auto* facts = snapshot.find("facts");
+    ASSERT_NE(nullptr, facts);
+    EXPECT_EQ(3u, facts->requests);
+    EXPECT_EQ(1u, facts->transfer_errors);
+    EXPECT_EQ(1u, facts->cache_hits);
+    EXPECT_EQ(2u, facts->getErrors());
+    EXPECT_EQ(2u, facts->latency.getCount());
+    EXPECT_EQ(6u, snapshot.total.requests);
+    EXPECT_EQ(120u, snapshot.total.result_bytes);
+    EXPECT_EQ(5u, snapshot.total.latency.getCount());
+}
+
+TEST_F(MetricsTest, extraEndpointsAreAggregated) {
+    QueryMetrics metrics { 1 };
+    metrics.record(makeStats("nodes", 200, 100));
+    metrics.record(makeStats("facts", 200, 100));
+    metrics.record(makeStats("reports", 200, 100));
+
+    auto snapshot = metrics.getSnapshot();
+
+    ASSERT_EQ(2u, snapshot.endpoints.size());
+    const auto* other = snapshot.find(METRICS_OTHER_ENDPOINT);
+    ASSERT_NE(nullptr, other);
+    EXPECT_EQ(2u, other->requests);
+    EXPECT_EQ(3u, snapshot.total.requests);
+}
+
+TEST_F(MetricsTest, concurrentRecording) {
+    QueryMetrics metrics { 4 };
+    std::vector<std::thread> threads {};
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([&metrics, i]() {
+            for (int j = 0; j < 1000; j++) {
+                metrics.record(makeStats(j % 2 ? "nodes" : "facts", 200, j));
+                if (i == 0 && j % 100 == 0) {
+                    metrics.getSnapshot();
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    auto snapshot = metrics.getSnapshot();
+
+    EXPECT_EQ(2u, snapshot.endpoints.size());
+    EXPECT_EQ(4000u, snapshot.total.requests);
+    EXPECT_EQ(4000u, snapshot.total.latency.getCount());
+}
+
+TEST_F(MetricsTest, connectorRecordsQueries) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("facts.json")));
+    std::shared_ptr<QueryMetrics> metrics { new QueryMetrics {} };
+    mock_connector.setQueryMetrics(metrics);
+
+    auto result = mock_connector.performQuery(query);
+    mock_connector.submit(query).get();
+
+    auto snapshot = metrics->getSnapshot();
+    const auto* eggs = snapshot.find("eggs");
+    ASSERT_NE(nullptr, eggs);
+    EXPECT_EQ(2u, eggs->requests);
+    EXPECT_EQ(2u, eggs->responses[0]);
+    EXPECT_EQ(2 * result.size(), eggs->result_bytes);
+    EXPECT_EQ(2u, eggs->latency.getCount());
+}
+
+// Testing the trace recorder
+
+class TraceTest : public ::testing::Test {
+  protected:
+    static QueryStats makeStats(std::string endpoint, long response_code,
+                                int64_t total_time) {
+        QueryStats stats {};
+        stats.url = "http://spam:8080/v4/" + endpoint;
+        stats.endpoint = std::move(endpoint);
+        stats.response_code = response_code;
+        stats.name_lookup_time = std::chrono::microseconds { 10 };
+        stats.connect_time = std::chrono::microseconds { 30 };
+        stats.pre_transfer_time = std::chrono::microseconds { 40 };
+        stats.start_transfer_time = std::chrono::microseconds { 90 };
+        stats.total_time = std::chrono::microseconds { total_time };
+        stats.downloaded_bytes = 10;
+        stats.result_bytes = 20;
+        return stats;
+    }
+};
+
+TEST_F(TraceTest, ringKeepsTheLastQueries) {
+    TraceRecorder trace { 2 };
+    std::string body { "{\"query\":[\"=\",\"certname\",\"a\"]}" };
+
+    trace.record(makeStats("nodes", 200, 100));
+    trace.record(makeStats("facts", 200, 100), &body);
+    trace.record(makeStats("reports", 503, 100));
+
+    auto events = trace.getEvents();
+    ASSERT_EQ(2u, events.size());
+    EXPECT_EQ("facts", events[0].endpoint);
+    EXPECT_EQ(body, events[0].request_body);
+    EXPECT_EQ("http://spam:8080/v4/reports", events[1].url);
+    EXPECT_TRUE(events[1].request_body.empty());
+    EXPECT_TRUE(events[1].isError());
+    EXPECT_EQ(3u, trace.getNumRecorded());
+    EXPECT_EQ(1u, trace.getNumDropped());
+
+    trace.clear();
+    EXPECT_TRUE(trace.getEvents().empty());
+}
+
+TEST_F(TraceTest, chromeTraceExport) {
+    TraceRecorder trace {};
+    trace.record(makeStats("nodes", 200, 150));
+    trace.record(makeStats("facts", 200, 150));
+    std::ostringstream out {};
+
+    trace.writeChromeTrace(out);
+
+    std::string text { out.str() };
+    EXPECT_EQ(0u, text.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["));
+    EXPECT_NE(std::string::npos,
+              text.find("\"name\":\"nodes\",\"cat\":\"puppetdb.query\","
+                        "\"ph\":\"X\""));
+    EXPECT_NE(std::string::npos,
+              text.find("\"args\":{\"url\":\"http://spam:8080/v4/nodes\","
+                        "\"status\":200,\"curl_code\":0,"));
+    EXPECT_NE(std::string::npos,
+              text.find("\"name\":\"server\",\"cat\":\"puppetdb.phase\""));
+    EXPECT_NE(std::string::npos, text.find("\"dur\":50,"));
+    // The two queries overlap, hence their events are on two threads
+    EXPECT_NE(std::string::npos, text.find("\"tid\":2"));
+    EXPECT_EQ("]}", text.substr(text.size() - 2));
+}
+
+TEST_F(TraceTest, otlpSpansExport) {
+    TraceRecorder trace {};
+    QueryStats failed { makeStats("nodes", 0, 150) };
+    failed.curl_code = CURLE_COULDNT_CONNECT;
+    trace.record(failed);
+    std::ostringstream out {};
+
+    trace.writeOtlpSpans(out, "inventory");
+
+    std::string text { out.str() };
+    EXPECT_NE(std::string::npos, text.find("{\"stringValue\":\"inventory\"}"));
+    EXPECT_NE(std::string::npos,
+              text.find("\"name\":\"GET nodes\",\"kind\":3,"));
+    EXPECT_NE(std::string::npos,
+              text.find("{\"key\":\"url.full\",\"value\":"
+                        "{\"stringValue\":\"http://spam:8080/v4/nodes\"}}"));
+    EXPECT_NE(std::string::npos, text.find("\"status\":{\"code\":2,"));
+    size_t trace_id { text.find("\"traceId\":\"") };
+    ASSERT_NE(std::string::npos, trace_id);
+    EXPECT_EQ('"', text[trace_id + 11 + 32]);
+}
+
+TEST_F(TraceTest, connectorRecordsQueries) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"node1\"]");
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    std::shared_ptr<TraceRecorder> trace { new TraceRecorder {} };
+    connector.setTraceRecorder(trace);
+    Query query { "nodes", "[\"=\",\"certname\",\"node1\"]" };
+
+    connector.performQuery(query);
+    connector.setQueryMethod(QueryMethod::Post);
+    connector.submit(query).get();
+
+    auto events = trace->getEvents();
+    ASSERT_EQ(2u, events.size());
+    EXPECT_EQ(connector.getPerformedQueryUrl(), events[0].url);
+    EXPECT_TRUE(events[0].request_body.empty());
+    EXPECT_EQ(200, events[0].response_code);
+    EXPECT_EQ(9u, events[0].result_bytes);
+    EXPECT_EQ("{\"query\":[\"=\",\"certname\",\"node1\"]}",
+              events[1].request_body);
+    EXPECT_LE(events[0].start_time, events[1].start_time);
+}
+
 // Testing the PuppetDB connector
 
 class ConnectionTest : public ::testing::Test {
@@ -111,6 +698,78 @@ TEST_F(ConnectionTest, ConnectDefaultPortAndVersion) {
     EXPECT_EQ(expected_url, connector.getQueryUrl(query, curl_handle_));
 }
 
+TEST_F(ConnectionTest, pagedQueryUrl) {
+    PuppetdbConnector connector { "spam" };
+    Query query { "nodes", "[\"=\", \"name\", \"a\"]" };
+    query.setLimit(10);
+    query.setOffset(20);
+    query.setOrderBy({ OrderBy { "certname", false } });
+    query.setIncludeTotal(true);
+    std::string expected_url {
+        "http://spam:8080/v4/nodes"
+        "?query=%5B%22%3D%22%2C%20%22name%22%2C%20%22a%22%5D"
+        "&limit=10&offset=20"
+        "&order_by=%5B%7B%22field%22%3A%22certname%22%2C"
+        "%22order%22%3A%22desc%22%7D%5D"
+        "&include_total=true" };
+
+    EXPECT_EQ(expected_url, connector.getQueryUrl(query, curl_handle_));
+}
+
+TEST_F(ConnectionTest, pagedQueryUrlV3) {
+    PuppetdbConnector connector { "spam", 8080, ApiVersion::v3 };
+    Query query { "nodes" };
+    query.setLimit(5);
+    query.setOrderBy({ OrderBy { "name" } });
+    std::string expected_url {
+        "http://spam:8080/v3/nodes?limit=5"
+        "&order-by=%5B%7B%22field%22%3A%22name%22%2C"
+        "%22order%22%3A%22asc%22%7D%5D" };
+
+    EXPECT_EQ(expected_url, connector.getQueryUrl(query, curl_handle_));
+}
+
+TEST_F(ConnectionTest, projectedQueryUrl) {
+    PuppetdbConnector connector { "spam" };
+    Query query { "resources", "[\"=\",\"type\",\"File\"]" };
+    query.setProjection({ "title", "a\"b" });
+    Query all_query { "resources" };
+    all_query.setProjection({ "title" });
+
+    EXPECT_EQ("http://spam:8080/v4/resources"
+              "?query=%5B%22extract%22%2C%5B%22title%22%2C%22a%5C%22b%22%5D"
+              "%2C%5B%22%3D%22%2C%22type%22%2C%22File%22%5D%5D",
+              connector.getQueryUrl(query, curl_handle_));
+    EXPECT_EQ("http://spam:8080/v4/resources"
+              "?query=%5B%22extract%22%2C%5B%22title%22%5D%5D",
+              connector.getQueryUrl(all_query, curl_handle_));
+}
+
+TEST_F(ConnectionTest, projectedQueryUrlV3) {
+    PuppetdbConnector connector { "spam", 8080, ApiVersion::v3 };
+    Query query { "resources", "[\"=\",\"type\",\"File\"]" };
+    query.setProjection({ "title" });
+
+    // No server-side projection before v4
+    EXPECT_EQ("http://spam:8080/v3/resources"
+              "?query=%5B%22%3D%22%2C%22type%22%2C%22File%22%5D",
+              connector.getQueryUrl(query, curl_handle_));
+}
+
+TEST_F(ConnectionTest, invalidProjections) {
+    PuppetdbConnector connector { "spam" };
+    Query pql_query { "resources", "resources { type = \"File\" }" };
+    pql_query.setProjection({ "title" });
+    Query extract_query { "resources",
+                          " [ \"extract\", [\"title\"]]" };
+    extract_query.setProjection({ "title" });
+
+    EXPECT_THROW(connector.getQueryUrl(pql_query, curl_handle_),
+                 query_error);
+    EXPECT_THROW(connector.getQueryUrl(extract_query, curl_handle_),
+                 query_error);
+}
+
 TEST_F(ConnectionTest, ConnectWithoutHost) {
     EXPECT_THROW(PuppetdbConnector(""), connector_error);
 }
@@ -135,6 +794,30 @@ TEST_F(ConnectionTest, ConnectWithSSLValid) {
     EXPECT_NO_THROW(ctor());
 }
 
+TEST_F(ConnectionTest, certificatesAreReadOnce) {
+    std::vector<std::string> paths {};
+    for (std::string name : { "ca_crt.pem", "test_crt.pem", "test_key.pem" }) {
+        char path[] = "/tmp/libpuppetdb_cert_XXXXXX";
+        int fd { mkstemp(path) };
+        ASSERT_GE(fd, 0);
+        close(fd);
+        std::ifstream input { "./resources/" + name, std::ios::binary };
+        std::ofstream output { path, std::ios::binary };
+        output << input.rdbuf();
+        paths.push_back(path);
+    }
+    MockSSLURLConnector mock_connector { paths[0], paths[1], paths[2] };
+    for (auto& path : paths) {
+        std::remove(path.c_str());
+    }
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("facts.json")));
+    Query query { "facts" };
+
+    EXPECT_FALSE(mock_connector.performQuery(query).empty());
+    EXPECT_NO_THROW(PuppetdbConnector { mock_connector });
+}
+
 TEST_F(ConnectionTest, ConnectWithSSLIsSecure) {
     PuppetdbConnector connector { "fake_host",
                                   "./resources/ca_crt.pem",
@@ -182,6 +865,1087 @@ TEST_F(ConnectionTest, multipleHttpQueries) {
     EXPECT_FALSE(second_result.size() == 0);
 }
 
+TEST_F(ConnectionTest, closeWithoutQuery) {
+    PuppetdbConnector connector { "spam" };
+
+    EXPECT_FALSE(connector.isOpen());
+    EXPECT_NO_THROW(connector.close());
+    EXPECT_NO_THROW(connector.reset());
+    EXPECT_FALSE(connector.isOpen());
+}
+
+TEST_F(ConnectionTest, handleIsKeptAcrossQueries) {
+    MockURLConnector mock_connector { "spam" };
+    Query first_query { "eggs" };
+    Query second_query { "beans" };
+    std::string file_url { getResourceUrl("ca_crt.pem") };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(file_url));
+
+    std::string first_result { mock_connector.performQuery(first_query) };
+    EXPECT_TRUE(mock_connector.isOpen());
+    std::string second_result { mock_connector.performQuery(second_query) };
+    EXPECT_TRUE(mock_connector.isOpen());
+
+    EXPECT_FALSE(first_result.empty());
+    EXPECT_EQ(first_result, second_result);
+}
+
+TEST_F(ConnectionTest, queryAfterClose) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    std::string file_url { getResourceUrl("ca_crt.pem") };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(file_url));
+
+    std::string first_result { mock_connector.performQuery(query) };
+    mock_connector.close();
+    EXPECT_FALSE(mock_connector.isOpen());
+    std::string second_result { mock_connector.performQuery(query) };
+
+    EXPECT_TRUE(mock_connector.isOpen());
+    EXPECT_EQ(first_result, second_result);
+}
+
+TEST_F(ConnectionTest, copyDoesNotShareHandle) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("ca_crt.pem")));
+    mock_connector.performQuery(query);
+
+    PuppetdbConnector copy { mock_connector };
+
+    EXPECT_TRUE(mock_connector.isOpen());
+    EXPECT_FALSE(copy.isOpen());
+}
+
+TEST_F(ConnectionTest, submitQuery) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("ca_crt.pem")));
+
+    std::string sync_result { mock_connector.performQuery(query) };
+    auto future_result = mock_connector.submit(query);
+
+    EXPECT_EQ(sync_result, future_result.get());
+}
+
+TEST_F(ConnectionTest, submitQueryFailure) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("non_existent.pem")));
+
+    auto future_result = mock_connector.submit(query);
+
+    EXPECT_THROW(future_result.get(), processing_error);
+}
+
+TEST_F(ConnectionTest, submitQueryWithCallback) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("ca_crt.pem")))
+        .WillOnce(testing::Return(getResourceUrl("non_existent.pem")));
+    std::string sync_result {};
+    {
+        std::ifstream file { "./resources/ca_crt.pem" };
+        sync_result.assign(std::istreambuf_iterator<char> { file },
+                           std::istreambuf_iterator<char> {});
+    }
+    std::promise<std::string> first {};
+    std::promise<bool> second_failed {};
+
+    // The callback starts the second query
+    mock_connector.submit(query, [&](std::future<std::string> result) {
+        first.set_value(result.get());
+        mock_connector.submit(query, [&](std::future<std::string> result) {
+            try {
+                result.get();
+                second_failed.set_value(false);
+            } catch (processing_error&) {
+                second_failed.set_value(true);
+            }
+        });
+    });
+
+    EXPECT_EQ(sync_result, first.get_future().get());
+    EXPECT_TRUE(second_failed.get_future().get());
+}
+
+TEST_F(ConnectionTest, performQueriesAsyncWithCap) {
+    MockURLConnector mock_connector { "spam" };
+    std::vector<Query> queries {};
+    for (int idx = 0; idx < 10; idx++) {
+        queries.push_back(Query { "eggs" });
+    }
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("test_crt.pem")));
+
+    mock_connector.setMaxConcurrentTransfers(2);
+    auto results = mock_connector.performQueriesAsync(queries);
+
+    EXPECT_EQ(2u, mock_connector.getMaxConcurrentTransfers());
+    ASSERT_EQ(queries.size(), results.size());
+    std::string first_result { results[0].get() };
+    EXPECT_FALSE(first_result.empty());
+    for (size_t idx = 1; idx < results.size(); idx++) {
+        EXPECT_EQ(first_result, results[idx].get());
+    }
+}
+
+TEST_F(ConnectionTest, closeFailsPendingQueries) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("ca_crt.pem")));
+
+    auto future_result = mock_connector.submit(query);
+    mock_connector.close();
+
+    // The query either completed before close() or failed
+    try {
+        EXPECT_FALSE(future_result.get().empty());
+    } catch (processing_error&) {
+    }
+
+    // A new engine is started by the next query
+    EXPECT_FALSE(mock_connector.submit(query).get().empty());
+}
+
+TEST_F(ConnectionTest, performQueryWithSink) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("test_key.pem")));
+    std::string streamed_result {};
+    size_t num_chunks { 0 };
+
+    mock_connector.performQuery(query,
+        [&](const char* data, size_t size) {
+            streamed_result.append(data, size);
+            num_chunks++;
+        });
+
+    EXPECT_LT(0u, num_chunks);
+    EXPECT_EQ(mock_connector.performQuery(query), streamed_result);
+}
+
+TEST_F(ConnectionTest, performQueryWithBuffer) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("test_key.pem")))
+        .WillOnce(testing::Return(getResourceUrl("ca_crt.pem")))
+        .WillOnce(testing::Return(getResourceUrl("ca_crt.pem")));
+    std::string result_buffer {};
+
+    mock_connector.performQuery(query, result_buffer);
+    size_t capacity { result_buffer.capacity() };
+    const char* data { result_buffer.data() };
+    mock_connector.performQuery(query, result_buffer);
+
+    // The second result is shorter and neither reallocates nor
+    // includes the first
+    EXPECT_EQ(mock_connector.performQuery(query), result_buffer);
+    EXPECT_EQ(capacity, result_buffer.capacity());
+    EXPECT_EQ(data, result_buffer.data());
+}
+
+TEST_F(ConnectionTest, performQueryWithStream) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("test_key.pem")));
+    std::ostringstream output {};
+
+    mock_connector.performQuery(query, output);
+
+    EXPECT_EQ(mock_connector.performQuery(query), output.str());
+}
+
+TEST_F(ConnectionTest, performQueryWithFailingSink) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("test_key.pem")));
+
+    auto sink = [](const char* data, size_t size) {
+        throw std::logic_error { "sink failure" };
+    };
+
+    EXPECT_THROW(mock_connector.performQuery(query, sink), std::logic_error);
+}
+
+TEST_F(ConnectionTest, compressionIsDisabledByDefault) {
+    PuppetdbConnector connector { "spam" };
+    EXPECT_FALSE(connector.getCompression());
+    connector.setCompression(true);
+    EXPECT_TRUE(connector.getCompression());
+    PuppetdbConnector copy { connector };
+    EXPECT_TRUE(copy.getCompression());
+}
+
+TEST_F(ConnectionTest, compressionCountersAreUpdated) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("facts.json")));
+    mock_connector.setCompression(true);
+    EXPECT_EQ(0u, mock_connector.getCompressionCounters().decompressed_bytes);
+
+    auto result = mock_connector.performQuery(query);
+    auto counters = mock_connector.getCompressionCounters();
+    EXPECT_EQ(result.size(), counters.decompressed_bytes);
+    EXPECT_EQ(result.size(), counters.compressed_bytes);
+    EXPECT_DOUBLE_EQ(1.0, counters.getRatio());
+
+    mock_connector.submit(query).get();
+    EXPECT_EQ(2 * result.size(),
+              mock_connector.getCompressionCounters().decompressed_bytes);
+}
+
+TEST_F(ConnectionTest, lastQueryStats) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("facts.json")))
+        .WillOnce(testing::Return(getResourceUrl("missing.json")));
+
+    auto result = mock_connector.performQuery(query);
+    auto stats = mock_connector.getLastQueryStats();
+    EXPECT_EQ(getResourceUrl("facts.json"), stats.url);
+    EXPECT_EQ("eggs", stats.endpoint);
+    EXPECT_EQ(CURLE_OK, stats.curl_code);
+    EXPECT_EQ(result.size(), stats.result_bytes);
+    EXPECT_EQ(result.size(), stats.downloaded_bytes);
+    EXPECT_FALSE(stats.isError());
+
+    EXPECT_THROW(mock_connector.performQuery(query), processing_error);
+    EXPECT_NE(CURLE_OK, mock_connector.getLastQueryStats().curl_code);
+    EXPECT_TRUE(mock_connector.getLastQueryStats().isError());
+}
+
+TEST_F(ConnectionTest, queryObserver) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "eggs" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("facts.json")));
+    std::vector<QueryStats> observed {};
+    std::mutex observed_mutex {};
+    setQueryObserver([&](const QueryStats& stats) {
+        std::lock_guard<std::mutex> lock { observed_mutex };
+        observed.push_back(stats);
+    });
+
+    mock_connector.performQuery(query);
+    mock_connector.submit(query).get();
+    setQueryObserver(QueryObserver {});
+    mock_connector.performQuery(query);
+
+    std::lock_guard<std::mutex> lock { observed_mutex };
+    ASSERT_EQ(2u, observed.size());
+    for (const auto& stats : observed) {
+        EXPECT_EQ("eggs", stats.endpoint);
+        EXPECT_EQ(CURLE_OK, stats.curl_code);
+        EXPECT_LT(0u, stats.result_bytes);
+    }
+}
+
+TEST_F(ConnectionTest, mockServerConnectionIsReused) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"node1\"]");
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    Query query { "nodes" };
+
+    EXPECT_EQ("[\"node1\"]", connector.performQuery(query));
+    EXPECT_EQ("[\"node1\"]", connector.performQuery(query));
+
+    EXPECT_EQ(2u, server.getNumRequests());
+    EXPECT_EQ(1u, server.getNumConnections());
+    EXPECT_EQ(200, connector.getLastQueryStats().response_code);
+    EXPECT_TRUE(connector.getLastQueryStats().connection_reused);
+    EXPECT_EQ("/v4/nodes", server.getLastRequest().target);
+}
+
+TEST_F(ConnectionTest, mockServerWarmup) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"node1\"]");
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    Query query { "nodes" };
+
+    EXPECT_EQ(0u, connector.warmup(0).get());
+    EXPECT_EQ(3u, connector.warmup(3).get());
+    EXPECT_EQ(3u, server.getNumConnections());
+    EXPECT_EQ("HEAD", server.getLastRequest().method);
+
+    // The warm connections are reused by the queries
+    EXPECT_EQ("[\"node1\"]", connector.performQuery(query));
+    EXPECT_TRUE(connector.getLastQueryStats().connection_reused);
+    for (auto& result : connector.performQueriesAsync({ query, query })) {
+        EXPECT_EQ("[\"node1\"]", result.get());
+    }
+    EXPECT_EQ(3u, server.getNumConnections());
+    EXPECT_EQ(6u, server.getNumRequests());
+}
+
+TEST_F(ConnectionTest, mockServerWarmupFailure) {
+    MockPuppetdbServer server {};
+    server.start();
+    int port { server.getPort() };
+    server.stop();
+    PuppetdbConnector connector { "127.0.0.1", port };
+
+    EXPECT_EQ(0u, connector.warmup(2).get());
+}
+
+TEST_F(ConnectionTest, globalInitAndCleanup) {
+    EXPECT_NO_THROW(globalInit());
+    globalCleanup();
+}
+
+TEST_F(ConnectionTest, mockServerRevalidatesCachedResult) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"node1\"]");
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    std::shared_ptr<ResponseCache> cache {
+        new ResponseCache { 1024, std::chrono::milliseconds { 1 } } };
+    connector.setResponseCache(cache);
+    Query query { "nodes" };
+
+    EXPECT_EQ("[\"node1\"]", connector.performQuery(query));
+    std::this_thread::sleep_for(std::chrono::milliseconds { 5 });
+    EXPECT_EQ("[\"node1\"]", connector.performQuery(query));
+
+    auto stats = connector.getLastQueryStats();
+    EXPECT_EQ(304, stats.response_code);
+    EXPECT_TRUE(stats.revalidated);
+    EXPECT_FALSE(stats.from_cache);
+    EXPECT_EQ(9u, stats.result_bytes);
+    EXPECT_EQ(1u, cache->getStats().revalidations);
+    EXPECT_EQ(1u, server.getLastRequest().headers.count("if-none-match"));
+
+    // The asynchronous queries report the cached result as well
+    std::shared_ptr<QueryMetrics> metrics { new QueryMetrics {} };
+    connector.setQueryMetrics(metrics);
+    std::this_thread::sleep_for(std::chrono::milliseconds { 5 });
+    EXPECT_EQ("[\"node1\"]", connector.performQueriesAsync({ query })[0].get());
+
+    auto snapshot = metrics->getSnapshot();
+    EXPECT_EQ(2u, cache->getStats().revalidations);
+    EXPECT_EQ(1u, snapshot.total.cache_hits);
+    EXPECT_EQ(1u, snapshot.total.responses[3]);
+    EXPECT_EQ(9u, snapshot.total.result_bytes);
+}
+
+TEST_F(ConnectionTest, queryMethodDefaults) {
+    PuppetdbConnector connector { "spam" };
+    PuppetdbConnector v3_connector { "spam", PUPPETDB_HTTP_PORT,
+                                     ApiVersion::v3 };
+
+    EXPECT_EQ(QueryMethod::Get, connector.getQueryMethod());
+    EXPECT_EQ(POST_THRESHOLD_DEFAULT, connector.getPostThreshold());
+    EXPECT_EQ(QueryMethod::Get, v3_connector.getQueryMethod());
+    connector.setQueryMethod(QueryMethod::Auto);
+    EXPECT_EQ(QueryMethod::Auto, connector.getQueryMethod());
+    EXPECT_THROW(v3_connector.setQueryMethod(QueryMethod::Post),
+                 connector_error);
+}
+
+TEST_F(ConnectionTest, mockServerPostedQuery) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"node1\"]");
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    connector.setQueryMethod(QueryMethod::Post);
+    Query query { "nodes", "[\"=\", \"certname\", \"node1\"]" };
+    query.setLimit(10);
+    query.setOrderBy({ OrderBy { "certname" } });
+
+    EXPECT_EQ("[\"node1\"]", connector.performQuery(query));
+
+    auto request = server.getLastRequest();
+    EXPECT_EQ("POST", request.method);
+    EXPECT_EQ("/v4/nodes", request.target);
+    EXPECT_EQ("application/json", request.headers["content-type"]);
+    EXPECT_EQ(0u, request.headers.count("expect"));
+    EXPECT_EQ("{\"query\":[\"=\", \"certname\", \"node1\"],\"limit\":10,"
+              "\"order_by\":[{\"field\":\"certname\",\"order\":\"asc\"}]}",
+              request.body);
+    EXPECT_EQ("http://127.0.0.1:" + std::to_string(server.getPort())
+              + "/v4/nodes", connector.getPerformedQueryUrl());
+}
+
+TEST_F(ConnectionTest, mockServerPostsProjectedQueries) {
+    MockPuppetdbServer server {};
+    server.setResponse("resources", "[{\"title\":\"/etc/hosts\"}]");
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    connector.setQueryMethod(QueryMethod::Auto, 40);
+    Query query { "resources", "[\"=\",\"type\",\"File\"]" };
+
+    connector.performQuery(query);
+    EXPECT_EQ("GET", server.getLastRequest().method);
+    // The extract clause counts toward the POST threshold
+    query.setProjection({ "title" });
+    connector.performQuery(query);
+
+    EXPECT_EQ("POST", server.getLastRequest().method);
+    EXPECT_EQ("{\"query\":[\"extract\",[\"title\"],"
+              "[\"=\",\"type\",\"File\"]]}",
+              server.getLastRequest().body);
+}
+
+TEST_F(ConnectionTest, mockServerPostsLargeQueries) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"node1\"]");
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    connector.setQueryMethod(QueryMethod::Auto, 24);
+    Query small_query { "nodes", "[\"=\", \"name\", \"a\"]" };
+    Query large_query { "nodes", "[\"=\", \"certname\", \"node1\"]" };
+    Query pql_query { "nodes", "nodes[certname] { certname = \"node1\" }" };
+
+    connector.performQuery(small_query);
+    EXPECT_EQ("GET", server.getLastRequest().method);
+    connector.submit(large_query).get();
+    EXPECT_EQ("POST", server.getLastRequest().method);
+    connector.performQuery(pql_query);
+    EXPECT_EQ("{\"query\":\"nodes[certname] { certname = \\\"node1\\\" }\"}",
+              server.getLastRequest().body);
+}
+
+TEST_F(ConnectionTest, mockServerCachesPostedQueriesByBody) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"node1\"]");
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    connector.setQueryMethod(QueryMethod::Post);
+    std::shared_ptr<ResponseCache> cache {
+        new ResponseCache { 1024, std::chrono::milliseconds { 60000 } } };
+    connector.setResponseCache(cache);
+    Query query_1 { "nodes", "[\"=\", \"certname\", \"node1\"]" };
+    Query query_2 { "nodes", "[\"=\", \"certname\", \"node2\"]" };
+
+    connector.performQuery(query_1);
+    connector.performQuery(query_2);
+    connector.performQuery(query_1);
+
+    EXPECT_EQ(2u, server.getNumRequests());
+    EXPECT_TRUE(connector.getLastQueryStats().from_cache);
+}
+
+TEST_F(ConnectionTest, retryBackoffIsBounded) {
+    RetryPolicy policy { 5, std::chrono::milliseconds { 10 },
+                         std::chrono::milliseconds { 35 } };
+
+    for (int index = 0; index < 100; index++) {
+        EXPECT_LE(policy.getBackoff(1).count(), 10);
+        EXPECT_LE(policy.getBackoff(2).count(), 20);
+        EXPECT_LE(policy.getBackoff(10).count(), 35);
+        EXPECT_GE(policy.getBackoff(10).count(), 0);
+    }
+    EXPECT_TRUE(RetryPolicy::isRetryable(CURLE_COULDNT_CONNECT));
+    EXPECT_FALSE(RetryPolicy::isRetryable(CURLE_WRITE_ERROR));
+}
+
+TEST_F(ConnectionTest, retriesTransientErrors) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return("http://127.0.0.1:1/v4/nodes"));
+    std::shared_ptr<QueryMetrics> metrics { new QueryMetrics {} };
+    mock_connector.setQueryMetrics(metrics);
+    mock_connector.setRetryPolicy(RetryPolicy {
+        2, std::chrono::milliseconds { 1 }, std::chrono::milliseconds { 1 } });
+    Query query { "nodes" };
+
+    EXPECT_THROW(mock_connector.performQuery(query), processing_error);
+
+    EXPECT_EQ(3u, metrics->getSnapshot().total.transfer_errors);
+    EXPECT_EQ(2u, mock_connector.getLastQueryStats().retries);
+}
+
+TEST_F(ConnectionTest, retriesStopAtTheDeadline) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return("http://127.0.0.1:1/v4/nodes"));
+    mock_connector.setRetryPolicy(RetryPolicy {
+        1000, std::chrono::milliseconds { 10 },
+        std::chrono::milliseconds { 10 } });
+    mock_connector.setTimeouts(std::chrono::milliseconds { 0 },
+                               std::chrono::milliseconds { 100 });
+    Query query { "nodes" };
+
+    EXPECT_THROW(mock_connector.performQuery(query), processing_error);
+
+    EXPECT_LT(mock_connector.getLastQueryStats().retries, 100u);
+}
+
+TEST_F(ConnectionTest, mockServerQueryTimeout) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"node1\"]",
+                       std::chrono::milliseconds { 300 });
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    connector.setTimeouts(std::chrono::milliseconds { 1000 },
+                          std::chrono::milliseconds { 50 });
+    Query query { "nodes" };
+
+    EXPECT_THROW(connector.performQuery(query), processing_error);
+
+    EXPECT_EQ(CURLE_OPERATION_TIMEDOUT,
+              connector.getLastQueryStats().curl_code);
+}
+
+TEST_F(ConnectionTest, mockServerHedgedQuery) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"slow\"]",
+                       std::chrono::milliseconds { 1000 });
+    server.start();
+    MockPuppetdbServer replica {};
+    replica.setResponse("nodes", "[\"fast\"]");
+    replica.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    connector.setHedgingPolicy(HedgingPolicy {
+        "127.0.0.1", replica.getPort(), std::chrono::milliseconds { 20 } });
+    Query query { "nodes" };
+
+    EXPECT_EQ("[\"fast\"]", connector.performQuery(query));
+
+    EXPECT_TRUE(connector.getLastQueryStats().hedged);
+    EXPECT_EQ(200, connector.getLastQueryStats().response_code);
+    EXPECT_EQ("http://127.0.0.1:" + std::to_string(replica.getPort())
+              + "/v4/nodes", connector.getLastQueryStats().url);
+}
+
+TEST_F(ConnectionTest, mockServerHedgingDelay) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"node1\"]");
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    connector.setHedgingPolicy(HedgingPolicy {
+        "127.0.0.1", 1, std::chrono::milliseconds { 1000 } });
+    Query query { "nodes" };
+
+    EXPECT_EQ("[\"node1\"]", connector.performQuery(query));
+    EXPECT_EQ("[\"node1\"]", connector.performQuery(query));
+
+    EXPECT_FALSE(connector.getLastQueryStats().hedged);
+    EXPECT_EQ(1u, server.getNumConnections());
+}
+
+TEST_F(ConnectionTest, pagerWithZeroPageSize) {
+    PuppetdbConnector connector { "spam" };
+
+    EXPECT_THROW(QueryPager(connector, Query { "facts" }, 0), query_error);
+}
+
+TEST_F(ConnectionTest, pagerFetchesAllPages) {
+    MockURLConnector mock_connector { "spam" };
+    std::vector<size_t> offsets {};
+    std::mutex offsets_mutex {};
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Invoke([&](Query& query, CURL* curl) {
+            std::lock_guard<std::mutex> lock { offsets_mutex };
+            EXPECT_EQ(4u, query.getLimit());
+            offsets.push_back(query.getOffset());
+            return getResourceUrl(query.getOffset() < 10 ? "facts.json"
+                                                         : "empty.json");
+        }));
+    Query query { "facts" };
+    query.setOffset(2);
+    QueryPager pager { mock_connector, query, 4 };
+    std::string page {};
+    std::ifstream facts_file { "./resources/facts.json" };
+    std::string expected_page { std::istreambuf_iterator<char>(facts_file),
+                                std::istreambuf_iterator<char>() };
+
+    while (pager.next(page)) {
+        EXPECT_EQ(expected_page, page);
+    }
+
+    EXPECT_EQ(2u, pager.getNumPages());
+    EXPECT_FALSE(pager.next(page));
+    std::lock_guard<std::mutex> lock { offsets_mutex };
+    EXPECT_EQ((std::vector<size_t> { 2, 6, 10 }), offsets);
+}
+
+TEST_F(ConnectionTest, pagerStopsAtShortPage) {
+    MockURLConnector mock_connector { "spam" };
+    std::vector<size_t> offsets {};
+    std::mutex offsets_mutex {};
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Invoke([&](Query& query, CURL* curl) {
+            std::lock_guard<std::mutex> lock { offsets_mutex };
+            offsets.push_back(query.getOffset());
+            return getResourceUrl(query.getOffset() < 4 ? "facts.json"
+                                                        : "reports.json");
+        }));
+    QueryPager pager { mock_connector, Query { "facts" }, 4 };
+    std::string page {};
+    std::ifstream reports_file { "./resources/reports.json" };
+    std::string short_page { std::istreambuf_iterator<char>(reports_file),
+                             std::istreambuf_iterator<char>() };
+
+    EXPECT_TRUE(pager.next(page));
+    EXPECT_TRUE(pager.next(page));
+    EXPECT_EQ(short_page, page);
+    EXPECT_FALSE(pager.next(page));
+
+    // No page is fetched past the short one
+    EXPECT_EQ(2u, pager.getNumPages());
+    std::lock_guard<std::mutex> lock { offsets_mutex };
+    EXPECT_EQ((std::vector<size_t> { 0, 4 }), offsets);
+}
+
+TEST_F(ConnectionTest, pagerStopsAtQueryLimit) {
+    MockURLConnector mock_connector { "spam" };
+    std::vector<std::pair<size_t, size_t>> pages {};
+    std::mutex pages_mutex {};
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Invoke([&](Query& query, CURL* curl) {
+            std::lock_guard<std::mutex> lock { pages_mutex };
+            pages.emplace_back(query.getOffset(), query.getLimit());
+            return getResourceUrl("facts.json");
+        }));
+    Query query { "facts" };
+    query.setLimit(6);
+    QueryPager pager { mock_connector, query, 4 };
+    std::string page {};
+
+    while (pager.next(page)) {}
+
+    // The last page is shrunk to the limit
+    EXPECT_EQ(2u, pager.getNumPages());
+    std::lock_guard<std::mutex> lock { pages_mutex };
+    EXPECT_EQ((std::vector<std::pair<size_t, size_t>> { { 0, 4 }, { 4, 2 } }),
+              pages);
+}
+
+TEST_F(ConnectionTest, pagerCountsRecords) {
+    EXPECT_EQ(0u, QueryPager::countRecords("[]"));
+    EXPECT_EQ(0u, QueryPager::countRecords(" [ ]\n"));
+    EXPECT_EQ(1u, QueryPager::countRecords("[{\"a\": [1, 2]}]"));
+    EXPECT_EQ(3u, QueryPager::countRecords("[\"a,]\\\"\", {\"b\": {}}, 3]"));
+    EXPECT_EQ(2u, QueryPager::countRecords("[1, 2, 3]", 2));
+}
+
+// Testing the cluster
+
+class ClusterTest : public ::testing::Test {};
+
+TEST_F(ClusterTest, noReplicas) {
+    EXPECT_THROW(PuppetdbCluster { std::vector<PuppetdbConnector> {} },
+                 connector_error);
+}
+
+TEST_F(ClusterTest, queriesAreSpread) {
+    MockPuppetdbServer server_1 {};
+    server_1.setResponse("nodes", "[\"node1\"]");
+    server_1.start();
+    MockPuppetdbServer server_2 {};
+    server_2.setResponse("nodes", "[\"node1\"]");
+    server_2.start();
+    ClusterPolicy policy {};
+    policy.strategy = BalancingStrategy::LeastOutstanding;
+    policy.probe_interval = std::chrono::milliseconds { 0 };
+    PuppetdbCluster cluster {
+        { PuppetdbConnector { "127.0.0.1", server_1.getPort() },
+          PuppetdbConnector { "127.0.0.1", server_2.getPort() } },
+        policy };
+    Query query { "nodes" };
+
+    for (int index = 0; index < 10; index++) {
+        EXPECT_EQ("[\"node1\"]", cluster.performQuery(query));
+    }
+
+    EXPECT_EQ(5u, server_1.getNumRequests());
+    EXPECT_EQ(5u, server_2.getNumRequests());
+}
+
+TEST_F(ClusterTest, fasterReplicaIsPreferred) {
+    MockPuppetdbServer fast_server {};
+    fast_server.setResponse("nodes", "[\"node1\"]");
+    fast_server.start();
+    MockPuppetdbServer slow_server {};
+    slow_server.setResponse("nodes", "[\"node1\"]",
+                            std::chrono::milliseconds { 20 });
+    slow_server.start();
+    ClusterPolicy policy {};
+    policy.slow_factor = 0;
+    policy.probe_interval = std::chrono::milliseconds { 0 };
+    PuppetdbCluster cluster {
+        { PuppetdbConnector { "127.0.0.1", fast_server.getPort() },
+          PuppetdbConnector { "127.0.0.1", slow_server.getPort() } },
+        policy };
+    Query query { "nodes" };
+
+    for (int index = 0; index < 20; index++) {
+        cluster.performQuery(query);
+    }
+
+    EXPECT_GT(fast_server.getNumRequests(), 15u);
+    EXPECT_TRUE(cluster.getStatus()[1].healthy);
+}
+
+TEST_F(ClusterTest, failingReplicaIsEjectedAndProbed) {
+    MockPuppetdbServer server {};
+    server.setResponse("nodes", "[\"node1\"]");
+    server.start();
+    MockPuppetdbServer replica {};
+    replica.setResponse("nodes", "[\"node1\"]");
+    replica.start();
+    int replica_port { replica.getPort() };
+    replica.stop();
+    ClusterPolicy policy {};
+    policy.strategy = BalancingStrategy::LeastOutstanding;
+    policy.max_failures = 2;
+    policy.ejection_time = std::chrono::milliseconds { 20 };
+    policy.probe_interval = std::chrono::milliseconds { 10 };
+    PuppetdbCluster cluster {
+        { PuppetdbConnector { "127.0.0.1", server.getPort() },
+          PuppetdbConnector { "127.0.0.1", replica_port } },
+        policy };
+    Query query { "nodes" };
+
+    // The failed attempts are repeated on the healthy replica
+    for (int index = 0; index < 10; index++) {
+        EXPECT_EQ("[\"node1\"]", cluster.performQuery(query));
+    }
+    EXPECT_FALSE(cluster.getStatus()[1].healthy);
+    EXPECT_TRUE(cluster.getStatus()[0].healthy);
+    EXPECT_GE(cluster.getStatus()[1].failures, 2u);
+
+    MockPuppetdbServer restarted_replica {};
+    restarted_replica.setResponse("nodes", "[\"node1\"]");
+    restarted_replica.start(replica_port);
+    for (int index = 0; index < 200 && !cluster.getStatus()[1].healthy;
+            index++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds { 10 });
+    }
+    EXPECT_TRUE(cluster.getStatus()[1].healthy);
+}
+
+TEST_F(ClusterTest, probesAreNotThrottled) {
+    MockPuppetdbServer server {};
+    server.setResponse("version", "{}", std::chrono::milliseconds { 100 });
+    server.start();
+    ThrottlePolicy throttle_policy {};
+    throttle_policy.max_concurrency = 8;
+    throttle_policy.initial_concurrency = 8;
+    std::shared_ptr<Throttle> throttle { new Throttle { throttle_policy } };
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    connector.setThrottle(throttle);
+    ClusterPolicy policy {};
+    policy.probe_interval = std::chrono::milliseconds { 10 };
+    policy.probe_timeout = std::chrono::milliseconds { 10 };
+    PuppetdbCluster cluster { { connector }, policy };
+
+    // The probes time out, without reducing the concurrency limit
+    for (int index = 0; index < 200 && server.getNumRequests() < 2;
+            index++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds { 10 });
+    }
+    EXPECT_LE(2u, server.getNumRequests());
+    EXPECT_EQ(8u, throttle->getConcurrencyLimit());
+}
+
+TEST_F(ClusterTest, probesAreNotTraced) {
+    MockPuppetdbServer server {};
+    server.setResponse("version", "{}");
+    server.start();
+    std::shared_ptr<TraceRecorder> trace { new TraceRecorder {} };
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    connector.setTraceRecorder(trace);
+    ClusterPolicy policy {};
+    policy.probe_interval = std::chrono::milliseconds { 10 };
+    PuppetdbCluster cluster { { connector }, policy };
+
+    for (int index = 0; index < 200 && server.getNumRequests() < 2;
+            index++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds { 10 });
+    }
+    EXPECT_LE(2u, server.getNumRequests());
+    EXPECT_EQ(0u, trace->getNumRecorded());
+}
+
+TEST_F(ConnectionTest, mockServerThrottledByPriority) {
+    MockPuppetdbServer server {};
+    server.setResponse("a", "[]", std::chrono::milliseconds { 200 });
+    server.setResponse("b", "[]");
+    server.setResponse("c", "[]");
+    server.start();
+    PuppetdbConnector connector { "127.0.0.1", server.getPort() };
+    ThrottlePolicy policy {};
+    policy.max_concurrency = 1;
+    policy.initial_concurrency = 1;
+    std::shared_ptr<Throttle> throttle { new Throttle { policy } };
+    connector.setThrottle(throttle);
+    std::mutex mutex {};
+    std::vector<std::string> completed {};
+    std::promise<void> done {};
+
+    auto submit = [&](std::string endpoint, int priority) {
+        Query query { endpoint };
+        query.setPriority(priority);
+        connector.submit(query, [&, endpoint](std::future<std::string>) {
+            std::lock_guard<std::mutex> lock { mutex };
+            completed.push_back(endpoint);
+            if (completed.size() == 3) {
+                done.set_value();
+            }
+        });
+    };
+    submit("a", 0);
+    while (throttle->getNumInFlight() == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds { 1 });
+    }
+    submit("b", 0);
+    submit("c", 5);
+    done.get_future().wait();
+
+    // c overtakes b while a holds the only permit
+    EXPECT_EQ((std::vector<std::string> { "a", "c", "b" }), completed);
+    EXPECT_EQ(0u, throttle->getNumInFlight());
+    EXPECT_EQ(0u, throttle->getNumWaiting());
+}
+
+// Testing the throttle
+
+class ThrottleTest : public ::testing::Test {
+  protected:
+    static QueryStats getStats(std::chrono::microseconds latency,
+                               long response_code = 200) {
+        QueryStats stats {};
+        stats.response_code = response_code;
+        stats.total_time = latency;
+        return stats;
+    }
+};
+
+TEST_F(ThrottleTest, waitersAreServedByPriority) {
+    ThrottlePolicy policy {};
+    policy.max_concurrency = 1;
+    Throttle throttle { policy };
+    std::mutex mutex {};
+    std::vector<int> granted {};
+    std::vector<std::thread> waiters {};
+
+    Throttle::Permit permit { throttle.acquire() };
+    for (int priority : { 1, 5, 3 }) {
+        waiters.push_back(std::thread { [&, priority]() {
+            Throttle::Permit waiter_permit { throttle.acquire(priority) };
+            std::lock_guard<std::mutex> lock { mutex };
+            granted.push_back(priority);
+        } });
+        while (throttle.getNumWaiting() < waiters.size()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds { 1 });
+        }
+    }
+    permit = Throttle::Permit {};
+    for (auto& waiter : waiters) {
+        waiter.join();
+    }
+
+    EXPECT_EQ((std::vector<int> { 5, 3, 1 }), granted);
+    EXPECT_EQ(0u, throttle.getNumInFlight());
+}
+
+TEST_F(ThrottleTest, tokenBucketLimitsTheRate) {
+    ThrottlePolicy policy {};
+    policy.rate = 100;
+    policy.burst = 2;
+    Throttle throttle { policy };
+    auto start = std::chrono::steady_clock::now();
+
+    // The burst, then one query every 10ms
+    for (int index = 0; index < 7; index++) {
+        throttle.acquire().complete(getStats(std::chrono::milliseconds { 1 }));
+    }
+
+    EXPECT_LE(std::chrono::milliseconds { 45 },
+              std::chrono::steady_clock::now() - start);
+    EXPECT_EQ(0u, throttle.getConcurrencyLimit());
+}
+
+TEST_F(ThrottleTest, concurrencyLimitAdapts) {
+    ThrottlePolicy policy {};
+    policy.max_concurrency = 8;
+    policy.min_concurrency = 2;
+    policy.initial_concurrency = 4;
+    policy.latency_target = std::chrono::milliseconds { 100 };
+    Throttle throttle { policy };
+    EXPECT_EQ(4u, throttle.getConcurrencyLimit());
+
+    // Additive increase, up to the maximum
+    for (int index = 0; index < 100; index++) {
+        throttle.acquire().complete(getStats(std::chrono::milliseconds { 10 }));
+    }
+    EXPECT_EQ(8u, throttle.getConcurrencyLimit());
+
+    // Multiplicative decrease, once per latency period
+    throttle.acquire().complete(getStats(std::chrono::milliseconds { 10 },
+                                         503));
+    EXPECT_EQ(7u, throttle.getConcurrencyLimit());
+    throttle.acquire().complete(getStats(std::chrono::seconds { 1 }));
+    EXPECT_EQ(7u, throttle.getConcurrencyLimit());
+
+    // Down to the minimum
+    for (int index = 0; index < 100; index++) {
+        std::this_thread::sleep_for(std::chrono::microseconds { 200 });
+        throttle.acquire().complete(getStats(std::chrono::microseconds {
+            200 }, 429));
+    }
+    EXPECT_EQ(2u, throttle.getConcurrencyLimit());
+
+    // A query that did not complete leaves the limit unchanged
+    { Throttle::Permit permit { throttle.acquire() }; }
+    EXPECT_EQ(2u, throttle.getConcurrencyLimit());
+    EXPECT_EQ(0u, throttle.getNumInFlight());
+}
+
+// Testing the single-flight coalescing
+
+class SingleFlightTest : public ::testing::Test {};
+
+TEST_F(SingleFlightTest, followerGetsLeaderResult) {
+    SingleFlight single_flight {};
+    std::shared_future<std::string> result {};
+
+    EXPECT_TRUE(single_flight.join("url", result));
+    EXPECT_FALSE(single_flight.join("url", result));
+    EXPECT_TRUE(single_flight.join("other_url", result));
+    single_flight.complete("other_url", "other");
+    EXPECT_FALSE(single_flight.join("url", result));
+    single_flight.complete("url", "result");
+
+    EXPECT_EQ("result", result.get());
+    EXPECT_EQ(2u, single_flight.getNumCoalesced());
+    EXPECT_EQ(0u, single_flight.getNumInFlight());
+}
+
+TEST_F(SingleFlightTest, followerGetsLeaderFailure) {
+    SingleFlight single_flight {};
+    std::shared_future<std::string> result {};
+    single_flight.join("url", result);
+    single_flight.join("url", result);
+
+    single_flight.fail("url", std::make_exception_ptr(
+        processing_error { "failure" }));
+
+    EXPECT_THROW(result.get(), processing_error);
+}
+
+TEST_F(SingleFlightTest, connectorWaitsForQueryInFlight) {
+    MockURLConnector mock_connector { "spam" };
+    std::string url { "http://unreachable.invalid/v4/nodes" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(url));
+    std::shared_ptr<SingleFlight> single_flight { new SingleFlight {} };
+    mock_connector.setSingleFlight(single_flight);
+    std::shared_future<std::string> leader_result {};
+    ASSERT_TRUE(single_flight->join(url, leader_result));
+
+    auto follower_result = std::async(std::launch::async, [&]() {
+        Query query { "nodes" };
+        return mock_connector.performQuery(query);
+    });
+    while (single_flight->getNumCoalesced() == 0) {
+        std::this_thread::yield();
+    }
+    single_flight->complete(url, "shared_result");
+
+    EXPECT_EQ("shared_result", follower_result.get());
+}
+
+TEST_F(SingleFlightTest, leaderSharesItsResult) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "facts" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillRepeatedly(testing::Return(getResourceUrl("facts.json")));
+    std::shared_ptr<SingleFlight> single_flight { new SingleFlight {} };
+    mock_connector.setSingleFlight(single_flight);
+    std::string streamed_result {};
+
+    mock_connector.performQuery(query, [&](const char* data, size_t size) {
+        streamed_result.append(data, size);
+    });
+
+    EXPECT_FALSE(streamed_result.empty());
+    EXPECT_EQ(streamed_result, mock_connector.performQuery(query));
+    EXPECT_EQ(0u, single_flight->getNumInFlight());
+}
+
+// Testing the connector pool
+
+class PoolTest : public ::testing::Test {
+  protected:
+    static std::unique_ptr<PuppetdbConnector> makeFileConnector() {
+        std::unique_ptr<MockURLConnector> connector {
+            new MockURLConnector { "spam" } };
+        EXPECT_CALL(*connector, getQueryUrl(testing::_, testing::_))
+            .WillRepeatedly(testing::Return(getResourceUrl("ca_crt.pem")));
+        return std::unique_ptr<PuppetdbConnector> { connector.release() };
+    }
+};
+
+TEST_F(PoolTest, createFromPrototype) {
+    PuppetdbConnector prototype { "spam" };
+    PuppetdbConnectorPool pool { prototype, 3 };
+
+    EXPECT_EQ(3u, pool.size());
+}
+
+TEST_F(PoolTest, createWithZeroSize) {
+    PuppetdbConnector prototype { "spam" };
+
+    EXPECT_THROW(PuppetdbConnectorPool(prototype, 0), connector_error);
+}
+
+TEST_F(PoolTest, leasesAreDistinct) {
+    PuppetdbConnectorPool pool { makeFileConnector, 2 };
+    Query query { "eggs" };
+
+    auto first_lease = pool.acquire();
+    auto second_lease = pool.acquire();
+    first_lease->performQuery(query);
+
+    EXPECT_NE(&*first_lease, &*second_lease);
+    EXPECT_EQ(getResourceUrl("ca_crt.pem"),
+              first_lease->getPerformedQueryUrl());
+    EXPECT_EQ("", second_lease->getPerformedQueryUrl());
+}
+
+TEST_F(PoolTest, concurrentQueries) {
+    PuppetdbConnectorPool pool { makeFileConnector, 2 };
+    Query query { "eggs" };
+    std::string expected_result { pool.performQuery(query) };
+    std::atomic<int> failures { 0 };
+    std::vector<std::thread> workers {};
+
+    for (int idx = 0; idx < 6; idx++) {
+        workers.push_back(std::thread { [&]() {
+            for (int count = 0; count < 20; count++) {
+                Query worker_query { "eggs" };
+                if (pool.performQuery(worker_query) != expected_result) {
+                    failures++;
+                }
+            }
+        } });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    EXPECT_FALSE(expected_result.empty());
+    EXPECT_EQ(0, failures.load());
+}
+
 #ifdef PUPET_AGENT_TEST
     TEST_F(ConnectionTest, testingPuppetSSL) {
         PuppetdbConnector connector {
@@ -0,0 +1,382 @@
+/*
+    mock_server.h
+    =============
+
+    A local mock PuppetDB server (HTTP/1.1, keep-alive), serving canned
+    responses per endpoint with a configurable latency, for the
+    libpuppetdb benchmarks and tests.
+
+    It supports the ETag validation (If-None-Match) and, if built with
+    LIBPUPPETDB_MOCK_SERVER_ZLIB, the deflate content encoding.
+
+*/
+
+#ifndef LIBPUPPETDB_TEST_MOCK_SERVER_H_
+#define LIBPUPPETDB_TEST_MOCK_SERVER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef LIBPUPPETDB_MOCK_SERVER_ZLIB
+#include <zlib.h>
+#endif
+
+namespace LibPuppetdb {
+
+class MockPuppetdbServer {
+  public:
+    struct Request {
+        std::string method;
+        std::string target;
+        // Names in lower case
+        std::map<std::string, std::string> headers;
+        std::string body;
+    };
+
+    MockPuppetdbServer()
+            : listen_fd_ { -1 },
+              port_ { 0 },
+              stopping_ { false },
+              num_requests_ { 0 },
+              num_connections_ { 0 } {
+    }
+
+    MockPuppetdbServer(const MockPuppetdbServer&) = delete;
+    MockPuppetdbServer& operator=(const MockPuppetdbServer&) = delete;
+
+    ~MockPuppetdbServer() {
+        stop();
+    }
+
+    /// Serves the body for the endpoint (the path after the api
+    /// version, e.g. "nodes"), after the specified latency
+    void setResponse(const std::string& endpoint, std::string body,
+                     std::chrono::milliseconds latency =
+                         std::chrono::milliseconds { 0 },
+                     int status = 200) {
+        std::shared_ptr<Response> response { new Response {} };
+        response->status = status;
+        response->latency = latency;
+        response->etag = "\"" + std::to_string(
+            std::hash<std::string> {}(body)) + "\"";
+        response->deflated_body = deflate(body);
+        response->body = std::move(body);
+        std::lock_guard<std::mutex> lock { mutex_ };
+        responses_[endpoint] = std::move(response);
+    }
+
+    /// Listens on the port (an ephemeral one by default) of the
+    /// loopback interface
+    void start(int port = 0) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            throw std::runtime_error { "failed to create the socket" };
+        }
+        int enable { 1 };
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable,
+                   sizeof(enable));
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        socklen_t length { sizeof(address) };
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address),
+                 sizeof(address)) != 0
+                || listen(listen_fd_, 128) != 0
+                || getsockname(listen_fd_,
+                               reinterpret_cast<sockaddr*>(&address),
+                               &length) != 0) {
+            close(listen_fd_);
+            listen_fd_ = -1;
+            throw std::runtime_error { "failed to listen" };
+        }
+        port_ = ntohs(address.sin_port);
+        accept_thread_ = std::thread { &MockPuppetdbServer::acceptLoop, this };
+    }
+
+    void stop() {
+        if (listen_fd_ < 0) {
+            return;
+        }
+        stopping_ = true;
+        shutdown(listen_fd_, SHUT_RDWR);
+        accept_thread_.join();
+        close(listen_fd_);
+        listen_fd_ = -1;
+
+        std::vector<std::thread> connection_threads {};
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            for (int fd : connection_fds_) {
+                shutdown(fd, SHUT_RDWR);
+            }
+            connection_threads.swap(connection_threads_);
+        }
+        for (auto& thread : connection_threads) {
+            thread.join();
+        }
+    }
+
+    int getPort() const {
+        return port_;
+    }
+
+    size_t getNumRequests() const {
+        return num_requests_;
+    }
+
+    size_t getNumConnections() const {
+        return num_connections_;
+    }
+
+    Request getLastRequest() const {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        return last_request_;
+    }
+
+    /// Returns a json array of fact records of at least the specified
+    /// size
+    static std::string makeRecords(size_t min_size) {
+        std::string records { "[" };
+        for (size_t index = 0; records.size() + 1 < min_size || index == 0;
+                index++) {
+            if (index > 0) {
+                records += ",";
+            }
+            records += "{\"certname\":\"node" + std::to_string(index)
+                       + ".example.com\",\"environment\":\"production\","
+                       "\"name\":\"operatingsystem\",\"value\":\"Debian\"}";
+        }
+        return records + "]";
+    }
+
+  private:
+    struct Response {
+        int status;
+        std::chrono::milliseconds latency;
+        std::string etag;
+        std::string body;
+        std::string deflated_body;
+    };
+
+    int listen_fd_;
+    int port_;
+    std::atomic<bool> stopping_;
+    std::atomic<size_t> num_requests_;
+    std::atomic<size_t> num_connections_;
+    std::thread accept_thread_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<const Response>> responses_;
+    std::vector<std::thread> connection_threads_;
+    std::vector<int> connection_fds_;
+    Request last_request_;
+
+    static std::string deflate(const std::string& body) {
+#ifdef LIBPUPPETDB_MOCK_SERVER_ZLIB
+        // NB: the http deflate encoding is the zlib format
+        uLongf size { compressBound(body.size()) };
+        std::string deflated(size, '\0');
+        if (compress2(reinterpret_cast<Bytef*>(&deflated[0]), &size,
+                      reinterpret_cast<const Bytef*>(body.data()),
+                      body.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+            return "";
+        }
+        deflated.resize(size);
+        return deflated;
+#else
+        return "";
+#endif
+    }
+
+    void acceptLoop() {
+        while (!stopping_) {
+            int fd { accept(listen_fd_, nullptr, nullptr) };
+            if (fd < 0) {
+                if (stopping_) {
+                    break;
+                }
+                continue;
+            }
+            int enable { 1 };
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+            num_connections_++;
+            std::lock_guard<std::mutex> lock { mutex_ };
+            connection_fds_.push_back(fd);
+            connection_threads_.emplace_back(&MockPuppetdbServer::serve,
+                                             this, fd);
+        }
+    }
+
+    void serve(int fd) {
+        std::string buffer {};
+        Request request {};
+        while (!stopping_ && readRequest(fd, buffer, request)) {
+            num_requests_++;
+            {
+                std::lock_guard<std::mutex> lock { mutex_ };
+                last_request_ = request;
+            }
+            if (!respond(fd, request)) {
+                break;
+            }
+            auto connection = request.headers.find("connection");
+            if (connection != request.headers.end()
+                    && connection->second == "close") {
+                break;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            connection_fds_.erase(std::remove(connection_fds_.begin(),
+                                              connection_fds_.end(), fd),
+                                  connection_fds_.end());
+        }
+        close(fd);
+    }
+
+    static bool receive(int fd, std::string& buffer) {
+        char chunk[16384];
+        ssize_t size { recv(fd, chunk, sizeof(chunk), 0) };
+        if (size <= 0) {
+            return false;
+        }
+        buffer.append(chunk, static_cast<size_t>(size));
+        return true;
+    }
+
+    static bool readRequest(int fd, std::string& buffer, Request& request) {
+        size_t headers_end { 0 };
+        while ((headers_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (!receive(fd, buffer)) {
+                return false;
+            }
+        }
+
+        request = Request {};
+        size_t line_end { buffer.find("\r\n") };
+        std::string request_line { buffer.substr(0, line_end) };
+        size_t method_end { request_line.find(' ') };
+        size_t target_end { request_line.find(' ', method_end + 1) };
+        request.method = request_line.substr(0, method_end);
+        request.target = request_line.substr(method_end + 1,
+                                             target_end - method_end - 1);
+
+        size_t position { line_end + 2 };
+        while (position < headers_end) {
+            line_end = buffer.find("\r\n", position);
+            std::string line { buffer.substr(position, line_end - position) };
+            position = line_end + 2;
+            size_t colon { line.find(':') };
+            if (colon == std::string::npos) {
+                continue;
+            }
+            std::string name { line.substr(0, colon) };
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            size_t value_start { line.find_first_not_of(' ', colon + 1) };
+            request.headers[name] = value_start == std::string::npos
+                                    ? "" : line.substr(value_start);
+        }
+
+        size_t body_size { 0 };
+        auto content_length = request.headers.find("content-length");
+        if (content_length != request.headers.end()) {
+            body_size = std::stoul(content_length->second);
+        }
+        size_t body_start { headers_end + 4 };
+        while (buffer.size() < body_start + body_size) {
+            if (!receive(fd, buffer)) {
+                return false;
+            }
+        }
+        request.body = buffer.substr(body_start, body_size);
+        buffer.erase(0, body_start + body_size);
+        return true;
+    }
+
+    static std::string getEndpoint(const std::string& target) {
+        // /<api version>/<endpoint>[?<parameters>]
+        std::string path { target.substr(0, target.find('?')) };
+        size_t version_end { path.find('/', 1) };
+        return version_end == std::string::npos ? ""
+                                                : path.substr(version_end + 1);
+    }
+
+    bool respond(int fd, const Request& request) {
+        std::shared_ptr<const Response> response {};
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            auto it = responses_.find(getEndpoint(request.target));
+            if (it != responses_.end()) {
+                response = it->second;
+            }
+        }
+        if (!response) {
+            return send(fd, "HTTP/1.1 404 Not Found\r\n"
+                            "Content-Length: 0\r\n\r\n");
+        }
+
+        if (response->latency.count() > 0) {
+            std::this_thread::sleep_for(response->latency);
+        }
+
+        auto if_none_match = request.headers.find("if-none-match");
+        if (if_none_match != request.headers.end()
+                && if_none_match->second == response->etag) {
+            return send(fd, "HTTP/1.1 304 Not Modified\r\nETag: "
+                            + response->etag + "\r\nContent-Length: 0\r\n\r\n");
+        }
+
+        auto accept_encoding = request.headers.find("accept-encoding");
+        bool deflated { !response->deflated_body.empty()
+                        && accept_encoding != request.headers.end()
+                        && accept_encoding->second.find("deflate")
+                            != std::string::npos };
+        const std::string& body = deflated ? response->deflated_body
+                                           : response->body;
+
+        std::string headers { "HTTP/1.1 " + std::to_string(response->status)
+                              + (response->status < 400 ? " OK" : " Error")
+                              + "\r\nContent-Type: application/json\r\n"
+                              "ETag: " + response->etag + "\r\n" };
+        if (deflated) {
+            headers += "Content-Encoding: deflate\r\n";
+        }
+        headers += "Content-Length: " + std::to_string(body.size())
+                   + "\r\n\r\n";
+        return send(fd, headers) && send(fd, body);
+    }
+
+    static bool send(int fd, const std::string& data) {
+        size_t sent { 0 };
+        while (sent < data.size()) {
+            ssize_t size { ::send(fd, data.data() + sent, data.size() - sent,
+                                  MSG_NOSIGNAL) };
+            if (size <= 0) {
+                return false;
+            }
+            sent += static_cast<size_t>(size);
+        }
+        return true;
+    }
+};
+
+}  // namespace LibPuppetdb
+
+#endif  // LIBPUPPETDB_TEST_MOCK_SERVER_H_
@@ -0,0 +1,160 @@
+/*
+    parallel_parser_test.cpp
+    ========================
+
+    libpuppetdb parallel parser unit tests.
+    Requires: googletest, googlemock.
+
+*/
+
+#include "../include/libpuppetdb/parallel_parser.h"
+#include "test_utils.h"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <set>
+
+namespace LibPuppetdb {
+
+// Testing the chunk ring
+
+class ChunkRingTest : public ::testing::Test {};
+
+TEST_F(ChunkRingTest, chunksAreReceivedInOrder) {
+    ChunkRing ring { 2 };
+    std::thread producer { [&]() {
+        for (int index = 0; index < 1000; index++) {
+            std::string chunk { std::to_string(index) };
+            ring.push(chunk.data(), chunk.size());
+        }
+        ring.close();
+    } };
+
+    int expected { 0 };
+    while (const std::string* chunk = ring.front()) {
+        EXPECT_EQ(std::to_string(expected++), *chunk);
+        ring.pop();
+    }
+    producer.join();
+
+    EXPECT_EQ(1000, expected);
+}
+
+TEST_F(ChunkRingTest, closingWakesTheProducer) {
+    ChunkRing ring { 1 };
+    ring.push("a", 1);
+    std::thread closer { [&]() { ring.close(); } };
+
+    EXPECT_FALSE(ring.push("b", 1));
+    closer.join();
+}
+
+// Testing the parallel parser
+
+class ParallelParserTest : public ::testing::Test {
+  protected:
+    // Feeds the text in chunks of the specified size
+    static size_t parse(ParallelResultParser& parser, const std::string& text,
+                        size_t chunk_size) {
+        for (size_t idx = 0; idx < text.size(); idx += chunk_size) {
+            parser.feed(text.data() + idx,
+                        std::min(chunk_size, text.size() - idx));
+        }
+        return parser.finish();
+    }
+};
+
+TEST_F(ParallelParserTest, forEachRecordParallel) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("facts.json")));
+    Query query { "facts" };
+    std::mutex mutex {};
+    std::multiset<std::string> certnames {};
+
+    size_t num_records = forEachRecordParallel(
+        mock_connector, query, [&](const JsonValue& record, size_t worker) {
+            std::lock_guard<std::mutex> lock { mutex };
+            certnames.insert(record.find("certname")->asString());
+        }, 3);
+
+    EXPECT_EQ(4u, num_records);
+    EXPECT_EQ(2u, certnames.count("master.example.com"));
+    EXPECT_EQ(2u, certnames.count("agent1.example.com"));
+}
+
+TEST_F(ParallelParserTest, allRecordsAreParsed) {
+    std::string text { "[" };
+    for (int index = 0; index < 5000; index++) {
+        text += (index > 0 ? "," : "") + std::string { "{\"n\":" }
+                + std::to_string(index) + ",\"s\":\"],\\\"}\"}";
+    }
+    text += "]";
+    std::vector<std::atomic<long>> sums(4);
+    for (auto& sum : sums) {
+        sum = 0;
+    }
+
+    // Small ring and batches, so that the stages wait for each other
+    ParallelResultParser parser {
+        [&](const JsonValue& record, size_t worker) {
+            sums.at(worker) += record.find("n")->asInt();
+        }, sums.size(), 2, 7 };
+    size_t num_records { parse(parser, text, 100) };
+
+    long sum { 0 };
+    for (auto& worker_sum : sums) {
+        sum += worker_sum;
+    }
+    EXPECT_EQ(4u, parser.getNumWorkers());
+    EXPECT_EQ(5000u, num_records);
+    EXPECT_EQ(5000L * 4999 / 2, sum);
+}
+
+TEST_F(ParallelParserTest, malformedResults) {
+    auto ignore = [](const JsonValue&, size_t) {};
+    {
+        ParallelResultParser parser { ignore, 2 };
+        EXPECT_THROW(parse(parser, "[{\"a\":1}, {\"b\":}]", 4), parsing_error);
+    }
+    {
+        ParallelResultParser parser { ignore, 2 };
+        EXPECT_THROW(parse(parser, "[{\"a\":1}, {\"b\":", 4), parsing_error);
+    }
+    {
+        ParallelResultParser parser { ignore, 2 };
+        EXPECT_THROW(parse(parser, "[{}] x", 1), parsing_error);
+    }
+}
+
+TEST_F(ParallelParserTest, callbackErrorAbortsTheFeed) {
+    std::string text { "[" };
+    for (int index = 0; index < 10000; index++) {
+        text += (index > 0 ? ",{}" : "{}");
+    }
+    text += "]";
+    ParallelResultParser parser {
+        [](const JsonValue&, size_t) {
+            throw std::runtime_error { "spam" };
+        }, 2, 1, 1 };
+
+    try {
+        parse(parser, text, 1);
+        FAIL() << "no exception";
+    } catch (const std::runtime_error& e) {
+        EXPECT_STREQ("spam", e.what());
+    }
+}
+
+TEST_F(ParallelParserTest, abortStopsThePipeline) {
+    std::atomic<size_t> num_records { 0 };
+    ParallelResultParser parser {
+        [&](const JsonValue&, size_t) { num_records++; }, 2 };
+    parser.feed("[{}, {}", 7);
+
+    parser.abort();
+
+    EXPECT_THROW(parser.feed(", {}]", 5), processing_error);
+    EXPECT_LE(num_records, 2u);
+}
+
+}  // namespace LibPuppetdb
@@ -0,0 +1,144 @@
+/*
+    query_builder_test.cpp
+    ======================
+
+    libpuppetdb query builder unit tests.
+    Requires: googletest, googlemock.
+
+*/
+
+#include "../include/libpuppetdb/query_builder.h"
+#include "../include/libpuppetdb/result_parser.h"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <climits>
+#include <cstring>
+
+namespace LibPuppetdb {
+
+using namespace Pql;
+
+// The syntax sizes are known at compile time
+static_assert(Comparison<Equal, LiteralValue>::getStaticSize() == 9,
+              "unexpected size of [\"=\",\"\",]");
+static_assert(Conjunction<And, Comparison<Equal, BoolValue>,
+                          Comparison<Match, BoolValue>>::getStaticSize() == 9,
+              "unexpected size of [\"and\",,]");
+
+// The literals are referenced, the char pointers are copied
+static_assert(std::is_same<decltype(makeValue("abc")), LiteralValue>::value,
+              "a literal is not referenced");
+static_assert(std::is_same<decltype(makeValue(static_cast<const char*>("abc"))),
+                           StringValue>::value,
+              "a char pointer is not copied");
+
+// Testing the query builder
+
+class QueryBuilderTest : public ::testing::Test {};
+
+TEST_F(QueryBuilderTest, comparisons) {
+    std::string master { "master" };
+
+    EXPECT_EQ("[\"=\",\"name\",\"master\"]",
+              serialize(eq(Fields::NAME, "master")));
+    EXPECT_EQ("[\"=\",\"name\",\"master\"]",
+              serialize(eq(Fields::NAME, master)));
+    EXPECT_EQ("[\"~\",\"certname\",\"^web\\\\d+\"]",
+              serialize(match(Fields::CERTNAME, "^web\\d+")));
+    EXPECT_EQ("[\">=\",\"value\",-12]", serialize(ge(Fields::VALUE, -12)));
+    EXPECT_EQ("[\"<\",\"value\",9223372036854775807]",
+              serialize(lt(Fields::VALUE, LLONG_MAX)));
+    EXPECT_EQ("[\"=\",\"deactivated\",false]",
+              serialize(eq(Fields::DEACTIVATED, false)));
+    EXPECT_EQ("[\"null?\",\"deactivated\",true]",
+              serialize(isNull(Fields::DEACTIVATED)));
+    EXPECT_EQ("[\"=\",\"custom\",0]", serialize(eq("custom", 0)));
+}
+
+TEST_F(QueryBuilderTest, charPointersAndArrays) {
+    std::string host { "db01" };
+    const char* pointer { host.c_str() };
+    char buffer[16] {};
+    std::strcpy(buffer, "db01");
+
+    EXPECT_EQ("[\"=\",\"certname\",\"db01\"]",
+              serialize(eq(Fields::CERTNAME, host.c_str())));
+    EXPECT_EQ("[\"=\",\"certname\",\"db01\"]",
+              serialize(eq(Fields::CERTNAME, pointer)));
+    EXPECT_EQ("[\"=\",\"certname\",\"db01\"]",
+              serialize(eq(Fields::CERTNAME, buffer)));
+    EXPECT_EQ("[\"=\",\"certname\",\"db01\"]",
+              serialize(eq(Fields::CERTNAME, &buffer[0])));
+}
+
+TEST_F(QueryBuilderTest, stringsAreEscaped) {
+    std::string value { "a\"b\\c\nd\x01" };
+    std::string text { serialize(eq(Fields::VALUE, value)) };
+
+    EXPECT_EQ("[\"=\",\"value\",\"a\\\"b\\\\c\\nd\\u0001\"]", text);
+    EXPECT_EQ(value, parseJson(text)[2].asString());
+}
+
+TEST_F(QueryBuilderTest, booleanOperators) {
+    auto expression = and_(eq(Fields::NAME, "operatingsystem"),
+                           or_(eq(Fields::VALUE, "Debian"),
+                               eq(Fields::VALUE, "Ubuntu")),
+                           not_(eq(Fields::ENVIRONMENT, "test")));
+
+    EXPECT_EQ("[\"and\",[\"=\",\"name\",\"operatingsystem\"],"
+              "[\"or\",[\"=\",\"value\",\"Debian\"],"
+              "[\"=\",\"value\",\"Ubuntu\"]],"
+              "[\"not\",[\"=\",\"environment\",\"test\"]]]",
+              serialize(expression));
+}
+
+TEST_F(QueryBuilderTest, subqueries) {
+    auto expression = and_(
+        eq(Fields::NAME, "ipaddress"),
+        in(Fields::CERTNAME,
+           extract(Fields::CERTNAME,
+                   select(Entities::SELECT_RESOURCES,
+                          and_(eq(Fields::TYPE, "Class"),
+                               eq(Fields::TITLE, "Apache"))))));
+
+    EXPECT_EQ("[\"and\",[\"=\",\"name\",\"ipaddress\"],"
+              "[\"in\",\"certname\",[\"extract\",\"certname\","
+              "[\"select_resources\",[\"and\",[\"=\",\"type\",\"Class\"],"
+              "[\"=\",\"title\",\"Apache\"]]]]]]",
+              serialize(expression));
+}
+
+TEST_F(QueryBuilderTest, extractSeveralFields) {
+    EXPECT_EQ("[\"extract\",[\"certname\",\"value\"],[\"=\",\"name\",\"os\"]]",
+              serialize(extract(fields(Fields::CERTNAME, Fields::VALUE),
+                                eq(Fields::NAME, "os"))));
+}
+
+TEST_F(QueryBuilderTest, inArray) {
+    EXPECT_EQ("[\"in\",\"certname\",[\"array\",[\"a\",\"b\"]]]",
+              serialize(in(Fields::CERTNAME, { "a", "b" })));
+    EXPECT_EQ("[\"in\",\"certname\",[\"array\",[]]]",
+              serialize(in(Fields::CERTNAME, std::vector<std::string> {})));
+}
+
+TEST_F(QueryBuilderTest, exactSizeAndValidJson) {
+    auto expression = or_(eq(Fields::CERTNAME, "node1"),
+                          gt(Fields::REPORT_TIMESTAMP, "2015-05-01"),
+                          in(Fields::CERTNAME, { "x\"y", "z" }));
+    std::string buffer {};
+
+    serialize(expression, buffer);
+
+    EXPECT_EQ(expression.getSize(), buffer.size());
+    EXPECT_TRUE(parseJson(buffer).isArray());
+}
+
+TEST_F(QueryBuilderTest, makeQuery) {
+    Query query { makeQuery(Endpoints::NODES,
+                            eq(Fields::CERTNAME, "master")) };
+
+    EXPECT_EQ("nodes", query.getEndpoint());
+    EXPECT_EQ("[\"=\",\"certname\",\"master\"]", query.getQueryString());
+}
+
+}  // namespace LibPuppetdb
@@ -0,0 +1,288 @@
+/*
+    result_parser_test.cpp
+    ======================
+
+    libpuppetdb result parser unit tests.
+    Requires: googletest, googlemock.
+
+*/
+
+#include "../include/libpuppetdb/result_parser.h"
+#include "test_utils.h"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace LibPuppetdb {
+
+// Testing the json parser
+
+class JsonTest : public ::testing::Test {};
+
+TEST_F(JsonTest, parseScalars) {
+    EXPECT_TRUE(parseJson("null").isNull());
+    EXPECT_TRUE(parseJson(" true ").asBool());
+    EXPECT_FALSE(parseJson("false").asBool());
+    EXPECT_EQ(-42, parseJson("-42").asInt());
+    EXPECT_DOUBLE_EQ(1.5e3, parseJson("1.5e3").asDouble());
+    EXPECT_EQ("spam", parseJson("\"spam\"").asString());
+}
+
+TEST_F(JsonTest, parseEscapes) {
+    EXPECT_EQ("a\"b\\c/d\n", parseJson("\"a\\\"b\\\\c\\/d\\n\"").asString());
+    EXPECT_EQ("\xc3\xa9", parseJson("\"\\u00e9\"").asString());
+    EXPECT_EQ("\xf0\x9f\x98\x80", parseJson("\"\\ud83d\\ude00\"").asString());
+}
+
+TEST_F(JsonTest, parseObject) {
+    JsonValue record { parseJson(
+        "{\"certname\": \"spam\", \"facts\": [1, {\"a\": null}]}") };
+
+    ASSERT_TRUE(record.isObject());
+    EXPECT_EQ(2u, record.size());
+    EXPECT_EQ("spam", record.get("certname").asString());
+    EXPECT_EQ(2u, record.get("facts").size());
+    EXPECT_TRUE(record.get("facts")[1].get("a").isNull());
+    EXPECT_EQ(nullptr, record.find("eggs"));
+    EXPECT_THROW(record.get("eggs"), parsing_error);
+}
+
+TEST_F(JsonTest, serialize) {
+    std::string text { "{\"a\":[1,true,null,\"b\\\"c\\n\"],\"d\":{}}" };
+
+    EXPECT_EQ(text, parseJson(text).serialize());
+}
+
+TEST_F(JsonTest, parseInvalid) {
+    EXPECT_THROW(parseJson("{\"a\": }"), parsing_error);
+    EXPECT_THROW(parseJson("[1, 2"), parsing_error);
+    EXPECT_THROW(parseJson("\"spam"), parsing_error);
+    EXPECT_THROW(parseJson("nul"), parsing_error);
+    EXPECT_THROW(parseJson("{} {}"), parsing_error);
+    EXPECT_THROW(parseJson("true").asString(), parsing_error);
+}
+
+TEST_F(JsonTest, parseProjection) {
+    std::vector<std::string> projection { "title", "tags" };
+    std::string text { "{\"title\": \"a\", \"parameters\": {\"b\": [1, "
+                       "\"\\u00e9\\\"]\", null]}, \"tags\": [\"c\"], "
+                       "\"exported\": false}" };
+    std::string array_text { "[{\"a\": 1}]" };
+
+    JsonValue record { parseJson(text.data(), text.size(), projection) };
+
+    ASSERT_TRUE(record.isObject());
+    EXPECT_EQ(2u, record.size());
+    EXPECT_EQ("a", record.get("title").asString());
+    EXPECT_EQ("c", record.get("tags")[0].asString());
+    EXPECT_EQ(nullptr, record.find("parameters"));
+    // Only the members of a top-level object are projected
+    EXPECT_EQ(1u, parseJson(array_text.data(), array_text.size(),
+                            projection)[0].size());
+    EXPECT_EQ(4u, parseJson(text.data(), text.size(), {}).size());
+}
+
+TEST_F(JsonTest, parseInvalidSkippedMembers) {
+    std::vector<std::string> projection { "title" };
+
+    for (std::string text : { "{\"a\": [1, }", "{\"a\": {\"b\" 1}}",
+                              "{\"a\": \"\\x\"}", "{\"a\": nul}",
+                              "{\"a\": -}", "{\"a\": \"b" }) {
+        EXPECT_THROW(parseJson(text.data(), text.size(), projection),
+                     parsing_error) << text;
+    }
+}
+
+// Testing the record splitter
+
+class SplitterTest : public ::testing::Test {
+  protected:
+    std::vector<std::string> records_;
+
+    // Feeds the text in chunks of the specified size
+    void split(const std::string& text, size_t chunk_size,
+               ScanKernel kernel = getBestScanKernel()) {
+        records_.clear();
+        RecordSplitter splitter {
+            [this](const char* data, size_t size) {
+                records_.push_back(std::string { data, size });
+            } };
+        splitter.setScanKernel(kernel);
+        for (size_t idx = 0; idx < text.size(); idx += chunk_size) {
+            splitter.feed(text.data() + idx,
+                          std::min(chunk_size, text.size() - idx));
+        }
+        splitter.finish();
+        EXPECT_EQ(records_.size(), splitter.getNumRecords());
+    }
+};
+
+TEST_F(SplitterTest, splitObjects) {
+    std::string text { " [ {\"a\": \"}{\"}, {\"b\": [1, {\"c\": \"\\\"]\"}]} ] " };
+
+    for (size_t chunk_size = 1; chunk_size <= text.size(); chunk_size++) {
+        split(text, chunk_size);
+        ASSERT_EQ(2u, records_.size());
+        EXPECT_EQ("{\"a\": \"}{\"}", records_[0]);
+        EXPECT_EQ("{\"b\": [1, {\"c\": \"\\\"]\"}]}", records_[1]);
+    }
+}
+
+TEST_F(SplitterTest, splitScalars) {
+    std::string text { "[\"osfamily\", 42,true , \"a,]\"]" };
+
+    for (size_t chunk_size = 1; chunk_size <= text.size(); chunk_size++) {
+        split(text, chunk_size);
+        ASSERT_EQ(4u, records_.size());
+        EXPECT_EQ("\"osfamily\"", records_[0]);
+        EXPECT_EQ("42", records_[1]);
+        EXPECT_EQ("true", records_[2]);
+        EXPECT_EQ("\"a,]\"", records_[3]);
+    }
+}
+
+TEST_F(SplitterTest, splitEmptyArray) {
+    split(" [ ] ", 1);
+
+    EXPECT_TRUE(records_.empty());
+}
+
+TEST_F(SplitterTest, splitSingleObject) {
+    split("{\"certname\": \"spam\"}\n", 3);
+
+    ASSERT_EQ(1u, records_.size());
+    EXPECT_EQ("{\"certname\": \"spam\"}", records_[0]);
+}
+
+TEST_F(SplitterTest, splitInvalid) {
+    EXPECT_THROW(split("[{}, ]", 1), parsing_error);
+    EXPECT_THROW(split("[{} {}]", 1), parsing_error);
+    EXPECT_THROW(split("[{}] x", 1), parsing_error);
+    EXPECT_THROW(split("[{}, {\"a\"", 4), parsing_error);
+    EXPECT_THROW(split("", 1), parsing_error);
+}
+
+TEST_F(SplitterTest, scanKernels) {
+    EXPECT_TRUE(isScanKernelSupported(ScanKernel::Scalar));
+    EXPECT_TRUE(isScanKernelSupported(getBestScanKernel()));
+    for (auto kernel : { ScanKernel::Sse2, ScanKernel::Avx2,
+                         ScanKernel::Neon }) {
+        if (!isScanKernelSupported(kernel)) {
+            RecordSplitter splitter { [](const char*, size_t) {} };
+            EXPECT_THROW(splitter.setScanKernel(kernel), processing_error);
+        }
+    }
+}
+
+TEST_F(SplitterTest, splitWithEachKernel) {
+    // The escapes and brackets in strings fall on every offset of the
+    // scan blocks
+    std::vector<std::string> expected {};
+    std::string text { "[" };
+    for (size_t padding = 0; padding < 2 * SCAN_BLOCK_SIZE + 3; padding++) {
+        std::string record { "{\"value\":\"" + std::string(padding, 'x')
+                             + "\\\\\\\"]}\",\"nested\":[{\"a\":[]},\""
+                             + std::string(padding % 7, '\\') + "\"]}" };
+        if (padding % 7 % 2 != 0) {
+            record.insert(record.size() - 3, "\\");
+        }
+        ASSERT_TRUE(parseJson(record).isObject());
+        expected.push_back(record);
+        text += (padding > 0 ? ", " : " ") + record;
+    }
+    text += " ]";
+
+    for (auto kernel : { ScanKernel::Scalar, ScanKernel::Sse2,
+                         ScanKernel::Avx2, ScanKernel::Neon }) {
+        if (!isScanKernelSupported(kernel)) {
+            continue;
+        }
+        for (size_t chunk_size : { size_t { 1 }, size_t { 63 },
+                                   size_t { 100 }, text.size() }) {
+            split(text, chunk_size, kernel);
+            EXPECT_EQ(expected, records_);
+        }
+    }
+}
+
+// Testing the result parser
+
+class ResultParserTest : public ::testing::Test {};
+
+TEST_F(ResultParserTest, parseChunks) {
+    std::vector<std::string> certnames {};
+    ResultParser parser { [&](const JsonValue& record) {
+        certnames.push_back(record.get("certname").asString());
+    } };
+    std::string text { "[{\"certname\": \"a\"},{\"certname\": \"b\"}]" };
+
+    parser.feed(text.data(), 10);
+    EXPECT_TRUE(certnames.empty());
+    parser.feed(text.data() + 10, 10);
+    EXPECT_EQ(1u, certnames.size());
+    parser.feed(text.data() + 20, text.size() - 20);
+    parser.finish();
+
+    EXPECT_EQ(2u, parser.getNumRecords());
+    EXPECT_EQ((std::vector<std::string> { "a", "b" }), certnames);
+}
+
+TEST_F(ResultParserTest, parseInvalidRecord) {
+    ResultParser parser { [](const JsonValue& record) {} };
+    std::string text { "[{\"certname\" \"a\"}]" };
+
+    EXPECT_THROW(parser.feed(text.data(), text.size()), parsing_error);
+}
+
+TEST_F(ResultParserTest, forEachRecord) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "facts" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("facts.json")));
+    std::vector<std::string> names {};
+
+    size_t num_records { forEachRecord(mock_connector, query,
+        [&](const JsonValue& record) {
+            names.push_back(record.get("name").asString());
+        }) };
+
+    EXPECT_EQ(4u, num_records);
+    EXPECT_EQ((std::vector<std::string> {
+                  "osfamily", "processorcount", "osfamily", "is_virtual" }),
+              names);
+}
+
+TEST_F(ResultParserTest, parseProjectedRecords) {
+    std::vector<std::string> names {};
+    ResultParser parser { [&](const JsonValue& record) {
+                              EXPECT_EQ(1u, record.size());
+                              names.push_back(record.get("name").asString());
+                          },
+                          { "name" } };
+    std::string text { "[{\"name\": \"a\", \"value\": {\"b\": [1]}},"
+                       "{\"value\": \"}\", \"name\": \"c\"}]" };
+
+    parser.feed(text.data(), text.size());
+    parser.finish();
+
+    EXPECT_EQ(2u, parser.getNumRecords());
+    EXPECT_EQ((std::vector<std::string> { "a", "c" }), names);
+}
+
+TEST_F(ResultParserTest, forEachRecordUsesTheProjection) {
+    MockURLConnector mock_connector { "spam" };
+    Query query { "facts" };
+    query.setProjection({ "value" });
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("facts.json")));
+    size_t num_values { 0 };
+
+    forEachRecord(mock_connector, query, [&](const JsonValue& record) {
+        EXPECT_EQ(1u, record.size());
+        EXPECT_NE(nullptr, record.find("value"));
+        num_values++;
+    });
+
+    EXPECT_EQ(4u, num_values);
+}
+
+}  // namespace LibPuppetdb
@@ -0,0 +1,150 @@
+/*
+    snapshot_test.cpp
+    =================
+
+    libpuppetdb snapshot unit tests.
+    Requires: googletest, googlemock.
+
+*/
+
+#include "../include/libpuppetdb/snapshot.h"
+#include "test_utils.h"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <fstream>
+
+namespace LibPuppetdb {
+
+// Testing the snapshots
+
+class SnapshotTest : public ::testing::Test {
+  protected:
+    std::string path_;
+
+    void SetUp() override {
+        char path[] = "/tmp/libpuppetdb_snapshot_XXXXXX";
+        int fd { mkstemp(path) };
+        ASSERT_GE(fd, 0);
+        close(fd);
+        path_ = path;
+    }
+
+    void TearDown() override {
+        std::remove(path_.c_str());
+    }
+
+    size_t write(const std::string& text, size_t max_strings =
+                     SNAPSHOT_MAX_STRINGS_DEFAULT) {
+        SnapshotWriter writer { path_, max_strings };
+        writer.feed(text.data(), text.size());
+        return writer.finish();
+    }
+
+    void overwrite(const std::string& content) {
+        std::ofstream output { path_, std::ios::binary | std::ios::trunc };
+        output << content;
+    }
+};
+
+TEST_F(SnapshotTest, writeAndReadFacts) {
+    MockURLConnector mock_connector { "spam" };
+    EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+        .WillOnce(testing::Return(getResourceUrl("facts.json")));
+    Query query { "facts" };
+
+    EXPECT_EQ(4u, writeSnapshot(mock_connector, query, path_));
+
+    Snapshot snapshot { path_ };
+    ASSERT_EQ(4u, snapshot.size());
+    EXPECT_EQ("agent1.example.com",
+              snapshot[2].find("certname").asString().toString());
+    EXPECT_EQ("RedHat", snapshot[0].find("value").asString().toString());
+    EXPECT_EQ(4, snapshot[1].find("value").asInt());
+    EXPECT_TRUE(snapshot[3].find("value").asBool());
+    EXPECT_FALSE(snapshot[3].find("spam"));
+    // Keys, certnames, fact names, and values are interned once
+    EXPECT_EQ(13u, snapshot.getNumStrings());
+
+    std::vector<std::string> names {};
+    snapshot.forEach([&](SnapshotValue record) {
+        names.push_back(record.find("name").asString().toString());
+    });
+    EXPECT_EQ((std::vector<std::string> { "osfamily", "processorcount",
+                                          "osfamily", "is_virtual" }),
+              names);
+}
+
+TEST_F(SnapshotTest, valuesRoundTrip) {
+    std::string record { "{\"a\":[1,-2,1.50,12345678901234567890,-0,null,"
+                         "true,false],\"b\":{\"c\":\"" + std::string(100, 'x')
+                         + "\",\"d\":{}},\"e\":[],\"f\":\"\\u00e9\\n\"}" };
+
+    EXPECT_EQ(2u, write("[" + record + ", \"scalar\"]"));
+
+    Snapshot snapshot { path_ };
+    ASSERT_EQ(2u, snapshot.size());
+    EXPECT_EQ(parseJson(record).serialize(), snapshot[0].serialize());
+    EXPECT_EQ("\"scalar\"", snapshot[1].serialize());
+
+    SnapshotValue array { snapshot[0].find("a") };
+    EXPECT_EQ(8u, array.size());
+    EXPECT_EQ(-2, array[1].asInt());
+    EXPECT_DOUBLE_EQ(1.5, array[2].asDouble());
+    EXPECT_TRUE(array[5].isNull());
+    EXPECT_EQ(100u, snapshot[0].find("b").find("c").asString().size);
+    EXPECT_THROW(array[8], parsing_error);
+    EXPECT_THROW(array.asString(), parsing_error);
+    EXPECT_THROW(snapshot[2], parsing_error);
+}
+
+TEST_F(SnapshotTest, stringTableIsCapped) {
+    write("[\"a\", \"b\", \"c\", \"a\"]", 2);
+
+    Snapshot snapshot { path_ };
+    EXPECT_EQ(2u, snapshot.getNumStrings());
+    EXPECT_EQ("c", snapshot[2].asString().toString());
+    EXPECT_EQ("a", snapshot[3].asString().toString());
+}
+
+TEST_F(SnapshotTest, emptyResult) {
+    EXPECT_EQ(0u, write("[]"));
+
+    Snapshot snapshot { path_ };
+    EXPECT_EQ(0u, snapshot.size());
+}
+
+TEST_F(SnapshotTest, unfinishedSnapshotsAreRemoved) {
+    {
+        SnapshotWriter writer { path_ };
+        writer.feed("[{}", 3);
+        EXPECT_THROW(writer.finish(), parsing_error);
+    }
+    std::ifstream tmp { path_ + ".tmp" };
+
+    EXPECT_FALSE(tmp.good());
+}
+
+TEST_F(SnapshotTest, invalidSnapshots) {
+    EXPECT_THROW(Snapshot { path_ + ".missing" }, processing_error);
+
+    overwrite("spam");
+    EXPECT_THROW(Snapshot { path_ }, parsing_error);
+
+    write("[{\"a\":1}]");
+    std::string content {};
+    {
+        std::ifstream input { path_, std::ios::binary };
+        content.assign(std::istreambuf_iterator<char> { input },
+                       std::istreambuf_iterator<char> {});
+    }
+    overwrite(content.substr(0, content.size() - 1));
+    EXPECT_THROW(Snapshot { path_ }, parsing_error);
+
+    // Index offset past the end
+    std::string corrupted { content };
+    corrupted[corrupted.size() - 16] = '\x7f';
+    overwrite(corrupted);
+    EXPECT_THROW(Snapshot { path_ }, parsing_error);
+}
+
+}  // namespace LibPuppetdb
@@ -0,0 +1,185 @@
+/*
+    sync_test.cpp
+    =============
+
+    libpuppetdb incremental sync unit tests.
+    Requires: googletest, googlemock.
+
+*/
+
+#include "../include/libpuppetdb/sync.h"
+#include "test_utils.h"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace LibPuppetdb {
+
+// Testing the timestamps
+
+class TimestampTest : public ::testing::Test {};
+
+TEST_F(TimestampTest, parseAndFormat) {
+    int64_t milliseconds { 0 };
+
+    ASSERT_TRUE(parseTimestamp("2015-06-19T23:05:37.125Z", milliseconds));
+    EXPECT_EQ(1434755137125, milliseconds);
+    EXPECT_EQ("2015-06-19T23:05:37.125Z", formatTimestamp(milliseconds));
+    ASSERT_TRUE(parseTimestamp("2015-06-20T01:05:37.125+02:00",
+                               milliseconds));
+    EXPECT_EQ(1434755137125, milliseconds);
+    ASSERT_TRUE(parseTimestamp("1970-01-01T00:00:00Z", milliseconds));
+    EXPECT_EQ(0, milliseconds);
+    EXPECT_EQ("1969-12-31T23:59:59.999Z", formatTimestamp(-1));
+    EXPECT_EQ("2016-02-29T12:00:00.000Z", formatTimestamp(1456747200000));
+}
+
+TEST_F(TimestampTest, parseInvalid) {
+    int64_t milliseconds { 0 };
+
+    EXPECT_FALSE(parseTimestamp("", milliseconds));
+    EXPECT_FALSE(parseTimestamp("2015-06-19", milliseconds));
+    EXPECT_FALSE(parseTimestamp("2015-13-19T23:05:37Z", milliseconds));
+    EXPECT_FALSE(parseTimestamp("2015-06-19T23:05:37", milliseconds));
+    EXPECT_FALSE(parseTimestamp("2015-06-19T23:05:37.1Zspam", milliseconds));
+}
+
+// Testing the incremental sync
+
+class SyncTest : public ::testing::Test {
+  protected:
+    // Expects a query, returning the resource; the query string is
+    // stored in query_string_
+    void expectQuery(MockURLConnector& mock_connector,
+                     const std::string& resource) {
+        EXPECT_CALL(mock_connector, getQueryUrl(testing::_, testing::_))
+            .WillOnce(testing::Invoke([this, resource](Query& query, CURL*) {
+                query_string_ = query.getQueryString();
+                return getResourceUrl(resource);
+            }));
+    }
+
+    std::string query_string_;
+};
+
+TEST_F(SyncTest, invalidArguments) {
+    EXPECT_THROW((IncrementalSync { Query { "reports" }, "" }), query_error);
+    EXPECT_THROW((IncrementalSync { Query { "reports" }, "hash", "" }),
+                 query_error);
+
+    IncrementalSync pql_sync { Query { "reports", "reports {}" } };
+    pql_sync.setWatermark("2015-06-19T23:05:37.125Z");
+
+    EXPECT_THROW(pql_sync.getDeltaQuery(), query_error);
+}
+
+TEST_F(SyncTest, deltaQuery) {
+    Query query { "reports", "[\"=\",\"status\",\"failed\"]" };
+    query.setOrderBy({ { "producer_timestamp", false } });
+    IncrementalSync sync { query, "hash" };
+
+    EXPECT_EQ("[\"=\",\"status\",\"failed\"]",
+              sync.getDeltaQuery().getQueryString());
+
+    sync.setWatermark("2015-06-19T23:05:37.125Z");
+    Query delta_query { sync.getDeltaQuery() };
+
+    EXPECT_EQ("[\"and\",[\"=\",\"status\",\"failed\"],"
+              "[\">=\",\"producer_timestamp\",\"2015-06-19T23:05:37.125Z\"]]",
+              delta_query.getQueryString());
+    EXPECT_EQ(1u, delta_query.getOrderBy().size());
+
+    sync.setLookback(std::chrono::minutes { 10 });
+
+    EXPECT_EQ("[\"and\",[\"=\",\"status\",\"failed\"],"
+              "[\">=\",\"producer_timestamp\",\"2015-06-19T22:55:37.125Z\"]]",
+              sync.getDeltaQuery().getQueryString());
+}
+
+TEST_F(SyncTest, deltaQueryWithoutFilter) {
+    IncrementalSync sync { Query { "nodes" }, "certname", "report_timestamp" };
+    sync.setWatermark("2015-06-19T23:05:37.125Z");
+
+    EXPECT_EQ("[\">=\",\"report_timestamp\",\"2015-06-19T23:05:37.125Z\"]",
+              sync.getDeltaQuery().getQueryString());
+}
+
+TEST_F(SyncTest, syncMergesTheChanges) {
+    MockURLConnector mock_connector { "spam" };
+    IncrementalSync sync { Query { "reports" }, "hash" };
+    std::vector<std::string> changes {};
+    sync.setChangeCallback([&](const char* data, size_t size) {
+        changes.push_back(parseJson(data, size).find("hash")->asString());
+    });
+
+    expectQuery(mock_connector, "reports.json");
+    SyncStats stats { sync.sync(mock_connector) };
+
+    EXPECT_TRUE(stats.full);
+    EXPECT_EQ(3u, stats.num_records);
+    EXPECT_EQ(3u, stats.num_changed);
+    EXPECT_EQ("", query_string_);
+    EXPECT_EQ("2015-06-19T23:10:02.000Z", sync.getWatermark());
+
+    changes.clear();
+    expectQuery(mock_connector, "reports_delta.json");
+    stats = sync.sync(mock_connector);
+
+    EXPECT_FALSE(stats.full);
+    EXPECT_EQ(2u, stats.num_records);
+    EXPECT_EQ(1u, stats.num_changed);
+    EXPECT_EQ((std::vector<std::string> { "d4" }), changes);
+    EXPECT_EQ("[\">=\",\"producer_timestamp\",\"2015-06-19T23:10:02.000Z\"]",
+              query_string_);
+    EXPECT_EQ("2015-06-19T23:35:40.500Z", sync.getWatermark());
+    EXPECT_EQ(4u, sync.getRecords().size());
+    EXPECT_EQ("failed", parseJson(sync.getRecords().at("c3"))
+                            .find("status")->asString());
+}
+
+TEST_F(SyncTest, failedSyncKeepsTheWatermark) {
+    MockURLConnector mock_connector { "spam" };
+    IncrementalSync sync { Query { "reports" }, "hash" };
+    sync.setWatermark("2015-06-19T23:10:02.000Z");
+
+    expectQuery(mock_connector, "missing.json");
+
+    EXPECT_THROW(sync.sync(mock_connector), processing_error);
+    EXPECT_EQ("2015-06-19T23:10:02.000Z", sync.getWatermark());
+
+    expectQuery(mock_connector, "facts.json");
+
+    EXPECT_THROW(sync.sync(mock_connector), parsing_error);
+    EXPECT_EQ("2015-06-19T23:10:02.000Z", sync.getWatermark());
+}
+
+TEST_F(SyncTest, stateIsSaved) {
+    char path[] = "/tmp/libpuppetdb_sync_XXXXXX";
+    int fd { mkstemp(path) };
+    ASSERT_GE(fd, 0);
+    close(fd);
+    std::remove(path);
+    MockURLConnector mock_connector { "spam" };
+    {
+        IncrementalSync sync { Query { "reports" }, "hash" };
+        sync.setStatePath(path);
+        expectQuery(mock_connector, "reports.json");
+        sync.sync(mock_connector);
+    }
+
+    IncrementalSync sync { Query { "reports" }, "hash" };
+    sync.setStatePath(path);
+
+    EXPECT_EQ("2015-06-19T23:10:02.000Z", sync.getWatermark());
+    EXPECT_EQ(3u, sync.getRecords().size());
+
+    sync.reset();
+
+    EXPECT_EQ("", sync.getWatermark());
+    EXPECT_TRUE(sync.getRecords().empty());
+
+    IncrementalSync other_key_sync { Query { "reports" }, "spam" };
+    EXPECT_THROW(other_key_sync.setStatePath(path), parsing_error);
+    std::remove(path);
+}
+
+}  // namespace LibPuppetdb
@@ -0,0 +1,41 @@
+/*
+    test_utils.h
+    ============
+
+    Mock classes and utility functions shared by the libpuppetdb unit
+    tests.
+
+*/
+
+#ifndef LIBPUPPETDB_TEST_TEST_UTILS_H_
+#define LIBPUPPETDB_TEST_TEST_UTILS_H_
+
+#include "../include/libpuppetdb/libpuppetdb.h"
+#include <gmock/gmock.h>
+#include <unistd.h>
+
+namespace LibPuppetdb {
+
+// Utility functions
+
+// Returns a file:// URL pointing to the specified test resource
+inline std::string getResourceUrl(const std::string& resource) {
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        return "";
+    }
+    return "file://" + std::string { cwd } + "/resources/" + resource;
+}
+
+// Mock classes
+
+class MockURLConnector : public PuppetdbConnector {
+  public:
+    MockURLConnector(std::string host_name)
+        : PuppetdbConnector::PuppetdbConnector(host_name) {}
+    MOCK_METHOD2(getQueryUrl, std::string(Query& query, CURL* curl));
+};
+
+}  // namespace LibPuppetdb
+
+#endif  // LIBPUPPETDB_TEST_TEST_UTILS_H_